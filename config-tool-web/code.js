@@ -8,7 +8,7 @@ const STICKY_FLAG = 1 << 0;
 const TAP_FLAG = 1 << 1;
 const HOLD_FLAG = 1 << 2;
 const CONFIG_SIZE = 32;
-const CONFIG_VERSION = 18;
+const CONFIG_VERSION = 22;
 const VENDOR_ID = 0xCAFE;
 const PRODUCT_ID = 0xBAF2;
 const DEFAULT_PARTIAL_SCROLL_TIMEOUT = 1000000;
@@ -21,10 +21,18 @@ const NLAYERS = 8;
 const NMACROS = 32;
 const NEXPRESSIONS = 8;
 const MACRO_ITEMS_IN_PACKET = 6;
+const BLOB_BYTES_IN_PACKET = 21;
+const BLOB_BYTES_IN_RESPONSE = 28;
 const IGNORE_AUTH_DEV_INPUTS_FLAG = 1 << 4;
 const GPIO_OUTPUT_MODE_FLAG = 1 << 5;
 const NORMALIZE_GAMEPAD_INPUTS_FLAG = 1 << 6;
 const HUB_PORT_NONE = 255;
+// usage pages that can be referred to with a 4-bit code in the persisted config
+const USAGE_PAGE_DICTIONARY = [0x0001, 0x0007, 0x0008, 0x0009, 0x000C, 0xFFF1, 0xFFF2, 0xFFF3, 0xFFF4, 0xFFF5, 0xFFF6, 0xFFF7, 0xFFF8, 0xFFF9];
+const USAGE_PAGE_CODE_SAME = 0;
+const USAGE_PAGE_CODE_EXPLICIT = 15;
+const PERSISTED_MAPPING_FLAG_HUB_PORTS = 1 << 7;
+const PERSISTED_OP_FLAG_THOUSANDS = 1 << 7;
 
 const QUIRK_FLAG_RELATIVE_MASK = 0b10000000;
 const QUIRK_FLAG_SIGNED_MASK = 0b01000000;
@@ -60,9 +68,24 @@ const SET_MONITOR_ENABLED = 22;
 const CLEAR_QUIRKS = 23;
 const ADD_QUIRK = 24;
 const GET_QUIRK = 25;
+const GET_EXTRA_CONFIG = 27;
+const BEGIN_BLOB = 28;
+const BLOB_CHUNK = 29;
+const COMMIT_BLOB = 30;
+const READ_BLOB = 31;
+const GET_BLOB_CHUNK = 32;
+const GET_THEIR_USAGES_PACKED = 33;
+const GET_PERSIST_STATUS = 34;
+const SET_ACTIVE_PROFILE = 35;
+const GET_ACTIVE_PROFILE = 36;
 
 const PERSIST_CONFIG_SUCCESS = 1;
 const PERSIST_CONFIG_CONFIG_TOO_BIG = 2;
+const PERSIST_CONFIG_BUSY = 3;
+
+const COMMIT_BLOB_SUCCESS = 1;
+const COMMIT_BLOB_CRC_MISMATCH = 2;
+const COMMIT_BLOB_BUSY = 4;
 
 const ops = {
     "PUSH": 0,
@@ -130,11 +153,17 @@ const UINT8 = Symbol('uint8');
 const UINT16 = Symbol('uint16');
 const UINT32 = Symbol('uint32');
 const INT32 = Symbol('int32');
+// only in the config blob
+const VARINT = Symbol('varint');
+const SVARINT = Symbol('svarint');
+const USAGE = Symbol('usage');
 
 let device = null;
 let source_modal = null;
 let target_modal = null;
 let extra_usages = { 'source': [], 'target': [] };
+let their_usages_generation = null;
+let their_usages_device = null;
 let config = {
     'version': CONFIG_VERSION,
     'unmapped_passthrough_layers': [0, 1, 2, 3, 4, 5, 6, 7],
@@ -145,6 +174,7 @@ let config = {
     'our_descriptor_number': 0,
     'ignore_auth_dev_inputs': false,
     'macro_entry_duration': DEFAULT_MACRO_ENTRY_DURATION,
+    'macro_step_duration_us': 0,
     'gpio_output_mode': 0,
     'input_labels': 0,
     'normalize_gamepad_inputs': true,
@@ -167,6 +197,8 @@ let config = {
         '', '', '', '', '', '', '', ''
     ],
     quirks: [],
+    'active_profile': 0,
+    profiles: [],
 };
 let monitor_enabled = false;
 let monitor_min_val = {};
@@ -200,6 +232,7 @@ document.addEventListener("DOMContentLoaded", function () {
     document.getElementById("tap_hold_threshold_input").addEventListener("change", tap_hold_threshold_onchange);
     document.getElementById("gpio_debounce_time_input").addEventListener("change", gpio_debounce_time_onchange);
     document.getElementById("macro_entry_duration_input").addEventListener("change", macro_entry_duration_onchange);
+    document.getElementById("macro_step_duration_us_input").addEventListener("change", macro_step_duration_us_onchange);
     for (let i = 0; i < NLAYERS; i++) {
         document.getElementById("unmapped_passthrough_checkbox" + i).addEventListener("change", unmapped_passthrough_onchange);
     }
@@ -289,123 +322,7 @@ async function load_from_device() {
     document.getElementById('load_from_device').disabled = true;
 
     try {
-        await send_feature_command(GET_CONFIG);
-        const [config_version, flags, unmapped_passthrough_layer_mask, partial_scroll_timeout, mapping_count, our_usage_count, their_usage_count, interval_override, tap_hold_threshold, gpio_debounce_time_ms, our_descriptor_number, macro_entry_duration, quirk_count] =
-            await read_config_feature([UINT8, UINT8, UINT8, UINT32, UINT16, UINT32, UINT32, UINT8, UINT32, UINT8, UINT8, UINT8, UINT16]);
-        check_received_version(config_version);
-
-        config['version'] = config_version;
-        config['unmapped_passthrough_layers'] = mask_to_layer_list(unmapped_passthrough_layer_mask);
-        config['partial_scroll_timeout'] = partial_scroll_timeout;
-        config['tap_hold_threshold'] = tap_hold_threshold;
-        config['gpio_debounce_time_ms'] = gpio_debounce_time_ms;
-        config['interval_override'] = interval_override;
-        config['our_descriptor_number'] = our_descriptor_number;
-        config['ignore_auth_dev_inputs'] = !!(flags & IGNORE_AUTH_DEV_INPUTS_FLAG);
-        config['gpio_output_mode'] = (flags & GPIO_OUTPUT_MODE_FLAG) ? 1 : 0;
-        config['normalize_gamepad_inputs'] = !!(flags & NORMALIZE_GAMEPAD_INPUTS_FLAG);
-        config['macro_entry_duration'] = macro_entry_duration + 1;
-        config['mappings'] = [];
-
-        for (let i = 0; i < mapping_count; i++) {
-            await send_feature_command(GET_MAPPING, [[UINT32, i]]);
-            const [target_usage, source_usage, scaling, layer_mask, mapping_flags, hub_ports] =
-                await read_config_feature([UINT32, UINT32, INT32, UINT8, UINT8, UINT8]);
-            config['mappings'].push({
-                'target_usage': '0x' + target_usage.toString(16).padStart(8, '0'),
-                'source_usage': '0x' + source_usage.toString(16).padStart(8, '0'),
-                'scaling': scaling,
-                'layers': mask_to_layer_list(layer_mask),
-                'sticky': (mapping_flags & STICKY_FLAG) != 0,
-                'tap': (mapping_flags & TAP_FLAG) != 0,
-                'hold': (mapping_flags & HOLD_FLAG) != 0,
-                'source_port': hub_ports & 0x0F,
-                'target_port': (hub_ports >> 4) & 0x0F,
-            });
-        }
-
-        config['macros'] = [];
-
-        for (let macro_i = 0; macro_i < NMACROS; macro_i++) {
-            let macro = [];
-            let i = 0;
-            let keep_going = true;
-            while (keep_going) {
-                await send_feature_command(GET_MACRO, [[UINT32, macro_i], [UINT32, i]]);
-                const fields = await read_config_feature([UINT8, UINT32, UINT32, UINT32, UINT32, UINT32, UINT32]);
-                const nitems = fields[0];
-                const usages_ = fields.slice(1);
-                if (nitems < MACRO_ITEMS_IN_PACKET) {
-                    keep_going = false;
-                }
-                if ((macro.length == 0) && (nitems > 0)) {
-                    macro = [[]];
-                }
-                for (const usage of usages_.slice(0, nitems)) {
-                    if (usage == 0) {
-                        macro.push([]);
-                    } else {
-                        macro.at(-1).push('0x' + usage.toString(16).padStart(8, '0'));
-                    }
-                }
-                i += MACRO_ITEMS_IN_PACKET;
-            }
-
-            config['macros'].push(macro);
-        }
-
-        config['expressions'] = [];
-
-        for (let expr_i = 0; expr_i < NEXPRESSIONS; expr_i++) {
-            let expression = [];
-            let i = 0;
-            while (true) {
-                await send_feature_command(GET_EXPRESSION, [[UINT32, expr_i], [UINT32, i]]);
-                const fields = await read_config_feature([UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8, UINT8]);
-                const nelems = fields[0];
-                if (nelems == 0) {
-                    break;
-                }
-                let elems = fields.slice(1);
-                for (let j = 0; j < nelems; j++) {
-                    const elem = elems[0];
-                    elems = elems.slice(1);
-                    if ([ops['PUSH'], ops['PUSH_USAGE']].includes(elem)) {
-                        const val = elems[3] << 24 | elems[2] << 16 | elems[1] << 8 | elems[0];
-                        elems = elems.slice(4);
-                        if (elem == ops['PUSH']) {
-                            expression.push(val.toString());
-                        } else {
-                            expression.push('0x' + (val >>> 0).toString(16).padStart(8, '0'));
-                        }
-                    } else {
-                        expression.push(opcodes[elem].toLowerCase());
-                    }
-                }
-                i += nelems;
-            }
-
-            config['expressions'].push(expression.join(' '));
-        }
-
-        config['quirks'] = [];
-
-        for (let quirk_i = 0; quirk_i < quirk_count; quirk_i++) {
-            await send_feature_command(GET_QUIRK, [[UINT32, quirk_i]]);
-            const [vendor_id, product_id, interface_, report_id, usage, bitpos, size_flags] =
-                await read_config_feature([UINT16, UINT16, UINT8, UINT8, UINT32, UINT16, UINT8]);
-            config['quirks'].push({
-                'vendor_id': '0x' + vendor_id.toString(16).padStart(4, '0'),
-                'product_id': '0x' + product_id.toString(16).padStart(4, '0'),
-                'interface': interface_,
-                'report_id': report_id,
-                'usage': '0x' + usage.toString(16).padStart(8, '0'),
-                'bitpos': bitpos,
-                'size': size_flags & QUIRK_SIZE_MASK,
-                'relative': (size_flags & QUIRK_FLAG_RELATIVE_MASK) != 0,
-                'signed': (size_flags & QUIRK_FLAG_SIGNED_MASK) != 0,
-            });
-        }
+        blob_to_config(await receive_config_blob());
 
         set_ui_state();
         validate_ui_expressions();
@@ -440,110 +357,7 @@ async function save_to_device() {
 
     try {
         await send_feature_command(SUSPEND);
-        const flags = (config['ignore_auth_dev_inputs'] ? IGNORE_AUTH_DEV_INPUTS_FLAG : 0) |
-            (config['gpio_output_mode'] ? GPIO_OUTPUT_MODE_FLAG : 0) |
-            (config['normalize_gamepad_inputs'] ? NORMALIZE_GAMEPAD_INPUTS_FLAG : 0);
-        await send_feature_command(SET_CONFIG, [
-            [UINT8, flags],
-            [UINT8, layer_list_to_mask(config['unmapped_passthrough_layers'])],
-            [UINT32, config['partial_scroll_timeout']],
-            [UINT8, config['interval_override']],
-            [UINT32, config['tap_hold_threshold']],
-            [UINT8, config['gpio_debounce_time_ms']],
-            [UINT8, config['our_descriptor_number']],
-            [UINT8, config['macro_entry_duration'] - 1],
-        ]);
-        await send_feature_command(CLEAR_MAPPING);
-
-        for (const mapping of config['mappings']) {
-            await send_feature_command(ADD_MAPPING, [
-                [UINT32, parseInt(mapping['target_usage'], 16)],
-                [UINT32, parseInt(mapping['source_usage'], 16)],
-                [INT32, mapping['scaling']],
-                [UINT8, layer_list_to_mask(mapping['layers'])],
-                [UINT8, (mapping['sticky'] ? STICKY_FLAG : 0)
-                    | (mapping['tap'] ? TAP_FLAG : 0)
-                    | (mapping['hold'] ? HOLD_FLAG : 0)],
-                [UINT8, ((mapping['target_port'] & 0x0F) << 4) | (mapping['source_port'] & 0x0F)],
-            ]);
-        }
-
-        await send_feature_command(CLEAR_MACROS);
-        let macro_i = 0;
-        for (const macro of config['macros']) {
-            if (macro_i >= NMACROS) {
-                break;
-            }
-
-            const flat_zero_separated = macro.map((x) => x.concat(["0x00"])).flat().slice(0, -1);
-
-            for (let i = 0; i < flat_zero_separated.length; i += MACRO_ITEMS_IN_PACKET) {
-                const chunk_size = i + MACRO_ITEMS_IN_PACKET > flat_zero_separated.length
-                    ? flat_zero_separated.length - i
-                    : MACRO_ITEMS_IN_PACKET;
-                await send_feature_command(APPEND_TO_MACRO,
-                    [[UINT8, macro_i], [UINT8, chunk_size]].concat(
-                        flat_zero_separated
-                            .slice(i, i + chunk_size)
-                            .map((x) => [UINT32, parseInt(x, 16)])));
-            }
-
-            macro_i++;
-        }
-
-        await send_feature_command(CLEAR_EXPRESSIONS);
-        let expr_i = 0;
-        for (const expr of config['expressions']) {
-            if (expr_i >= NEXPRESSIONS) {
-                break;
-            }
-
-            let elems = expr_to_elems(expr);
-            while (elems.length > 0) {
-                let bytes_left = 24;
-                let items_to_send = [];
-                let nelems = 0;
-                while ((elems.length > 0) && (bytes_left > 0)) {
-                    const elem = elems[0];
-                    if ([ops["PUSH"], ops["PUSH_USAGE"]].includes(elem[0])) {
-                        if (bytes_left >= 5) {
-                            items_to_send.push([UINT8, elem[0]]);
-                            items_to_send.push([UINT32, elem[1] >>> 0]);
-                            bytes_left -= 5;
-                            nelems++;
-                            elems = elems.slice(1);
-                        } else {
-                            break
-                        }
-                    } else {
-                        items_to_send.push([UINT8, elem[0]]);
-                        bytes_left--;
-                        nelems++;
-                        elems = elems.slice(1);
-                    }
-                }
-                await send_feature_command(APPEND_TO_EXPRESSION,
-                    [[UINT8, expr_i], [UINT8, nelems]].concat(items_to_send));
-            }
-
-            expr_i++;
-        }
-
-        await send_feature_command(CLEAR_QUIRKS);
-        for (const quirk of config['quirks']) {
-            const size_flags = (quirk['size'] & QUIRK_SIZE_MASK) |
-                (quirk['relative'] ? QUIRK_FLAG_RELATIVE_MASK : 0) |
-                (quirk['signed'] ? QUIRK_FLAG_SIGNED_MASK : 0);
-            await send_feature_command(ADD_QUIRK, [
-                [UINT16, parseInt(quirk['vendor_id'], 16)],
-                [UINT16, parseInt(quirk['product_id'], 16)],
-                [UINT8, quirk['interface']],
-                [UINT8, quirk['report_id']],
-                [UINT32, parseInt(quirk['usage'], 16)],
-                [UINT16, quirk['bitpos']],
-                [UINT8, size_flags],
-            ]);
-        }
+        await send_config_blob(config_to_blob());
 
         await send_feature_command(PERSIST_CONFIG);
 
@@ -576,32 +390,480 @@ async function save_to_device() {
     busy = false;
 }
 
-async function do_get_usages_from_device(command, rle_count) {
+// Mappings, macros and expressions make up a profile. Usage pages start over in each
+// profile, so each one gets its own streams.
+function profile_fields(fields, mappings, profile_macros, profile_expressions, stream_prefix) {
+    for (const mapping of mappings) {
+        const mapping_flags = (mapping['sticky'] ? STICKY_FLAG : 0)
+            | (mapping['tap'] ? TAP_FLAG : 0)
+            | (mapping['hold'] ? HOLD_FLAG : 0);
+        const hub_ports = ((mapping['target_port'] & 0x0F) << 4) | (mapping['source_port'] & 0x0F);
+        fields.push(
+            [USAGE, parseInt(mapping['target_usage'], 16), stream_prefix + 'target'],
+            [USAGE, parseInt(mapping['source_usage'], 16), stream_prefix + 'source'],
+            [SVARINT, mapping['scaling'] - DEFAULT_SCALING],
+            [UINT8, layer_list_to_mask(mapping['layers'])]);
+        if (hub_ports != 0) {
+            fields.push(
+                [UINT8, mapping_flags | PERSISTED_MAPPING_FLAG_HUB_PORTS],
+                [UINT8, hub_ports]);
+        } else {
+            fields.push([UINT8, mapping_flags]);
+        }
+    }
+
+    let macros = [];
+    for (let macro_i = 0; macro_i < NMACROS; macro_i++) {
+        let macro = profile_macros[macro_i] || [];
+        if ((macro.length == 1) && (macro[0].length == 0)) {
+            macro = [];
+        }
+        macros.push(macro);
+    }
+    while ((macros.length > 0) && (macros[macros.length - 1].length == 0)) {
+        macros.pop();
+    }
+    fields.push([VARINT, macros.length]);
+    for (const macro of macros) {
+        fields.push([VARINT, macro.length]);
+        for (const entry of macro) {
+            fields.push([VARINT, entry.length]);
+            fields.push(...entry.map((x) => [USAGE, parseInt(x, 16), stream_prefix + 'macro']));
+        }
+    }
+
+    let expressions = [];
+    for (let expr_i = 0; expr_i < NEXPRESSIONS; expr_i++) {
+        expressions.push(expr_to_elems(profile_expressions[expr_i] || ''));
+    }
+    while ((expressions.length > 0) && (expressions[expressions.length - 1].length == 0)) {
+        expressions.pop();
+    }
+    fields.push([VARINT, expressions.length]);
+    for (const elems of expressions) {
+        fields.push([VARINT, elems.length]);
+        for (const elem of elems) {
+            if ((elem[0] == ops["PUSH"]) && (elem[1] != 0) && (elem[1] % 1000 == 0)) {
+                fields.push([UINT8, ops["PUSH"] | PERSISTED_OP_FLAG_THOUSANDS], [SVARINT, elem[1] / 1000]);
+                continue;
+            }
+            fields.push([UINT8, elem[0]]);
+            if (elem[0] == ops["PUSH"]) {
+                fields.push([SVARINT, elem[1]]);
+            } else if (elem[0] == ops["PUSH_USAGE"]) {
+                fields.push([USAGE, elem[1] >>> 0, stream_prefix + 'expression']);
+            }
+        }
+    }
+}
+
+// The whole config goes over in one blob, in the same format the device persists it in.
+function config_to_blob() {
+    const flags = (config['ignore_auth_dev_inputs'] ? IGNORE_AUTH_DEV_INPUTS_FLAG : 0) |
+        (config['gpio_output_mode'] ? GPIO_OUTPUT_MODE_FLAG : 0) |
+        (config['normalize_gamepad_inputs'] ? NORMALIZE_GAMEPAD_INPUTS_FLAG : 0);
+    let fields = [
+        [UINT8, CONFIG_VERSION],
+        [UINT8, flags],
+        [UINT8, layer_list_to_mask(config['unmapped_passthrough_layers'])],
+        [UINT32, config['partial_scroll_timeout']],
+        [UINT16, config['mappings'].length],
+        [UINT8, config['interval_override']],
+        [UINT32, config['tap_hold_threshold']],
+        [UINT8, config['gpio_debounce_time_ms']],
+        [UINT8, config['our_descriptor_number']],
+        [UINT8, config['macro_entry_duration'] - 1],
+        [UINT16, config['quirks'].length],
+        [UINT32, config['macro_step_duration_us']],
+    ];
+
+    profile_fields(fields, config['mappings'], config['macros'], config['expressions'], '');
+
+    for (const quirk of config['quirks']) {
+        const size_flags = (quirk['size'] & QUIRK_SIZE_MASK) |
+            (quirk['relative'] ? QUIRK_FLAG_RELATIVE_MASK : 0) |
+            (quirk['signed'] ? QUIRK_FLAG_SIGNED_MASK : 0);
+        fields.push(
+            [UINT16, parseInt(quirk['vendor_id'], 16)],
+            [UINT16, parseInt(quirk['product_id'], 16)],
+            [UINT8, quirk['interface']],
+            [UINT8, quirk['report_id']],
+            [USAGE, parseInt(quirk['usage'], 16), 'quirk'],
+            [VARINT, quirk['bitpos']],
+            [UINT8, size_flags]);
+    }
+
+    // the profiles that aren't active, in the order they're numbered
+    const profiles = (config['profiles'] || []).slice().sort((a, b) => a['profile'] - b['profile']);
+    fields.push([UINT8, config['active_profile'] || 0], [VARINT, profiles.length]);
+    for (const profile of profiles) {
+        const mappings = profile['mappings'] || [];
+        fields.push([UINT8, profile['profile']], [VARINT, mappings.length]);
+        profile_fields(fields, mappings, profile['macros'] || [], profile['expressions'] || [], 'profile' + profile['profile'] + ' ');
+    }
+
+    let bytes = [];
+    let prev_pages = {};
+    const write = function (type, value, stream) {
+        switch (type) {
+            case UINT8:
+                bytes.push(value & 0xFF);
+                break;
+            case UINT16:
+                bytes.push(value & 0xFF, (value >>> 8) & 0xFF);
+                break;
+            case UINT32:
+            case INT32:
+                for (let i = 0; i < 4; i++) {
+                    bytes.push((value >>> (8 * i)) & 0xFF);
+                }
+                break;
+            case VARINT:
+                value >>>= 0;
+                while (value >= 0x80) {
+                    bytes.push((value & 0x7F) | 0x80);
+                    value >>>= 7;
+                }
+                bytes.push(value);
+                break;
+            case SVARINT:
+                write(VARINT, (value << 1) ^ (value >> 31));
+                break;
+            case USAGE: {
+                const page = value >>> 16;
+                let page_code = USAGE_PAGE_CODE_EXPLICIT;
+                if (page == (prev_pages[stream] || 0)) {
+                    page_code = USAGE_PAGE_CODE_SAME;
+                } else if (USAGE_PAGE_DICTIONARY.includes(page)) {
+                    page_code = USAGE_PAGE_DICTIONARY.indexOf(page) + 1;
+                }
+                prev_pages[stream] = page;
+                write(VARINT, ((value & 0xFFFF) << 4) | page_code);
+                if (page_code == USAGE_PAGE_CODE_EXPLICIT) {
+                    write(VARINT, page);
+                }
+                break;
+            }
+        }
+    };
+    for (const [type, value, stream] of fields) {
+        write(type, value, stream);
+    }
+    return new DataView(new Uint8Array(bytes).buffer);
+}
+
+function blob_to_config(blob) {
+    let pos = 0;
+    let prev_pages = {};
+    const read = function (type, stream) {
+        let value;
+        switch (type) {
+            case UINT8:
+                value = blob.getUint8(pos);
+                pos += 1;
+                break;
+            case UINT16:
+                value = blob.getUint16(pos, true);
+                pos += 2;
+                break;
+            case UINT32:
+                value = blob.getUint32(pos, true);
+                pos += 4;
+                break;
+            case INT32:
+                value = blob.getInt32(pos, true);
+                pos += 4;
+                break;
+            case VARINT: {
+                value = 0;
+                let shift = 0;
+                while (true) {
+                    const byte = blob.getUint8(pos++);
+                    value += (byte & 0x7F) * (2 ** shift);
+                    shift += 7;
+                    if (!(byte & 0x80)) {
+                        break;
+                    }
+                }
+                break;
+            }
+            case SVARINT: {
+                const zigzag = read(VARINT) >>> 0;
+                value = (zigzag >>> 1) ^ -(zigzag & 1);
+                break;
+            }
+            case USAGE: {
+                const varint = read(VARINT);
+                const page_code = varint & 0x0F;
+                let page;
+                if (page_code == USAGE_PAGE_CODE_SAME) {
+                    page = prev_pages[stream] || 0;
+                } else if (page_code == USAGE_PAGE_CODE_EXPLICIT) {
+                    page = read(VARINT) & 0xFFFF;
+                } else {
+                    page = USAGE_PAGE_DICTIONARY[page_code - 1];
+                }
+                prev_pages[stream] = page;
+                value = ((page << 16) | ((varint >>> 4) & 0xFFFF)) >>> 0;
+                break;
+            }
+        }
+        return value;
+    };
+
+    // usage pages start over in each profile, so each one gets its own streams
+    const read_profile = function (mapping_count, stream_prefix) {
+        let profile = { 'mappings': [], 'macros': [], 'expressions': [] };
+
+        for (let i = 0; i < mapping_count; i++) {
+            const target_usage = read(USAGE, stream_prefix + 'target');
+            const source_usage = read(USAGE, stream_prefix + 'source');
+            const scaling = DEFAULT_SCALING + read(SVARINT);
+            const layer_mask = read(UINT8);
+            const mapping_flags = read(UINT8);
+            const hub_ports = (mapping_flags & PERSISTED_MAPPING_FLAG_HUB_PORTS) ? read(UINT8) : 0;
+            profile['mappings'].push({
+                'target_usage': '0x' + target_usage.toString(16).padStart(8, '0'),
+                'source_usage': '0x' + source_usage.toString(16).padStart(8, '0'),
+                'scaling': scaling,
+                'layers': mask_to_layer_list(layer_mask),
+                'sticky': (mapping_flags & STICKY_FLAG) != 0,
+                'tap': (mapping_flags & TAP_FLAG) != 0,
+                'hold': (mapping_flags & HOLD_FLAG) != 0,
+                'source_port': hub_ports & 0x0F,
+                'target_port': (hub_ports >> 4) & 0x0F,
+            });
+        }
+
+        const macro_count = read(VARINT);
+        for (let macro_i = 0; macro_i < NMACROS; macro_i++) {
+            let macro = [];
+            const macro_len = (macro_i < macro_count) ? read(VARINT) : 0;
+            for (let i = 0; i < macro_len; i++) {
+                const entry_len = read(VARINT);
+                let entry = [];
+                for (let j = 0; j < entry_len; j++) {
+                    entry.push('0x' + read(USAGE, stream_prefix + 'macro').toString(16).padStart(8, '0'));
+                }
+                macro.push(entry);
+            }
+            profile['macros'].push(macro);
+        }
+
+        const expr_count = read(VARINT);
+        for (let expr_i = 0; expr_i < NEXPRESSIONS; expr_i++) {
+            let expression = [];
+            const expr_len = (expr_i < expr_count) ? read(VARINT) : 0;
+            for (let i = 0; i < expr_len; i++) {
+                const elem = read(UINT8);
+                if (elem == ops['PUSH']) {
+                    expression.push(read(SVARINT).toString());
+                } else if (elem == (ops['PUSH'] | PERSISTED_OP_FLAG_THOUSANDS)) {
+                    expression.push((read(SVARINT) * 1000).toString());
+                } else if (elem == ops['PUSH_USAGE']) {
+                    expression.push('0x' + read(USAGE, stream_prefix + 'expression').toString(16).padStart(8, '0'));
+                } else {
+                    expression.push(opcodes[elem].toLowerCase());
+                }
+            }
+            profile['expressions'].push(expression.join(' '));
+        }
+
+        return profile;
+    };
+
+    const [config_version, flags, unmapped_passthrough_layer_mask, partial_scroll_timeout, mapping_count, interval_override, tap_hold_threshold, gpio_debounce_time_ms, our_descriptor_number, macro_entry_duration, quirk_count, macro_step_duration_us] =
+        [UINT8, UINT8, UINT8, UINT32, UINT16, UINT8, UINT32, UINT8, UINT8, UINT8, UINT16, UINT32].map(read);
+    check_received_version(config_version);
+
+    config['version'] = config_version;
+    config['unmapped_passthrough_layers'] = mask_to_layer_list(unmapped_passthrough_layer_mask);
+    config['partial_scroll_timeout'] = partial_scroll_timeout;
+    config['tap_hold_threshold'] = tap_hold_threshold;
+    config['gpio_debounce_time_ms'] = gpio_debounce_time_ms;
+    config['interval_override'] = interval_override;
+    config['our_descriptor_number'] = our_descriptor_number;
+    config['ignore_auth_dev_inputs'] = !!(flags & IGNORE_AUTH_DEV_INPUTS_FLAG);
+    config['gpio_output_mode'] = (flags & GPIO_OUTPUT_MODE_FLAG) ? 1 : 0;
+    config['normalize_gamepad_inputs'] = !!(flags & NORMALIZE_GAMEPAD_INPUTS_FLAG);
+    config['macro_entry_duration'] = macro_entry_duration + 1;
+    config['macro_step_duration_us'] = macro_step_duration_us;
+
+    const active_profile = read_profile(mapping_count, '');
+    config['mappings'] = active_profile['mappings'];
+    config['macros'] = active_profile['macros'];
+    config['expressions'] = active_profile['expressions'];
+
+    config['quirks'] = [];
+
+    for (let quirk_i = 0; quirk_i < quirk_count; quirk_i++) {
+        const [vendor_id, product_id, interface_, report_id] =
+            [UINT16, UINT16, UINT8, UINT8].map(read);
+        const usage = read(USAGE, 'quirk');
+        const bitpos = read(VARINT);
+        const size_flags = read(UINT8);
+        config['quirks'].push({
+            'vendor_id': '0x' + vendor_id.toString(16).padStart(4, '0'),
+            'product_id': '0x' + product_id.toString(16).padStart(4, '0'),
+            'interface': interface_,
+            'report_id': report_id,
+            'usage': '0x' + usage.toString(16).padStart(8, '0'),
+            'bitpos': bitpos,
+            'size': size_flags & QUIRK_SIZE_MASK,
+            'relative': (size_flags & QUIRK_FLAG_RELATIVE_MASK) != 0,
+            'signed': (size_flags & QUIRK_FLAG_SIGNED_MASK) != 0,
+        });
+    }
+
+    config['active_profile'] = read(UINT8);
+    config['profiles'] = [];
+
+    const profile_count = read(VARINT);
+    for (let i = 0; i < profile_count; i++) {
+        const n = read(UINT8);
+        const profile = read_profile(read(VARINT), 'profile' + n + ' ');
+        config['profiles'].push({ 'profile': n, ...profile });
+    }
+}
+
+async function send_config_blob(blob) {
+    await send_feature_command(BEGIN_BLOB, [[UINT32, blob.byteLength], [UINT32, crc32(blob, blob.byteLength)]]);
+    for (let offset = 0; offset < blob.byteLength; offset += BLOB_BYTES_IN_PACKET) {
+        const len = Math.min(BLOB_BYTES_IN_PACKET, blob.byteLength - offset);
+        let fields = [[UINT32, offset], [UINT8, len]];
+        for (let i = 0; i < len; i++) {
+            fields.push([UINT8, blob.getUint8(offset + i)]);
+        }
+        await send_feature_command(BLOB_CHUNK, fields);
+    }
+    await send_feature_command(COMMIT_BLOB);
+    const [return_code] = await read_config_feature([UINT8]);
+    switch (return_code) {
+        case COMMIT_BLOB_SUCCESS:
+            break;
+        case COMMIT_BLOB_CRC_MISMATCH:
+            throw new Error('Configuration upload failed (CRC mismatch).');
+        case COMMIT_BLOB_BUSY:
+            throw new Error('Device is busy saving its configuration, try again.');
+        default:
+            throw new Error('Configuration rejected by device (' + return_code + ').');
+    }
+}
+
+async function receive_config_blob() {
+    await send_feature_command(READ_BLOB);
+    const [return_code, size, blob_crc] = await read_config_feature([UINT8, UINT32, UINT32]);
+    if (return_code == PERSIST_CONFIG_CONFIG_TOO_BIG) {
+        throw new Error('Configuration too big to read.');
+    }
+    if (return_code == PERSIST_CONFIG_BUSY) {
+        throw new Error('Device is busy saving its configuration, try again.');
+    }
+    let blob = new DataView(new ArrayBuffer(size));
+    for (let offset = 0; offset < size; offset += BLOB_BYTES_IN_RESPONSE) {
+        // the offset goes with every read, so a retried read gets the same chunk
+        await send_feature_command(GET_BLOB_CHUNK, [[UINT32, offset]]);
+        const chunk = await read_config_feature(Array(BLOB_BYTES_IN_RESPONSE).fill(UINT8));
+        for (let i = 0; (i < BLOB_BYTES_IN_RESPONSE) && (offset + i < size); i++) {
+            blob.setUint8(offset + i, chunk[i]);
+        }
+    }
+    if (crc32(blob, size) != blob_crc) {
+        throw new Error('Configuration download failed (CRC mismatch).');
+    }
+    return blob;
+}
+
+function rle_to_extra_usages(usages_rle) {
     const extra_usage_set = new Set();
+    for (const [usage, count] of usages_rle) {
+        if (usage != 0) {
+            for (let k = 0; k < count; k++) {
+                const u = '0x' + (usage + k).toString(16).padStart(8, '0');
+                if (!ignored_usages.has(u)) {
+                    extra_usage_set.add(u);
+                }
+            }
+        }
+    }
+
+    const extra_usages_ = Array.from(extra_usage_set);
+    extra_usages_.sort();
+    return extra_usages_;
+}
+
+async function do_get_usages_from_device(command, rle_count) {
+    let usages_rle = [];
     let i = 0;
     while (i < rle_count) {
         await send_feature_command(command, [[UINT32, i]]);
         const fields = await read_config_feature([UINT32, UINT32, UINT32, UINT32, UINT32, UINT32]);
 
         for (let j = 0; j < 3; j++) {
-            const usage = fields[2 * j];
-            const count = fields[2 * j + 1];
-            if (usage != 0) {
-                for (let k = 0; k < count; k++) {
-                    const u = '0x' + (usage + k).toString(16).padStart(8, '0');
-                    if (!ignored_usages.has(u)) {
-                        extra_usage_set.add(u);
-                    }
-                }
-            }
+            usages_rle.push([fields[2 * j], fields[2 * j + 1]]);
         }
 
         i += 3;
     }
 
-    const extra_usages_ = Array.from(extra_usage_set);
-    extra_usages_.sort();
-    return extra_usages_;
+    return rle_to_extra_usages(usages_rle);
+}
+
+function decode_packed_usages(nitems, data) {
+    let usages_rle = [];
+    let prev_end = 0;
+    let pos = 0;
+    const read_varint = function () {
+        let value = 0;
+        let shift = 0;
+        while (true) {
+            const byte = data[pos++];
+            value += (byte & 0x7F) * (2 ** shift);
+            shift += 7;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+    };
+    for (let i = 0; i < nitems; i++) {
+        const usage = prev_end + read_varint();
+        const count = read_varint();
+        usages_rle.push([usage, count]);
+        prev_end = usage + count;
+    }
+    return usages_rle;
+}
+
+// Returns null if devices were connected or disconnected while we were reading,
+// or if nothing changed since the last time (their_usages_generation is not null then).
+async function get_their_usages_from_device() {
+    if (device !== their_usages_device) {
+        their_usages_generation = null;
+    }
+    let usages_rle = [];
+    let generation = null;
+    let total = null;
+    while ((total === null) || (usages_rle.length < total)) {
+        await send_feature_command(GET_THEIR_USAGES_PACKED, [[UINT32, usages_rle.length], [UINT32, (generation === null) ? 0 : generation]]);
+        const [packet_generation, packet_total, nitems, stale, ...data] =
+            await read_config_feature([UINT32, UINT16, UINT8, UINT8].concat(Array(20).fill(UINT8)));
+        if ((generation === null) && (packet_generation === their_usages_generation)) {
+            return null;
+        }
+        if (stale || ((generation !== null) && (packet_generation != generation))) {
+            their_usages_generation = null;
+            return null;
+        }
+        generation = packet_generation;
+        total = packet_total;
+        if (nitems == 0) {
+            break;
+        }
+        usages_rle.push(...decode_packed_usages(nitems, data));
+    }
+    their_usages_generation = generation;
+    their_usages_device = device;
+    return usages_rle;
 }
 
 async function get_usages_from_device() {
@@ -612,8 +874,17 @@ async function get_usages_from_device() {
 
     extra_usages['target'] =
         await do_get_usages_from_device(GET_OUR_USAGES, our_usage_count);
-    extra_usages['source'] =
-        await do_get_usages_from_device(GET_THEIR_USAGES, their_usage_count);
+    while (true) {
+        const their_usages_rle = await get_their_usages_from_device();
+        if (their_usages_rle !== null) {
+            extra_usages['source'] = rle_to_extra_usages(their_usages_rle);
+            break;
+        }
+        if (their_usages_generation !== null) {
+            // unchanged since last time
+            break;
+        }
+    }
 }
 
 function set_config_ui_state() {
@@ -628,6 +899,7 @@ function set_config_ui_state() {
     document.getElementById('our_descriptor_number_dropdown').value = config['our_descriptor_number'];
     document.getElementById('ignore_auth_dev_inputs_checkbox').checked = config['ignore_auth_dev_inputs'];
     document.getElementById('macro_entry_duration_input').value = config['macro_entry_duration'];
+    document.getElementById('macro_step_duration_us_input').value = config['macro_step_duration_us'];
     document.getElementById('gpio_output_mode_dropdown').value = config['gpio_output_mode'];
     document.getElementById('input_labels_dropdown').value = config['input_labels'];
     document.getElementById('input_labels_modal_dropdown').value = config['input_labels'];
@@ -764,6 +1036,9 @@ function set_ui_state() {
         // set it to false to preserve previous behavior.
         config['normalize_gamepad_inputs'] = false;
     }
+    if (config['version'] < 19) {
+        config['macro_step_duration_us'] = 0;
+    }
     if (config['version'] < CONFIG_VERSION) {
         config['version'] = CONFIG_VERSION;
     }
@@ -989,7 +1264,7 @@ function add_crc(data) {
 }
 
 function check_json_version(config_version) {
-    if (!([3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18].includes(config_version))) {
+    if (!([3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21].includes(config_version))) {
         throw new Error("Incompatible version.");
     }
 }
@@ -1005,7 +1280,7 @@ async function check_device_version() {
     // device because it could be version X, ignore our GET_CONFIG call with version Y and
     // just happen to have Y at the right place in the buffer from some previous call done
     // by some other software.
-    for (const version of [CONFIG_VERSION, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2]) {
+    for (const version of [CONFIG_VERSION, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2]) {
         await send_feature_command(GET_CONFIG, [], version);
         const [received_version] = await read_config_feature([UINT8]);
         if (received_version == version) {
@@ -1441,6 +1716,17 @@ function macro_entry_duration_onchange() {
     config['macro_entry_duration'] = value;
 }
 
+function macro_step_duration_us_onchange() {
+    let value = parseInt(document.getElementById("macro_step_duration_us_input").value, 10);
+    if (isNaN(value) || (value < 0)) {
+        value = 0;
+    }
+    if (value > 1000000) {
+        value = 1000000;
+    }
+    config['macro_step_duration_us'] = value;
+}
+
 function input_labels_onchange(element_id) {
     return function () {
         config['input_labels'] = parseInt(document.getElementById(element_id).value, 10);
@@ -638,6 +638,10 @@ const common_target_usages = {
     "0xfff60003": { 'name': 'Analog 3', 'class': 'other' },
     "0xfff60004": { 'name': 'Analog 4', 'class': 'other' },
     "0xfff60005": { 'name': 'Analog 5', 'class': 'other' },
+    "0xfffa0000": { 'name': 'Profile 0', 'class': 'other' },
+    "0xfffa0001": { 'name': 'Profile 1', 'class': 'other' },
+    "0xfffa0002": { 'name': 'Profile 2', 'class': 'other' },
+    "0xfffa0003": { 'name': 'Profile 3', 'class': 'other' },
 }
 
 Object.assign(usages[0], common_target_usages);
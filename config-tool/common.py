@@ -11,7 +11,7 @@ PRODUCT_ID = 0xBAF2
 CONFIG_USAGE_PAGE = 0xFF00
 CONFIG_USAGE = 0x0020
 
-CONFIG_VERSION = 18
+CONFIG_VERSION = 22
 CONFIG_SIZE = 32
 REPORT_ID_CONFIG = 100
 
@@ -48,9 +48,25 @@ SET_MONITOR_ENABLED = 22
 CLEAR_QUIRKS = 23
 ADD_QUIRK = 24
 GET_QUIRK = 25
+GET_EXTRA_CONFIG = 27
+BEGIN_BLOB = 28
+BLOB_CHUNK = 29
+COMMIT_BLOB = 30
+READ_BLOB = 31
+GET_BLOB_CHUNK = 32
+GET_THEIR_USAGES_PACKED = 33
+GET_PERSIST_STATUS = 34
+SET_ACTIVE_PROFILE = 35
+GET_ACTIVE_PROFILE = 36
 
 PERSIST_CONFIG_SUCCESS = 1
 PERSIST_CONFIG_CONFIG_TOO_BIG = 2
+PERSIST_CONFIG_BUSY = 3
+
+COMMIT_BLOB_SUCCESS = 1
+COMMIT_BLOB_CRC_MISMATCH = 2
+COMMIT_BLOB_INVALID_CONFIG = 3
+COMMIT_BLOB_BUSY = 4
 
 
 UNMAPPED_PASSTHROUGH_FLAG = 0x01
@@ -64,7 +80,32 @@ NORMALIZE_GAMEPAD_INPUTS_FLAG = 1 << 6
 
 NMACROS = 32
 NEXPRESSIONS = 8
+NPROFILES = 4
 MACRO_ITEMS_IN_PACKET = 6
+BLOB_BYTES_IN_PACKET = 21
+BLOB_BYTES_IN_RESPONSE = 28
+
+# usage pages that can be referred to with a 4-bit code in the persisted config
+USAGE_PAGE_DICTIONARY = [
+    0x0001,
+    0x0007,
+    0x0008,
+    0x0009,
+    0x000C,
+    0xFFF1,
+    0xFFF2,
+    0xFFF3,
+    0xFFF4,
+    0xFFF5,
+    0xFFF6,
+    0xFFF7,
+    0xFFF8,
+    0xFFF9,
+]
+USAGE_PAGE_CODE_SAME = 0
+USAGE_PAGE_CODE_EXPLICIT = 15
+PERSISTED_MAPPING_FLAG_HUB_PORTS = 1 << 7
+PERSISTED_OP_FLAG_THOUSANDS = 1 << 7
 
 QUIRK_FLAG_RELATIVE_MASK = 0b10000000
 QUIRK_FLAG_SIGNED_MASK = 0b01000000
@@ -198,3 +239,150 @@ def get_feature_report(device, report_id, size):
             delay *= 2
             continue
         raise Exception("Error in get_feature_report (given up retrying)")
+
+
+def send_config_blob(device, blob):
+    data = struct.pack(
+        "<BBBLL18B",
+        REPORT_ID_CONFIG,
+        CONFIG_VERSION,
+        BEGIN_BLOB,
+        len(blob),
+        binascii.crc32(blob),
+        *([0] * 18)
+    )
+    device.send_feature_report(add_crc(data))
+    for offset in range(0, len(blob), BLOB_BYTES_IN_PACKET):
+        chunk = blob[offset : offset + BLOB_BYTES_IN_PACKET]
+        data = struct.pack(
+            "<BBBLB21s",
+            REPORT_ID_CONFIG,
+            CONFIG_VERSION,
+            BLOB_CHUNK,
+            offset,
+            len(chunk),
+            chunk,
+        )
+        device.send_feature_report(add_crc(data))
+    data = struct.pack(
+        "<BBB26B", REPORT_ID_CONFIG, CONFIG_VERSION, COMMIT_BLOB, *([0] * 26)
+    )
+    device.send_feature_report(add_crc(data))
+    data = get_feature_report(device, REPORT_ID_CONFIG, CONFIG_SIZE + 1)
+    (report_id, return_code, *_, crc) = struct.unpack("<BB27BL", data)
+    check_crc(data, crc)
+    if return_code == COMMIT_BLOB_CRC_MISMATCH:
+        raise Exception("Configuration upload failed (CRC mismatch).")
+    if return_code == COMMIT_BLOB_BUSY:
+        raise Exception("Device is busy saving its configuration, try again.")
+    if return_code != COMMIT_BLOB_SUCCESS:
+        raise Exception("Configuration rejected by device ({}).".format(return_code))
+
+
+def receive_config_blob(device):
+    data = struct.pack(
+        "<BBB26B", REPORT_ID_CONFIG, CONFIG_VERSION, READ_BLOB, *([0] * 26)
+    )
+    device.send_feature_report(add_crc(data))
+    data = get_feature_report(device, REPORT_ID_CONFIG, CONFIG_SIZE + 1)
+    (report_id, return_code, size, blob_crc, *_, crc) = struct.unpack("<BBLL19BL", data)
+    check_crc(data, crc)
+    if return_code == PERSIST_CONFIG_CONFIG_TOO_BIG:
+        raise Exception("Configuration too big to read.")
+    if return_code == PERSIST_CONFIG_BUSY:
+        raise Exception("Device is busy saving its configuration, try again.")
+    blob = b""
+    while len(blob) < size:
+        # the offset goes with every read, so a retried read gets the same chunk
+        data = struct.pack(
+            "<BBBL22B",
+            REPORT_ID_CONFIG,
+            CONFIG_VERSION,
+            GET_BLOB_CHUNK,
+            len(blob),
+            *([0] * 22)
+        )
+        device.send_feature_report(add_crc(data))
+        data = get_feature_report(device, REPORT_ID_CONFIG, CONFIG_SIZE + 1)
+        (crc,) = struct.unpack("<L", data[29:33])
+        check_crc(data, crc)
+        blob += bytes(data[1 : 1 + BLOB_BYTES_IN_RESPONSE])
+    blob = blob[:size]
+    if binascii.crc32(blob) != blob_crc:
+        raise Exception("Configuration download failed (CRC mismatch).")
+    return blob
+
+
+def pack_varint(val):
+    data = bytearray()
+    while val >= 0x80:
+        data.append((val & 0x7F) | 0x80)
+        val >>= 7
+    data.append(val)
+    return bytes(data)
+
+
+def unpack_varint(data, pos):
+    val = 0
+    shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        val |= (byte & 0x7F) << shift
+        shift += 7
+        if not (byte & 0x80):
+            return val, pos
+
+
+def pack_svarint(val):
+    val = ((val + 0x80000000) & 0xFFFFFFFF) - 0x80000000
+    return pack_varint(((val << 1) ^ (val >> 31)) & 0xFFFFFFFF)
+
+
+def unpack_svarint(data, pos):
+    val, pos = unpack_varint(data, pos)
+    return (val >> 1) ^ -(val & 1), pos
+
+
+# prev_pages holds the last usage page for each stream (mapping targets, mapping
+# sources, macros, expressions, quirks), a usage on the same page as the previous
+# one in its stream gets page code 0
+def pack_usage(usage, prev_pages, stream):
+    page = usage >> 16
+    if page == prev_pages.get(stream, 0):
+        page_code = USAGE_PAGE_CODE_SAME
+    elif page in USAGE_PAGE_DICTIONARY:
+        page_code = USAGE_PAGE_DICTIONARY.index(page) + 1
+    else:
+        page_code = USAGE_PAGE_CODE_EXPLICIT
+    prev_pages[stream] = page
+    data = pack_varint(((usage & 0xFFFF) << 4) | page_code)
+    if page_code == USAGE_PAGE_CODE_EXPLICIT:
+        data += pack_varint(page)
+    return data
+
+
+def unpack_usage(data, pos, prev_pages, stream):
+    val, pos = unpack_varint(data, pos)
+    page_code = val & 0x0F
+    if page_code == USAGE_PAGE_CODE_SAME:
+        page = prev_pages.get(stream, 0)
+    elif page_code == USAGE_PAGE_CODE_EXPLICIT:
+        page, pos = unpack_varint(data, pos)
+    else:
+        page = USAGE_PAGE_DICTIONARY[page_code - 1]
+    prev_pages[stream] = page
+    return (page << 16) | ((val >> 4) & 0xFFFF), pos
+
+
+def decode_packed_usages(nitems, data):
+    usages_rle = []
+    prev_end = 0
+    pos = 0
+    for _ in range(nitems):
+        delta, pos = unpack_varint(data, pos)
+        count, pos = unpack_varint(data, pos)
+        usage = prev_end + delta
+        usages_rle.append((usage, count))
+        prev_end = usage + count
+    return usages_rle
@@ -5,32 +5,101 @@ from common import *
 import struct
 import json
 
-device = get_device()
 
-data = struct.pack("<BBB26B", REPORT_ID_CONFIG, CONFIG_VERSION, GET_CONFIG, *([0] * 26))
-device.send_feature_report(add_crc(data))
+# Mappings, macros and expressions make up a profile. Usage pages start over in each profile.
+def unpack_profile(blob, pos, mapping_count):
+    mappings = []
+    macros = []
+    expressions = []
+    prev_pages = {}
+
+    for i in range(mapping_count):
+        target_usage, pos = unpack_usage(blob, pos, prev_pages, "target")
+        source_usage, pos = unpack_usage(blob, pos, prev_pages, "source")
+        scaling, pos = unpack_svarint(blob, pos)
+        scaling += DEFAULT_SCALING
+        (layer_mask, flags) = struct.unpack_from("<BB", blob, pos)
+        pos += 2
+        hub_ports = 0
+        if flags & PERSISTED_MAPPING_FLAG_HUB_PORTS:
+            flags &= ~PERSISTED_MAPPING_FLAG_HUB_PORTS
+            (hub_ports,) = struct.unpack_from("<B", blob, pos)
+            pos += 1
+        mappings.append(
+            {
+                "target_usage": "{0:#010x}".format(target_usage),
+                "source_usage": "{0:#010x}".format(source_usage),
+                "scaling": scaling,
+                "layers": mask_to_layer_list(layer_mask),
+                "sticky": (flags & STICKY_FLAG) != 0,
+                "tap": (flags & TAP_FLAG) != 0,
+                "hold": (flags & HOLD_FLAG) != 0,
+                "source_port": hub_ports & 0x0F,
+                "target_port": (hub_ports >> 4) & 0x0F,
+            }
+        )
+
+    macro_count, pos = unpack_varint(blob, pos)
+    for macro_i in range(NMACROS):
+        macro = []
+        macro_len = 0
+        if macro_i < macro_count:
+            macro_len, pos = unpack_varint(blob, pos)
+        for _ in range(macro_len):
+            entry_len, pos = unpack_varint(blob, pos)
+            entry = []
+            for _ in range(entry_len):
+                usage, pos = unpack_usage(blob, pos, prev_pages, "macro")
+                entry.append("{0:#010x}".format(usage))
+            macro.append(entry)
+        macros.append(macro)
+
+    expr_count, pos = unpack_varint(blob, pos)
+    for expression_i in range(NEXPRESSIONS):
+        expression = []
+        expr_len = 0
+        if expression_i < expr_count:
+            expr_len, pos = unpack_varint(blob, pos)
+        for _ in range(expr_len):
+            (elem,) = struct.unpack_from("<B", blob, pos)
+            pos += 1
+            if elem == ops["PUSH"]:
+                val, pos = unpack_svarint(blob, pos)
+                expression.append(str(val))
+            elif elem == ops["PUSH"] | PERSISTED_OP_FLAG_THOUSANDS:
+                val, pos = unpack_svarint(blob, pos)
+                expression.append(str(val * 1000))
+            elif elem == ops["PUSH_USAGE"]:
+                val, pos = unpack_usage(blob, pos, prev_pages, "expression")
+                expression.append("0x{:08x}".format(val))
+            else:
+                expression.append(opcodes[elem].lower())
+
+        expressions.append(" ".join(expression))
 
-data = get_feature_report(device, REPORT_ID_CONFIG, CONFIG_SIZE + 1)
+    return mappings, macros, expressions, pos
+
+
+device = get_device()
+
+blob = receive_config_blob(device)
 
 (
-    report_id,
     version,
     flags,
     unmapped_passthrough_layer_mask,
     partial_scroll_timeout,
     mapping_count,
-    our_usage_count,
-    their_usage_count,
     interval_override,
     tap_hold_threshold,
     gpio_debounce_time_ms,
     our_descriptor_number,
     macro_entry_duration,
     quirk_count,
-    *_,
-    crc,
-) = struct.unpack("<BBBBLHLLBLBBBHBL", data)
-check_crc(data, crc)
+    macro_step_duration_us,
+) = struct.unpack_from("<BBBLHBLBBBHL", blob)
+pos = struct.calcsize("<BBBLHBLBBBHL")
+prev_pages = {}
 
 config = {
     "version": version,
@@ -42,6 +111,7 @@ config = {
     "our_descriptor_number": our_descriptor_number,
     "ignore_auth_dev_inputs": bool(flags & IGNORE_AUTH_DEV_INPUTS_FLAG),
     "macro_entry_duration": macro_entry_duration + 1,
+    "macro_step_duration_us": macro_step_duration_us,
     "gpio_output_mode": 1 if (flags & GPIO_OUTPUT_MODE_FLAG) else 0,
     "input_labels": 0,
     "normalize_gamepad_inputs": bool(flags & NORMALIZE_GAMEPAD_INPUTS_FLAG),
@@ -51,133 +121,22 @@ config = {
     "quirks": [],
 }
 
-for i in range(mapping_count):
-    data = struct.pack(
-        "<BBBL22B", REPORT_ID_CONFIG, CONFIG_VERSION, GET_MAPPING, i, *([0] * 22)
-    )
-    device.send_feature_report(add_crc(data))
-    data = get_feature_report(device, REPORT_ID_CONFIG, CONFIG_SIZE + 1)
-    (
-        report_id,
-        target_usage,
-        source_usage,
-        scaling,
-        layer_mask,
-        flags,
-        hub_ports,
-        *_,
-        crc,
-    ) = struct.unpack("<BLLlBBB13BL", data)
-    check_crc(data, crc)
-    config["mappings"].append(
-        {
-            "target_usage": "{0:#010x}".format(target_usage),
-            "source_usage": "{0:#010x}".format(source_usage),
-            "scaling": scaling,
-            "layers": mask_to_layer_list(layer_mask),
-            "sticky": (flags & STICKY_FLAG) != 0,
-            "tap": (flags & TAP_FLAG) != 0,
-            "hold": (flags & HOLD_FLAG) != 0,
-            "source_port": hub_ports & 0x0F,
-            "target_port": (hub_ports >> 4) & 0x0F,
-        }
-    )
-
-for macro_i in range(NMACROS):
-    macro = []
-    i = 0
-    keep_going = True
-    while keep_going:
-        data = struct.pack(
-            "<BBBLL18B",
-            REPORT_ID_CONFIG,
-            CONFIG_VERSION,
-            GET_MACRO,
-            macro_i,
-            i,
-            *([0] * 18)
-        )
-        device.send_feature_report(add_crc(data))
-        data = get_feature_report(device, REPORT_ID_CONFIG, CONFIG_SIZE + 1)
-        (
-            report_id,
-            nitems,
-            *usages,
-            crc,
-        ) = struct.unpack("<BB6L3BL", data)
-        check_crc(data, crc)
-        if nitems < MACRO_ITEMS_IN_PACKET:
-            keep_going = False
-        if (len(macro) == 0) and (nitems > 0):
-            macro = [[]]
-        for usage in usages[0:nitems]:
-            if usage == 0:
-                macro.append([])
-            else:
-                macro[-1].append("{0:#010x}".format(usage))
-        i += MACRO_ITEMS_IN_PACKET
-    config["macros"].append(macro)
-
-for expression_i in range(NEXPRESSIONS):
-    expression = []
-    i = 0
-    while True:
-        data = struct.pack(
-            "<BBBLL18B",
-            REPORT_ID_CONFIG,
-            CONFIG_VERSION,
-            GET_EXPRESSION,
-            expression_i,
-            i,
-            *([0] * 18)
-        )
-        device.send_feature_report(add_crc(data))
-        data = get_feature_report(device, REPORT_ID_CONFIG, CONFIG_SIZE + 1)
-        (
-            report_id,
-            nelems,
-            *elems,
-            crc,
-        ) = struct.unpack("<BB27BL", data)
-        check_crc(data, crc)
-        if nelems == 0:
-            break
-        for _ in range(nelems):
-            elem = elems[0]
-            elems = elems[1:]
-            if elem in (ops["PUSH"], ops["PUSH_USAGE"]):
-                val = elems[3] << 24 | elems[2] << 16 | elems[1] << 8 | elems[0]
-                elems = elems[4:]
-                if elem == ops["PUSH"]:
-                    val -= (val & (1 << 31)) << 1
-                    expression.append(str(val))
-                else:
-                    expression.append("0x{:08x}".format(val))
-            else:
-                expression.append(opcodes[elem].lower())
-        i += nelems
-
-    config["expressions"].append(" ".join(expression))
+config["mappings"], config["macros"], config["expressions"], pos = unpack_profile(
+    blob, pos, mapping_count
+)
 
 for quirk_i in range(quirk_count):
-    data = struct.pack(
-        "<BBBL22B", REPORT_ID_CONFIG, CONFIG_VERSION, GET_QUIRK, quirk_i, *([0] * 22)
-    )
-    device.send_feature_report(add_crc(data))
-    data = get_feature_report(device, REPORT_ID_CONFIG, CONFIG_SIZE + 1)
     (
-        report_id_,
         vendor_id,
         product_id,
         interface,
         report_id,
-        usage,
-        bitpos,
-        size_flags,
-        *_,
-        crc,
-    ) = struct.unpack("<BHHBBLHB15BL", data)
-    check_crc(data, crc)
+    ) = struct.unpack_from("<HHBB", blob, pos)
+    pos += struct.calcsize("<HHBB")
+    usage, pos = unpack_usage(blob, pos, prev_pages, "quirk")
+    bitpos, pos = unpack_varint(blob, pos)
+    (size_flags,) = struct.unpack_from("<B", blob, pos)
+    pos += 1
     config["quirks"].append(
         {
             "vendor_id": "{0:#06x}".format(vendor_id),
@@ -192,4 +151,22 @@ for quirk_i in range(quirk_count):
         }
     )
 
+(config["active_profile"],) = struct.unpack_from("<B", blob, pos)
+pos += 1
+profile_count, pos = unpack_varint(blob, pos)
+config["profiles"] = []
+for _ in range(profile_count):
+    (n,) = struct.unpack_from("<B", blob, pos)
+    pos += 1
+    mapping_count, pos = unpack_varint(blob, pos)
+    mappings, macros, expressions, pos = unpack_profile(blob, pos, mapping_count)
+    config["profiles"].append(
+        {
+            "profile": n,
+            "mappings": mappings,
+            "macros": macros,
+            "expressions": expressions,
+        }
+    )
+
 print(json.dumps(config, indent=4))
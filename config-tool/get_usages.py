@@ -16,32 +16,66 @@ data = get_feature_report(device, REPORT_ID_CONFIG, CONFIG_SIZE + 1)
     report_id,
     version,
     flags,
+    unmapped_passthrough_layer_mask,
     partial_scroll_timeout,
     mapping_count,
     our_usage_count,
     their_usage_count,
-    interval_override,
     *_,
     crc,
-) = struct.unpack("<BBBLLLLB9BL", data)
+) = struct.unpack("<BBBBLHLL11BL", data)
 check_crc(data, crc)
 
-usages = {"our_usages": [], "their_usages": []}
 
-for command, key, count in [
-    [GET_OUR_USAGES, "our_usages", our_usage_count],
-    [GET_THEIR_USAGES, "their_usages", their_usage_count],
-]:
-    for i in range(0, count, 3):
+
+def get_their_usages_rle():
+    usages_rle = []
+    generation = None
+    total = None
+    while (total is None) or (len(usages_rle) < total):
         data = struct.pack(
-            "<BBBL22B", REPORT_ID_CONFIG, CONFIG_VERSION, command, i, *([0] * 22)
+            "<BBBLL18B",
+            REPORT_ID_CONFIG,
+            CONFIG_VERSION,
+            GET_THEIR_USAGES_PACKED,
+            len(usages_rle),
+            generation or 0,
+            *([0] * 18)
         )
         device.send_feature_report(add_crc(data))
         data = get_feature_report(device, REPORT_ID_CONFIG, CONFIG_SIZE + 1)
-        (report_id, *usages_rle, _, crc) = struct.unpack("<B6L4BL", data)
+        (report_id, packet_generation, total, nitems, stale, *packed, crc) = struct.unpack(
+            "<BLHBB20BL", data
+        )
         check_crc(data, crc)
-        for u, l in zip(*(iter(usages_rle),) * 2):
-            if u != 0:
-                usages[key].extend("{0:#010x}".format(u + i) for i in range(l))
+        if stale or ((generation is not None) and (packet_generation != generation)):
+            # devices were connected or disconnected while we were reading
+            return None
+        generation = packet_generation
+        if nitems == 0:
+            break
+        usages_rle.extend(decode_packed_usages(nitems, packed))
+    return usages_rle
+
+
+usages = {"our_usages": [], "their_usages": []}
+
+for i in range(0, our_usage_count, 3):
+    data = struct.pack(
+        "<BBBL22B", REPORT_ID_CONFIG, CONFIG_VERSION, GET_OUR_USAGES, i, *([0] * 22)
+    )
+    device.send_feature_report(add_crc(data))
+    data = get_feature_report(device, REPORT_ID_CONFIG, CONFIG_SIZE + 1)
+    (report_id, *usages_rle, _, crc) = struct.unpack("<B6L4BL", data)
+    check_crc(data, crc)
+    for u, l in zip(*(iter(usages_rle),) * 2):
+        if u != 0:
+            usages["our_usages"].extend("{0:#010x}".format(u + i) for i in range(l))
+
+while (their_usages_rle := get_their_usages_rle()) is None:
+    pass
+
+for u, l in their_usages_rle:
+    usages["their_usages"].extend("{0:#010x}".format(u + i) for i in range(l))
 
 print(json.dumps(usages, indent=2))
@@ -6,6 +6,69 @@ import sys
 import struct
 import json
 
+
+# Mappings, macros and expressions make up a profile. Usage pages start over in each profile.
+def pack_profile(version, mappings, macros, expressions):
+    blob = b""
+    prev_pages = {}
+
+    for mapping in mappings:
+        target_usage = int(mapping["target_usage"], 16)
+        source_usage = int(mapping["source_usage"], 16)
+        scaling = mapping.get("scaling", DEFAULT_SCALING)
+        if version == 3:
+            layer_mask = 1 << mapping.get("layer", 0)
+        else:
+            layer_mask = layer_list_to_mask(mapping.get("layers", [0]))
+        flags = 0
+        flags |= STICKY_FLAG if mapping.get("sticky", False) else 0
+        if version >= 5:
+            flags |= TAP_FLAG if mapping.get("tap", False) else 0
+            flags |= HOLD_FLAG if mapping.get("hold", False) else 0
+        hub_ports = ((mapping.get("target_port", 0) & 0x0F) << 4) | (
+            mapping.get("source_port", 0) & 0x0F
+        )
+        blob += pack_usage(target_usage, prev_pages, "target")
+        blob += pack_usage(source_usage, prev_pages, "source")
+        blob += pack_svarint(scaling - DEFAULT_SCALING)
+        if hub_ports != 0:
+            blob += struct.pack(
+                "<BBB", layer_mask, flags | PERSISTED_MAPPING_FLAG_HUB_PORTS, hub_ports
+            )
+        else:
+            blob += struct.pack("<BB", layer_mask, flags)
+
+    macros = [[] if macro == [[]] else macro for macro in macros[:NMACROS]]
+    while macros and not macros[-1]:
+        macros.pop()
+    blob += pack_varint(len(macros))
+    for macro in macros:
+        blob += pack_varint(len(macro))
+        for entry in macro:
+            blob += pack_varint(len(entry))
+            for item in entry:
+                blob += pack_usage(int(item, 16), prev_pages, "macro")
+
+    expressions = [expr_to_elems(expr) for expr in expressions[:NEXPRESSIONS]]
+    while expressions and not expressions[-1]:
+        expressions.pop()
+    blob += pack_varint(len(expressions))
+    for elems in expressions:
+        blob += pack_varint(len(elems))
+        for elem in elems:
+            if elem[0] == ops["PUSH"] and elem[1] != 0 and elem[1] % 1000 == 0:
+                blob += struct.pack("<B", ops["PUSH"] | PERSISTED_OP_FLAG_THOUSANDS)
+                blob += pack_svarint(elem[1] // 1000)
+                continue
+            blob += struct.pack("<B", elem[0])
+            if elem[0] == ops["PUSH"]:
+                blob += pack_svarint(elem[1])
+            elif elem[0] == ops["PUSH_USAGE"]:
+                blob += pack_usage(elem[1] & 0xFFFFFFFF, prev_pages, "expression")
+
+    return blob
+
+
 config = json.load(sys.stdin)
 
 device = get_device()
@@ -33,6 +96,7 @@ interval_override = config.get("interval_override", 0)
 our_descriptor_number = config.get("our_descriptor_number", 0)
 ignore_auth_dev_inputs = config.get("ignore_auth_dev_inputs", False)
 macro_entry_duration = config.get("macro_entry_duration", 1) - 1
+macro_step_duration_us = config.get("macro_step_duration_us", 0)
 gpio_output_mode = config.get("gpio_output_mode", 0)
 normalize_gamepad_inputs = (
     config.get("normalize_gamepad_inputs", True) if version >= 18 else False
@@ -43,152 +107,69 @@ flags |= IGNORE_AUTH_DEV_INPUTS_FLAG if ignore_auth_dev_inputs else 0
 flags |= GPIO_OUTPUT_MODE_FLAG if gpio_output_mode == 1 else 0
 flags |= NORMALIZE_GAMEPAD_INPUTS_FLAG if normalize_gamepad_inputs else 0
 
-data = struct.pack(
-    "<BBBBBLBLBBB12B",
-    REPORT_ID_CONFIG,
+mappings = config.get("mappings", [])
+quirks = config.get("quirks", [])
+
+# the whole config is sent in one go, in the same format the device persists it in
+blob = struct.pack(
+    "<BBBLHBLBBBHL",
     CONFIG_VERSION,
-    SET_CONFIG,
     flags,
     unmapped_passthrough_layer_mask,
     partial_scroll_timeout,
+    len(mappings),
     interval_override,
     tap_hold_threshold,
     gpio_debounce_time_ms,
     our_descriptor_number,
     macro_entry_duration,
-    *([0] * 12)
-)
-device.send_feature_report(add_crc(data))
-
-data = struct.pack(
-    "<BBB26B", REPORT_ID_CONFIG, CONFIG_VERSION, CLEAR_MAPPING, *([0] * 26)
-)
-device.send_feature_report(add_crc(data))
-
-for mapping in config.get("mappings", []):
-    target_usage = int(mapping["target_usage"], 16)
-    source_usage = int(mapping["source_usage"], 16)
-    scaling = mapping.get("scaling", DEFAULT_SCALING)
-    if version == 3:
-        layer_mask = 1 << mapping.get("layer", 0)
-    else:
-        layer_mask = layer_list_to_mask(mapping.get("layers", [0]))
-    flags = 0
-    flags |= STICKY_FLAG if mapping.get("sticky", False) else 0
-    if version >= 5:
-        flags |= TAP_FLAG if mapping.get("tap", False) else 0
-        flags |= HOLD_FLAG if mapping.get("hold", False) else 0
-    hub_ports = ((mapping.get("target_port", 0) & 0x0F) << 4) | (
-        mapping.get("source_port", 0) & 0x0F
-    )
-    data = struct.pack(
-        "<BBBLLlBBB11B",
-        REPORT_ID_CONFIG,
-        CONFIG_VERSION,
-        ADD_MAPPING,
-        target_usage,
-        source_usage,
-        scaling,
-        layer_mask,
-        flags,
-        hub_ports,
-        *([0] * 11)
-    )
-    device.send_feature_report(add_crc(data))
-
-data = struct.pack(
-    "<BBB26B", REPORT_ID_CONFIG, CONFIG_VERSION, CLEAR_MACROS, *([0] * 26)
+    len(quirks),
+    macro_step_duration_us,
 )
-device.send_feature_report(add_crc(data))
-
-for macro_index, macro in enumerate(config.get("macros", [])):
-    if macro_index >= NMACROS:
-        break
-    flat_zero_separated = [
-        int(item, 16) for entry in macro for item in entry + ["0x00"]
-    ][:-1]
-    for chunk in batched(flat_zero_separated, MACRO_ITEMS_IN_PACKET):
-        data = struct.pack(
-            "<BBBBB6L",
-            REPORT_ID_CONFIG,
-            CONFIG_VERSION,
-            APPEND_TO_MACRO,
-            macro_index,
-            len(chunk),
-            *(chunk + (0,) * (MACRO_ITEMS_IN_PACKET - len(chunk)))
-        )
-        device.send_feature_report(add_crc(data))
-
-data = struct.pack(
-    "<BBB26B", REPORT_ID_CONFIG, CONFIG_VERSION, CLEAR_EXPRESSIONS, *([0] * 26)
+blob += pack_profile(
+    version, mappings, config.get("macros", []), config.get("expressions", [])
 )
-device.send_feature_report(add_crc(data))
 
-for expr_index, expr in enumerate(config.get("expressions", [])):
-    if expr_index >= NEXPRESSIONS:
-        break
-    elems = expr_to_elems(expr)
-    while elems:
-        bytes_left = 24
-        pack_string = ""
-        pack_items = []
-        nelems = 0
-        while elems and (bytes_left > 0):
-            elem = elems[0]
-            if elem[0] in (ops["PUSH"], ops["PUSH_USAGE"]):
-                if bytes_left >= 5:
-                    pack_string += "BL"
-                    pack_items.append(elem[0])
-                    pack_items.append(elem[1] & 0xFFFFFFFF)
-                    bytes_left -= 5
-                    nelems += 1
-                    elems = elems[1:]
-                else:
-                    break
-            else:
-                pack_string += "B"
-                pack_items.append(elem[0])
-                bytes_left -= 1
-                nelems += 1
-                elems = elems[1:]
-        data = struct.pack(
-            "<BBBBB" + pack_string + ("B" * bytes_left),
-            REPORT_ID_CONFIG,
-            CONFIG_VERSION,
-            APPEND_TO_EXPRESSION,
-            expr_index,
-            nelems,
-            *(pack_items + [0] * bytes_left)
-        )
-        device.send_feature_report(add_crc(data))
-
-data = struct.pack(
-    "<BBB26B", REPORT_ID_CONFIG, CONFIG_VERSION, CLEAR_QUIRKS, *([0] * 26)
-)
-device.send_feature_report(add_crc(data))
-
-for quirk in config.get("quirks", []):
+prev_pages = {}
+for quirk in quirks:
     size_flags = (
         (quirk["size"] & QUIRK_SIZE_MASK)
         | (QUIRK_FLAG_RELATIVE_MASK if quirk["relative"] else 0)
         | (QUIRK_FLAG_SIGNED_MASK if quirk["signed"] else 0)
     )
-    data = struct.pack(
-        "<BBBHHBBLHB13B",
-        REPORT_ID_CONFIG,
-        CONFIG_VERSION,
-        ADD_QUIRK,
+    blob += struct.pack(
+        "<HHBB",
         int(quirk["vendor_id"], 16),
         int(quirk["product_id"], 16),
         quirk["interface"],
         quirk["report_id"],
-        int(quirk["usage"], 16),
-        quirk["bitpos"],
-        size_flags,
-        *([0] * 13)
     )
-    device.send_feature_report(add_crc(data))
+    blob += pack_usage(int(quirk["usage"], 16), prev_pages, "quirk")
+    blob += pack_varint(quirk["bitpos"])
+    blob += struct.pack("<B", size_flags)
+
+# the profiles that aren't active, in the order they're numbered
+active_profile = config.get("active_profile", 0)
+profiles = sorted(config.get("profiles", []), key=lambda profile: profile["profile"])
+if active_profile not in range(NPROFILES):
+    raise Exception("Invalid active profile.")
+profile_numbers = [profile["profile"] for profile in profiles]
+if (
+    any(n not in range(NPROFILES) or n == active_profile for n in profile_numbers)
+    or len(set(profile_numbers)) != len(profile_numbers)
+):
+    raise Exception("Invalid profile number.")
+blob += struct.pack("<B", active_profile)
+blob += pack_varint(len(profiles))
+for profile in profiles:
+    mappings = profile.get("mappings", [])
+    blob += struct.pack("<B", profile["profile"])
+    blob += pack_varint(len(mappings))
+    blob += pack_profile(
+        version, mappings, profile.get("macros", []), profile.get("expressions", [])
+    )
 
+send_config_blob(device, blob)
 
 data = struct.pack(
     "<BBB26B", REPORT_ID_CONFIG, CONFIG_VERSION, PERSIST_CONFIG, *([0] * 26)
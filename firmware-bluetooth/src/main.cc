@@ -992,7 +992,11 @@ int main() {
         if (need_to_persist_config) {
             int64_t t0 = k_uptime_get();
             persist_config_return_code = persist_config();
-            LOG_INF("persist_config took %lld ms\n", k_uptime_get() - t0);
+            int64_t elapsed = k_uptime_get() - t0;
+            LOG_INF("persist_config took %lld ms\n", elapsed);
+            if (elapsed * 1000 > persist_longest_stall_us) {
+                persist_longest_stall_us = elapsed * 1000;
+            }
             need_to_persist_config = false;
             get_report_response_pending = true;
         }
@@ -0,0 +1,39 @@
+#include "arena.h"
+
+#define ARENA_BLOCK_SIZE 256
+#define ARENA_ALIGNMENT 8
+
+void* arena_alloc(arena_t& arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+    if (size == 0) {
+        return NULL;
+    }
+
+    if (arena.used + size > arena.capacity) {
+        if (size > ARENA_BLOCK_SIZE) {
+            // gets a block of its own, we keep filling the current one
+            uint8_t* block = new uint8_t[size];
+            arena.blocks.insert(arena.blocks.end() - (arena.blocks.empty() ? 0 : 1), block);
+            arena.allocated += size;
+            return block;
+        }
+        arena.blocks.push_back(new uint8_t[ARENA_BLOCK_SIZE]);
+        arena.used = 0;
+        arena.capacity = ARENA_BLOCK_SIZE;
+        arena.allocated += ARENA_BLOCK_SIZE;
+    }
+
+    void* ret = arena.blocks.back() + arena.used;
+    arena.used += size;
+    return ret;
+}
+
+void arena_release(arena_t& arena) {
+    for (uint8_t* block : arena.blocks) {
+        delete[] block;
+    }
+    arena.blocks.clear();
+    arena.used = 0;
+    arena.capacity = 0;
+    arena.allocated = 0;
+}
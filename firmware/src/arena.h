@@ -0,0 +1,25 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Bump allocator for data that gets freed all at once, like everything we know about a device.
+struct arena_t {
+    std::vector<uint8_t*> blocks;
+    size_t used = 0;      // in the last block
+    size_t capacity = 0;  // of the last block
+    size_t allocated = 0;
+};
+
+void* arena_alloc(arena_t& arena, size_t size);
+void arena_release(arena_t& arena);
+
+template <typename T>
+T* arena_new(arena_t& arena, size_t count) {
+    return (T*) arena_alloc(arena, count * sizeof(T));
+}
+
+#endif
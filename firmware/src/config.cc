@@ -1,16 +1,19 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
 #include <unordered_set>
 
 #include "config.h"
+#include "config_log.h"
 #include "crc.h"
 #include "globals.h"
 #include "interval_override.h"
 #include "our_descriptor.h"
 #include "platform.h"
+#include "quirks.h"
 #include "remapper.h"
 
-const uint8_t CONFIG_VERSION = 18;
+const uint8_t CONFIG_VERSION = 22;
 
 const uint8_t CONFIG_FLAG_UNMAPPED_PASSTHROUGH = 0x01;
 const uint8_t CONFIG_FLAG_UNMAPPED_PASSTHROUGH_MASK = 0b00001111;
@@ -23,6 +26,22 @@ ConfigCommand last_config_command = ConfigCommand::NO_COMMAND;
 uint32_t requested_index = 0;
 uint32_t requested_secondary_index = 0;
 
+// Serialized config, for persist_config() and for blob transfers. The stack is 2KB, and
+// we don't have the RAM for a second 4KB buffer, so they share it. While a persist is in
+// progress the config log is reading from it, so blob commands are refused until that's
+// done, and persisting ends any blob transfer that was going on.
+static uint8_t serialized_config[PERSISTED_CONFIG_SIZE];
+uint32_t blob_size = 0;
+uint32_t blob_crc32 = 0;
+bool blob_chunks_ok = false;
+
+PersistConfigReturnCode read_blob_return_code = PersistConfigReturnCode::UNKNOWN;
+CommitBlobReturnCode commit_blob_return_code = CommitBlobReturnCode::UNKNOWN;
+PersistConfigReturnCode pending_persist_config_return_code = PersistConfigReturnCode::UNKNOWN;  // until the flash write is done
+
+// set_active_profile() only asks for the switch, it happens in set_mapping_from_config()
+volatile uint8_t requested_profile = 0;
+
 bool checksum_ok(const uint8_t* buffer, uint16_t data_size) {
     return crc32(buffer, data_size - 4) == ((crc32_t*) (buffer + data_size - 4))->crc32;
 }
@@ -74,17 +93,16 @@ void load_config_v3_v4(const uint8_t* persisted_config) {
             macros[i].clear();
             uint8_t macro_len = *macros_config_ptr;
             macros_config_ptr++;
-            macros[i].reserve(macro_len);
             for (int j = 0; j < macro_len; j++) {
                 uint8_t entry_len = *macros_config_ptr;
                 macros_config_ptr++;
-                macros[i].push_back({});
-                macros[i].back().reserve(entry_len);
                 for (int k = 0; k < entry_len; k++) {
-                    macros[i].back().push_back(((macro_item_t*) macros_config_ptr)->usage);
+                    macros[i].push_back(((macro_item_t*) macros_config_ptr)->usage);
                     macros_config_ptr += sizeof(macro_item_t);
                 }
+                macros[i].push_back(0);
             }
+            macros[i].shrink_to_fit();
         }
         my_mutex_exit(MutexId::MACROS);
     }
@@ -108,17 +126,16 @@ void load_config_v5(const uint8_t* persisted_config) {
         macros[i].clear();
         uint8_t macro_len = *macros_config_ptr;
         macros_config_ptr++;
-        macros[i].reserve(macro_len);
         for (int j = 0; j < macro_len; j++) {
             uint8_t entry_len = *macros_config_ptr;
             macros_config_ptr++;
-            macros[i].push_back({});
-            macros[i].back().reserve(entry_len);
             for (int k = 0; k < entry_len; k++) {
-                macros[i].back().push_back(((macro_item_t*) macros_config_ptr)->usage);
+                macros[i].push_back(((macro_item_t*) macros_config_ptr)->usage);
                 macros_config_ptr += sizeof(macro_item_t);
             }
+            macros[i].push_back(0);
         }
+        macros[i].shrink_to_fit();
     }
     my_mutex_exit(MutexId::MACROS);
 }
@@ -141,17 +158,16 @@ void load_config_v6(const uint8_t* persisted_config) {
         macros[i].clear();
         uint8_t macro_len = *macros_config_ptr;
         macros_config_ptr++;
-        macros[i].reserve(macro_len);
         for (int j = 0; j < macro_len; j++) {
             uint8_t entry_len = *macros_config_ptr;
             macros_config_ptr++;
-            macros[i].push_back({});
-            macros[i].back().reserve(entry_len);
             for (int k = 0; k < entry_len; k++) {
-                macros[i].back().push_back(((macro_item_t*) macros_config_ptr)->usage);
+                macros[i].push_back(((macro_item_t*) macros_config_ptr)->usage);
                 macros_config_ptr += sizeof(macro_item_t);
             }
+            macros[i].push_back(0);
         }
+        macros[i].shrink_to_fit();
     }
     my_mutex_exit(MutexId::MACROS);
 
@@ -197,17 +213,16 @@ void load_config_v7_v8(const uint8_t* persisted_config) {
         macros[i].clear();
         uint8_t macro_len = *macros_config_ptr;
         macros_config_ptr++;
-        macros[i].reserve(macro_len);
         for (int j = 0; j < macro_len; j++) {
             uint8_t entry_len = *macros_config_ptr;
             macros_config_ptr++;
-            macros[i].push_back({});
-            macros[i].back().reserve(entry_len);
             for (int k = 0; k < entry_len; k++) {
-                macros[i].back().push_back(((macro_item_t*) macros_config_ptr)->usage);
+                macros[i].push_back(((macro_item_t*) macros_config_ptr)->usage);
                 macros_config_ptr += sizeof(macro_item_t);
             }
+            macros[i].push_back(0);
         }
+        macros[i].shrink_to_fit();
     }
     my_mutex_exit(MutexId::MACROS);
 
@@ -256,17 +271,16 @@ void load_config_v9(const uint8_t* persisted_config) {
         macros[i].clear();
         uint8_t macro_len = *macros_config_ptr;
         macros_config_ptr++;
-        macros[i].reserve(macro_len);
         for (int j = 0; j < macro_len; j++) {
             uint8_t entry_len = *macros_config_ptr;
             macros_config_ptr++;
-            macros[i].push_back({});
-            macros[i].back().reserve(entry_len);
             for (int k = 0; k < entry_len; k++) {
-                macros[i].back().push_back(((macro_item_t*) macros_config_ptr)->usage);
+                macros[i].push_back(((macro_item_t*) macros_config_ptr)->usage);
                 macros_config_ptr += sizeof(macro_item_t);
             }
+            macros[i].push_back(0);
         }
+        macros[i].shrink_to_fit();
     }
     my_mutex_exit(MutexId::MACROS);
 
@@ -317,17 +331,16 @@ void load_config_v10(const uint8_t* persisted_config) {
         macros[i].clear();
         uint8_t macro_len = *macros_config_ptr;
         macros_config_ptr++;
-        macros[i].reserve(macro_len);
         for (int j = 0; j < macro_len; j++) {
             uint8_t entry_len = *macros_config_ptr;
             macros_config_ptr++;
-            macros[i].push_back({});
-            macros[i].back().reserve(entry_len);
             for (int k = 0; k < entry_len; k++) {
-                macros[i].back().push_back(((macro_item_t*) macros_config_ptr)->usage);
+                macros[i].push_back(((macro_item_t*) macros_config_ptr)->usage);
                 macros_config_ptr += sizeof(macro_item_t);
             }
+            macros[i].push_back(0);
         }
+        macros[i].shrink_to_fit();
     }
     my_mutex_exit(MutexId::MACROS);
 
@@ -378,17 +391,16 @@ void load_config_v11(const uint8_t* persisted_config) {
         macros[i].clear();
         uint8_t macro_len = *macros_config_ptr;
         macros_config_ptr++;
-        macros[i].reserve(macro_len);
         for (int j = 0; j < macro_len; j++) {
             uint8_t entry_len = *macros_config_ptr;
             macros_config_ptr++;
-            macros[i].push_back({});
-            macros[i].back().reserve(entry_len);
             for (int k = 0; k < entry_len; k++) {
-                macros[i].back().push_back(((macro_item_t*) macros_config_ptr)->usage);
+                macros[i].push_back(((macro_item_t*) macros_config_ptr)->usage);
                 macros_config_ptr += sizeof(macro_item_t);
             }
+            macros[i].push_back(0);
         }
+        macros[i].shrink_to_fit();
     }
     my_mutex_exit(MutexId::MACROS);
 
@@ -438,17 +450,16 @@ void load_config_v12(const uint8_t* persisted_config) {
         macros[i].clear();
         uint8_t macro_len = *macros_config_ptr;
         macros_config_ptr++;
-        macros[i].reserve(macro_len);
         for (int j = 0; j < macro_len; j++) {
             uint8_t entry_len = *macros_config_ptr;
             macros_config_ptr++;
-            macros[i].push_back({});
-            macros[i].back().reserve(entry_len);
             for (int k = 0; k < entry_len; k++) {
-                macros[i].back().push_back(((macro_item_t*) macros_config_ptr)->usage);
+                macros[i].push_back(((macro_item_t*) macros_config_ptr)->usage);
                 macros_config_ptr += sizeof(macro_item_t);
             }
+            macros[i].push_back(0);
         }
+        macros[i].shrink_to_fit();
     }
     my_mutex_exit(MutexId::MACROS);
 
@@ -478,6 +489,7 @@ void load_config_v12(const uint8_t* persisted_config) {
         quirks.push_back(*quirk_config_ptr);
         quirk_config_ptr++;
     }
+    invalidate_user_quirks_index();
     my_mutex_exit(MutexId::QUIRKS);
 }
 
@@ -506,17 +518,16 @@ void load_config_v13(const uint8_t* persisted_config) {
         macros[i].clear();
         uint8_t macro_len = *macros_config_ptr;
         macros_config_ptr++;
-        macros[i].reserve(macro_len);
         for (int j = 0; j < macro_len; j++) {
             uint8_t entry_len = *macros_config_ptr;
             macros_config_ptr++;
-            macros[i].push_back({});
-            macros[i].back().reserve(entry_len);
             for (int k = 0; k < entry_len; k++) {
-                macros[i].back().push_back(((macro_item_t*) macros_config_ptr)->usage);
+                macros[i].push_back(((macro_item_t*) macros_config_ptr)->usage);
                 macros_config_ptr += sizeof(macro_item_t);
             }
+            macros[i].push_back(0);
         }
+        macros[i].shrink_to_fit();
     }
     my_mutex_exit(MutexId::MACROS);
 
@@ -546,6 +557,563 @@ void load_config_v13(const uint8_t* persisted_config) {
         quirks.push_back(*quirk_config_ptr);
         quirk_config_ptr++;
     }
+    invalidate_user_quirks_index();
+    my_mutex_exit(MutexId::QUIRKS);
+}
+
+void load_config_v18(const uint8_t* persisted_config) {
+    persist_config_v18_t* config = (persist_config_v18_t*) persisted_config;
+    unmapped_passthrough_layer_mask = config->unmapped_passthrough_layer_mask;
+    ignore_auth_dev_inputs = config->flags & (1 << CONFIG_FLAG_IGNORE_AUTH_DEV_INPUTS_BIT);
+    gpio_output_mode = !!(config->flags & (1 << CONFIG_FLAG_GPIO_OUTPUT_MODE_BIT));
+    normalize_gamepad_inputs = !!(config->flags & (1 << CONFIG_FLAG_NORMALIZE_GAMEPAD_INPUTS_BIT));
+    partial_scroll_timeout = config->partial_scroll_timeout;
+    tap_hold_threshold = config->tap_hold_threshold;
+    gpio_debounce_time = config->gpio_debounce_time_ms * 1000;
+    interval_override = config->interval_override;
+    our_descriptor_number = config->our_descriptor_number;
+    if (our_descriptor_number >= NOUR_DESCRIPTORS) {
+        our_descriptor_number = 0;
+    }
+    macro_entry_duration = config->macro_entry_duration;
+    mapping_config11_t* buffer_mappings = (mapping_config11_t*) (persisted_config + sizeof(persist_config_v18_t));
+    for (uint32_t i = 0; i < config->mapping_count; i++) {
+        config_mappings.push_back(buffer_mappings[i]);
+    }
+
+    const uint8_t* macros_config_ptr = (persisted_config + sizeof(persist_config_v18_t) + config->mapping_count * sizeof(mapping_config11_t));
+    my_mutex_enter(MutexId::MACROS);
+    for (int i = 0; i < NMACROS; i++) {
+        macros[i].clear();
+        uint8_t macro_len = *macros_config_ptr;
+        macros_config_ptr++;
+        for (int j = 0; j < macro_len; j++) {
+            uint8_t entry_len = *macros_config_ptr;
+            macros_config_ptr++;
+            for (int k = 0; k < entry_len; k++) {
+                macros[i].push_back(((macro_item_t*) macros_config_ptr)->usage);
+                macros_config_ptr += sizeof(macro_item_t);
+            }
+            macros[i].push_back(0);
+        }
+        macros[i].shrink_to_fit();
+    }
+    my_mutex_exit(MutexId::MACROS);
+
+    const uint8_t* expr_config_ptr = macros_config_ptr;
+    my_mutex_enter(MutexId::EXPRESSIONS);
+    for (int i = 0; i < NEXPRESSIONS; i++) {
+        expressions[i].clear();
+        uint16_t expr_len = ((uint16_val_t*) expr_config_ptr)->val;
+        expr_config_ptr += 2;
+        expressions[i].reserve(expr_len);
+        for (int j = 0; j < expr_len; j++) {
+            uint8_t op = *expr_config_ptr;
+            expr_config_ptr++;
+            uint32_t val = 0;
+            if ((op == (uint8_t) Op::PUSH) || (op == (uint8_t) Op::PUSH_USAGE)) {
+                val = ((expr_val_t*) expr_config_ptr)->val;
+                expr_config_ptr += sizeof(expr_val_t);
+            }
+            expressions[i].push_back((expr_elem_t){ .op = (Op) op, .val = val });
+        }
+    }
+    my_mutex_exit(MutexId::EXPRESSIONS);
+
+    my_mutex_enter(MutexId::QUIRKS);
+    quirk_t* quirk_config_ptr = (quirk_t*) expr_config_ptr;
+    for (int i = 0; i < config->quirk_count; i++) {
+        quirks.push_back(*quirk_config_ptr);
+        quirk_config_ptr++;
+    }
+    invalidate_user_quirks_index();
+    my_mutex_exit(MutexId::QUIRKS);
+}
+
+void load_config_v19(const uint8_t* persisted_config) {
+    persist_config_v19_t* config = (persist_config_v19_t*) persisted_config;
+    unmapped_passthrough_layer_mask = config->unmapped_passthrough_layer_mask;
+    ignore_auth_dev_inputs = config->flags & (1 << CONFIG_FLAG_IGNORE_AUTH_DEV_INPUTS_BIT);
+    gpio_output_mode = !!(config->flags & (1 << CONFIG_FLAG_GPIO_OUTPUT_MODE_BIT));
+    normalize_gamepad_inputs = !!(config->flags & (1 << CONFIG_FLAG_NORMALIZE_GAMEPAD_INPUTS_BIT));
+    partial_scroll_timeout = config->partial_scroll_timeout;
+    tap_hold_threshold = config->tap_hold_threshold;
+    gpio_debounce_time = config->gpio_debounce_time_ms * 1000;
+    interval_override = config->interval_override;
+    our_descriptor_number = config->our_descriptor_number;
+    if (our_descriptor_number >= NOUR_DESCRIPTORS) {
+        our_descriptor_number = 0;
+    }
+    macro_entry_duration = config->macro_entry_duration;
+    macro_step_duration_us = config->macro_step_duration_us;
+    mapping_config11_t* buffer_mappings = (mapping_config11_t*) (persisted_config + sizeof(persist_config_v19_t));
+    for (uint32_t i = 0; i < config->mapping_count; i++) {
+        config_mappings.push_back(buffer_mappings[i]);
+    }
+
+    const uint8_t* macros_config_ptr = (persisted_config + sizeof(persist_config_v19_t) + config->mapping_count * sizeof(mapping_config11_t));
+    my_mutex_enter(MutexId::MACROS);
+    for (int i = 0; i < NMACROS; i++) {
+        macros[i].clear();
+        uint8_t macro_len = *macros_config_ptr;
+        macros_config_ptr++;
+        for (int j = 0; j < macro_len; j++) {
+            uint8_t entry_len = *macros_config_ptr;
+            macros_config_ptr++;
+            for (int k = 0; k < entry_len; k++) {
+                macros[i].push_back(((macro_item_t*) macros_config_ptr)->usage);
+                macros_config_ptr += sizeof(macro_item_t);
+            }
+            macros[i].push_back(0);
+        }
+        macros[i].shrink_to_fit();
+    }
+    my_mutex_exit(MutexId::MACROS);
+
+    const uint8_t* expr_config_ptr = macros_config_ptr;
+    my_mutex_enter(MutexId::EXPRESSIONS);
+    for (int i = 0; i < NEXPRESSIONS; i++) {
+        expressions[i].clear();
+        uint16_t expr_len = ((uint16_val_t*) expr_config_ptr)->val;
+        expr_config_ptr += 2;
+        expressions[i].reserve(expr_len);
+        for (int j = 0; j < expr_len; j++) {
+            uint8_t op = *expr_config_ptr;
+            expr_config_ptr++;
+            uint32_t val = 0;
+            if ((op == (uint8_t) Op::PUSH) || (op == (uint8_t) Op::PUSH_USAGE)) {
+                val = ((expr_val_t*) expr_config_ptr)->val;
+                expr_config_ptr += sizeof(expr_val_t);
+            }
+            expressions[i].push_back((expr_elem_t){ .op = (Op) op, .val = val });
+        }
+    }
+    my_mutex_exit(MutexId::EXPRESSIONS);
+
+    my_mutex_enter(MutexId::QUIRKS);
+    quirk_t* quirk_config_ptr = (quirk_t*) expr_config_ptr;
+    for (int i = 0; i < config->quirk_count; i++) {
+        quirks.push_back(*quirk_config_ptr);
+        quirk_config_ptr++;
+    }
+    invalidate_user_quirks_index();
+    my_mutex_exit(MutexId::QUIRKS);
+}
+
+// Since v21 everything after the header is variable-length. Counts and bit positions are
+// LEB128 varints and signed values are zigzag-encoded varints (scaling is stored as the
+// difference from the default 1000). A usage is one varint, (usage ID << 4) | page code.
+// Page code 0 means the same usage page as the previous usage in the same stream (mapping
+// targets, mapping sources, macros, expressions and quirks are separate streams), 1-14
+// are indexes into usage_page_dictionary + 1 and 15 means the usage page follows as
+// another varint. Only macros and expressions up to the last non-empty one are stored.
+
+static const uint16_t usage_page_dictionary[] = {
+    0x0001,  // generic desktop
+    0x0007,  // keyboard
+    0x0008,  // LEDs
+    0x0009,  // buttons
+    0x000C,  // consumer
+    0xFFF1,  // layers
+    0xFFF2,  // macros
+    0xFFF3,  // expressions
+    0xFFF4,  // GPIO
+    0xFFF5,  // registers
+    0xFFF6,  // digipots
+    0xFFF7,  // MIDI
+    0xFFF8,  // ADC
+    0xFFF9,  // dpad
+};
+
+const uint8_t USAGE_PAGE_CODE_SAME = 0;
+const uint8_t USAGE_PAGE_CODE_EXPLICIT = 15;
+
+const int32_t PERSISTED_DEFAULT_SCALING = 1000;
+
+// only in persisted config, means the hub_ports byte follows (it's omitted when zero)
+const uint8_t PERSISTED_MAPPING_FLAG_HUB_PORTS = 1 << 7;
+// only in persisted config, set on a PUSH whose value is stored divided by 1000
+const uint8_t PERSISTED_OP_FLAG_THOUSANDS = 1 << 7;
+
+// Reading past the end returns zeros and sets overrun.
+struct config_reader_t {
+    const uint8_t* ptr;
+    const uint8_t* end;
+    bool overrun = false;
+};
+
+// Writing past the end doesn't write anything and sets overflow.
+struct config_writer_t {
+    uint8_t* ptr;
+    uint8_t* end;
+    bool overflow = false;
+};
+
+static uint8_t read_u8(config_reader_t& reader) {
+    if (reader.ptr >= reader.end) {
+        reader.overrun = true;
+        return 0;
+    }
+    return *reader.ptr++;
+}
+
+static uint16_t read_u16(config_reader_t& reader) {
+    uint16_t lo = read_u8(reader);
+    return lo | (read_u8(reader) << 8);
+}
+
+static uint32_t read_varint(config_reader_t& reader) {
+    uint32_t val = 0;
+    for (uint8_t shift = 0; shift < 35; shift += 7) {
+        uint8_t byte = read_u8(reader);
+        val |= (uint32_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    return val;
+}
+
+static int32_t read_svarint(config_reader_t& reader) {
+    uint32_t val = read_varint(reader);
+    return (int32_t) (val >> 1) ^ -(int32_t) (val & 1);
+}
+
+static uint32_t read_usage(config_reader_t& reader, uint16_t& prev_page) {
+    uint32_t val = read_varint(reader);
+    uint8_t page_code = val & 0x0F;
+    uint16_t page;
+    if (page_code == USAGE_PAGE_CODE_SAME) {
+        page = prev_page;
+    } else if (page_code == USAGE_PAGE_CODE_EXPLICIT) {
+        page = read_varint(reader);
+    } else {
+        page = usage_page_dictionary[page_code - 1];
+    }
+    prev_page = page;
+    return ((uint32_t) page << 16) | ((val >> 4) & 0xFFFF);
+}
+
+static void write_u8(config_writer_t& writer, uint8_t val) {
+    if (writer.ptr >= writer.end) {
+        writer.overflow = true;
+        return;
+    }
+    *writer.ptr++ = val;
+}
+
+static void write_u16(config_writer_t& writer, uint16_t val) {
+    write_u8(writer, val & 0xFF);
+    write_u8(writer, val >> 8);
+}
+
+static void write_varint(config_writer_t& writer, uint32_t val) {
+    while (val >= 0x80) {
+        write_u8(writer, (val & 0x7F) | 0x80);
+        val >>= 7;
+    }
+    write_u8(writer, val);
+}
+
+static void write_svarint(config_writer_t& writer, int32_t val) {
+    write_varint(writer, ((uint32_t) val << 1) ^ (uint32_t) (val >> 31));
+}
+
+static void write_usage(config_writer_t& writer, uint32_t usage, uint16_t& prev_page) {
+    uint16_t page = usage >> 16;
+    uint8_t page_code = USAGE_PAGE_CODE_EXPLICIT;
+    if (page == prev_page) {
+        page_code = USAGE_PAGE_CODE_SAME;
+    } else {
+        for (uint8_t i = 0; i < sizeof(usage_page_dictionary) / sizeof(usage_page_dictionary[0]); i++) {
+            if (usage_page_dictionary[i] == page) {
+                page_code = i + 1;
+                break;
+            }
+        }
+    }
+    write_varint(writer, ((usage & 0xFFFF) << 4) | page_code);
+    if (page_code == USAGE_PAGE_CODE_EXPLICIT) {
+        write_varint(writer, page);
+    }
+    prev_page = page;
+}
+
+// Mappings, macros and expressions make up a profile, they're stored the same way
+// for the active profile and for the others. Callers hold the MACROS and EXPRESSIONS mutexes.
+
+static void read_mappings(config_reader_t& reader, uint32_t count, std::vector<mapping_config11_t>& profile_mappings) {
+    uint16_t target_page = 0;
+    uint16_t source_page = 0;
+    profile_mappings.reserve(std::min<uint32_t>(count, reader.end - reader.ptr));
+    for (uint32_t i = 0; (i < count) && !reader.overrun; i++) {
+        mapping_config11_t mapping;
+        mapping.target_usage = read_usage(reader, target_page);
+        mapping.source_usage = read_usage(reader, source_page);
+        mapping.scaling = PERSISTED_DEFAULT_SCALING + (uint32_t) read_svarint(reader);
+        mapping.layer_mask = read_u8(reader);
+        mapping.flags = read_u8(reader);
+        if (mapping.flags & PERSISTED_MAPPING_FLAG_HUB_PORTS) {
+            mapping.flags &= ~PERSISTED_MAPPING_FLAG_HUB_PORTS;
+            mapping.hub_ports = read_u8(reader);
+        }
+        profile_mappings.push_back(mapping);
+    }
+}
+
+static void read_macros(config_reader_t& reader, std::vector<uint32_t>* profile_macros) {
+    uint16_t macro_page = 0;
+    uint32_t macro_count = read_varint(reader);
+    for (uint32_t i = 0; i < NMACROS; i++) {
+        profile_macros[i].clear();
+        uint32_t macro_len = (i < macro_count) ? read_varint(reader) : 0;
+        for (uint32_t j = 0; (j < macro_len) && !reader.overrun; j++) {
+            uint32_t entry_len = read_varint(reader);
+            for (uint32_t k = 0; (k < entry_len) && !reader.overrun; k++) {
+                profile_macros[i].push_back(read_usage(reader, macro_page));
+            }
+            profile_macros[i].push_back(0);
+        }
+        profile_macros[i].shrink_to_fit();
+    }
+}
+
+static void read_expressions(config_reader_t& reader, std::vector<expr_elem_t>* profile_expressions) {
+    uint16_t expr_page = 0;
+    uint32_t expr_count = read_varint(reader);
+    for (uint32_t i = 0; i < NEXPRESSIONS; i++) {
+        profile_expressions[i].clear();
+        uint32_t expr_len = (i < expr_count) ? read_varint(reader) : 0;
+        for (uint32_t j = 0; (j < expr_len) && !reader.overrun; j++) {
+            uint8_t op = read_u8(reader);
+            uint32_t val = 0;
+            if (op == (uint8_t) Op::PUSH) {
+                val = read_svarint(reader);
+            } else if (op == ((uint8_t) Op::PUSH | PERSISTED_OP_FLAG_THOUSANDS)) {
+                op = (uint8_t) Op::PUSH;
+                val = (uint32_t) read_svarint(reader) * 1000;
+            } else if (op == (uint8_t) Op::PUSH_USAGE) {
+                val = read_usage(reader, expr_page);
+            }
+            profile_expressions[i].push_back((expr_elem_t){ .op = (Op) op, .val = val });
+        }
+    }
+}
+
+static void write_mappings(config_writer_t& writer, const std::vector<mapping_config11_t>& profile_mappings) {
+    uint16_t target_page = 0;
+    uint16_t source_page = 0;
+    for (auto const& mapping : profile_mappings) {
+        write_usage(writer, mapping.target_usage, target_page);
+        write_usage(writer, mapping.source_usage, source_page);
+        write_svarint(writer, (uint32_t) mapping.scaling - PERSISTED_DEFAULT_SCALING);
+        write_u8(writer, mapping.layer_mask);
+        uint8_t flags = mapping.flags & ~PERSISTED_MAPPING_FLAG_HUB_PORTS;
+        if (mapping.hub_ports != 0) {
+            write_u8(writer, flags | PERSISTED_MAPPING_FLAG_HUB_PORTS);
+            write_u8(writer, mapping.hub_ports);
+        } else {
+            write_u8(writer, flags);
+        }
+    }
+}
+
+static void write_macros(config_writer_t& writer, const std::vector<uint32_t>* profile_macros) {
+    uint16_t macro_page = 0;
+    uint32_t macro_count = NMACROS;
+    while ((macro_count > 0) && profile_macros[macro_count - 1].empty()) {
+        macro_count--;
+    }
+    write_varint(writer, macro_count);
+    for (uint32_t i = 0; i < macro_count; i++) {
+        const std::vector<uint32_t>& macro = profile_macros[i];
+        write_varint(writer, std::count(macro.begin(), macro.end(), 0));
+        for (auto entry = macro.begin(); entry != macro.end(); entry++) {
+            auto entry_end = std::find(entry, macro.end(), 0);
+            write_varint(writer, entry_end - entry);
+            for (; entry != entry_end; entry++) {
+                write_usage(writer, *entry, macro_page);
+            }
+        }
+    }
+}
+
+static void write_expressions(config_writer_t& writer, const std::vector<expr_elem_t>* profile_expressions) {
+    uint16_t expr_page = 0;
+    uint32_t expr_count = NEXPRESSIONS;
+    while ((expr_count > 0) && profile_expressions[expr_count - 1].empty()) {
+        expr_count--;
+    }
+    write_varint(writer, expr_count);
+    for (uint32_t i = 0; i < expr_count; i++) {
+        write_varint(writer, profile_expressions[i].size());
+        for (auto const& elem : profile_expressions[i]) {
+            int32_t val = elem.val;
+            if ((elem.op == Op::PUSH) && (val != 0) && (val % 1000 == 0)) {
+                write_u8(writer, (uint8_t) Op::PUSH | PERSISTED_OP_FLAG_THOUSANDS);
+                write_svarint(writer, val / 1000);
+                continue;
+            }
+            write_u8(writer, (uint8_t) elem.op);
+            if (elem.op == Op::PUSH) {
+                write_svarint(writer, val);
+            } else if (elem.op == Op::PUSH_USAGE) {
+                write_usage(writer, elem.val, expr_page);
+            }
+        }
+    }
+}
+
+static bool profile_empty(const profile_t& profile) {
+    for (auto const& macro : profile.macros) {
+        if (!macro.empty()) {
+            return false;
+        }
+    }
+    for (auto const& expr : profile.expressions) {
+        if (!expr.empty()) {
+            return false;
+        }
+    }
+    return profile.mappings.empty();
+}
+
+// The profiles that aren't active come last in a persisted config, after the quirks: the active
+// profile's number, the number of stored profiles and then each of them as its number, mapping
+// count, mappings, macros and expressions. Empty profiles aren't stored. Configs persisted before
+// v22 don't have this part. Blobs carry it the same way.
+
+static void read_profiles(config_reader_t& reader) {
+    uint8_t active = read_u8(reader);
+    uint32_t count = read_varint(reader);
+    active_profile = (active < NPROFILES) ? active : 0;
+    requested_profile = active_profile;
+
+    my_mutex_enter(MutexId::MACROS);
+    my_mutex_enter(MutexId::EXPRESSIONS);
+    for (uint8_t i = 0; i < NPROFILES; i++) {
+        profiles[i] = profile_t();
+    }
+    for (uint32_t i = 0; (i < count) && !reader.overrun; i++) {
+        uint8_t n = read_u8(reader);
+        if ((n >= NPROFILES) || (n == active_profile)) {
+            break;
+        }
+        uint32_t mapping_count = read_varint(reader);
+        read_mappings(reader, mapping_count, profiles[n].mappings);
+        read_macros(reader, profiles[n].macros);
+        read_expressions(reader, profiles[n].expressions);
+    }
+    my_mutex_exit(MutexId::EXPRESSIONS);
+    my_mutex_exit(MutexId::MACROS);
+}
+
+static void write_profiles(config_writer_t& writer) {
+    my_mutex_enter(MutexId::MACROS);
+    my_mutex_enter(MutexId::EXPRESSIONS);
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < NPROFILES; i++) {
+        if ((i != active_profile) && !profile_empty(profiles[i])) {
+            count++;
+        }
+    }
+    write_u8(writer, active_profile);
+    write_varint(writer, count);
+    for (uint8_t i = 0; i < NPROFILES; i++) {
+        if ((i != active_profile) && !profile_empty(profiles[i])) {
+            write_u8(writer, i);
+            write_varint(writer, profiles[i].mappings.size());
+            write_mappings(writer, profiles[i].mappings);
+            write_macros(writer, profiles[i].macros);
+            write_expressions(writer, profiles[i].expressions);
+        }
+    }
+    my_mutex_exit(MutexId::EXPRESSIONS);
+    my_mutex_exit(MutexId::MACROS);
+}
+
+void set_active_profile(uint8_t profile) {
+    if (profile < NPROFILES) {
+        requested_profile = profile;
+        config_updated = true;
+    }
+}
+
+bool inactive_profile_empty(uint8_t profile) {
+    return profile_empty(profiles[profile]);
+}
+
+void exchange_profile_config(uint8_t profile) {
+    profile_t& other = profiles[profile];
+    my_mutex_enter(MutexId::MACROS);
+    my_mutex_enter(MutexId::EXPRESSIONS);
+    config_mappings.swap(other.mappings);
+    for (int i = 0; i < NMACROS; i++) {
+        macros[i].swap(other.macros[i]);
+    }
+    for (int i = 0; i < NEXPRESSIONS; i++) {
+        expressions[i].swap(other.expressions[i]);
+    }
+    my_mutex_exit(MutexId::EXPRESSIONS);
+    my_mutex_exit(MutexId::MACROS);
+}
+
+bool switch_to_requested_profile() {
+    uint8_t profile = requested_profile;
+    if (profile == active_profile) {
+        return false;
+    }
+
+    // The profile we're leaving goes back to its place and the one we're switching to
+    // takes over the globals. Nothing is copied, the vectors just trade buffers.
+    exchange_profile_config(active_profile);
+    exchange_profile_config(profile);
+    active_profile = profile;
+    return true;
+}
+
+// Loads the settings, the active profile and the quirks. Leaves the reader where the other profiles start.
+static void load_config_v21(const uint8_t* persisted_config, config_reader_t& reader) {
+    persist_config_v21_t* config = (persist_config_v21_t*) persisted_config;
+    unmapped_passthrough_layer_mask = config->unmapped_passthrough_layer_mask;
+    ignore_auth_dev_inputs = config->flags & (1 << CONFIG_FLAG_IGNORE_AUTH_DEV_INPUTS_BIT);
+    gpio_output_mode = !!(config->flags & (1 << CONFIG_FLAG_GPIO_OUTPUT_MODE_BIT));
+    normalize_gamepad_inputs = !!(config->flags & (1 << CONFIG_FLAG_NORMALIZE_GAMEPAD_INPUTS_BIT));
+    partial_scroll_timeout = config->partial_scroll_timeout;
+    tap_hold_threshold = config->tap_hold_threshold;
+    gpio_debounce_time = config->gpio_debounce_time_ms * 1000;
+    interval_override = config->interval_override;
+    our_descriptor_number = config->our_descriptor_number;
+    if (our_descriptor_number >= NOUR_DESCRIPTORS) {
+        our_descriptor_number = 0;
+    }
+    macro_entry_duration = config->macro_entry_duration;
+    macro_step_duration_us = config->macro_step_duration_us;
+
+    read_mappings(reader, config->mapping_count, config_mappings);
+
+    my_mutex_enter(MutexId::MACROS);
+    read_macros(reader, macros);
+    my_mutex_exit(MutexId::MACROS);
+
+    my_mutex_enter(MutexId::EXPRESSIONS);
+    read_expressions(reader, expressions);
+    my_mutex_exit(MutexId::EXPRESSIONS);
+
+    uint16_t quirk_page = 0;
+    my_mutex_enter(MutexId::QUIRKS);
+    for (int i = 0; (i < config->quirk_count) && !reader.overrun; i++) {
+        quirk_t quirk;
+        quirk.vendor_id = read_u16(reader);
+        quirk.product_id = read_u16(reader);
+        quirk.interface = read_u8(reader);
+        quirk.report_id = read_u8(reader);
+        quirk.usage = read_usage(reader, quirk_page);
+        quirk.bitpos = read_varint(reader);
+        quirk.size_flags = read_u8(reader);
+        quirks.push_back(quirk);
+    }
+    invalidate_user_quirks_index();
     my_mutex_exit(MutexId::QUIRKS);
 }
 
@@ -616,72 +1184,29 @@ void load_config(const uint8_t* persisted_config) {
         return;
     }
 
-    persist_config_v18_t* config = (persist_config_v18_t*) persisted_config;
-    unmapped_passthrough_layer_mask = config->unmapped_passthrough_layer_mask;
-    ignore_auth_dev_inputs = config->flags & (1 << CONFIG_FLAG_IGNORE_AUTH_DEV_INPUTS_BIT);
-    gpio_output_mode = !!(config->flags & (1 << CONFIG_FLAG_GPIO_OUTPUT_MODE_BIT));
-    normalize_gamepad_inputs = !!(config->flags & (1 << CONFIG_FLAG_NORMALIZE_GAMEPAD_INPUTS_BIT));
-    partial_scroll_timeout = config->partial_scroll_timeout;
-    tap_hold_threshold = config->tap_hold_threshold;
-    gpio_debounce_time = config->gpio_debounce_time_ms * 1000;
-    interval_override = config->interval_override;
-    our_descriptor_number = config->our_descriptor_number;
-    if (our_descriptor_number >= NOUR_DESCRIPTORS) {
-        our_descriptor_number = 0;
-    }
-    macro_entry_duration = config->macro_entry_duration;
-    mapping_config11_t* buffer_mappings = (mapping_config11_t*) (persisted_config + sizeof(persist_config_v18_t));
-    for (uint32_t i = 0; i < config->mapping_count; i++) {
-        config_mappings.push_back(buffer_mappings[i]);
+    if (version == 18) {
+        load_config_v18(persisted_config);
+        return;
     }
 
-    const uint8_t* macros_config_ptr = (persisted_config + sizeof(persist_config_v18_t) + config->mapping_count * sizeof(mapping_config11_t));
-    my_mutex_enter(MutexId::MACROS);
-    for (int i = 0; i < NMACROS; i++) {
-        macros[i].clear();
-        uint8_t macro_len = *macros_config_ptr;
-        macros_config_ptr++;
-        macros[i].reserve(macro_len);
-        for (int j = 0; j < macro_len; j++) {
-            uint8_t entry_len = *macros_config_ptr;
-            macros_config_ptr++;
-            macros[i].push_back({});
-            macros[i].back().reserve(entry_len);
-            for (int k = 0; k < entry_len; k++) {
-                macros[i].back().push_back(((macro_item_t*) macros_config_ptr)->usage);
-                macros_config_ptr += sizeof(macro_item_t);
-            }
-        }
-    }
-    my_mutex_exit(MutexId::MACROS);
+    // v20 is same as v19, it just introduces the config blob commands
 
-    const uint8_t* expr_config_ptr = macros_config_ptr;
-    my_mutex_enter(MutexId::EXPRESSIONS);
-    for (int i = 0; i < NEXPRESSIONS; i++) {
-        expressions[i].clear();
-        uint16_t expr_len = ((uint16_val_t*) expr_config_ptr)->val;
-        expr_config_ptr += 2;
-        expressions[i].reserve(expr_len);
-        for (int j = 0; j < expr_len; j++) {
-            uint8_t op = *expr_config_ptr;
-            expr_config_ptr++;
-            uint32_t val = 0;
-            if ((op == (uint8_t) Op::PUSH) || (op == (uint8_t) Op::PUSH_USAGE)) {
-                val = ((expr_val_t*) expr_config_ptr)->val;
-                expr_config_ptr += sizeof(expr_val_t);
-            }
-            expressions[i].push_back((expr_elem_t){ .op = (Op) op, .val = val });
-        }
+    if ((version == 19) || (version == 20)) {
+        load_config_v19(persisted_config);
+        return;
     }
-    my_mutex_exit(MutexId::EXPRESSIONS);
 
-    my_mutex_enter(MutexId::QUIRKS);
-    quirk_t* quirk_config_ptr = (quirk_t*) expr_config_ptr;
-    for (int i = 0; i < config->quirk_count; i++) {
-        quirks.push_back(*quirk_config_ptr);
-        quirk_config_ptr++;
+    config_reader_t reader = {
+        .ptr = persisted_config + sizeof(persist_config_v21_t),
+        .end = persisted_config + PERSISTED_CONFIG_SIZE - 4,
+    };
+    load_config_v21(persisted_config, reader);
+
+    // v22 is same as v21, with the profiles that aren't active after the quirks
+
+    if (version >= 22) {
+        read_profiles(reader);
     }
-    my_mutex_exit(MutexId::QUIRKS);
 }
 
 void fill_get_config(get_config_t* config) {
@@ -719,105 +1244,230 @@ void fill_persist_config(persist_config_t* config) {
     config->interval_override = interval_override;
     config->our_descriptor_number = our_descriptor_number;
     config->macro_entry_duration = macro_entry_duration;
+    config->macro_step_duration_us = macro_step_duration_us;
     my_mutex_enter(MutexId::QUIRKS);
     config->quirk_count = quirks.size();
     my_mutex_exit(MutexId::QUIRKS);
 }
 
-PersistConfigReturnCode persist_config() {
-    // stack size is 2KB
-    static uint8_t buffer[PERSISTED_CONFIG_SIZE];
-    memset(buffer, 0, sizeof(buffer));
-
+// Writes the config in persisted format, without the trailing CRC, to a zeroed PERSISTED_CONFIG_SIZE
+// buffer. Returns the number of bytes written or -1 if it doesn't fit.
+static int32_t serialize_config(uint8_t* buffer) {
     persist_config_t* config = (persist_config_t*) buffer;
     fill_persist_config(config);
 
-    // check if persisted config will fit in the space we have reserved for it in flash
-    int32_t real_persisted_config_size = 0;
-    real_persisted_config_size += sizeof(persist_config_t);
-    real_persisted_config_size += config->mapping_count * sizeof(mapping_config11_t);
+    config_writer_t writer = {
+        .ptr = buffer + sizeof(persist_config_t),
+        .end = buffer + PERSISTED_CONFIG_SIZE - 4,  // CRC32
+    };
+
+    write_mappings(writer, config_mappings);
+
     my_mutex_enter(MutexId::MACROS);
-    for (int i = 0; i < NMACROS; i++) {
-        real_persisted_config_size += 1;
-        for (auto const& entries : macros[i]) {
-            real_persisted_config_size += 1 + entries.size() * sizeof(macro_item_t);
-        }
-    }
+    write_macros(writer, macros);
     my_mutex_exit(MutexId::MACROS);
+
     my_mutex_enter(MutexId::EXPRESSIONS);
-    for (int i = 0; i < NEXPRESSIONS; i++) {
-        real_persisted_config_size += 2;
-        for (auto const& elem : expressions[i]) {
-            real_persisted_config_size += 1;
-            if ((elem.op == Op::PUSH) || (elem.op == Op::PUSH_USAGE)) {
-                real_persisted_config_size += sizeof(expr_val_t);
-            }
-        }
-    }
+    write_expressions(writer, expressions);
     my_mutex_exit(MutexId::EXPRESSIONS);
+
+    uint16_t quirk_page = 0;
     my_mutex_enter(MutexId::QUIRKS);
-    real_persisted_config_size += quirks.size() * sizeof(quirk_t);
+    for (uint16_t i = 0; i < config->quirk_count; i++) {
+        const quirk_t& quirk = quirks[i];
+        write_u16(writer, quirk.vendor_id);
+        write_u16(writer, quirk.product_id);
+        write_u8(writer, quirk.interface);
+        write_u8(writer, quirk.report_id);
+        write_usage(writer, quirk.usage, quirk_page);
+        write_varint(writer, quirk.bitpos);
+        write_u8(writer, quirk.size_flags);
+    }
     my_mutex_exit(MutexId::QUIRKS);
-    real_persisted_config_size += 4;  // CRC32
-    if (real_persisted_config_size > PERSISTED_CONFIG_SIZE) {
+
+    write_profiles(writer);
+
+    if (writer.overflow) {
+        return -1;
+    }
+
+    return writer.ptr - buffer;
+}
+
+static bool persist_busy() {
+    return need_to_persist_config || persist_in_progress;
+}
+
+PersistConfigReturnCode persist_config() {
+    uint8_t* buffer = serialized_config;
+    memset(buffer, 0, PERSISTED_CONFIG_SIZE);
+    blob_chunks_ok = false;
+    blob_size = 0;
+    blob_crc32 = 0;
+
+    if (serialize_config(buffer) < 0) {
         printf("config too large to be persisted!\n");
         return PersistConfigReturnCode::CONFIG_TOO_BIG;
     }
 
-    mapping_config11_t* buffer_mappings = (mapping_config11_t*) (buffer + sizeof(persist_config_t));
-    for (uint32_t i = 0; i < config->mapping_count; i++) {
-        buffer_mappings[i] = config_mappings[i];
+    ((crc32_t*) (buffer + PERSISTED_CONFIG_SIZE - 4))->crc32 = crc32(buffer, PERSISTED_CONFIG_SIZE - 4);
+
+    do_persist_config(buffer);
+
+    return PersistConfigReturnCode::SUCCESS;
+}
+
+// Flash writes happen one erase or page program per main loop iteration so that
+// reports keep getting processed in between. The result is only made available
+// to the host once the write is done.
+void persist_config_maybe() {
+    uint64_t start = get_time();
+    if (config_log_busy()) {
+        config_log_step();
+    } else if (need_to_persist_config) {
+        pending_persist_config_return_code = persist_config();
+        need_to_persist_config = false;
+    } else {
+        return;
+    }
+    uint32_t stall = get_time() - start;
+    if (stall > persist_longest_stall_us) {
+        persist_longest_stall_us = stall;
     }
 
-    uint8_t* macros_config_ptr = (buffer + sizeof(persist_config_t) + config->mapping_count * sizeof(mapping_config11_t));
-    my_mutex_enter(MutexId::MACROS);
-    for (int i = 0; i < NMACROS; i++) {
-        *macros_config_ptr = macros[i].size();
-        macros_config_ptr++;
-        for (auto const& entries : macros[i]) {
-            *macros_config_ptr = entries.size();
-            macros_config_ptr++;
-            for (uint32_t usage : entries) {
-                ((macro_item_t*) macros_config_ptr)->usage = usage;
-                macros_config_ptr += sizeof(macro_item_t);
+    persist_in_progress = config_log_busy();
+    if (!persist_in_progress && !need_to_persist_config) {
+        persist_config_return_code = pending_persist_config_return_code;
+    }
+}
+
+// Skips the mappings, macros and expressions of a profile in a blob. False if there are too many
+// macros or expressions.
+static bool skip_profile(config_reader_t& reader, uint32_t mapping_count) {
+    uint16_t page = 0;
+    for (uint32_t i = 0; (i < mapping_count) && !reader.overrun; i++) {
+        read_usage(reader, page);
+        read_usage(reader, page);
+        read_svarint(reader);
+        read_u8(reader);
+        if (read_u8(reader) & PERSISTED_MAPPING_FLAG_HUB_PORTS) {
+            read_u8(reader);
+        }
+    }
+    uint32_t macro_count = read_varint(reader);
+    if (macro_count > NMACROS) {
+        return false;
+    }
+    for (uint32_t i = 0; i < macro_count; i++) {
+        uint32_t macro_len = read_varint(reader);
+        for (uint32_t j = 0; (j < macro_len) && !reader.overrun; j++) {
+            uint32_t entry_len = read_varint(reader);
+            for (uint32_t k = 0; (k < entry_len) && !reader.overrun; k++) {
+                read_usage(reader, page);
             }
         }
     }
-    my_mutex_exit(MutexId::MACROS);
-
-    uint8_t* expr_config_ptr = macros_config_ptr;
-    my_mutex_enter(MutexId::EXPRESSIONS);
-    for (int i = 0; i < NEXPRESSIONS; i++) {
-        ((uint16_val_t*) expr_config_ptr)->val = expressions[i].size();
-        expr_config_ptr += 2;
-        for (auto const& elem : expressions[i]) {
-            *expr_config_ptr = (uint8_t) elem.op;
-            expr_config_ptr++;
-            if ((elem.op == Op::PUSH) || (elem.op == Op::PUSH_USAGE)) {
-                ((expr_val_t*) expr_config_ptr)->val = elem.val;
-                expr_config_ptr += sizeof(expr_val_t);
+    uint32_t expr_count = read_varint(reader);
+    if (expr_count > NEXPRESSIONS) {
+        return false;
+    }
+    for (uint32_t i = 0; i < expr_count; i++) {
+        uint32_t expr_len = read_varint(reader);
+        for (uint32_t j = 0; (j < expr_len) && !reader.overrun; j++) {
+            uint8_t op = read_u8(reader);
+            if ((op == (uint8_t) Op::PUSH) || (op == ((uint8_t) Op::PUSH | PERSISTED_OP_FLAG_THOUSANDS))) {
+                read_svarint(reader);
+            } else if (op == (uint8_t) Op::PUSH_USAGE) {
+                read_usage(reader, page);
             }
         }
     }
-    my_mutex_exit(MutexId::EXPRESSIONS);
+    return true;
+}
 
-    my_mutex_enter(MutexId::QUIRKS);
-    quirk_t* quirk_config_ptr = (quirk_t*) expr_config_ptr;
-    for (uint16_t i = 0; i < quirks.size(); i++) {
-        *quirk_config_ptr = quirks[i];
-        quirk_config_ptr++;
+// Walks an uploaded blob the same way load_config() will, so that we never read past its end.
+static bool config_blob_valid(const uint8_t* blob, uint32_t size) {
+    if ((size < sizeof(persist_config_t)) || (((config_version_t*) blob)->version != CONFIG_VERSION)) {
+        return false;
     }
-    my_mutex_exit(MutexId::QUIRKS);
+    const persist_config_t* config = (const persist_config_t*) blob;
+    config_reader_t reader = {
+        .ptr = blob + sizeof(persist_config_t),
+        .end = blob + size,
+    };
+    if (!skip_profile(reader, config->mapping_count)) {
+        return false;
+    }
+    uint16_t page = 0;
+    for (uint32_t i = 0; (i < config->quirk_count) && !reader.overrun; i++) {
+        read_u16(reader);
+        read_u16(reader);
+        read_u8(reader);
+        read_u8(reader);
+        read_usage(reader, page);
+        read_varint(reader);
+        read_u8(reader);
+    }
+    // each of the other profiles at most once
+    uint8_t active = read_u8(reader);
+    uint32_t profile_count = read_varint(reader);
+    if (active >= NPROFILES) {
+        return false;
+    }
+    uint32_t seen = 1 << active;
+    for (uint32_t i = 0; (i < profile_count) && !reader.overrun; i++) {
+        uint8_t n = read_u8(reader);
+        if ((n >= NPROFILES) || (seen & (1 << n))) {
+            return false;
+        }
+        seen |= 1 << n;
+        if (!skip_profile(reader, read_varint(reader))) {
+            return false;
+        }
+    }
+    return !reader.overrun && (reader.ptr == reader.end);
+}
 
-    ((crc32_t*) (buffer + PERSISTED_CONFIG_SIZE - 4))->crc32 = crc32(buffer, PERSISTED_CONFIG_SIZE - 4);
+// Replaces the whole config with the uploaded blob. Nothing is touched unless the blob checks out.
+static CommitBlobReturnCode commit_blob() {
+    if (persist_busy()) {
+        return CommitBlobReturnCode::BUSY;
+    }
+    if (!blob_chunks_ok || (crc32(serialized_config, blob_size) != blob_crc32)) {
+        return CommitBlobReturnCode::CRC_MISMATCH;
+    }
+    if (!config_blob_valid(serialized_config, blob_size)) {
+        return CommitBlobReturnCode::INVALID_CONFIG;
+    }
+    blob_chunks_ok = false;
 
-    if (real_persisted_config_size != 4 + ((uint8_t*) quirk_config_ptr) - buffer) {
-        printf("we calculated real persisted config size wrong!\n");
+    uint8_t prev_interval_override = interval_override;
+    config_mappings.clear();
+    my_mutex_enter(MutexId::QUIRKS);
+    quirks.clear();
+    my_mutex_exit(MutexId::QUIRKS);
+    // Macros and expressions are cleared when they're read, so are the other profiles.
+    config_reader_t reader = {
+        .ptr = serialized_config + sizeof(persist_config_t),
+        .end = serialized_config + blob_size,
+    };
+    load_config_v21(serialized_config, reader);
+    read_profiles(reader);
+    if (prev_interval_override != interval_override) {
+        interval_override_updated();
     }
+    config_updated = true;
 
-    do_persist_config(buffer);
+    return CommitBlobReturnCode::SUCCESS;
+}
 
-    return PersistConfigReturnCode::SUCCESS;
+static uint8_t varint_size(uint32_t val) {
+    uint8_t size = 1;
+    while (val >= 0x80) {
+        val >>= 7;
+        size++;
+    }
+    return size;
 }
 
 void reset_resolution_multiplier() {
@@ -838,6 +1488,11 @@ uint16_t handle_get_report1(uint8_t report_id, uint8_t* buffer, uint16_t reqlen)
                 fill_get_config((get_config_t*) config_buffer);
                 break;
             }
+            case ConfigCommand::GET_EXTRA_CONFIG: {
+                get_extra_config_t* extra_config = (get_extra_config_t*) config_buffer;
+                extra_config->macro_step_duration_us = macro_step_duration_us;
+                break;
+            }
             case ConfigCommand::GET_MAPPING: {
                 mapping_config11_t* mapping_config = (mapping_config11_t*) config_buffer;
                 if (requested_index < config_mappings.size()) {
@@ -859,36 +1514,45 @@ uint16_t handle_get_report1(uint8_t report_id, uint8_t* buffer, uint16_t reqlen)
                 }
                 break;
             }
+            case ConfigCommand::GET_THEIR_USAGES_PACKED: {
+                packed_usages_t* returned = (packed_usages_t*) config_buffer;
+                returned->generation = their_usages_generation;
+                returned->total = their_usages_rle.size();
+                if ((requested_index > 0) && (requested_secondary_index != their_usages_generation)) {
+                    returned->stale = true;
+                    break;
+                }
+                config_writer_t writer = {
+                    .ptr = returned->data,
+                    .end = returned->data + sizeof(returned->data),
+                };
+                uint32_t prev_end = 0;
+                for (uint32_t i = requested_index; i < their_usages_rle.size(); i++) {
+                    const usage_rle_t& item = their_usages_rle[i];
+                    uint32_t delta = item.usage - prev_end;
+                    if (varint_size(delta) + varint_size(item.count) > writer.end - writer.ptr) {
+                        break;
+                    }
+                    write_varint(writer, delta);
+                    write_varint(writer, item.count);
+                    prev_end = item.usage + item.count;
+                    returned->nitems++;
+                }
+                break;
+            }
             case ConfigCommand::GET_MACRO: {
                 if (requested_index < NMACROS) {
                     get_macro_response_t* returned = (get_macro_response_t*) config_buffer;
-                    uint16_t i = 0;
                     uint8_t ret_idx = 0;
-                    bool exhausted = true;
                     my_mutex_enter(MutexId::MACROS);
-                    for (auto const& entries : macros[requested_index]) {
-                        if (ret_idx >= MACRO_ITEMS_IN_PACKET) {
-                            exhausted = false;
-                            break;
-                        }
-                        for (uint32_t usage : entries) {
-                            if (i >= requested_secondary_index) {
-                                returned->usages[ret_idx++] = usage;
-                                if (ret_idx >= MACRO_ITEMS_IN_PACKET) {
-                                    break;
-                                }
-                            }
-                            i++;
-                        }
-                        if ((ret_idx < MACRO_ITEMS_IN_PACKET) && (i >= requested_secondary_index)) {
-                            returned->usages[ret_idx++] = 0;
-                        }
-                        i++;
+                    auto const& macro = macros[requested_index];
+                    // the protocol has zeros between entries, not after the last one
+                    uint32_t nitems = macro.empty() ? 0 : macro.size() - 1;
+                    while ((ret_idx < MACRO_ITEMS_IN_PACKET) && (requested_secondary_index + ret_idx < nitems)) {
+                        returned->usages[ret_idx] = macro[requested_secondary_index + ret_idx];
+                        ret_idx++;
                     }
                     my_mutex_exit(MutexId::MACROS);
-                    if (exhausted && (ret_idx > 0) && (returned->usages[ret_idx - 1] == 0)) {
-                        ret_idx--;
-                    }
                     returned->nitems = ret_idx;
                 }
                 break;
@@ -899,30 +1563,30 @@ uint16_t handle_get_report1(uint8_t report_id, uint8_t* buffer, uint16_t reqlen)
                 }
                 get_expr_response_t* returned = (get_expr_response_t*) config_buffer;
                 uint8_t* ptr = returned->elem_data;
-                uint32_t i = 0;
-                for (auto const& elem : expressions[requested_index]) {
-                    if (i >= requested_secondary_index) {
-                        if ((elem.op == Op::PUSH) || (elem.op == Op::PUSH_USAGE)) {
-                            if (ptr <= returned->elem_data + sizeof(returned->elem_data) - 5) {
-                                *ptr = (uint8_t) elem.op;
-                                ptr++;
-                                ((expr_val_t*) ptr)->val = elem.val;
-                                ptr += sizeof(expr_val_t);
-                                returned->nelems++;
-                            } else {
-                                break;
-                            }
-                        } else {
+                my_mutex_enter(MutexId::EXPRESSIONS);
+                auto const& expr = expressions[requested_index];
+                for (uint32_t i = requested_secondary_index; i < expr.size(); i++) {
+                    auto const& elem = expr[i];
+                    if ((elem.op == Op::PUSH) || (elem.op == Op::PUSH_USAGE)) {
+                        if (ptr <= returned->elem_data + sizeof(returned->elem_data) - 5) {
                             *ptr = (uint8_t) elem.op;
                             ptr++;
+                            ((expr_val_t*) ptr)->val = elem.val;
+                            ptr += sizeof(expr_val_t);
                             returned->nelems++;
+                        } else {
+                            break;
                         }
+                    } else {
+                        *ptr = (uint8_t) elem.op;
+                        ptr++;
+                        returned->nelems++;
                     }
                     if (ptr > returned->elem_data + sizeof(returned->elem_data) - 1) {
                         break;
                     }
-                    i++;
                 }
+                my_mutex_exit(MutexId::EXPRESSIONS);
                 break;
             }
             case ConfigCommand::GET_QUIRK: {
@@ -943,11 +1607,49 @@ uint16_t handle_get_report1(uint8_t report_id, uint8_t* buffer, uint16_t reqlen)
                 returned->return_code = persist_config_return_code;
                 break;
             }
+            case ConfigCommand::GET_PERSIST_STATUS: {
+                persist_status_t* returned = (persist_status_t*) config_buffer;
+                returned->in_progress = need_to_persist_config || persist_in_progress;
+                returned->longest_stall_us = persist_longest_stall_us;
+                break;
+            }
+            case ConfigCommand::GET_ACTIVE_PROFILE: {
+                active_profile_response_t* returned = (active_profile_response_t*) config_buffer;
+                returned->profile = active_profile;
+                returned->nprofiles = NPROFILES;
+                break;
+            }
+            case ConfigCommand::COMMIT_BLOB: {
+                commit_blob_response_t* returned = (commit_blob_response_t*) config_buffer;
+                returned->return_code = commit_blob_return_code;
+                break;
+            }
+            case ConfigCommand::READ_BLOB: {
+                read_blob_response_t* returned = (read_blob_response_t*) config_buffer;
+                returned->return_code = read_blob_return_code;
+                returned->header.size = blob_size;
+                returned->header.crc32 = blob_crc32;
+                break;
+            }
+            case ConfigCommand::GET_BLOB_CHUNK: {
+                if (requested_index < blob_size) {
+                    uint32_t len = blob_size - requested_index;
+                    if (len > sizeof(config_buffer->data)) {
+                        len = sizeof(config_buffer->data);
+                    }
+                    memcpy(config_buffer->data, serialized_config + requested_index, len);
+                }
+                break;
+            }
             default:
                 return 0;
         }
         config_buffer->crc32 = crc32((uint8_t*) config_buffer, CONFIG_SIZE - 4);
-        last_config_command = ConfigCommand::NO_COMMAND;
+        // a repeated GET_FEATURE after GET_BLOB_CHUNK returns the same chunk again, the
+        // offset only changes with the next GET_BLOB_CHUNK
+        if (last_config_command != ConfigCommand::GET_BLOB_CHUNK) {
+            last_config_command = ConfigCommand::NO_COMMAND;
+        }
         return CONFIG_SIZE;
     }
 
@@ -984,9 +1686,13 @@ void handle_set_report1(uint8_t report_id, uint8_t const* buffer, uint16_t bufsi
                         our_descriptor_number = 0;
                     }
                     macro_entry_duration = config->macro_entry_duration;
+                    macro_step_duration_us = config->macro_step_duration_us;
                     break;
                 }
                 case ConfigCommand::GET_CONFIG:
+                case ConfigCommand::GET_EXTRA_CONFIG:
+                case ConfigCommand::GET_PERSIST_STATUS:
+                case ConfigCommand::GET_ACTIVE_PROFILE:
                     break;
                 case ConfigCommand::CLEAR_MAPPING:
                     config_mappings.clear();
@@ -999,7 +1705,8 @@ void handle_set_report1(uint8_t report_id, uint8_t const* buffer, uint16_t bufsi
                 case ConfigCommand::GET_MAPPING:
                 case ConfigCommand::GET_OUR_USAGES:
                 case ConfigCommand::GET_THEIR_USAGES:
-                case ConfigCommand::GET_QUIRK: {
+                case ConfigCommand::GET_QUIRK:
+                case ConfigCommand::GET_BLOB_CHUNK: {
                     get_indexed_t* get_indexed = (get_indexed_t*) config_buffer->data;
                     requested_index = get_indexed->requested_index;
                     break;
@@ -1034,20 +1741,32 @@ void handle_set_report1(uint8_t report_id, uint8_t const* buffer, uint16_t bufsi
                     break;
                 case ConfigCommand::APPEND_TO_MACRO: {
                     append_to_macro_t* append_to_macro = (append_to_macro_t*) config_buffer->data;
+                    if (append_to_macro->macro >= NMACROS) {
+                        break;
+                    }
                     my_mutex_enter(MutexId::MACROS);
-                    if (macros[append_to_macro->macro].empty()) {
-                        macros[append_to_macro->macro].push_back({});
+                    auto& macro = macros[append_to_macro->macro];
+                    if (macro.empty()) {
+                        macro.push_back(0);
                     }
                     for (int i = 0; (i < MACRO_ITEMS_IN_PACKET) && (i < append_to_macro->nitems); i++) {
                         if (append_to_macro->usages[i] == 0) {
-                            macros[append_to_macro->macro].push_back({});
+                            macro.push_back(0);
                         } else {
-                            macros[append_to_macro->macro].back().push_back(append_to_macro->usages[i]);
+                            // goes in place of the last entry's terminator
+                            macro.back() = append_to_macro->usages[i];
+                            macro.push_back(0);
                         }
                     }
                     my_mutex_exit(MutexId::MACROS);
                     break;
                 }
+                case ConfigCommand::GET_THEIR_USAGES_PACKED: {
+                    get_their_usages_packed_t* get_packed = (get_their_usages_packed_t*) config_buffer->data;
+                    requested_index = get_packed->requested_index;
+                    requested_secondary_index = get_packed->generation;
+                    break;
+                }
                 case ConfigCommand::GET_MACRO: {
                     get_macro_t* get_macro = (get_macro_t*) config_buffer->data;
                     requested_index = get_macro->requested_macro;
@@ -1101,15 +1820,22 @@ void handle_set_report1(uint8_t report_id, uint8_t const* buffer, uint16_t bufsi
                     set_monitor_enabled(monitor->enabled);
                     break;
                 }
+                case ConfigCommand::SET_ACTIVE_PROFILE: {
+                    active_profile_t* profile = (active_profile_t*) config_buffer->data;
+                    set_active_profile(profile->profile);
+                    break;
+                }
                 case ConfigCommand::CLEAR_QUIRKS:
                     my_mutex_enter(MutexId::QUIRKS);
                     quirks.clear();
+                    invalidate_user_quirks_index();
                     my_mutex_exit(MutexId::QUIRKS);
                     break;
                 case ConfigCommand::ADD_QUIRK: {
                     quirk_t* quirk = (quirk_t*) config_buffer->data;
                     my_mutex_enter(MutexId::QUIRKS);
                     quirks.push_back(*quirk);
+                    invalidate_user_quirks_index();
                     my_mutex_exit(MutexId::QUIRKS);
                     break;
                 }
@@ -1118,6 +1844,50 @@ void handle_set_report1(uint8_t report_id, uint8_t const* buffer, uint16_t bufsi
                     inject_input(cmd->usage, cmd->value);
                     break;
                 }
+                case ConfigCommand::BEGIN_BLOB: {
+                    blob_header_t* header = (blob_header_t*) config_buffer->data;
+                    blob_chunks_ok = !persist_busy() && (header->size <= PERSISTED_CONFIG_SIZE - 4);
+                    blob_size = blob_chunks_ok ? header->size : 0;
+                    blob_crc32 = header->crc32;
+                    commit_blob_return_code = CommitBlobReturnCode::UNKNOWN;
+                    break;
+                }
+                case ConfigCommand::BLOB_CHUNK: {
+                    blob_chunk_t* chunk = (blob_chunk_t*) config_buffer->data;
+                    if (!blob_chunks_ok ||
+                        (chunk->len > BLOB_BYTES_IN_PACKET) ||
+                        (chunk->offset > blob_size) ||
+                        (chunk->len > blob_size - chunk->offset)) {
+                        blob_chunks_ok = false;
+                        break;
+                    }
+                    memcpy(serialized_config + chunk->offset, chunk->data, chunk->len);
+                    break;
+                }
+                case ConfigCommand::COMMIT_BLOB:
+                    commit_blob_return_code = commit_blob();
+                    break;
+                case ConfigCommand::READ_BLOB: {
+                    if (persist_busy()) {
+                        blob_size = 0;
+                        blob_crc32 = 0;
+                        read_blob_return_code = PersistConfigReturnCode::BUSY;
+                        break;
+                    }
+                    memset(serialized_config, 0, sizeof(serialized_config));
+                    blob_chunks_ok = false;
+                    int32_t size = serialize_config(serialized_config);
+                    if (size < 0) {
+                        blob_size = 0;
+                        blob_crc32 = 0;
+                        read_blob_return_code = PersistConfigReturnCode::CONFIG_TOO_BIG;
+                    } else {
+                        blob_size = size;
+                        blob_crc32 = crc32(serialized_config, blob_size);
+                        read_blob_return_code = PersistConfigReturnCode::SUCCESS;
+                    }
+                    break;
+                }
                 default:
                     last_config_command = ConfigCommand::INVALID_COMMAND;
                     break;
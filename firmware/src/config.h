@@ -6,6 +6,18 @@
 
 void load_config(const uint8_t* persisted_config);
 PersistConfigReturnCode persist_config();
+// Called from the main loop, starts a requested persist or does the next step of one in progress.
+void persist_config_maybe();
+
+// The switch happens the next time the mappings are rebuilt, when switch_to_requested_profile() is called.
+// That returns true if it switched.
+void set_active_profile(uint8_t profile);
+bool switch_to_requested_profile();
+
+// Trades config_mappings, macros and expressions with those of a profile that isn't active, so that
+// it can be compiled. Doing it again puts everything back.
+void exchange_profile_config(uint8_t profile);
+bool inactive_profile_empty(uint8_t profile);
 
 uint16_t handle_get_report1(uint8_t report_id, uint8_t* buffer, uint16_t reqlen);
 void handle_set_report1(uint8_t report_id, uint8_t const* buffer, uint16_t bufsize);
@@ -0,0 +1,257 @@
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "config_log.h"
+#include "crc.h"
+#include "types.h"
+
+const uint16_t CONFIG_LOG_MAGIC = 0x4C43;
+
+const uint8_t CONFIG_LOG_SNAPSHOT = 1;
+const uint8_t CONFIG_LOG_DELTA = 2;
+
+// everything but the CRC at the end of a persisted config
+#define CONFIG_BODY_SIZE (PERSISTED_CONFIG_SIZE - 4)
+
+static const uint8_t* log_in_memory = nullptr;
+
+// where the newest valid record is
+static bool log_valid = false;
+static uint8_t current_slot = 0;
+static uint32_t next_record_offset = 0;  // within current_slot
+static uint32_t last_seq = 0;
+
+static uint8_t page_buffer[CONFIG_LOG_PAGE_SIZE];
+
+struct config_log_write_t {
+    bool active;
+    uint8_t slot;
+    uint32_t offset;            // of the record within the slot
+    uint8_t sectors_to_erase;   // before the record can be programmed, when compacting
+    uint32_t programmed;        // how much of the record is already in flash
+    config_log_record_t header;
+    const uint8_t* data;
+};
+
+static config_log_write_t write_in_progress;
+
+// The unused part at the end of a persisted config is zeros, we don't store them.
+static uint32_t trimmed_len(const uint8_t* buffer) {
+    uint32_t len = CONFIG_BODY_SIZE;
+    while ((len > 0) && (buffer[len - 1] == 0)) {
+        len--;
+    }
+    return len;
+}
+
+// Records are padded to whole pages.
+static uint32_t record_span(uint32_t size) {
+    return (sizeof(config_log_record_t) + size + CONFIG_LOG_PAGE_SIZE - 1) / CONFIG_LOG_PAGE_SIZE * CONFIG_LOG_PAGE_SIZE;
+}
+
+static const config_log_record_t* record_at(const uint8_t* slot, uint32_t offset) {
+    if (offset + sizeof(config_log_record_t) > CONFIG_LOG_SLOT_SIZE) {
+        return nullptr;
+    }
+    const config_log_record_t* record = (const config_log_record_t*) (slot + offset);
+    if ((record->magic != CONFIG_LOG_MAGIC) ||
+        (record->size > CONFIG_LOG_SLOT_SIZE - offset - sizeof(config_log_record_t)) ||
+        (crc32(slot + offset + 4, sizeof(config_log_record_t) - 4 + record->size) != record->crc32)) {
+        return nullptr;
+    }
+    return record;
+}
+
+static bool record_applies(const config_log_record_t* record, uint32_t len) {
+    return (record->offset + record->removed <= len) &&
+           (len - record->removed + record->size <= CONFIG_BODY_SIZE);
+}
+
+static void apply_record(uint8_t* buffer, uint32_t len, const config_log_record_t* record) {
+    uint32_t new_len = len - record->removed + record->size;
+    memmove(buffer + record->offset + record->size, buffer + record->offset + record->removed, len - record->offset - record->removed);
+    memcpy(buffer + record->offset, (const uint8_t*) (record + 1), record->size);
+    if (new_len < len) {
+        memset(buffer + new_len, 0, len - new_len);
+    }
+}
+
+// Follows the chain of records in a slot for as long as they check out, applying them
+// to buffer if it's not null. Returns false if the slot doesn't start with a valid snapshot.
+static bool scan_slot(const uint8_t* slot, uint8_t* buffer, uint32_t& len, uint32_t& seq, uint32_t& end) {
+    const config_log_record_t* record = record_at(slot, 0);
+    if ((record == nullptr) ||
+        (record->type != CONFIG_LOG_SNAPSHOT) ||
+        (record->offset != 0) ||
+        (record->removed != 0) ||
+        !record_applies(record, 0)) {
+        return false;
+    }
+    len = 0;
+    seq = record->seq;
+    end = 0;
+    while (true) {
+        if (buffer != nullptr) {
+            apply_record(buffer, len, record);
+        }
+        len = len - record->removed + record->size;
+        end += record_span(record->size);
+
+        record = record_at(slot, end);
+        if ((record == nullptr) ||
+            (record->type != CONFIG_LOG_DELTA) ||
+            (record->seq != seq + 1) ||
+            !record_applies(record, len)) {
+            break;
+        }
+        seq = record->seq;
+    }
+    return true;
+}
+
+bool config_log_load(const uint8_t* log, uint8_t* buffer) {
+    log_in_memory = log;
+    log_valid = false;
+    write_in_progress.active = false;
+
+    for (uint8_t slot = 0; slot < CONFIG_LOG_NSLOTS; slot++) {
+        uint32_t len;
+        uint32_t seq;
+        uint32_t end;
+        if (scan_slot(log + slot * CONFIG_LOG_SLOT_SIZE, nullptr, len, seq, end) &&
+            (!log_valid || ((int32_t) (seq - last_seq) > 0))) {
+            log_valid = true;
+            current_slot = slot;
+            last_seq = seq;
+        }
+    }
+
+    if (!log_valid) {
+        return false;
+    }
+
+    uint32_t len;
+    memset(buffer, 0, PERSISTED_CONFIG_SIZE);
+    scan_slot(log + current_slot * CONFIG_LOG_SLOT_SIZE, buffer, len, last_seq, next_record_offset);
+    ((crc32_t*) (buffer + CONFIG_BODY_SIZE))->crc32 = crc32(buffer, CONFIG_BODY_SIZE);
+
+    return true;
+}
+
+static bool erased(uint32_t offset, uint32_t size) {
+    for (uint32_t i = 0; i < size; i++) {
+        if (log_in_memory[offset + i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void start_write(uint8_t slot, uint32_t offset, uint8_t sectors_to_erase, uint8_t type, uint16_t delta_offset, uint16_t removed, const uint8_t* data, uint16_t size) {
+    config_log_write_t& w = write_in_progress;
+    w.active = true;
+    w.slot = slot;
+    w.offset = offset;
+    w.sectors_to_erase = sectors_to_erase;
+    w.programmed = 0;
+    w.header = {
+        .crc32 = 0,
+        .magic = CONFIG_LOG_MAGIC,
+        .type = type,
+        .reserved = 0,
+        .seq = last_seq + 1,
+        .offset = delta_offset,
+        .removed = removed,
+        .size = size,
+    };
+    w.header.crc32 = crc32_update(crc32((uint8_t*) &w.header + 4, sizeof(w.header) - 4), data, size);
+    w.data = data;
+}
+
+static void record_written(uint8_t slot, uint32_t offset) {
+    const config_log_record_t* record = record_at(log_in_memory + slot * CONFIG_LOG_SLOT_SIZE, offset);
+    if ((record == nullptr) || (record->seq != last_seq + 1)) {
+        printf("config log write failed!\n");
+        // make the next write a snapshot in the slot we're not using
+        next_record_offset = CONFIG_LOG_SLOT_SIZE;
+        return;
+    }
+    log_valid = true;
+    current_slot = slot;
+    next_record_offset = offset + record_span(record->size);
+    last_seq = record->seq;
+}
+
+void config_log_step() {
+    config_log_write_t& w = write_in_progress;
+    if (!w.active) {
+        return;
+    }
+
+    uint32_t slot_start = w.slot * CONFIG_LOG_SLOT_SIZE;
+
+    if (w.sectors_to_erase > 0) {
+        w.sectors_to_erase--;
+        config_log_erase_sector(slot_start + w.offset + w.sectors_to_erase * CONFIG_LOG_SECTOR_SIZE);
+        return;
+    }
+
+    uint32_t total = sizeof(w.header) + w.header.size;
+    uint32_t pos = w.programmed;
+    memset(page_buffer, 0xFF, sizeof(page_buffer));
+    for (uint32_t i = 0; (i < CONFIG_LOG_PAGE_SIZE) && (pos + i < total); i++) {
+        page_buffer[i] = (pos + i < sizeof(w.header)) ? ((uint8_t*) &w.header)[pos + i] : w.data[pos + i - sizeof(w.header)];
+    }
+    config_log_program_page(slot_start + w.offset + pos, page_buffer);
+    w.programmed += CONFIG_LOG_PAGE_SIZE;
+
+    if (w.programmed >= total) {
+        w.active = false;
+        record_written(w.slot, w.offset);
+    }
+}
+
+bool config_log_busy() {
+    return write_in_progress.active;
+}
+
+void config_log_persist(const uint8_t* buffer) {
+    uint32_t len = trimmed_len(buffer);
+
+    if (log_valid) {
+        // We don't keep a copy of what's in the log around, we rebuild it to see what changed.
+        std::vector<uint8_t> previous(CONFIG_BODY_SIZE);
+        uint32_t previous_len;
+        uint32_t seq;
+        uint32_t end;
+        if (scan_slot(log_in_memory + current_slot * CONFIG_LOG_SLOT_SIZE, previous.data(), previous_len, seq, end) &&
+            (seq == last_seq) && (end == next_record_offset)) {
+            if ((len == previous_len) && !memcmp(buffer, previous.data(), len)) {
+                return;
+            }
+
+            uint32_t prefix = 0;
+            while ((prefix < len) && (prefix < previous_len) && (buffer[prefix] == previous[prefix])) {
+                prefix++;
+            }
+            uint32_t suffix = 0;
+            while ((prefix + suffix < len) && (prefix + suffix < previous_len) &&
+                   (buffer[len - 1 - suffix] == previous[previous_len - 1 - suffix])) {
+                suffix++;
+            }
+            uint32_t size = len - prefix - suffix;
+            uint32_t span = record_span(size);
+
+            if ((next_record_offset + span <= CONFIG_LOG_SLOT_SIZE) &&
+                erased(current_slot * CONFIG_LOG_SLOT_SIZE + next_record_offset, span)) {
+                start_write(current_slot, next_record_offset, 0, CONFIG_LOG_DELTA, prefix, previous_len - prefix - suffix, buffer + prefix, size);
+                return;
+            }
+        }
+    }
+
+    // compaction: start a new chain in the other slot
+    uint8_t slot = log_valid ? (current_slot + 1) % CONFIG_LOG_NSLOTS : 0;
+    start_write(slot, 0, CONFIG_LOG_SLOT_SIZE / CONFIG_LOG_SECTOR_SIZE, CONFIG_LOG_SNAPSHOT, 0, 0, buffer, len);
+}
@@ -0,0 +1,40 @@
+#ifndef _CONFIG_LOG_H_
+#define _CONFIG_LOG_H_
+
+#include <stdint.h>
+
+// The persisted config lives in a log spread over two slots. A slot starts with a snapshot
+// of the whole config, followed by deltas, each against the config the previous record
+// left behind. Every record starts on a page boundary, so appending a delta only programs
+// the pages it occupies. When a delta doesn't fit, a new snapshot is written to the other
+// slot, which is the only time anything gets erased. The slot we're compacting away from
+// is left alone until the next compaction, so if power is cut halfway through any write,
+// the previous config can still be loaded.
+//
+// Writes are done one sector erase or one page program at a time, see config_log_step().
+
+#define CONFIG_LOG_PAGE_SIZE 256
+#define CONFIG_LOG_SECTOR_SIZE 4096
+#define CONFIG_LOG_SLOT_SIZE (2 * CONFIG_LOG_SECTOR_SIZE)
+#define CONFIG_LOG_NSLOTS 2
+#define CONFIG_LOG_SIZE (CONFIG_LOG_NSLOTS * CONFIG_LOG_SLOT_SIZE)
+
+// Finds the newest valid record in the log (as mapped in memory) and rebuilds the config
+// it describes into a PERSISTED_CONFIG_SIZE buffer that can be passed to load_config().
+// Returns false if there's nothing in the log.
+bool config_log_load(const uint8_t* log, uint8_t* buffer);
+
+// Starts appending a PERSISTED_CONFIG_SIZE buffer, as given to do_persist_config(), to the log.
+// Must be called after config_log_load() and not while config_log_busy(). The buffer has to
+// stay untouched until the write is done.
+void config_log_persist(const uint8_t* buffer);
+
+// Does the next flash operation of the write in progress, if there is one.
+void config_log_step();
+bool config_log_busy();
+
+// Implemented by the platform. Offsets are relative to the start of the log.
+void config_log_erase_sector(uint32_t offset);
+void config_log_program_page(uint32_t offset, const uint8_t* data);
+
+#endif
@@ -46,8 +46,8 @@ uint32_t crc_table[] = {
     0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
 };
 
-uint32_t crc32(const uint8_t* buf, int len) {
-    uint32_t c = 0xffffffffL;
+uint32_t crc32_update(uint32_t crc, const uint8_t* buf, int len) {
+    uint32_t c = crc ^ 0xffffffffL;
     int n;
 
     for (n = 0; n < len; n++) {
@@ -55,3 +55,7 @@ uint32_t crc32(const uint8_t* buf, int len) {
     }
     return c ^ 0xffffffffL;
 }
+
+uint32_t crc32(const uint8_t* buf, int len) {
+    return crc32_update(0, buf, len);
+}
@@ -4,5 +4,7 @@
 #include <stdint.h>
 
 uint32_t crc32(const uint8_t* buf, int len);
+// continues a CRC computed over the preceding bytes, crc32_update(0, ...) is the same as crc32()
+uint32_t crc32_update(uint32_t crc, const uint8_t* buf, int len);
 
 #endif
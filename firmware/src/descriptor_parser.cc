@@ -1,6 +1,7 @@
+#include <algorithm>
 #include <cstring>
-#include <deque>
 
+#include "crc.h"
 #include "descriptor_parser.h"
 #include "globals.h"
 #include "platform.h"
@@ -21,12 +22,62 @@ const uint8_t HID_USAGE_MAXIMUM = 0x28;
 const uint8_t HID_LOGICAL_MINIMUM = 0x14;
 const uint8_t HID_LOGICAL_MAXIMUM = 0x24;
 
-void mark_usage(
-    std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>>* usage_map,
+// How many parsed descriptors we keep around after the last interface using them is gone.
+#define DESCRIPTOR_CACHE_SIZE 4
+
+// Interfaces with the same descriptor and VID/PID share parsed tables, as long as
+// no user quirk makes them different.
+struct descriptor_cache_entry_t {
+    uint16_t vendor_id;
+    uint16_t product_id;
+    int len;
+    uint32_t descriptor_crc;
+    uint32_t quirks_crc;  // of user quirks that apply to the interface
+    bool normalize_gamepad_inputs;
+    uint16_t refcount;
+    uint32_t last_used;
+    parsed_descriptor_t parsed;
+    arena_t arena;
+};
+
+// What each connected device owns, so that tearing it down doesn't involve looking at other devices' data.
+struct device_data_t {
+    std::vector<uint16_t> interfaces;  // dev_addr+interface
+    arena_t arena;                     // out report buffers
+};
+
+static std::unordered_map<uint8_t, device_data_t> devices;  // dev_addr -> ...
+
+static std::vector<descriptor_cache_entry_t*> descriptor_cache;
+static std::unordered_map<uint16_t, descriptor_cache_entry_t*> interface_cache_entry;  // dev_addr+interface -> entry
+static uint32_t descriptor_cache_clock = 0;
+uint32_t descriptor_cache_hits = 0;
+uint32_t descriptor_cache_misses = 0;
+
+// usage_def_t.bitpos is 16 bits wide and a field can't wrap around, that's almost 8KB
+const uint32_t REPORT_BITS_LIMIT = 0x10000 - 32;
+
+static uint32_t report_bit_limit(ReportType report_type, uint8_t report_id) {
+    if (report_type == ReportType::INPUT) {
+        // input reports are read where they are received, there's no buffer to fit into
+        return REPORT_BITS_LIMIT;
+    }
+    // output and feature reports go out through 64-byte buffers
+    return (report_id == 0) ? 64u * 8 : 63u * 8;
+}
+
+static void advance_bitpos(uint32_t& bitpos, uint32_t report_size, uint32_t report_count) {
+    // saturates at REPORT_BITS_LIMIT, so it fits
+    bitpos = (uint32_t) std::min((uint64_t) bitpos + (uint64_t) report_size * report_count, (uint64_t) REPORT_BITS_LIMIT);
+}
+
+static void mark_usage(
+    usage_list_t& usages,
+    ReportType report_type,
     uint32_t usage,
     uint8_t report_id,
-    uint16_t bitpos,
-    uint8_t size,
+    uint32_t bitpos,
+    uint32_t size,
     bool is_relative,
     int32_t logical_minimum,
     int32_t logical_maximum,
@@ -34,17 +85,29 @@ void mark_usage(
     uint32_t index = 0,
     uint32_t count = 0,
     uint32_t usage_maximum = 0) {
-    if (bitpos >= (8 * ((report_id == 0) ? 64 : 63))) {
-        // We don't currently handle reports longer than 64 bytes so let's save some memory.
-        // It's probably a broken descriptor anyway.
+    if ((size == 0) || (size > 32)) {
+        // Values are handled as 32-bit integers, there is nothing we could do with these.
         return;
     }
-
-    (*usage_map)[report_id].try_emplace(usage,
-        (usage_def_t){
+    if (bitpos >= report_bit_limit(report_type, report_id)) {
+        // Past what we handle, it's probably a broken descriptor anyway.
+        return;
+    }
+    if (is_array && (bitpos + (uint64_t) size * count > REPORT_BITS_LIMIT)) {
+        count = (REPORT_BITS_LIMIT - bitpos) / size;
+    }
+    // checked above, these fit
+    uint8_t field_size = (uint8_t) size;
+    uint16_t field_bitpos = (uint16_t) bitpos;
+
+    // duplicates are removed when parsing is done, first one wins
+    usages.push_back((report_usage_t){
+        .report_id = report_id,
+        .usage = usage,
+        .usage_def = (usage_def_t){
             .report_id = report_id,
-            .size = size,
-            .bitpos = bitpos,
+            .size = field_size,
+            .bitpos = field_bitpos,
             .is_relative = is_relative,
             .is_array = is_array,
             .logical_minimum = logical_minimum,
@@ -52,7 +115,123 @@ void mark_usage(
             .index = index,
             .count = count,
             .usage_maximum = usage_maximum,
+        },
+    });
+}
+
+static bool report_usage_less(const report_usage_t& a, const report_usage_t& b) {
+    return (a.report_id < b.report_id) || ((a.report_id == b.report_id) && (a.usage < b.usage));
+}
+
+static usage_list_t::iterator lower_bound(usage_list_t& usages, uint8_t report_id, uint32_t usage) {
+    return std::lower_bound(usages.begin(), usages.end(), (report_usage_t){ .report_id = report_id, .usage = usage }, report_usage_less);
+}
+
+usage_def_t* find_usage(usage_list_t& usages, uint8_t report_id, uint32_t usage) {
+    auto it = lower_bound(usages, report_id, usage);
+    if ((it != usages.end()) && (it->report_id == report_id) && (it->usage == usage)) {
+        return &it->usage_def;
+    }
+    return NULL;
+}
+
+usage_def_t& get_usage(usage_list_t& usages, uint8_t report_id, uint32_t usage) {
+    auto it = lower_bound(usages, report_id, usage);
+    if ((it == usages.end()) || (it->report_id != report_id) || (it->usage != usage)) {
+        it = usages.insert(it, (report_usage_t){ .report_id = report_id, .usage = usage, .usage_def = {} });
+    }
+    return it->usage_def;
+}
+
+void erase_usage(usage_list_t& usages, uint8_t report_id, uint32_t usage) {
+    auto it = lower_bound(usages, report_id, usage);
+    if ((it != usages.end()) && (it->report_id == report_id) && (it->usage == usage)) {
+        usages.erase(it);
+    }
+}
+
+const report_usages_t* find_report(const usage_table_t& table, uint8_t report_id) {
+    const report_usages_t* it = std::lower_bound(table.reports, table.reports + table.nreports, report_id,
+        [](const report_usages_t& report, uint8_t report_id) {
+            return report.report_id < report_id;
         });
+    if ((it != table.reports + table.nreports) && (it->report_id == report_id)) {
+        return it;
+    }
+    return NULL;
+}
+
+const usage_def_t* find_usage(const usage_table_t& table, uint8_t report_id, uint32_t usage) {
+    const report_usages_t* report = find_report(table, report_id);
+    if (report == NULL) {
+        return NULL;
+    }
+    const usage_usage_def_t* begin = table.usages + report->first;
+    const usage_usage_def_t* end = begin + report->count;
+    const usage_usage_def_t* it = std::lower_bound(begin, end, usage,
+        [](const usage_usage_def_t& their, uint32_t usage) {
+            return their.usage < usage;
+        });
+    if ((it != end) && (it->usage == usage)) {
+        return &it->usage_def;
+    }
+    return NULL;
+}
+
+static void pack_usages(usage_table_t& table, arena_t& arena, const usage_list_t& usages, const std::vector<report_bits_t>& report_bits, ReportType report_type) {
+    uint32_t present[256 / 32] = { 0 };
+    for (auto const& entry : report_bits) {
+        if (entry.report_type == report_type) {
+            present[entry.report_id / 32] |= 1 << (entry.report_id % 32);
+        }
+    }
+    for (auto const& entry : usages) {
+        present[entry.report_id / 32] |= 1 << (entry.report_id % 32);
+    }
+    uint16_t nreports = 0;
+    for (uint32_t word : present) {
+        nreports += __builtin_popcount(word);
+    }
+
+    usage_usage_def_t* packed_usages = arena_new<usage_usage_def_t>(arena, usages.size());
+    report_usages_t* reports = arena_new<report_usages_t>(arena, nreports);
+
+    uint32_t usage_idx = 0;
+    uint16_t report_idx = 0;
+    for (uint16_t report_id = 0; report_id < 256; report_id++) {
+        if (!(present[report_id / 32] & (1 << (report_id % 32)))) {
+            continue;
+        }
+        report_usages_t& report = reports[report_idx++];
+        report.report_id = report_id;
+        report.size = 0;
+        for (auto const& entry : report_bits) {
+            if ((entry.report_type == report_type) && (entry.report_id == report_id)) {
+                report.size = entry.bits / 8;
+            }
+        }
+        report.first = usage_idx;
+        while ((usage_idx < usages.size()) && (usages[usage_idx].report_id == report_id)) {
+            packed_usages[usage_idx] = (usage_usage_def_t){
+                .usage = usages[usage_idx].usage,
+                .usage_def = usages[usage_idx].usage_def,
+            };
+            usage_idx++;
+        }
+        report.count = usage_idx - report.first;
+    }
+
+    table.usages = packed_usages;
+    table.reports = reports;
+    table.nusages = usages.size();
+    table.nreports = nreports;
+}
+
+void pack_descriptor(parsed_descriptor_t& result, arena_t& arena, const descriptor_usages_t& parsed) {
+    pack_usages(result.input, arena, parsed.usages[(uint8_t) ReportType::INPUT], parsed.report_bits, ReportType::INPUT);
+    pack_usages(result.output, arena, parsed.usages[(uint8_t) ReportType::OUTPUT], parsed.report_bits, ReportType::OUTPUT);
+    pack_usages(result.feature, arena, parsed.usages[(uint8_t) ReportType::FEATURE], parsed.report_bits, ReportType::FEATURE);
+    result.has_report_id = parsed.has_report_id;
 }
 
 void assign_interface_index(uint16_t interface) {
@@ -60,60 +239,180 @@ void assign_interface_index(uint16_t interface) {
         return;
     }
 
-    uint8_t i = 0;
-    while (i < 31 && ((1 << i) & interface_index_in_use)) {
-        i++;
+    // if we run out of indexes, the remaining interfaces end up sharing the last one
+    uint16_t i = NINTERFACE_INDEXES - 1;
+    for (uint8_t word = 0; word < INTERFACE_INDEX_WORDS; word++) {
+        if (~interface_index_in_use[word]) {
+            i = word * 32 + __builtin_ctz(~interface_index_in_use[word]);
+            break;
+        }
     }
 
-    // if we have more than 32 interfaces, they end up sharing bit 31
-
     interface_index[interface] = i;
-    interface_index_in_use |= 1 << i;
+    interface_index_in_use[i / 32] |= 1 << (i % 32);
 }
 
-static void add_synthetic_dpad_usages(std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>>& report_id_usage_map) {
-    for (auto& [report_id, usage_map] : report_id_usage_map) {
-        auto search = usage_map.find(DPAD_USAGE);
-        if (search != usage_map.end()) {
-            usage_def_t dpad_usage_def = search->second;
-            dpad_usage_def.is_array = true;
-            dpad_usage_def.count = 1;
-
-            dpad_usage_def.index_mask = 0b11100000;
-            usage_map[DPAD_USAGE_LEFT] = dpad_usage_def;
-            dpad_usage_def.index_mask = 0b00001110;
-            usage_map[DPAD_USAGE_RIGHT] = dpad_usage_def;
-            dpad_usage_def.index_mask = 0b10000011;
-            usage_map[DPAD_USAGE_UP] = dpad_usage_def;
-            dpad_usage_def.index_mask = 0b00111000;
-            usage_map[DPAD_USAGE_DOWN] = dpad_usage_def;
+static void add_synthetic_dpad_usages(usage_list_t& usages) {
+    std::vector<report_usage_t> dpads;
+    for (auto const& entry : usages) {
+        if (entry.usage == DPAD_USAGE) {
+            dpads.push_back(entry);
+        }
+    }
+    for (auto const& dpad : dpads) {
+        usage_def_t dpad_usage_def = dpad.usage_def;
+        dpad_usage_def.is_array = true;
+        dpad_usage_def.count = 1;
+
+        dpad_usage_def.index_mask = 0b11100000;
+        get_usage(usages, dpad.report_id, DPAD_USAGE_LEFT) = dpad_usage_def;
+        dpad_usage_def.index_mask = 0b00001110;
+        get_usage(usages, dpad.report_id, DPAD_USAGE_RIGHT) = dpad_usage_def;
+        dpad_usage_def.index_mask = 0b10000011;
+        get_usage(usages, dpad.report_id, DPAD_USAGE_UP) = dpad_usage_def;
+        dpad_usage_def.index_mask = 0b00111000;
+        get_usage(usages, dpad.report_id, DPAD_USAGE_DOWN) = dpad_usage_def;
+    }
+}
+
+static uint32_t matching_quirks_crc(uint16_t vendor_id, uint16_t product_id, uint8_t itf_num) {
+    std::vector<quirk_t> matching = matching_user_quirks(vendor_id, product_id, itf_num);
+    return crc32((const uint8_t*) matching.data(), matching.size() * sizeof(quirk_t));
+}
+
+static void release_cache_entry(uint16_t interface) {
+    auto search = interface_cache_entry.find(interface);
+    if (search == interface_cache_entry.end()) {
+        return;
+    }
+    search->second->refcount--;
+    interface_cache_entry.erase(search);
+
+    uint8_t unused = 0;
+    for (auto entry : descriptor_cache) {
+        if (entry->refcount == 0) {
+            unused++;
+        }
+    }
+    while (unused > DESCRIPTOR_CACHE_SIZE) {
+        auto oldest = descriptor_cache.end();
+        for (auto it = descriptor_cache.begin(); it != descriptor_cache.end(); it++) {
+            if (((*it)->refcount == 0) && ((oldest == descriptor_cache.end()) || ((*it)->last_used < (*oldest)->last_used))) {
+                oldest = it;
+            }
+        }
+        arena_release((*oldest)->arena);
+        delete *oldest;
+        descriptor_cache.erase(oldest);
+        unused--;
+    }
+}
+
+static descriptor_cache_entry_t* get_cache_entry(uint16_t vendor_id, uint16_t product_id, const uint8_t* report_descriptor, int len, uint8_t itf_num) {
+    // reused so that we don't allocate on every parse
+    static descriptor_usages_t parsed;
+
+    uint32_t descriptor_crc = crc32(report_descriptor, len);
+    uint32_t quirks_crc = matching_quirks_crc(vendor_id, product_id, itf_num);
+
+    for (auto entry : descriptor_cache) {
+        if ((entry->vendor_id == vendor_id) &&
+            (entry->product_id == product_id) &&
+            (entry->len == len) &&
+            (entry->descriptor_crc == descriptor_crc) &&
+            (entry->quirks_crc == quirks_crc) &&
+            (entry->normalize_gamepad_inputs == normalize_gamepad_inputs)) {
+            descriptor_cache_hits++;
+            entry->refcount++;
+            entry->last_used = descriptor_cache_clock++;
+            return entry;
+        }
+    }
+    descriptor_cache_misses++;
+
+    parse_descriptor(parsed, report_descriptor, len);
+    usage_list_t& input_usages = parsed.usages[(uint8_t) ReportType::INPUT];
+    apply_quirks(vendor_id, product_id, input_usages, report_descriptor, len, itf_num);
+    add_synthetic_dpad_usages(input_usages);
+
+    descriptor_cache_entry_t* entry = new descriptor_cache_entry_t;
+    entry->vendor_id = vendor_id;
+    entry->product_id = product_id;
+    entry->len = len;
+    entry->descriptor_crc = descriptor_crc;
+    entry->quirks_crc = quirks_crc;
+    entry->normalize_gamepad_inputs = normalize_gamepad_inputs;
+    entry->refcount = 1;
+    entry->last_used = descriptor_cache_clock++;
+    pack_descriptor(entry->parsed, entry->arena, parsed);
+    descriptor_cache.push_back(entry);
+
+    return entry;
+}
+
+// Buffers are in the device's arena and go away when the device does.
+static void remove_out_reports(uint16_t interface, const parsed_descriptor_t& their) {
+    for (uint16_t i = 0; i < their.output.nreports; i++) {
+        const report_usages_t& report = their.output.reports[i];
+        uint32_t key = (interface << 16) | report.report_id;
+        out_report_sizes.erase(key);
+        out_reports.erase(key);
+        prev_out_reports.erase(key);
+
+        for (uint32_t j = report.first; j < report.first + report.count; j++) {
+            auto search = their_out_usages_flat.find(their.output.usages[j].usage);
+            if (search == their_out_usages_flat.end()) {
+                continue;
+            }
+            std::vector<uint32_t>& keys = search->second;
+            keys.erase(std::remove(keys.begin(), keys.end(), key), keys.end());
+            if (keys.empty()) {
+                their_out_usages_flat.erase(search);
+            }
         }
     }
 }
 
 void parse_descriptor(uint16_t vendor_id, uint16_t product_id, const uint8_t* report_descriptor, int len, uint16_t interface, uint8_t itf_num) {
     my_mutex_enter(MutexId::THEIR_USAGES);
-    auto their_report_sizes_map = parse_descriptor(
-        their_usages[interface],
-        their_out_usages[interface],
-        their_feature_usages[interface],
-        has_report_id_theirs[interface],
-        report_descriptor,
-        len);
-    apply_quirks(vendor_id, product_id, their_usages[interface], report_descriptor, len, itf_num);
+    device_data_t& device = devices[interface >> 8];
+    auto search = their_descriptors.find(interface);
+    if (search != their_descriptors.end()) {
+        // same interface parsed again, must be done before its cache entry can go away
+        remove_out_reports(interface, search->second);
+    } else {
+        device.interfaces.push_back(interface);
+    }
+    release_cache_entry(interface);
+    descriptor_cache_entry_t* entry = get_cache_entry(vendor_id, product_id, report_descriptor, len, itf_num);
+    interface_cache_entry[interface] = entry;
     assign_interface_index(interface);
-    add_synthetic_dpad_usages(their_usages[interface]);
-
-    for (auto const& [report_id, size] : their_report_sizes_map[ReportType::OUTPUT]) {
-        out_report_sizes[(interface << 16) | report_id] = size;
-        out_reports[(interface << 16) | report_id] = new uint8_t[size];
-        memset(out_reports[(interface << 16) | report_id], 0, size);
-        prev_out_reports[(interface << 16) | report_id] = new uint8_t[size];
-        memset(prev_out_reports[(interface << 16) | report_id], 0, size);
-    }
-    for (auto const& [report_id, usage_map] : their_out_usages[interface]) {
-        for (auto const& [usage, usage_def] : usage_map) {
-            their_out_usages_flat[usage].push_back((interface << 16) | report_id);
+
+    parsed_descriptor_t& their = their_descriptors[interface];
+    their = entry->parsed;
+    their_descriptor_changes.push_back(interface);
+
+    // all of the interface's out report buffers come from the device's arena in one piece
+    size_t buffers_size = 0;
+    for (uint16_t i = 0; i < their.output.nreports; i++) {
+        buffers_size += 2 * their.output.reports[i].size;
+    }
+    uint8_t* buffers = arena_new<uint8_t>(device.arena, buffers_size);
+    if (buffers != NULL) {
+        memset(buffers, 0, buffers_size);
+    }
+
+    for (uint16_t i = 0; i < their.output.nreports; i++) {
+        const report_usages_t& report = their.output.reports[i];
+        uint32_t key = (interface << 16) | report.report_id;
+        out_report_sizes[key] = report.size;
+        out_reports[key] = buffers;
+        buffers += report.size;
+        prev_out_reports[key] = buffers;
+        buffers += report.size;
+
+        for (uint32_t j = report.first; j < report.first + report.count; j++) {
+            their_out_usages_flat[their.output.usages[j].usage].push_back(key);
         }
     }
 
@@ -133,42 +432,60 @@ static ReportType item_to_report_type(uint8_t item) {
     }
 }
 
-std::unordered_map<ReportType, std::unordered_map<uint8_t, uint16_t>> parse_descriptor(
-    std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>>& input_usage_map,
-    std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>>& output_usage_map,
-    std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>>& feature_usage_map,
-    bool& has_report_id,
-    const uint8_t* report_descriptor,
-    int len) {
+static int32_t sign_extend(uint32_t value, uint8_t item_size) {
+    if ((item_size == 0) || (item_size == 4)) {
+        return value;
+    }
+    uint32_t sign_bit = 1 << (item_size * 8 - 1);
+    return (value ^ sign_bit) - sign_bit;
+}
+
+static uint32_t& report_bits(descriptor_usages_t& result, ReportType report_type, uint8_t report_id) {
+    for (auto& entry : result.report_bits) {
+        if ((entry.report_type == report_type) && (entry.report_id == report_id)) {
+            return entry.bits;
+        }
+    }
+    result.report_bits.push_back((report_bits_t){
+        .report_type = report_type,
+        .report_id = report_id,
+        .bits = 0,
+    });
+    return result.report_bits.back().bits;
+}
+
+void parse_descriptor(descriptor_usages_t& result, const uint8_t* report_descriptor, int len) {
     int idx = 0;
 
     uint8_t report_id = 0;
-    std::unordered_map<ReportType, std::unordered_map<uint8_t, uint16_t>> bitpos;  // in/out/feature -> report_id -> bitpos
     uint32_t report_size = 0;
     uint32_t report_count = 0;
     uint32_t usage_page = 0;
-    std::deque<uint32_t> usages;
+    std::vector<uint32_t>& usages = result.usage_stack;
+    size_t usages_idx = 0;
     uint32_t usage_minimum = 0;
     uint32_t usage_maximum = 0;
     int32_t logical_minimum = 0;
     int32_t logical_maximum = 0;
     int32_t unsigned_logical_maximum = 0;
 
-    std::unordered_map<ReportType, std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>>*> usage_map;
-    usage_map[ReportType::INPUT] = &input_usage_map;
-    usage_map[ReportType::OUTPUT] = &output_usage_map;
-    usage_map[ReportType::FEATURE] = &feature_usage_map;
+    for (auto& usage_list : result.usages) {
+        usage_list.clear();
+    }
+    result.report_bits.clear();
+    result.has_report_id = false;
+    usages.clear();
 
     while (idx < len) {
-        if (report_descriptor[idx] == 0 && idx == len - 1) {
-            continue;
-        }
-
         uint8_t item = report_descriptor[idx] & 0xFC;
         uint8_t item_size = report_descriptor[idx] & 0x03;
         if (item_size == 3) {
             item_size = 4;
         }
+        if (idx + 1 + item_size > len) {
+            // truncated item, nothing more to parse
+            break;
+        }
         uint32_t value = 0;
         idx++;
         for (int i = 0; i < item_size; i++) {
@@ -180,49 +497,60 @@ std::unordered_map<ReportType, std::unordered_map<uint8_t, uint16_t>> parse_desc
             case HID_OUTPUT:
             case HID_FEATURE: {
                 ReportType report_type = item_to_report_type(item);
+                usage_list_t& usage_list = result.usages[(uint8_t) report_type];
+                uint32_t& bitpos = report_bits(result, report_type, report_id);
                 bool relative = value & (1 << 2);
                 if ((value & 0x03) == 0x02) {  // scalar
                     if (usage_minimum && usage_maximum) {
                         uint32_t usage = usage_minimum;
                         for (uint32_t i = 0; i < report_count; i++) {
                             mark_usage(
-                                usage_map[report_type],
+                                usage_list,
+                                report_type,
                                 usage,
                                 report_id,
-                                bitpos[report_type][report_id],
+                                bitpos,
                                 report_size,
                                 relative,
                                 logical_minimum,
                                 logical_maximum);
 
-                            if (usage < usage_maximum) {
-                                usage++;
-                            }
+                            advance_bitpos(bitpos, report_size, 1);
 
-                            bitpos[report_type][report_id] += report_size;
+                            // past usage_maximum or the end of what we handle the rest are duplicates we'd ignore anyway
+                            if ((usage >= usage_maximum) || (bitpos >= report_bit_limit(report_type, report_id)) || (report_size == 0)) {
+                                advance_bitpos(bitpos, report_size, report_count - i - 1);
+                                break;
+                            }
+                            usage++;
                         }
-                    } else if (!usages.empty()) {
+                    } else if (usages_idx < usages.size()) {
                         uint32_t usage = 0;
                         for (uint32_t i = 0; i < report_count; i++) {
-                            if (!usages.empty()) {
-                                usage = usages.front();
-                                usages.pop_front();
+                            if (usages_idx < usages.size()) {
+                                usage = usages[usages_idx++];
                             }
 
                             mark_usage(
-                                usage_map[report_type],
+                                usage_list,
+                                report_type,
                                 usage,
                                 report_id,
-                                bitpos[report_type][report_id],
+                                bitpos,
                                 report_size,
                                 relative,
                                 logical_minimum,
                                 logical_maximum);
 
-                            bitpos[report_type][report_id] += report_size;
+                            advance_bitpos(bitpos, report_size, 1);
+
+                            if (usages_idx == usages.size()) {
+                                advance_bitpos(bitpos, report_size, report_count - i - 1);
+                                break;
+                            }
                         }
                     } else {
-                        bitpos[report_type][report_id] += report_size * report_count;
+                        advance_bitpos(bitpos, report_size, report_count);
                     }
                 } else if ((value & 0x03) == 0x00) {  // array
                     if (usage_minimum && usage_maximum) {
@@ -230,10 +558,11 @@ std::unordered_map<ReportType, std::unordered_map<uint8_t, uint16_t>> parse_desc
                             std::min(usage_maximum, usage_minimum + unsigned_logical_maximum - logical_minimum);
 
                         mark_usage(
-                            usage_map[report_type],
+                            usage_list,
+                            report_type,
                             usage_minimum,
                             report_id,
-                            bitpos[report_type][report_id],
+                            bitpos,
                             report_size,
                             relative,
                             logical_minimum,
@@ -242,19 +571,14 @@ std::unordered_map<ReportType, std::unordered_map<uint8_t, uint16_t>> parse_desc
                             logical_minimum,
                             report_count,
                             effective_usage_maximum);
-                    } else if (!usages.empty()) {
-                        uint32_t usage = 0;
+                    } else if (usages_idx < usages.size()) {
                         for (int index = logical_minimum; index <= unsigned_logical_maximum; index++) {
-                            if (!usages.empty()) {
-                                usage = usages.front();
-                                usages.pop_front();
-                            }
-
                             mark_usage(
-                                usage_map[report_type],
-                                usage,
+                                usage_list,
+                                report_type,
+                                usages[usages_idx++],
                                 report_id,
-                                bitpos[report_type][report_id],
+                                bitpos,
                                 report_size,
                                 relative,
                                 logical_minimum,
@@ -262,20 +586,27 @@ std::unordered_map<ReportType, std::unordered_map<uint8_t, uint16_t>> parse_desc
                                 true,
                                 index,
                                 report_count);
+
+                            // the remaining indexes would repeat the last usage
+                            if (usages_idx == usages.size()) {
+                                break;
+                            }
                         }
                     }
-                    bitpos[report_type][report_id] += report_size * report_count;
+                    advance_bitpos(bitpos, report_size, report_count);
                 } else {  // constant
-                    bitpos[report_type][report_id] += report_size * report_count;
+                    advance_bitpos(bitpos, report_size, report_count);
                 }
 
                 usages.clear();
+                usages_idx = 0;
                 usage_minimum = 0;
                 usage_maximum = 0;
                 break;
             }
             case HID_COLLECTION:
                 usages.clear();
+                usages_idx = 0;
                 usage_minimum = 0;
                 usage_maximum = 0;
                 break;
@@ -287,7 +618,7 @@ std::unordered_map<ReportType, std::unordered_map<uint8_t, uint16_t>> parse_desc
                 break;
             case HID_REPORT_ID:
                 report_id = value;
-                has_report_id = true;
+                result.has_report_id = true;
                 break;
             case HID_REPORT_COUNT:
                 report_count = value;
@@ -308,87 +639,47 @@ std::unordered_map<ReportType, std::unordered_map<uint8_t, uint16_t>> parse_desc
                 break;
             }
             case HID_LOGICAL_MINIMUM:
-                logical_minimum = value;
-                if (logical_minimum & (1 << (item_size * 8 - 1))) {
-                    logical_minimum |= 0xFFFFFFFF << item_size * 8;
-                }
+                logical_minimum = sign_extend(value, item_size);
                 break;
             case HID_LOGICAL_MAXIMUM:
                 // XXX for 32-bit items unsigned_logical_maximum can still be negative
-                logical_maximum = unsigned_logical_maximum = value;
-                if (logical_maximum & (1 << (item_size * 8 - 1))) {
-                    logical_maximum |= 0xFFFFFFFF << item_size * 8;
-                }
+                unsigned_logical_maximum = value;
+                logical_maximum = sign_extend(value, item_size);
                 break;
         }
     }
 
-    for (auto& [report_type, rep_id_bitpos] : bitpos) {
-        for (auto& [report_id_, position] : rep_id_bitpos) {
-            position /= 8;  // final bit position becomes report size in bytes
-        }
+    // same usage in the same report: the first one wins
+    for (auto& usage_list : result.usages) {
+        std::stable_sort(usage_list.begin(), usage_list.end(), report_usage_less);
+        usage_list.erase(
+            std::unique(usage_list.begin(), usage_list.end(),
+                [](const report_usage_t& a, const report_usage_t& b) {
+                    return (a.report_id == b.report_id) && (a.usage == b.usage);
+                }),
+            usage_list.end());
     }
-
-    return bitpos;
 }
 
 void clear_descriptor_data(uint8_t dev_addr) {
     my_mutex_enter(MutexId::THEIR_USAGES);
 
-    for (auto it = their_usages.cbegin(); it != their_usages.cend();) {
-        uint16_t dev_addr_interface = it->first;
-        if (dev_addr_interface >> 8 == dev_addr) {
-            has_report_id_theirs.erase(dev_addr_interface);
+    auto search = devices.find(dev_addr);
+    if (search != devices.end()) {
+        device_data_t& device = search->second;
+        for (uint16_t dev_addr_interface : device.interfaces) {
+            remove_out_reports(dev_addr_interface, their_descriptors[dev_addr_interface]);
 
             uint8_t index = interface_index[dev_addr_interface];
             interface_index.erase(dev_addr_interface);
-            interface_index_in_use &= ~(1 << index);
-
-            it = their_usages.erase(it);
-        } else {
-            it++;
-        }
-    }
-
-    for (auto it = their_feature_usages.cbegin(); it != their_feature_usages.cend();) {
-        uint16_t dev_addr_interface = it->first;
-        if (dev_addr_interface >> 8 == dev_addr) {
-            it = their_feature_usages.erase(it);
-        } else {
-            it++;
-        }
-    }
+            interface_index_in_use[index / 32] &= ~(1 << (index % 32));
 
-    for (auto it = their_out_usages.cbegin(); it != their_out_usages.cend();) {
-        uint16_t dev_addr_interface = it->first;
-        if (dev_addr_interface >> 8 == dev_addr) {
-            it = their_out_usages.erase(it);
-        } else {
-            it++;
-        }
-    }
-
-    for (auto it = out_reports.cbegin(); it != out_reports.cend();) {
-        uint32_t dev_addr_int_rep_id = it->first;
-        if (dev_addr_int_rep_id >> 24 == dev_addr) {
-            out_report_sizes.erase(dev_addr_int_rep_id);
-            delete[] prev_out_reports[dev_addr_int_rep_id];
-            prev_out_reports.erase(dev_addr_int_rep_id);
-            delete[] out_reports[dev_addr_int_rep_id];
-            it = out_reports.erase(it);
-        } else {
-            it++;
-        }
-    }
-
-    for (auto& [usage, addr_int_rep_id_vector] : their_out_usages_flat) {
-        for (auto it = addr_int_rep_id_vector.cbegin(); it != addr_int_rep_id_vector.cend();) {
-            if ((*it) >> 24 == dev_addr) {
-                it = addr_int_rep_id_vector.erase(it);
-            } else {
-                it++;
-            }
+            release_cache_entry(dev_addr_interface);
+            their_descriptor_changes.push_back(dev_addr_interface);
+            their_descriptors.erase(dev_addr_interface);
         }
+        arena_release(device.arena);
+        devices.erase(search);
     }
 
     my_mutex_exit(MutexId::THEIR_USAGES);
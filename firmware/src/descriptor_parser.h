@@ -5,7 +5,8 @@
 
 #ifdef __cplusplus
 
-#include <unordered_map>
+#include <vector>
+#include "arena.h"
 #include "types.h"
 
 enum class ReportType : uint8_t {
@@ -14,13 +15,43 @@ enum class ReportType : uint8_t {
     FEATURE,
 };
 
-std::unordered_map<ReportType, std::unordered_map<uint8_t, uint16_t>> parse_descriptor(
-    std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>>& input_usage_map,
-    std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>>& output_usage_map,
-    std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>>& feature_usage_map,
-    bool& has_report_id,
-    const uint8_t* report_descriptor,
-    int len);
+#define NREPORT_TYPES 3
+
+struct report_usage_t {
+    uint8_t report_id;
+    uint32_t usage;
+    usage_def_t usage_def;
+};
+
+// sorted by report ID and usage
+typedef std::vector<report_usage_t> usage_list_t;
+
+struct report_bits_t {
+    ReportType report_type;
+    uint8_t report_id;
+    uint32_t bits;
+};
+
+// What the parser finds in a descriptor, before quirks are applied and it gets packed.
+struct descriptor_usages_t {
+    usage_list_t usages[NREPORT_TYPES];  // indexed by ReportType
+    std::vector<report_bits_t> report_bits;
+    bool has_report_id;
+    std::vector<uint32_t> usage_stack;  // parser's working space
+};
+
+void parse_descriptor(descriptor_usages_t& result, const uint8_t* report_descriptor, int len);
+void pack_descriptor(parsed_descriptor_t& result, arena_t& arena, const descriptor_usages_t& parsed);
+
+usage_def_t* find_usage(usage_list_t& usages, uint8_t report_id, uint32_t usage);
+usage_def_t& get_usage(usage_list_t& usages, uint8_t report_id, uint32_t usage);  // adds it if it isn't there
+void erase_usage(usage_list_t& usages, uint8_t report_id, uint32_t usage);
+
+const report_usages_t* find_report(const usage_table_t& table, uint8_t report_id);
+const usage_def_t* find_usage(const usage_table_t& table, uint8_t report_id, uint32_t usage);
+
+extern uint32_t descriptor_cache_hits;
+extern uint32_t descriptor_cache_misses;
 
 extern "C" {
 #endif
@@ -1,10 +1,7 @@
 #include "globals.h"
 
-std::unordered_map<uint16_t, std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>>> their_usages;
-std::unordered_map<uint16_t, std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>>> their_out_usages;
-std::unordered_map<uint16_t, std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>>> their_feature_usages;
-
-std::unordered_map<uint16_t, bool> has_report_id_theirs;
+std::unordered_map<uint16_t, parsed_descriptor_t> their_descriptors;
+std::vector<uint16_t> their_descriptor_changes;
 
 std::unordered_map<uint32_t, uint8_t*> out_reports;
 std::unordered_map<uint32_t, uint8_t*> prev_out_reports;
@@ -12,10 +9,11 @@ std::unordered_map<uint32_t, uint8_t> out_report_sizes;
 std::unordered_map<uint32_t, std::vector<uint32_t>> their_out_usages_flat;
 
 std::unordered_map<uint16_t, uint8_t> interface_index;
-uint32_t interface_index_in_use = 0;
+uint32_t interface_index_in_use[INTERFACE_INDEX_WORDS] = { 0 };
 
 std::vector<usage_rle_t> our_usages_rle;
 std::vector<usage_rle_t> their_usages_rle;
+uint32_t their_usages_generation = 0;
 
 volatile bool need_to_persist_config = false;
 volatile bool their_descriptor_updated = false;
@@ -30,6 +28,7 @@ uint64_t gpio_debounce_time = 5000;
 uint8_t our_descriptor_number = 0;
 bool ignore_auth_dev_inputs = false;
 uint8_t macro_entry_duration = 0;  // 0 means 1ms
+uint32_t macro_step_duration_us = 0;  // 0 means frame-based macro playback
 uint8_t gpio_output_mode = 0;
 bool normalize_gamepad_inputs = true;
 
@@ -37,10 +36,13 @@ std::vector<mapping_config11_t> config_mappings;
 
 uint8_t resolution_multiplier = 0;
 
-std::vector<std::vector<uint32_t>> macros[NMACROS];
+std::vector<uint32_t> macros[NMACROS];
 
 std::vector<expr_elem_t> expressions[NEXPRESSIONS];
 
+profile_t profiles[NPROFILES];
+uint8_t active_profile = 0;
+
 bool monitor_enabled = false;
 
 const our_descriptor_def_t* our_descriptor;
@@ -54,3 +56,5 @@ bool boot_protocol_keyboard = false;
 bool boot_protocol_updated = false;
 
 volatile PersistConfigReturnCode persist_config_return_code = PersistConfigReturnCode::UNKNOWN;
+volatile bool persist_in_progress = false;
+uint32_t persist_longest_stall_us = 0;
@@ -7,22 +7,26 @@
 #include "our_descriptor.h"
 #include "types.h"
 
-extern std::unordered_map<uint16_t, std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>>> their_usages;          // dev_addr+interface -> report_id -> usage -> usage_def
-extern std::unordered_map<uint16_t, std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>>> their_out_usages;      // dev_addr+interface -> report_id -> usage -> usage_def
-extern std::unordered_map<uint16_t, std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>>> their_feature_usages;  // dev_addr+interface -> report_id -> usage -> usage_def
-
-extern std::unordered_map<uint16_t, bool> has_report_id_theirs;  // dev_addr+interface -> bool
+extern std::unordered_map<uint16_t, parsed_descriptor_t> their_descriptors;  // dev_addr+interface -> packed usage tables
+extern std::vector<uint16_t> their_descriptor_changes;                      // dev_addr+interface added or removed since the derivates were updated
 
 extern std::unordered_map<uint32_t, uint8_t*> out_reports;                         // dev_addr+interface << 16 | report_id -> buffer
 extern std::unordered_map<uint32_t, uint8_t*> prev_out_reports;                    // dev_addr+interface << 16 | report_id -> buffer
 extern std::unordered_map<uint32_t, uint8_t> out_report_sizes;                     // dev_addr+interface << 16 | report_id -> size
 extern std::unordered_map<uint32_t, std::vector<uint32_t>> their_out_usages_flat;  // usage -> vector of dev_addr+interface << 16 | report_id
 
-extern std::unordered_map<uint16_t, uint8_t> interface_index;  // dev_addr+interface -> unique 0-31 integer
-extern uint32_t interface_index_in_use;                        // bit mask
+#ifndef INTERFACE_INDEX_WORDS
+#define INTERFACE_INDEX_WORDS 8
+#endif
+#define NINTERFACE_INDEXES (INTERFACE_INDEX_WORDS * 32)
+static_assert(NINTERFACE_INDEXES <= 256, "interface indexes have to fit in uint8_t");
+
+extern std::unordered_map<uint16_t, uint8_t> interface_index;     // dev_addr+interface -> unique 0-(NINTERFACE_INDEXES-1) integer
+extern uint32_t interface_index_in_use[INTERFACE_INDEX_WORDS];  // bit mask
 
 extern std::vector<usage_rle_t> our_usages_rle;
 extern std::vector<usage_rle_t> their_usages_rle;
+extern uint32_t their_usages_generation;  // incremented every time their_usages_rle changes
 
 extern volatile bool need_to_persist_config;
 extern volatile bool their_descriptor_updated;
@@ -37,6 +41,7 @@ extern uint64_t gpio_debounce_time;
 extern uint8_t our_descriptor_number;
 extern bool ignore_auth_dev_inputs;
 extern uint8_t macro_entry_duration;
+extern uint32_t macro_step_duration_us;
 extern uint8_t gpio_output_mode;
 extern bool normalize_gamepad_inputs;
 
@@ -46,11 +51,23 @@ extern uint8_t resolution_multiplier;
 
 #define NMACROS_8 8
 #define NMACROS 32
-extern std::vector<std::vector<uint32_t>> macros[NMACROS];
+// each entry's usages followed by a zero, same as in GET_MACRO/APPEND_TO_MACRO except there's also one after the last entry
+extern std::vector<uint32_t> macros[NMACROS];
 
 #define NEXPRESSIONS 8
 extern std::vector<expr_elem_t> expressions[NEXPRESSIONS];
 
+#define NPROFILES 4
+// The active profile lives in config_mappings, macros and expressions, the others are kept here
+// until they're switched to. Everything else in the config is shared by all profiles.
+struct profile_t {
+    std::vector<mapping_config11_t> mappings;
+    std::vector<uint32_t> macros[NMACROS];
+    std::vector<expr_elem_t> expressions[NEXPRESSIONS];
+};
+extern profile_t profiles[NPROFILES];
+extern uint8_t active_profile;
+
 extern bool monitor_enabled;
 
 extern const our_descriptor_def_t* our_descriptor;
@@ -68,5 +85,7 @@ extern bool boot_protocol_keyboard;
 extern bool boot_protocol_updated;
 
 extern volatile PersistConfigReturnCode persist_config_return_code;
+extern volatile bool persist_in_progress;  // a flash write was started and hasn't finished yet
+extern uint32_t persist_longest_stall_us;
 
 #endif
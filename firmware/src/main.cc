@@ -19,6 +19,7 @@
 
 #include "activity_led.h"
 #include "config.h"
+#include "config_log.h"
 #include "crc.h"
 #include "descriptor_parser.h"
 #include "globals.h"
@@ -40,6 +41,14 @@
 
 #define FLASH_CONFIG_IN_MEMORY (((uint8_t*) XIP_BASE) + CONFIG_OFFSET_IN_FLASH)
 
+// Configs are now persisted to a log right below where they used to be. The old location
+// is only read at boot, if there's nothing in the log yet.
+#define CONFIG_LOG_OFFSET_IN_FLASH (CONFIG_OFFSET_IN_FLASH - CONFIG_LOG_SIZE)
+#define CONFIG_LOG_IN_MEMORY (((uint8_t*) XIP_BASE) + CONFIG_LOG_OFFSET_IN_FLASH)
+
+static_assert(CONFIG_LOG_PAGE_SIZE == FLASH_PAGE_SIZE, "config log page size has to match flash");
+static_assert(CONFIG_LOG_SECTOR_SIZE == FLASH_SECTOR_SIZE, "config log sector size has to match flash");
+
 #define ADC_USAGE_PAGE 0xFFF80000
 
 uint64_t next_print = 0;
@@ -182,17 +191,40 @@ bool read_adc() {
 }
 #endif
 
-void do_persist_config(uint8_t* buffer) {
+void config_log_erase_sector(uint32_t offset) {
+#if !PICO_COPY_TO_RAM
+    uint32_t ints = save_and_disable_interrupts();
+#endif
+    flash_range_erase(CONFIG_LOG_OFFSET_IN_FLASH + offset, CONFIG_LOG_SECTOR_SIZE);
+#if !PICO_COPY_TO_RAM
+    restore_interrupts(ints);
+#endif
+}
+
+void config_log_program_page(uint32_t offset, const uint8_t* data) {
 #if !PICO_COPY_TO_RAM
     uint32_t ints = save_and_disable_interrupts();
 #endif
-    flash_range_erase(CONFIG_OFFSET_IN_FLASH, PERSISTED_CONFIG_SIZE);
-    flash_range_program(CONFIG_OFFSET_IN_FLASH, buffer, PERSISTED_CONFIG_SIZE);
+    flash_range_program(CONFIG_LOG_OFFSET_IN_FLASH + offset, data, CONFIG_LOG_PAGE_SIZE);
 #if !PICO_COPY_TO_RAM
     restore_interrupts(ints);
 #endif
 }
 
+// The config is only rebuilt from the log temporarily, we don't keep a copy of it in RAM.
+void load_persisted_config() {
+    std::vector<uint8_t> buffer(PERSISTED_CONFIG_SIZE);
+    if (config_log_load(CONFIG_LOG_IN_MEMORY, buffer.data())) {
+        load_config(buffer.data());
+    } else {
+        load_config(FLASH_CONFIG_IN_MEMORY);
+    }
+}
+
+void do_persist_config(uint8_t* buffer) {
+    config_log_persist(buffer);
+}
+
 void reset_to_bootloader() {
     reset_usb_boot(0, 0);
 }
@@ -241,14 +273,18 @@ int main() {
     adc_pins_init();
 #endif
     tick_init();
-    load_config(FLASH_CONFIG_IN_MEMORY);
+    load_persisted_config();
     our_descriptor = &our_descriptors[our_descriptor_number];
     parse_our_descriptor();
-    set_mapping_from_config();
     board_init();
     extra_init();
     tusb_init();
     stdio_init_all();
+    // Compiling the mappings can take a while with large configs. Doing it after we've
+    // connected means it happens while the host is still debouncing the attach (which
+    // takes at least 100ms), instead of delaying it. Nothing is processed before the
+    // main loop anyway.
+    set_mapping_from_config();
 
     tud_sof_isr_set(sof_handler);
 
@@ -307,10 +343,7 @@ int main() {
             our_descriptor->main_loop_task();
         }
         send_out_report();
-        if (need_to_persist_config) {
-            persist_config_return_code = persist_config();
-            need_to_persist_config = false;
-        }
+        persist_config_maybe();
 
         print_stats_maybe();
 
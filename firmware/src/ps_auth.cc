@@ -2,6 +2,7 @@
 #include <cstdlib>
 #include <cstring>
 
+#include "descriptor_parser.h"
 #include "globals.h"
 #include "ps_auth.h"
 #include "remapper.h"
@@ -40,12 +41,21 @@ static const uint8_t output_0x03[] = {
 
 static const uint8_t output_0xf3[] = { 0x0, 0x38, 0x38, 0, 0, 0, 0 };
 
+static bool has_feature_report(uint16_t interface, uint8_t report_id) {
+    auto search = their_descriptors.find(interface);
+    if (search == their_descriptors.end()) {
+        return false;
+    }
+    const report_usages_t* report = find_report(search->second.feature, report_id);
+    return (report != NULL) && (report->count > 0);
+}
+
 void ps4_device_connected(uint16_t interface, uint16_t vid, uint16_t pid) {
-    if (their_feature_usages[interface].count(0x03) &&
-        their_feature_usages[interface].count(0xF0) &&
-        their_feature_usages[interface].count(0xF1) &&
-        their_feature_usages[interface].count(0xF2) &&
-        their_feature_usages[interface].count(0xF3)) {
+    if (has_feature_report(interface, 0x03) &&
+        has_feature_report(interface, 0xF0) &&
+        has_feature_report(interface, 0xF1) &&
+        has_feature_report(interface, 0xF2) &&
+        has_feature_report(interface, 0xF3)) {
         printf("ps auth candidate detected\n");
         if (auth_dev == 0) {
             auth_dev = interface;
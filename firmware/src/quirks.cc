@@ -1,6 +1,10 @@
 #include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "constants.h"
+#include "crc.h"
 #include "globals.h"
 #include "platform.h"
 #include "quirks.h"
@@ -851,187 +855,213 @@ uint32_t xbox_mapping7[][2] = {
     { 0x0009000d, 0x00090011 },
 };
 
-void gamepad_normalize(std::unordered_map<uint32_t, usage_def_t>& current_map, uint32_t mapping[][2], uint16_t nentries) {
-    auto new_map = current_map;
+void gamepad_normalize(usage_list_t& usages, uint8_t report_id, uint32_t mapping[][2], uint16_t nentries) {
+    std::vector<usage_def_t> sources(nentries);
 
     for (uint16_t i = 0; i < nentries; i++) {
-        new_map.erase(mapping[i][1]);
+        usage_def_t* source = find_usage(usages, report_id, mapping[i][1]);
+        if (source != NULL) {
+            sources[i] = *source;
+        }
+    }
+    for (uint16_t i = 0; i < nentries; i++) {
+        erase_usage(usages, report_id, mapping[i][1]);
     }
     for (uint16_t i = 0; i < nentries; i++) {
-        new_map[mapping[i][0]] = current_map[mapping[i][1]];
+        get_usage(usages, report_id, mapping[i][0]) = sources[i];
     }
+}
+
+static void set_button(usage_list_t& usages, uint8_t report_id, uint32_t usage, uint16_t bitpos) {
+    get_usage(usages, report_id, usage) = (usage_def_t){
+        .report_id = report_id,
+        .size = 1,
+        .bitpos = bitpos,
+        .is_relative = false,
+        .logical_minimum = 0,
+    };
+}
+
+// Button Fn1 is described as a constant (padding) in the descriptor.
+// We add it as button 6.
+static void elecom_fn1_quirk(usage_list_t& usages) {
+    set_button(usages, 1, 0x00090006, 5);
+}
+
+// Buttons Fn1, Fn2, Fn3 are described as constants (padding) in the descriptor
+// (or don't work because Usage Maximum=5 when it should be 8).
+// We add them as buttons 6, 7, 8.
+static void elecom_fn123_quirk(usage_list_t& usages) {
+    set_button(usages, 1, 0x00090006, 5);
+    set_button(usages, 1, 0x00090007, 6);
+    set_button(usages, 1, 0x00090008, 7);
+}
+
+// Top left and top right buttons use vendor-specific usages.
+// They can be remapped as is, but we also add them as buttons 3 and 4.
+static void kensington_slimblade_quirk(usage_list_t& usages) {
+    set_button(usages, 0, 0x00090003, 32);
+    set_button(usages, 0, 0x00090004, 33);
+}
+
+// Buttons 2-4 don't work because Usage Maximum=1 when it should be 4
+static void ch_products_dt225_quirk(usage_list_t& usages) {
+    set_button(usages, 0, 0x00090002, 1);
+    set_button(usages, 0, 0x00090003, 2);
+    set_button(usages, 0, 0x00090004, 3);
+}
 
-    current_map = new_map;
+// SpaceMouse says its usages are relative, but they're not.
+static void spacemouse_quirk(usage_list_t& usages) {
+    get_usage(usages, 1, 0x00010030).is_relative = false;
+    get_usage(usages, 1, 0x00010031).is_relative = false;
+    get_usage(usages, 1, 0x00010032).is_relative = false;
+    get_usage(usages, 2, 0x00010033).is_relative = false;
+    get_usage(usages, 2, 0x00010034).is_relative = false;
+    get_usage(usages, 2, 0x00010035).is_relative = false;
 }
 
-void apply_quirks(uint16_t vendor_id, uint16_t product_id, std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>>& usage_map, const uint8_t* report_descriptor, int len, uint8_t itf_num) {
-    // Button Fn1 is described as a constant (padding) in the descriptor.
-    // We add it as button 6.
-    if (vendor_id == VENDOR_ID_ELECOM &&
-        (product_id == PRODUCT_ID_ELECOM_M_XT3URBK ||
-            product_id == PRODUCT_ID_ELECOM_M_XT3DRBK ||
-            product_id == PRODUCT_ID_ELECOM_M_XT4DRBK) &&
-        len == sizeof(elecom_huge_descriptor) &&
-        !memcmp(report_descriptor, elecom_huge_descriptor, len)) {
-        usage_map[1][0x00090006] = (usage_def_t){
-            .report_id = 1,
-            .size = 1,
-            .bitpos = 5,
-            .is_relative = false,
-            .logical_minimum = 0,
-        };
+struct builtin_quirk_t {
+    uint16_t vendor_id;
+    uint16_t product_id;
+    const uint8_t* descriptor;
+    uint16_t len;
+    void (*apply)(usage_list_t& usages);
+};
+
+#define BUILTIN_QUIRK(vid, pid, descriptor, apply) \
+    { vid, pid, descriptor, sizeof(descriptor), apply }
+
+static const builtin_quirk_t builtin_quirks[] = {
+    BUILTIN_QUIRK(VENDOR_ID_ELECOM, PRODUCT_ID_ELECOM_M_XT3URBK, elecom_huge_descriptor, elecom_fn1_quirk),
+    BUILTIN_QUIRK(VENDOR_ID_ELECOM, PRODUCT_ID_ELECOM_M_XT3DRBK, elecom_huge_descriptor, elecom_fn1_quirk),
+    BUILTIN_QUIRK(VENDOR_ID_ELECOM, PRODUCT_ID_ELECOM_M_XT4DRBK, elecom_huge_descriptor, elecom_fn1_quirk),
+    BUILTIN_QUIRK(VENDOR_ID_ELECOM, PRODUCT_ID_ELECOM_M_DT1URBK, elecom_huge_descriptor, elecom_fn123_quirk),
+    BUILTIN_QUIRK(VENDOR_ID_ELECOM, PRODUCT_ID_ELECOM_M_DT1DRBK, elecom_huge_descriptor, elecom_fn123_quirk),
+    BUILTIN_QUIRK(VENDOR_ID_ELECOM, PRODUCT_ID_ELECOM_M_HT1URBK, elecom_huge_descriptor, elecom_fn123_quirk),
+    BUILTIN_QUIRK(VENDOR_ID_ELECOM, PRODUCT_ID_ELECOM_M_HT1DRBK_010D, elecom_huge_descriptor, elecom_fn123_quirk),
+    BUILTIN_QUIRK(VENDOR_ID_ELECOM, PRODUCT_ID_ELECOM_M_HT1MRBK_01AA, elecom_huge_plus_01aa_descriptor, elecom_fn123_quirk),
+    BUILTIN_QUIRK(VENDOR_ID_ELECOM, PRODUCT_ID_ELECOM_M_HT1MRBK_01AB, elecom_huge_plus_01ab_descriptor, elecom_fn123_quirk),
+    BUILTIN_QUIRK(VENDOR_ID_ELECOM, PRODUCT_ID_ELECOM_M_HT1DRBK_011C, elecom_huge_descriptor2, elecom_fn123_quirk),
+    BUILTIN_QUIRK(VENDOR_ID_KENSINGTON, PRODUCT_ID_KENSINGTON_SLIMBLADE, kensington_slimblade_descriptor, kensington_slimblade_quirk),
+    BUILTIN_QUIRK(VENDOR_ID_CH_PRODUCTS, PRODUCT_ID_CH_PRODUCTS_DT225, ch_products_dt225_descriptor, ch_products_dt225_quirk),
+    BUILTIN_QUIRK(VENDOR_ID_3DCONNEXION, PRODUCT_ID_3DCONNEXION_SPACEMOUSE_COMPACT, spacemouse_compact_descriptor, spacemouse_quirk),
+    BUILTIN_QUIRK(VENDOR_ID_3DCONNEXION, PRODUCT_ID_3DCONNEXION_SPACEMOUSE_PRO, spacemouse_pro_descriptor, spacemouse_quirk),
+};
+
+// CRC32 of the descriptor << 32 | VID << 16 | PID -> index in builtin_quirks
+static std::unordered_map<uint64_t, uint8_t> builtin_quirks_index;
+// VID << 32 | PID << 16 | descriptor length, so that we only compute the CRC when it has a chance of matching
+static std::unordered_set<uint64_t> builtin_quirks_lengths;
+
+// VID << 32 | PID << 16 | interface -> indexes in quirks, including the ones that apply to all devices, in order
+static std::unordered_map<uint64_t, std::vector<uint16_t>> user_quirks_index;
+static std::vector<uint16_t> global_user_quirks;
+static bool user_quirks_index_valid = false;
+
+static uint64_t builtin_quirk_key(uint16_t vendor_id, uint16_t product_id, uint32_t crc) {
+    return ((uint64_t) crc << 32) | ((uint32_t) vendor_id << 16) | product_id;
+}
+
+static uint64_t builtin_quirk_length_key(uint16_t vendor_id, uint16_t product_id, uint16_t len) {
+    return ((uint64_t) vendor_id << 32) | ((uint32_t) product_id << 16) | len;
+}
+
+static void build_builtin_quirks_index() {
+    for (uint8_t i = 0; i < sizeof(builtin_quirks) / sizeof(builtin_quirks[0]); i++) {
+        const builtin_quirk_t& quirk = builtin_quirks[i];
+        builtin_quirks_index[builtin_quirk_key(quirk.vendor_id, quirk.product_id, crc32(quirk.descriptor, quirk.len))] = i;
+        builtin_quirks_lengths.insert(builtin_quirk_length_key(quirk.vendor_id, quirk.product_id, quirk.len));
     }
+}
 
-    // Buttons Fn1, Fn2, Fn3 are described as constants (padding) in the descriptor.
-    // We add them as buttons 6, 7, 8.
-    if (vendor_id == VENDOR_ID_ELECOM &&
-        (((product_id == PRODUCT_ID_ELECOM_M_DT1URBK ||
-              product_id == PRODUCT_ID_ELECOM_M_DT1DRBK ||
-              product_id == PRODUCT_ID_ELECOM_M_HT1URBK ||
-              product_id == PRODUCT_ID_ELECOM_M_HT1DRBK_010D) &&
-             len == sizeof(elecom_huge_descriptor) &&
-             !memcmp(report_descriptor, elecom_huge_descriptor, len)) ||
-            (product_id == PRODUCT_ID_ELECOM_M_HT1MRBK_01AA &&
-                len == sizeof(elecom_huge_plus_01aa_descriptor) &&
-                !memcmp(report_descriptor, elecom_huge_plus_01aa_descriptor, len)) ||
-            (product_id == PRODUCT_ID_ELECOM_M_HT1MRBK_01AB &&
-                len == sizeof(elecom_huge_plus_01ab_descriptor) &&
-                !memcmp(report_descriptor, elecom_huge_plus_01ab_descriptor, len)))) {
-        usage_map[1][0x00090006] = (usage_def_t){
-            .report_id = 1,
-            .size = 1,
-            .bitpos = 5,
-            .is_relative = false,
-            .logical_minimum = 0,
-        };
-        usage_map[1][0x00090007] = (usage_def_t){
-            .report_id = 1,
-            .size = 1,
-            .bitpos = 6,
-            .is_relative = false,
-            .logical_minimum = 0,
-        };
-        usage_map[1][0x00090008] = (usage_def_t){
-            .report_id = 1,
-            .size = 1,
-            .bitpos = 7,
-            .is_relative = false,
-            .logical_minimum = 0,
-        };
+static const builtin_quirk_t* find_builtin_quirk(uint16_t vendor_id, uint16_t product_id, const uint8_t* report_descriptor, int len) {
+    if (builtin_quirks_index.empty()) {
+        build_builtin_quirks_index();
+    }
+    if ((len > 0xFFFF) || (builtin_quirks_lengths.count(builtin_quirk_length_key(vendor_id, product_id, len)) == 0)) {
+        return NULL;
+    }
+    auto search = builtin_quirks_index.find(builtin_quirk_key(vendor_id, product_id, crc32(report_descriptor, len)));
+    if (search == builtin_quirks_index.end()) {
+        return NULL;
     }
+    const builtin_quirk_t* quirk = &builtin_quirks[search->second];
+    // CRC collisions are unlikely, but make sure it's really the same descriptor
+    if ((quirk->len != len) || memcmp(quirk->descriptor, report_descriptor, len)) {
+        return NULL;
+    }
+    return quirk;
+}
 
-    // Buttons Fn1, Fn2, Fn3 don't work because Usage Maximum=5 when it should be 8
-    if (vendor_id == VENDOR_ID_ELECOM &&
-        product_id == PRODUCT_ID_ELECOM_M_HT1DRBK_011C &&
-        len == sizeof(elecom_huge_descriptor2) &&
-        !memcmp(report_descriptor, elecom_huge_descriptor2, len)) {
-        usage_map[1][0x00090006] = (usage_def_t){
-            .report_id = 1,
-            .size = 1,
-            .bitpos = 5,
-            .is_relative = false,
-            .logical_minimum = 0,
-        };
-        usage_map[1][0x00090007] = (usage_def_t){
-            .report_id = 1,
-            .size = 1,
-            .bitpos = 6,
-            .is_relative = false,
-            .logical_minimum = 0,
-        };
-        usage_map[1][0x00090008] = (usage_def_t){
-            .report_id = 1,
-            .size = 1,
-            .bitpos = 7,
-            .is_relative = false,
-            .logical_minimum = 0,
-        };
+void invalidate_user_quirks_index() {
+    user_quirks_index_valid = false;
+}
+
+static uint64_t user_quirk_key(uint16_t vendor_id, uint16_t product_id, uint8_t itf_num) {
+    return ((uint64_t) vendor_id << 32) | ((uint64_t) product_id << 16) | itf_num;
+}
+
+// must be called with the QUIRKS mutex held
+static const std::vector<uint16_t>& find_user_quirks(uint16_t vendor_id, uint16_t product_id, uint8_t itf_num) {
+    if (!user_quirks_index_valid) {
+        user_quirks_index.clear();
+        global_user_quirks.clear();
+        for (uint16_t i = 0; i < quirks.size(); i++) {
+            if ((quirks[i].vendor_id == 0) && (quirks[i].product_id == 0)) {
+                global_user_quirks.push_back(i);
+                for (auto& [key, indexes] : user_quirks_index) {
+                    indexes.push_back(i);
+                }
+            } else {
+                uint64_t key = user_quirk_key(quirks[i].vendor_id, quirks[i].product_id, quirks[i].interface);
+                if (user_quirks_index.count(key) == 0) {
+                    user_quirks_index[key] = global_user_quirks;
+                }
+                user_quirks_index[key].push_back(i);
+            }
+        }
+        user_quirks_index_valid = true;
     }
 
-    // Top left and top right buttons use vendor-specific usages.
-    // They can be remapped as is, but we also add them as buttons 3 and 4.
-    if (vendor_id == VENDOR_ID_KENSINGTON &&
-        product_id == PRODUCT_ID_KENSINGTON_SLIMBLADE &&
-        len == sizeof(kensington_slimblade_descriptor) &&
-        !memcmp(report_descriptor, kensington_slimblade_descriptor, len)) {
-        usage_map[0][0x00090003] = (usage_def_t){
-            .report_id = 0,
-            .size = 1,
-            .bitpos = 32,
-            .is_relative = false,
-            .logical_minimum = 0,
-        };
-        usage_map[0][0x00090004] = (usage_def_t){
-            .report_id = 0,
-            .size = 1,
-            .bitpos = 33,
-            .is_relative = false,
-            .logical_minimum = 0,
-        };
+    auto search = user_quirks_index.find(user_quirk_key(vendor_id, product_id, itf_num));
+    if (search == user_quirks_index.end()) {
+        return global_user_quirks;
     }
+    return search->second;
+}
 
-    // Buttons 2-4 don't work because Usage Maximum=1 when it should be 4
-    if (vendor_id == VENDOR_ID_CH_PRODUCTS &&
-        product_id == PRODUCT_ID_CH_PRODUCTS_DT225 &&
-        len == sizeof(ch_products_dt225_descriptor) &&
-        !memcmp(report_descriptor, ch_products_dt225_descriptor, len)) {
-        usage_map[0][0x00090002] = (usage_def_t){
-            .report_id = 0,
-            .size = 1,
-            .bitpos = 1,
-            .is_relative = false,
-            .logical_minimum = 0,
-        };
-        usage_map[0][0x00090003] = (usage_def_t){
-            .report_id = 0,
-            .size = 1,
-            .bitpos = 2,
-            .is_relative = false,
-            .logical_minimum = 0,
-        };
-        usage_map[0][0x00090004] = (usage_def_t){
-            .report_id = 0,
-            .size = 1,
-            .bitpos = 3,
-            .is_relative = false,
-            .logical_minimum = 0,
-        };
+std::vector<quirk_t> matching_user_quirks(uint16_t vendor_id, uint16_t product_id, uint8_t itf_num) {
+    std::vector<quirk_t> ret;
+    my_mutex_enter(MutexId::QUIRKS);
+    for (uint16_t i : find_user_quirks(vendor_id, product_id, itf_num)) {
+        ret.push_back(quirks[i]);
     }
+    my_mutex_exit(MutexId::QUIRKS);
+    return ret;
+}
 
-    // SpaceMouse says its usages are relative, but they're not.
-    if (vendor_id == VENDOR_ID_3DCONNEXION &&
-        ((product_id == PRODUCT_ID_3DCONNEXION_SPACEMOUSE_COMPACT &&
-             len == sizeof(spacemouse_compact_descriptor) &&
-             !memcmp(report_descriptor, spacemouse_compact_descriptor, len)) ||
-            (product_id == PRODUCT_ID_3DCONNEXION_SPACEMOUSE_PRO &&
-                len == sizeof(spacemouse_pro_descriptor) &&
-                !memcmp(report_descriptor, spacemouse_pro_descriptor, len)))) {
-        usage_map[1][0x00010030].is_relative = false;
-        usage_map[1][0x00010031].is_relative = false;
-        usage_map[1][0x00010032].is_relative = false;
-        usage_map[2][0x00010033].is_relative = false;
-        usage_map[2][0x00010034].is_relative = false;
-        usage_map[2][0x00010035].is_relative = false;
+void apply_quirks(uint16_t vendor_id, uint16_t product_id, usage_list_t& usages, const uint8_t* report_descriptor, int len, uint8_t itf_num) {
+    const builtin_quirk_t* builtin_quirk = find_builtin_quirk(vendor_id, product_id, report_descriptor, len);
+    if (builtin_quirk != NULL) {
+        builtin_quirk->apply(usages);
     }
 
     // apply user-defined quirks
     my_mutex_enter(MutexId::QUIRKS);
-    for (uint16_t i = 0; i < quirks.size(); i++) {
+    for (uint16_t i : find_user_quirks(vendor_id, product_id, itf_num)) {
         quirk_t* quirk = &quirks[i];
-        if (((quirk->vendor_id == vendor_id) && (quirk->product_id == product_id) && (quirk->interface == itf_num)) ||
-            ((quirk->vendor_id == 0) && (quirk->product_id == 0))) {
-            uint8_t quirk_size = quirk->size_flags & QUIRK_SIZE_MASK;
-            if (quirk_size != 0) {
-                usage_map[quirk->report_id][quirk->usage] = (usage_def_t){
-                    .report_id = quirk->report_id,
-                    .size = quirk_size,
-                    .bitpos = quirk->bitpos,
-                    .is_relative = (quirk->size_flags & QUIRK_FLAG_RELATIVE_MASK) != 0,
-                    .logical_minimum = ((quirk->size_flags & QUIRK_FLAG_SIGNED_MASK) != 0) ? -1 : 0,
-                };
-            } else {
-                usage_map[quirk->report_id].erase(quirk->usage);
-            }
+        uint8_t quirk_size = quirk->size_flags & QUIRK_SIZE_MASK;
+        if (quirk_size != 0) {
+            get_usage(usages, quirk->report_id, quirk->usage) = (usage_def_t){
+                .report_id = quirk->report_id,
+                .size = quirk_size,
+                .bitpos = quirk->bitpos,
+                .is_relative = (quirk->size_flags & QUIRK_FLAG_RELATIVE_MASK) != 0,
+                .logical_minimum = ((quirk->size_flags & QUIRK_FLAG_SIGNED_MASK) != 0) ? -1 : 0,
+            };
+        } else {
+            erase_usage(usages, quirk->report_id, quirk->usage);
         }
     }
     my_mutex_exit(MutexId::QUIRKS);
@@ -1039,12 +1069,12 @@ void apply_quirks(uint16_t vendor_id, uint16_t product_id, std::unordered_map<ui
     if (normalize_gamepad_inputs) {
         if (vendor_id == VENDOR_ID_GOOGLE &&
             product_id == PRODUCT_ID_GOOGLE_STADIA_CONTROLLER) {
-            gamepad_normalize(usage_map[3], stadia_mapping, sizeof(stadia_mapping) / sizeof(stadia_mapping[0]));
+            gamepad_normalize(usages, 3, stadia_mapping, sizeof(stadia_mapping) / sizeof(stadia_mapping[0]));
         }
         if (vendor_id == VENDOR_ID_MICROSOFT &&
             product_id == PRODUCT_ID_MICROSOFT_XBOX_WIRELESS_CONTROLLER) {
-            gamepad_normalize(usage_map[32], xbox_mapping32, sizeof(xbox_mapping32) / sizeof(xbox_mapping32[0]));
-            gamepad_normalize(usage_map[7], xbox_mapping7, sizeof(xbox_mapping7) / sizeof(xbox_mapping7[0]));
+            gamepad_normalize(usages, 32, xbox_mapping32, sizeof(xbox_mapping32) / sizeof(xbox_mapping32[0]));
+            gamepad_normalize(usages, 7, xbox_mapping7, sizeof(xbox_mapping7) / sizeof(xbox_mapping7[0]));
         }
     }
 }
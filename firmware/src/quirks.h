@@ -2,9 +2,14 @@
 #define _QUIRKS_H_
 
 #include <stdint.h>
-#include <unordered_map>
-#include "types.h"
+#include <vector>
+#include "descriptor_parser.h"
 
-void apply_quirks(uint16_t vendor_id, uint16_t product_id, std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>>& usage_map, const uint8_t* report_descriptor, int len, uint8_t itf_num);
+void apply_quirks(uint16_t vendor_id, uint16_t product_id, usage_list_t& usages, const uint8_t* report_descriptor, int len, uint8_t itf_num);
+
+// user quirks that apply to a given interface, in the order they're applied
+std::vector<quirk_t> matching_user_quirks(uint16_t vendor_id, uint16_t product_id, uint8_t itf_num);
+// must be called (with the QUIRKS mutex held) whenever the quirks vector changes
+void invalidate_user_quirks_index();
 
 #endif
@@ -3,6 +3,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <map>
 #include <queue>
 #include <set>
 #include <unordered_map>
@@ -29,14 +30,28 @@ const uint32_t V_SCROLL_USAGE = 0x00010038;
 const uint32_t H_SCROLL_USAGE = 0x000C0238;
 
 const uint8_t NLAYERS = 4;
+// Layer tables are only precompiled while they fit in layer_tables_budget bytes. Layer
+// states that don't get one have their sources filtered on the fly.
+const uint32_t LAYER_TABLES_BUDGET = 16 * 1024;
+// Profiles that aren't active are kept compiled while they fit in precompiled_profiles_budget
+// bytes. The ones that don't are compiled when they're switched to.
+const uint32_t PRECOMPILED_PROFILES_BUDGET = 48 * 1024;
 const uint32_t LAYERS_USAGE_PAGE = 0xFFF10000;
 const uint32_t MACRO_USAGE_PAGE = 0xFFF20000;
 const uint32_t EXPR_USAGE_PAGE = 0xFFF30000;
 const uint32_t REGISTER_USAGE_PAGE = 0xFFF50000;
 const uint32_t MIDI_USAGE_PAGE = 0xFFF70000;
+const uint32_t PROFILE_USAGE_PAGE = 0xFFFA0000;
 
 const uint32_t ROLLOVER_USAGE = 0x00070001;
 
+const uint32_t KEYBOARD_USAGE_PAGE = 0x00070000;
+const uint32_t LEFT_CTRL_USAGE = 0x000700E0;
+const uint32_t RIGHT_GUI_USAGE = 0x000700E7;
+
+// same as the number of array slots in a boot protocol keyboard report
+const uint8_t MACRO_KEYS_PER_REPORT = 6;
+
 const uint16_t STACK_SIZE = 16;
 
 const uint8_t resolution_multiplier_masks[] = {
@@ -47,9 +62,22 @@ const uint8_t resolution_multiplier_masks[] = {
 std::vector<reverse_mapping_t> reverse_mapping;
 std::vector<reverse_mapping_t> reverse_mapping_macros;
 std::vector<reverse_mapping_t> reverse_mapping_layers;
-
-std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>> our_usages;  // report_id -> usage -> usage_def
-std::unordered_map<uint32_t, usage_def_t> our_usages_flat;
+std::vector<reverse_mapping_t> reverse_mapping_profiles;
+
+std::unordered_map<uint8_t, layer_table_t> layer_tables;  // layer_state_mask -> table
+uint32_t layer_tables_budget = LAYER_TABLES_BUDGET;       // tests set it to 0 to filter every layer state on the fly
+uint32_t layer_tables_bytes = 0;                          // how much of layer_tables_budget they take
+const layer_table_t* layer_table = NULL;                  // table for layer_table_mask, NULL if it didn't fit
+uint8_t layer_table_mask = 0;                             // 0 if layer_table needs to be looked up
+
+usage_table_t our_usages;
+arena_t our_usages_arena;
+
+// Our non-array usages get dense IDs when our descriptor is parsed, per-usage state is indexed by them.
+std::unordered_map<uint32_t, uint16_t> our_usage_ids;  // usage -> our usage ID
+std::vector<const usage_def_t*> our_usage_defs;        // our usage ID -> usage definition in our_usages
+std::vector<uint16_t> our_relative_usage_ids;
+const usage_def_t dpad_direction_usage_def = {};       // dpad directions aren't real fields in our reports
 bool have_dpad = false;
 usage_def_t our_dpad_usage;  // only valid if have_dpad is true
 
@@ -57,6 +85,34 @@ std::unordered_map<uint16_t, std::unordered_map<uint8_t, std::vector<usage_usage
 std::unordered_map<uint16_t, std::unordered_map<uint8_t, std::vector<int32_t*>>> array_range_usages;          // dev_addr+interface -> report_id -> input_state ptr vector
 std::unordered_map<uint16_t, std::unordered_map<uint8_t, std::vector<usage_def_t>>> rollover_usages;          // dev_addr+interface -> report_id -> usage_def vector
 
+// What each interface contributed to the derived tables, so that it can be taken out again when it goes away
+// without looking at the other interfaces.
+struct interface_derivates_t {
+    std::vector<uint16_t> relative_slots;
+    std::vector<uint16_t> binary_slots;
+    std::vector<uint16_t> live_slots;
+    std::vector<uint64_t> usage_ranges;  // usage << 32 | usage_maximum
+    std::vector<uint32_t> out_usages;
+};
+
+std::unordered_map<uint16_t, interface_derivates_t> interface_derivates;  // dev_addr+interface -> ...
+std::unordered_map<uint16_t, uint16_t> relative_slot_refs;                // input state slot -> number of interfaces
+std::unordered_map<uint16_t, uint16_t> binary_slot_refs;                  // input state slot -> number of interfaces
+std::unordered_map<uint16_t, uint16_t> live_slot_refs;                    // input state slot -> number of interfaces
+std::map<uint64_t, uint16_t> their_usage_ranges;                          // usage << 32 | usage_maximum -> number of interfaces
+std::vector<std::vector<map_source_t*>> slot_sources;                     // input state slot -> mapping sources reading it
+bool all_interfaces_dirty = true;                                         // derive everything, not just their_descriptor_changes
+uint16_t layer_tables_ports_mask = 0;                                     // active_ports_mask the layer tables were built with
+
+// What the mappings were last compiled from, so that small changes can be patched in, see patch_mappings().
+std::vector<mapping_config11_t> compiled_mappings;
+std::vector<expr_elem_t> compiled_expressions[NEXPRESSIONS];
+uint8_t compiled_passthrough_layer_mask = 0;
+uint32_t compiled_macros_gpio_out_mask = 0;
+std::unordered_map<uint32_t, uint8_t> mapped_on_layers;  // usage -> layer mask
+bool all_mappings_dirty = true;                          // compile everything from scratch on the next rebuild
+std::unordered_set<uint16_t> unreferenced_slots;         // input state slots that patches left without a source
+
 std::vector<sticky_usage_t> sticky_usages;
 std::vector<tap_hold_sticky_usage_t> tap_sticky_usages;
 std::vector<tap_hold_sticky_usage_t> hold_sticky_usages;
@@ -88,7 +144,27 @@ uint8_t sticky_state[MAX_INPUT_STATES];                  // state per layer (mas
 std::unordered_map<uint64_t, int32_t*> usage_state_ptr;  // usage -> input_state pointer
 uint32_t used_state_slots = 0;
 
-std::unordered_map<uint32_t, int32_t> accumulated;  // usage -> relative movement, * 1000
+// Tap-hold and sticky logic only looks at input state slots that changed since the last frame.
+uint16_t watched_slot_index[MAX_INPUT_STATES];  // slot -> index into slot_watches + 1, 0 if not watched
+std::vector<slot_watch_t> slot_watches;
+uint32_t changed_slots[MAX_INPUT_STATES / 32];  // watched slots written to since last frame
+std::vector<int16_t> tap_hold_one_frame;        // tap-hold usages whose tap/prev_hold flags need updating in the next frame
+bool profile_sources_changed = false;           // a profile switch mapping's source was pressed, released or held this frame
+
+// Tap-hold deadlines live in a two-level timer wheel with 1024us ticks (64 ticks per level),
+// deadlines further out than that go in the overflow bucket.
+#define TIMER_TICK_SHIFT 10
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+#define TIMER_OVERFLOW_BUCKET (2 * TIMER_WHEEL_SIZE)
+int16_t timer_buckets[TIMER_OVERFLOW_BUCKET + 1];  // tap_hold_usages index of list head, -1 if empty
+uint64_t timer_tick = 0;                           // buckets up to this tick have been cascaded
+uint16_t armed_timers = 0;
+
+uint32_t live_slots[MAX_INPUT_STATES / 32];  // slots that a connected device provides state for
+
+std::vector<int32_t> accumulated;  // our usage ID -> relative movement, * 1000
 uint8_t layer_state_mask = 1;
 
 std::vector<int32_t*> relative_usages;  // input_state pointers
@@ -100,6 +176,11 @@ struct macro_entry_t {
 
 std::queue<macro_entry_t> macro_queue;
 
+// high-rate macro playback (macro_step_duration_us != 0)
+std::vector<uint32_t> macro_held;  // usages in the report currently being held
+uint8_t macro_held_modifiers = 0;
+uint64_t macro_next_step_at = 0;
+
 uint32_t reports_received;
 uint32_t reports_sent;
 uint32_t processing_time;
@@ -107,7 +188,18 @@ uint32_t processing_time;
 bool expression_valid[NEXPRESSIONS] = { false };
 
 std::unordered_map<uint32_t, int32_t> monitor_input_state;
-std::unordered_map<uint32_t, int32_t> injected_state;
+std::vector<int32_t> injected_state;  // our usage ID -> value
+std::vector<bool> injected;           // our usage ID -> has injected_state
+
+// Binary inputs have one bit per interface so that they stay on as long as any interface reports them.
+// Interfaces with index 31 and up share bit 31, which stays set as long as any of them holds the input.
+#define SHARED_INTERFACE_BIT 31
+struct shared_interface_bit_t {
+    std::unordered_set<uint64_t> held;               // key << 8 | interface index
+    std::unordered_map<uint32_t, uint16_t> holders;  // key -> number of interfaces holding it
+};
+shared_interface_bit_t shared_input_bits;    // keyed by input state slot
+shared_interface_bit_t shared_monitor_bits;  // keyed by usage
 uint8_t monitor_usages_queued = 0;
 monitor_report_t monitor_report[2] = { { .report_id = REPORT_ID_MONITOR }, { .report_id = REPORT_ID_MONITOR } };
 uint8_t monitor_report_idx = 0;
@@ -117,6 +209,60 @@ int32_t registers[NREGISTERS] = { 0 };
 std::vector<register_ptrs_t> register_ptrs;
 uint8_t port_register = 0;
 
+// Layer state, expressions and mappings that target registers are evaluated in dependency order
+// so that values propagate within a frame. Each of them is an evaluation unit.
+#define EVAL_LAYERS 0
+#define EVAL_EXPRESSION(i) (1 + (i))
+#define EVAL_REGISTER(i) (1 + NEXPRESSIONS + (i))
+#define NEVAL_UNITS (1 + NEXPRESSIONS + NREGISTERS)
+std::vector<uint8_t> eval_order;
+uint64_t eval_writes_registers = 0;                   // units after which register input states need updating
+std::vector<uint16_t> register_rev_maps[NREGISTERS];  // reverse_mapping indexes for each register target
+uint8_t eval_cycle_breaks = 0;                        // dependencies that see previous frame's value because of cycles
+
+uint32_t compiled_gpio_in_mask = 0;
+uint32_t compiled_gpio_out_mask = 0;
+uint32_t profiles_gpio_in_mask = 0;  // every profile's GPIO inputs, the buttons are wired the same whichever profile is active
+
+// Everything that's compiled from a profile's mappings, macros and expressions. The active profile's
+// is in the globals above, the other profiles keep theirs here and a switch trades places with them.
+// Input state slots are shared by all profiles, so held inputs, sticky and tap-hold state stay put.
+struct compiled_profile_t {
+    bool valid = false;
+    uint32_t bytes = 0;  // compiled_profile_bytes(), once it's valid
+    uint32_t layer_tables_generation = 0;
+    std::vector<reverse_mapping_t> reverse_mapping;
+    std::vector<reverse_mapping_t> reverse_mapping_macros;
+    std::vector<reverse_mapping_t> reverse_mapping_layers;
+    std::vector<reverse_mapping_t> reverse_mapping_profiles;
+    std::unordered_map<uint8_t, layer_table_t> layer_tables;
+    uint32_t layer_tables_bytes = 0;
+    std::vector<mapping_config11_t> compiled_mappings;
+    std::vector<expr_elem_t> compiled_expressions[NEXPRESSIONS];
+    uint8_t compiled_passthrough_layer_mask = 0;
+    uint32_t compiled_macros_gpio_out_mask = 0;
+    uint32_t compiled_gpio_in_mask = 0;
+    uint32_t compiled_gpio_out_mask = 0;
+    std::unordered_map<uint32_t, uint8_t> mapped_on_layers;
+    std::unordered_set<uint16_t> unreferenced_slots;
+    std::vector<sticky_usage_t> sticky_usages;
+    std::vector<tap_hold_sticky_usage_t> tap_sticky_usages;
+    std::vector<tap_hold_sticky_usage_t> hold_sticky_usages;
+    std::vector<tap_hold_usage_t> tap_hold_usages;
+    std::vector<uint16_t> watched_slot_index;  // up to used_state_slots at the time it was swapped out
+    std::vector<slot_watch_t> slot_watches;
+    bool expression_valid[NEXPRESSIONS] = { false };
+    std::vector<register_ptrs_t> register_ptrs;
+    std::vector<uint8_t> eval_order;
+    uint64_t eval_writes_registers = 0;
+    std::vector<uint16_t> register_rev_maps[NREGISTERS];
+    uint8_t eval_cycle_breaks = 0;
+};
+
+compiled_profile_t compiled_profiles[NPROFILES];                     // valid for the precompiled ones that aren't active
+uint32_t precompiled_profiles_budget = PRECOMPILED_PROFILES_BUDGET;  // tests set it to 0 to compile on every switch
+uint32_t layer_tables_generation = 0;                                // bumped when connected devices make layer tables stale
+
 uint64_t frame_counter = 0;
 
 #define HUB_PORT_NONE 255
@@ -156,6 +302,19 @@ inline int8_t get_bit(const uint8_t* data, int len, uint16_t bitpos) {
 }
 
 inline uint32_t get_bits(const uint8_t* data, int len, uint16_t bitpos, uint8_t size) {
+    int byte_no = bitpos / 8;
+    int bit_no = bitpos % 8;
+    int nbytes = (bit_no + size + 7) / 8;
+    if ((size <= 32) && (byte_no + nbytes <= len)) {
+        // the whole field is in the report, no matter how long the report is
+        uint64_t chunk = 0;
+        for (int i = 0; i < nbytes; i++) {
+            chunk |= (uint64_t) data[byte_no + i] << (i * 8);
+        }
+        return (chunk >> bit_no) & ((1ull << size) - 1);
+    }
+
+    // field runs past the end of the report, missing bits read as zeros
     uint32_t value = 0;
     for (int i = 0; i < size; i++) {
         value |= get_bit(data, len, bitpos + i) << i;
@@ -163,6 +322,40 @@ inline uint32_t get_bits(const uint8_t* data, int len, uint16_t bitpos, uint8_t
     return value;
 }
 
+inline void set_interface_bit(int32_t& state, uint8_t interface_idx, shared_interface_bit_t& shared, uint32_t key) {
+    if (interface_idx < SHARED_INTERFACE_BIT) {
+        state |= 1 << interface_idx;
+        return;
+    }
+    if (shared.held.insert(((uint64_t) key << 8) | interface_idx).second) {
+        shared.holders[key]++;
+    }
+    state |= 1 << SHARED_INTERFACE_BIT;
+}
+
+inline void clear_interface_bit(int32_t& state, uint8_t interface_idx, shared_interface_bit_t& shared, uint32_t key) {
+    if (interface_idx < SHARED_INTERFACE_BIT) {
+        state &= ~(1 << interface_idx);
+        return;
+    }
+    if (shared.held.erase(((uint64_t) key << 8) | interface_idx)) {
+        auto search = shared.holders.find(key);
+        if (--search->second == 0) {
+            shared.holders.erase(search);
+        }
+    }
+    if (!shared.holders.count(key)) {
+        state &= ~(1 << SHARED_INTERFACE_BIT);
+    }
+}
+
+inline bool get_interface_bit(int32_t state, uint8_t interface_idx, const shared_interface_bit_t& shared, uint32_t key) {
+    if (interface_idx < SHARED_INTERFACE_BIT) {
+        return (state >> interface_idx) & 1;
+    }
+    return shared.held.count(((uint64_t) key << 8) | interface_idx);
+}
+
 inline void put_bit(uint8_t* data, int len, uint16_t bitpos, uint8_t value) {
     int byte_no = bitpos / 8;
     int bit_no = bitpos % 8;
@@ -298,94 +491,1252 @@ bool is_expr_valid(uint8_t expr) {
                 if (on_stack < 3) {
                     return false;
                 }
-                on_stack -= 1;
-                break;
-            case Op::DEADZONE2:
-                if (on_stack < 4) {
+                on_stack -= 1;
+                break;
+            case Op::DEADZONE2:
+                if (on_stack < 4) {
+                    return false;
+                }
+                on_stack -= 2;
+                break;
+            default:
+                printf("unknown op in is_expr_valid()\n");
+                return false;
+        }
+    }
+    return true;
+}
+
+void validate_expressions() {
+    for (uint8_t i = 0; i < NEXPRESSIONS; i++) {
+        expression_valid[i] = is_expr_valid(i);
+        if (!expression_valid[i]) {
+            printf("Expression %d invalid.\n", i + 1);
+        }
+    }
+}
+
+void invalidate_expr_state_ptr_cache() {
+    for (uint8_t i = 0; i < NEXPRESSIONS; i++) {
+        for (auto& elem : expressions[i]) {
+            elem.state_ptr = NULL;
+        }
+    }
+}
+
+static inline const usage_def_t* find_our_usage(uint32_t usage) {
+    auto search = our_usage_ids.find(usage);
+    if (search != our_usage_ids.end()) {
+        return our_usage_defs[search->second];
+    }
+    return NULL;
+}
+
+// Returns the usage's input state, NULL if we ran out of slots.
+int32_t* assign_state_slot(uint32_t usage, uint8_t hub_port, bool raw) {
+    uint64_t key = (raw ? ((uint64_t) 1 << 40) : 0) | ((uint64_t) hub_port << 32) | usage;
+    auto search = usage_state_ptr.find(key);
+    if (search != usage_state_ptr.end()) {
+        return search->second;
+    }
+    if (used_state_slots >= MAX_INPUT_STATES) {
+        printf("out of input_state slots!");
+        return NULL;
+    }
+    int32_t* state_ptr = input_state + used_state_slots++;
+    usage_state_ptr.emplace(key, state_ptr);
+    return state_ptr;
+}
+
+inline int32_t* get_state_ptr(uint32_t usage, uint8_t hub_port, bool assign_if_absent = false, bool raw = false) {
+    uint64_t key = (raw ? ((uint64_t) 1 << 40) : 0) | ((uint64_t) hub_port << 32) | usage;
+    auto search = usage_state_ptr.find(key);
+    if (search != usage_state_ptr.end()) {
+        return search->second;
+    }
+
+    if (assign_if_absent) {
+        int32_t* state_ptr = assign_state_slot(usage, hub_port, raw);
+        if (state_ptr != NULL) {
+            // connected devices may have this usage, we have to look at all of them again
+            all_interfaces_dirty = true;
+            their_descriptor_updated = true;
+            return state_ptr;  // it's zero, but maybe someone wants to write to it
+        }
+    }
+
+    return NULL;
+}
+
+inline tap_hold_state_t* get_tap_hold_state_ptr(uint32_t usage, uint8_t hub_port, bool assign_if_absent = false) {
+    int32_t* state_ptr = get_state_ptr(usage, hub_port, assign_if_absent);
+    if (state_ptr != NULL) {
+        return tap_hold_state + (state_ptr - input_state);
+    }
+
+    return NULL;
+}
+
+inline uint8_t* get_sticky_state_ptr(uint32_t usage, uint8_t hub_port, bool assign_if_absent = false) {
+    int32_t* state_ptr = get_state_ptr(usage, hub_port, assign_if_absent);
+    if (state_ptr != NULL) {
+        return sticky_state + (state_ptr - input_state);
+    }
+
+    return NULL;
+}
+
+inline void mark_changed(const int32_t* state_ptr) {
+    uint16_t slot = state_ptr - input_state;
+    if (watched_slot_index[slot]) {
+        changed_slots[slot >> 5] |= 1 << (slot & 31);
+    }
+}
+
+static uint16_t watch_slot(const int32_t* state_ptr) {
+    uint16_t slot = state_ptr - input_state;
+    if (watched_slot_index[slot] == 0) {
+        slot_watches.push_back(slot_watch_t());
+        watched_slot_index[slot] = slot_watches.size();
+    }
+    return watched_slot_index[slot] - 1;
+}
+
+static void timer_link(int16_t idx) {
+    tap_hold_usage_t& tap_hold = tap_hold_usages[idx];
+    uint64_t tick = std::max(tap_hold.deadline >> TIMER_TICK_SHIFT, timer_tick);
+    int16_t bucket;
+    if (tick - timer_tick < TIMER_WHEEL_SIZE) {
+        bucket = tick & TIMER_WHEEL_MASK;
+    } else if ((tick >> TIMER_WHEEL_BITS) - (timer_tick >> TIMER_WHEEL_BITS) < TIMER_WHEEL_SIZE) {
+        bucket = TIMER_WHEEL_SIZE + ((tick >> TIMER_WHEEL_BITS) & TIMER_WHEEL_MASK);
+    } else {
+        bucket = TIMER_OVERFLOW_BUCKET;
+    }
+    tap_hold.timer_bucket = bucket;
+    tap_hold.timer_prev = -1;
+    tap_hold.timer_next = timer_buckets[bucket];
+    if (tap_hold.timer_next >= 0) {
+        tap_hold_usages[tap_hold.timer_next].timer_prev = idx;
+    }
+    timer_buckets[bucket] = idx;
+}
+
+static void timer_unlink(int16_t idx) {
+    tap_hold_usage_t& tap_hold = tap_hold_usages[idx];
+    if (tap_hold.timer_prev >= 0) {
+        tap_hold_usages[tap_hold.timer_prev].timer_next = tap_hold.timer_next;
+    } else {
+        timer_buckets[tap_hold.timer_bucket] = tap_hold.timer_next;
+    }
+    if (tap_hold.timer_next >= 0) {
+        tap_hold_usages[tap_hold.timer_next].timer_prev = tap_hold.timer_prev;
+    }
+    tap_hold.timer_bucket = -1;
+}
+
+static void timer_arm(int16_t idx, uint64_t deadline) {
+    if (tap_hold_usages[idx].timer_bucket >= 0) {
+        timer_unlink(idx);
+        armed_timers--;
+    }
+    tap_hold_usages[idx].deadline = deadline;
+    timer_link(idx);
+    armed_timers++;
+}
+
+static void timer_cancel(int16_t idx) {
+    if (tap_hold_usages[idx].timer_bucket >= 0) {
+        timer_unlink(idx);
+        armed_timers--;
+    }
+}
+
+// moves everything from the given bucket to where it belongs now
+static void timer_cascade(int16_t bucket) {
+    int16_t idx = timer_buckets[bucket];
+    timer_buckets[bucket] = -1;
+    while (idx >= 0) {
+        int16_t next = tap_hold_usages[idx].timer_next;
+        timer_link(idx);
+        idx = next;
+    }
+}
+
+static void timer_wheel_clear() {
+    memset(timer_buckets, 0xFF, sizeof(timer_buckets));
+    timer_tick = get_time() >> TIMER_TICK_SHIFT;
+    armed_timers = 0;
+}
+
+static inline void toggle_sticky(uint8_t* sticky_state, uint8_t layer_mask) {
+    if (layer_state_mask & layer_mask) {
+        *sticky_state ^= (layer_state_mask & layer_mask);
+    }
+}
+
+static void tap_hold_expired(int16_t idx) {
+    tap_hold_state_t* tap_hold_state = tap_hold_usages[idx].tap_hold_state;
+    tap_hold_state->prev_hold = tap_hold_state->hold;
+    tap_hold_state->hold = true;
+    tap_hold_one_frame.push_back(idx);
+
+    const slot_watch_t& watch = slot_watches[watched_slot_index[tap_hold_usages[idx].input_state - input_state] - 1];
+    profile_sources_changed |= watch.profile;
+    if (watch.hold_sticky >= 0) {
+        toggle_sticky(hold_sticky_usages[watch.hold_sticky].sticky_state, hold_sticky_usages[watch.hold_sticky].layer_mask);
+    }
+}
+
+// calls tap_hold_expired() for all deadlines that are <= now
+static void run_timers(uint64_t now) {
+    uint64_t now_tick = now >> TIMER_TICK_SHIFT;
+
+    if (armed_timers == 0) {
+        timer_tick = now_tick;
+        return;
+    }
+
+    if (now_tick - timer_tick >= TIMER_WHEEL_SIZE * TIMER_WHEEL_SIZE) {
+        // we haven't been here in a while (suspended?), just re-sort everything
+        timer_tick = now_tick;
+        for (int16_t bucket = 0; bucket <= TIMER_OVERFLOW_BUCKET; bucket++) {
+            timer_cascade(bucket);
+        }
+    }
+
+    while (true) {
+        int16_t idx = timer_buckets[timer_tick & TIMER_WHEEL_MASK];
+        while (idx >= 0) {
+            int16_t next = tap_hold_usages[idx].timer_next;
+            if (tap_hold_usages[idx].deadline <= now) {
+                timer_cancel(idx);
+                tap_hold_expired(idx);
+            }
+            idx = next;
+        }
+
+        if (timer_tick == now_tick) {
+            break;
+        }
+
+        timer_tick++;
+        if ((timer_tick & TIMER_WHEEL_MASK) == 0) {
+            timer_cascade(TIMER_WHEEL_SIZE + ((timer_tick >> TIMER_WHEEL_BITS) & TIMER_WHEEL_MASK));
+            if (((timer_tick >> TIMER_WHEEL_BITS) & TIMER_WHEEL_MASK) == 0) {
+                timer_cascade(TIMER_OVERFLOW_BUCKET);
+            }
+        }
+    }
+}
+
+static void watched_slot_pressed_or_released(uint16_t slot, bool pressed, uint64_t now) {
+    const slot_watch_t& watch = slot_watches[watched_slot_index[slot] - 1];
+    profile_sources_changed |= watch.profile;
+
+    if (pressed && (watch.sticky >= 0)) {
+        toggle_sticky(sticky_usages[watch.sticky].sticky_state, sticky_usages[watch.sticky].layer_mask);
+    }
+
+    if (watch.tap_hold < 0) {
+        return;
+    }
+
+    tap_hold_usage_t& tap_hold = tap_hold_usages[watch.tap_hold];
+    if (pressed) {
+        tap_hold.pressed_at = now;
+        timer_arm(watch.tap_hold, now + tap_hold_threshold);
+    } else {
+        timer_cancel(watch.tap_hold);
+        tap_hold.tap_hold_state->tap = (now - tap_hold.pressed_at < tap_hold_threshold);
+        tap_hold.tap_hold_state->prev_hold = tap_hold.tap_hold_state->hold;
+        tap_hold.tap_hold_state->hold = false;
+        tap_hold_one_frame.push_back(watch.tap_hold);
+        if (tap_hold.tap_hold_state->tap && (watch.tap_sticky >= 0)) {
+            toggle_sticky(tap_sticky_usages[watch.tap_sticky].sticky_state, tap_sticky_usages[watch.tap_sticky].layer_mask);
+        }
+    }
+}
+
+static void watched_slot_changed(uint16_t slot, uint64_t now) {
+    bool pressed = (input_state[slot] != 0);
+    if (pressed == (input_state[slot + PREV_STATE_OFFSET] != 0)) {
+        return;
+    }
+    watched_slot_pressed_or_released(slot, pressed, now);
+}
+
+// Expression results and register values are written during process_mapping(), after
+// changed_slots has been scanned and before the previous state is saved, so they fire
+// their watches right away instead of going through changed_slots.
+static inline void set_evaluated_state(int32_t* state_ptr, int32_t value, uint64_t now) {
+    int32_t prev_value = *state_ptr;
+    if (value == prev_value) {
+        return;
+    }
+    *state_ptr = value;
+    uint16_t slot = state_ptr - input_state;
+    if (watched_slot_index[slot] && ((value != 0) != (prev_value != 0))) {
+        watched_slot_pressed_or_released(slot, value != 0, now);
+    }
+}
+
+static inline bool is_internal_usage(uint32_t usage) {
+    // layers, macros, expressions, GPIO, registers, MIDI, ...
+    return (usage & 0xFFF00000) == 0xFFF00000;
+}
+
+// A source is live if something that can change its state is connected.
+static inline bool is_source_live(const map_source_t& map_source) {
+    if (map_source.sticky || is_internal_usage(map_source.usage)) {
+        return true;
+    }
+    uint16_t slot = map_source.input_state - input_state;
+    return live_slots[slot >> 5] & (1 << (slot & 31));
+}
+
+static inline bool is_source_active(const map_source_t& map_source, uint8_t layers) {
+    // sticky sources are in effect regardless of layer state
+    return (map_source.sticky || (map_source.layer_mask & layers)) &&
+           ((map_source.orig_source_port == 0) || (active_ports_mask & (1 << map_source.orig_source_port))) &&
+           is_source_live(map_source);
+}
+
+static inline bool is_macro_source_active(const map_source_t& map_source, uint8_t layers) {
+    return (map_source.layer_mask & layers) && is_source_live(map_source);
+}
+
+// Returns NULL if the table doesn't fit in what's left of layer_tables_budget.
+static const layer_table_t* get_layer_table(uint8_t layers) {
+    auto search = layer_tables.find(layers);
+    if (search != layer_tables.end()) {
+        return &search->second;
+    }
+
+    uint32_t nsources = 0;
+    uint32_t nrev_maps = 0;
+    for (auto const& rev_map : reverse_mapping) {
+        uint32_t rev_map_sources = 0;
+        for (auto const& map_source : rev_map.sources) {
+            rev_map_sources += is_source_active(map_source, layers);
+        }
+        nsources += rev_map_sources;
+        // register targets are handled in eval_order
+        if (((rev_map.target & 0xFFFF0000) != REGISTER_USAGE_PAGE) &&
+            ((rev_map_sources > 0) ||
+                ((rev_map.our_usage_id != NO_OUR_USAGE_ID) && injected[rev_map.our_usage_id]))) {
+            nrev_maps++;
+        }
+    }
+    uint32_t nmacro_sources = 0;
+    for (auto const& rev_map : reverse_mapping_macros) {
+        for (auto const& map_source : rev_map.sources) {
+            nmacro_sources += is_macro_source_active(map_source, layers);
+        }
+    }
+
+    uint32_t bytes = sizeof(layer_table_t) +
+                     (nsources + nmacro_sources) * sizeof(map_source_t*) +
+                     (nrev_maps + reverse_mapping.size() + 1 + reverse_mapping_macros.size() + 1) * sizeof(uint16_t);
+    if (layer_tables_bytes + bytes > layer_tables_budget) {
+        return NULL;
+    }
+    layer_tables_bytes += bytes;
+
+    layer_table_t& table = layer_tables[layers];
+    table.rev_maps.reserve(nrev_maps);
+    table.sources.reserve(nsources);
+    table.sources_start.reserve(reverse_mapping.size() + 1);
+    table.macro_sources.reserve(nmacro_sources);
+    table.macro_sources_start.reserve(reverse_mapping_macros.size() + 1);
+
+    for (uint16_t i = 0; i < reverse_mapping.size(); i++) {
+        reverse_mapping_t& rev_map = reverse_mapping[i];
+        table.sources_start.push_back(table.sources.size());
+        for (auto& map_source : rev_map.sources) {
+            if (is_source_active(map_source, layers)) {
+                table.sources.push_back(&map_source);
+            }
+        }
+        if (((rev_map.target & 0xFFFF0000) != REGISTER_USAGE_PAGE) &&
+            ((table.sources.size() > table.sources_start.back()) ||
+                ((rev_map.our_usage_id != NO_OUR_USAGE_ID) && injected[rev_map.our_usage_id]))) {
+            table.rev_maps.push_back(i);
+        }
+    }
+    table.sources_start.push_back(table.sources.size());
+
+    for (auto& rev_map : reverse_mapping_macros) {
+        table.macro_sources_start.push_back(table.macro_sources.size());
+        for (auto& map_source : rev_map.sources) {
+            if (is_macro_source_active(map_source, layers)) {
+                table.macro_sources.push_back(&map_source);
+            }
+        }
+    }
+    table.macro_sources_start.push_back(table.macro_sources.size());
+
+    return &table;
+}
+
+// Calls f for every source of a reverse_mapping entry that's in effect in the current layer
+// state. If the layer state didn't get a table, the sources are filtered on the fly.
+template <typename F>
+static inline void for_each_active_source(uint16_t rev_map_idx, F f) {
+    if (layer_table != NULL) {
+        for (uint16_t j = layer_table->sources_start[rev_map_idx]; j < layer_table->sources_start[rev_map_idx + 1]; j++) {
+            f(*layer_table->sources[j]);
+        }
+    } else {
+        for (auto& map_source : reverse_mapping[rev_map_idx].sources) {
+            if (is_source_active(map_source, layer_table_mask)) {
+                f(map_source);
+            }
+        }
+    }
+}
+
+template <typename F>
+static inline void for_each_active_macro_source(uint16_t rev_map_idx, F f) {
+    if (layer_table != NULL) {
+        for (uint16_t j = layer_table->macro_sources_start[rev_map_idx]; j < layer_table->macro_sources_start[rev_map_idx + 1]; j++) {
+            f(*layer_table->macro_sources[j]);
+        }
+    } else {
+        for (auto const& map_source : reverse_mapping_macros[rev_map_idx].sources) {
+            if (is_macro_source_active(map_source, layer_table_mask)) {
+                f(map_source);
+            }
+        }
+    }
+}
+
+// Precompiles tables for the layer states that layer mappings can produce, as long as they fit in layer_tables_budget.
+// Needs to be called when mappings change and when devices are connected or disconnected.
+static void build_layer_tables() {
+    layer_tables.clear();
+    layer_tables_bytes = 0;
+    layer_table = NULL;
+    layer_table_mask = 0;
+    layer_tables_ports_mask = active_ports_mask;
+
+    uint8_t reachable = 0;
+    for (auto const& rev_map : reverse_mapping_layers) {
+        uint16_t layer = rev_map.target & 0xFFFF;
+        if (layer < 8) {
+            reachable |= 1 << layer;
+        }
+    }
+
+    // layer 0 first, it's the one in effect most of the time
+    get_layer_table(1);
+    // enumerate non-empty subsets, until we run out of budget
+    for (uint8_t layers = reachable; layers != 0; layers = (layers - 1) & reachable) {
+        get_layer_table(layers);
+    }
+}
+
+static inline bool is_input_state_op(Op op) {
+    return (op == Op::INPUT_STATE) ||
+           (op == Op::INPUT_STATE_BINARY) ||
+           (op == Op::INPUT_STATE_FP32) ||
+           (op == Op::INPUT_STATE_SCALED);
+}
+
+// units whose output is needed to know the current state of a usage
+static uint64_t usage_dependencies(uint32_t usage, const uint64_t* register_writers) {
+    if ((usage & 0xFFFF0000) == EXPR_USAGE_PAGE) {
+        uint16_t expr = (usage & 0xFFFF) - 1;
+        if (expr < NEXPRESSIONS) {
+            return (uint64_t) 1 << EVAL_EXPRESSION(expr);
+        }
+    }
+    if ((usage & 0xFFFF0000) == REGISTER_USAGE_PAGE) {
+        uint16_t reg = (usage & 0xFFFF) - 1;
+        if (reg < NREGISTERS) {
+            return register_writers[reg];
+        }
+    }
+    return 0;
+}
+
+// Orders layers, expressions and register mappings so that each one runs after the ones it reads from.
+// Usages and register numbers are only known if they're pushed right before they're used. If they're
+// not, the expression is assumed to depend on everything that ran before it in the old fixed order
+// (layers, expressions by index, mappings). Dependency cycles are broken by running the unit that
+// comes first in the fixed order first, so it sees the previous frame's values of the rest of the cycle.
+// Register mappings depending on layer state is the preferred edge to break, as the layer state rarely
+// changes, while the register's value is what the rest of the cycle is waiting on.
+static void build_eval_order() {
+    uint64_t deps[NEVAL_UNITS] = { 0 };
+    uint64_t soft_deps[NEVAL_UNITS] = { 0 };
+    uint64_t register_writers[NREGISTERS] = { 0 };
+    uint64_t all_registers_writers = 0;  // expressions that store to registers not known in advance
+    uint64_t pending = 0;
+
+    for (uint8_t reg = 0; reg < NREGISTERS; reg++) {
+        register_rev_maps[reg].clear();
+    }
+    for (uint16_t i = 0; i < reverse_mapping.size(); i++) {
+        if ((reverse_mapping[i].target & 0xFFFF0000) == REGISTER_USAGE_PAGE) {
+            uint16_t reg = (reverse_mapping[i].target & 0xFFFF) - 1;
+            if (reg < NREGISTERS) {
+                register_rev_maps[reg].push_back(i);
+            }
+        }
+    }
+
+    pending |= (uint64_t) 1 << EVAL_LAYERS;
+    for (uint8_t i = 0; i < NEXPRESSIONS; i++) {
+        pending |= (uint64_t) 1 << EVAL_EXPRESSION(i);
+    }
+    for (uint8_t reg = 0; reg < NREGISTERS; reg++) {
+        if (!register_rev_maps[reg].empty()) {
+            pending |= (uint64_t) 1 << EVAL_REGISTER(reg);
+            register_writers[reg] |= (uint64_t) 1 << EVAL_REGISTER(reg);
+        }
+    }
+
+    for (uint8_t i = 0; i < NEXPRESSIONS; i++) {
+        if (!expression_valid[i]) {
+            continue;
+        }
+        for (size_t j = 1; j < expressions[i].size(); j++) {
+            const expr_elem_t& elem = expressions[i][j];
+            if (elem.op != Op::STORE) {
+                continue;
+            }
+            const expr_elem_t& prev = expressions[i][j - 1];
+            int32_t reg = (prev.op == Op::PUSH) ? (int32_t) prev.val / 1000 - 1 : -1;
+            if ((prev.op == Op::PUSH) && (reg >= 0) && (reg < NREGISTERS)) {
+                register_writers[reg] |= (uint64_t) 1 << EVAL_EXPRESSION(i);
+            } else if (prev.op != Op::PUSH) {
+                all_registers_writers |= (uint64_t) 1 << EVAL_EXPRESSION(i);
+            }
+        }
+    }
+    for (uint8_t reg = 0; reg < NREGISTERS; reg++) {
+        register_writers[reg] |= all_registers_writers;
+    }
+
+    eval_writes_registers = 0;
+    for (uint8_t reg = 0; reg < NREGISTERS; reg++) {
+        eval_writes_registers |= register_writers[reg];
+    }
+
+    for (auto const& rev_map : reverse_mapping_layers) {
+        for (auto const& map_source : rev_map.sources) {
+            deps[EVAL_LAYERS] |= usage_dependencies(map_source.usage, register_writers);
+        }
+    }
+
+    for (uint8_t i = 0; i < NEXPRESSIONS; i++) {
+        if (!expression_valid[i]) {
+            continue;
+        }
+        uint8_t unit = EVAL_EXPRESSION(i);
+        bool unknown = false;
+        for (size_t j = 0; j < expressions[i].size(); j++) {
+            const expr_elem_t& elem = expressions[i][j];
+            bool pushed = (j > 0) && ((expressions[i][j - 1].op == Op::PUSH) || (expressions[i][j - 1].op == Op::PUSH_USAGE));
+            uint32_t arg = pushed ? expressions[i][j - 1].val : 0;
+            if (is_input_state_op(elem.op)) {
+                if (pushed) {
+                    deps[unit] |= usage_dependencies(arg, register_writers);
+                } else {
+                    unknown = true;
+                }
+            } else if (elem.op == Op::RECALL) {
+                int32_t reg = (int32_t) arg / 1000 - 1;
+                if (pushed && (reg >= 0) && (reg < NREGISTERS)) {
+                    deps[unit] |= register_writers[reg];
+                } else {
+                    unknown = true;
+                }
+            } else if (elem.op == Op::LAYER_STATE) {
+                deps[unit] |= (uint64_t) 1 << EVAL_LAYERS;
+            }
+        }
+        if (unknown) {
+            deps[unit] |= ((uint64_t) 1 << unit) - 1;
+        }
+    }
+
+    for (uint8_t reg = 0; reg < NREGISTERS; reg++) {
+        uint8_t unit = EVAL_REGISTER(reg);
+        if (register_rev_maps[reg].empty()) {
+            continue;
+        }
+        // mappings are filtered by layer state and have the last word on the register's value
+        soft_deps[unit] |= (uint64_t) 1 << EVAL_LAYERS;
+        deps[unit] |= register_writers[reg];
+        for (uint16_t rev_map_idx : register_rev_maps[reg]) {
+            for (auto const& map_source : reverse_mapping[rev_map_idx].sources) {
+                deps[unit] |= usage_dependencies(map_source.usage, register_writers);
+            }
+        }
+    }
+
+    eval_order.clear();
+    eval_cycle_breaks = 0;
+    while (pending) {
+        uint8_t next = NEVAL_UNITS;
+        for (uint8_t unit = 0; unit < NEVAL_UNITS; unit++) {
+            uint64_t unit_bit = (uint64_t) 1 << unit;
+            if ((pending & unit_bit) && (((deps[unit] | soft_deps[unit]) & pending & ~unit_bit) == 0)) {
+                next = unit;
+                break;
+            }
+        }
+        for (uint8_t unit = 0; (next == NEVAL_UNITS) && (unit < NEVAL_UNITS); unit++) {
+            uint64_t unit_bit = (uint64_t) 1 << unit;
+            if ((pending & unit_bit) && ((deps[unit] & pending & ~unit_bit) == 0)) {
+                next = unit;
+            }
+        }
+        if (next == NEVAL_UNITS) {
+            next = __builtin_ctzll(pending);
+            eval_cycle_breaks++;
+        }
+        eval_order.push_back(next);
+        pending &= ~((uint64_t) 1 << next);
+    }
+
+    if (eval_cycle_breaks > 0) {
+        printf("dependency cycle between layers, expressions and registers, some values will be one frame late\n");
+    }
+}
+
+// Inputs that are held when the mappings are rebuilt stay held afterwards, in whatever slots
+// their usages get this time, so that switching profiles (or changing the config) doesn't make
+// them look like they were just pressed. Sticky and tap-hold state is only kept when switching
+// profiles, see save_source_states(). Values that are only there because a mapping's default
+// value was written to its source aren't kept.
+static void save_held_inputs(std::vector<std::pair<uint64_t, int32_t>>& held_inputs) {
+    std::unordered_set<const int32_t*> at_default;
+    for (auto const* rev_maps : { &reverse_mapping, &reverse_mapping_macros, &reverse_mapping_layers, &reverse_mapping_profiles }) {
+        for (auto const& rev_map : *rev_maps) {
+            if (rev_map.default_value != 0) {
+                for (auto const& source : rev_map.sources) {
+                    if (*source.input_state == rev_map.default_value) {
+                        at_default.insert(source.input_state);
+                    }
+                }
+            }
+        }
+    }
+    for (auto const& [key, state_ptr] : usage_state_ptr) {
+        if ((*state_ptr != 0) && !at_default.count(state_ptr)) {
+            held_inputs.push_back({ key, *state_ptr });
+        }
+    }
+}
+
+static void restore_held_inputs(const std::vector<std::pair<uint64_t, int32_t>>& held_inputs) {
+    for (auto const& [key, value] : held_inputs) {
+        auto search = usage_state_ptr.find(key);
+        if (search != usage_state_ptr.end()) {
+            search->second[0] = value;
+            search->second[PREV_STATE_OFFSET] = value;
+        }
+    }
+}
+
+static inline uint16_t state_slot(const int32_t* state_ptr) {
+    return state_ptr - input_state;
+}
+
+struct source_state_t {
+    uint64_t key;  // usage_state_ptr key
+    uint8_t sticky_state;
+    bool hold;
+    bool timer_armed;
+    uint64_t pressed_at;
+};
+
+// When a profile switch has to compile everything from scratch, sticky and tap-hold state
+// follows its source to whatever slot it gets in the new profile's mappings. A key that
+// was latched stays latched and one that's being held down still becomes a tap or a hold.
+static void save_source_states(std::vector<source_state_t>& source_states) {
+    for (auto const& [key, state_ptr] : usage_state_ptr) {
+        uint16_t slot = state_slot(state_ptr);
+        source_state_t source_state = {
+            .key = key,
+            .sticky_state = sticky_state[slot],
+            .hold = tap_hold_state[slot].hold,
+            .timer_armed = false,
+            .pressed_at = 0,
+        };
+        int16_t tap_hold = watched_slot_index[slot] ? slot_watches[watched_slot_index[slot] - 1].tap_hold : -1;
+        if (tap_hold >= 0) {
+            source_state.timer_armed = (tap_hold_usages[tap_hold].timer_bucket >= 0);
+            source_state.pressed_at = tap_hold_usages[tap_hold].pressed_at;
+        }
+        if (source_state.sticky_state || source_state.hold || source_state.timer_armed) {
+            source_states.push_back(source_state);
+        }
+    }
+}
+
+// Hold edges that already happened don't happen again, taps that were in progress get their timers back.
+static void restore_source_states(const std::vector<source_state_t>& source_states) {
+    for (auto const& source_state : source_states) {
+        auto search = usage_state_ptr.find(source_state.key);
+        if (search == usage_state_ptr.end()) {
+            continue;
+        }
+        uint16_t slot = state_slot(search->second);
+        sticky_state[slot] = source_state.sticky_state;
+        tap_hold_state[slot].hold = source_state.hold;
+        tap_hold_state[slot].prev_hold = source_state.hold;
+        int16_t tap_hold = watched_slot_index[slot] ? slot_watches[watched_slot_index[slot] - 1].tap_hold : -1;
+        if (tap_hold >= 0) {
+            tap_hold_usages[tap_hold].pressed_at = source_state.pressed_at;
+            if (source_state.timer_armed) {
+                timer_arm(tap_hold, source_state.pressed_at + tap_hold_threshold);
+            }
+        }
+    }
+}
+
+static void link_source(map_source_t& map_source) {
+    bool have_state = (map_source.input_state != NULL);
+    uint16_t slot = have_state ? state_slot(map_source.input_state) : 0;
+    map_source.is_relative = have_state && (relative_slot_refs.count(slot) > 0);
+    map_source.is_binary = (have_state && (binary_slot_refs.count(slot) > 0) &&
+                               (map_source.usage != H_SCROLL_USAGE) &&
+                               !((map_source.usage >= 0x00010030) && (map_source.usage <= 0x00010039))) ||
+                           ((map_source.usage & 0xFFFF0000) == GPIO_USAGE_PAGE);
+}
+
+static void link_out_usages(reverse_mapping_t& rev_map) {
+    auto search = their_out_usages_flat.find(rev_map.target);
+    if (search != their_out_usages_flat.end()) {
+        rev_map.our_usages.clear();
+        for (auto dev_addr_int_rep_id : search->second) {
+            uint8_t hub_port = hub_ports[dev_addr_int_rep_id >> 24];
+            if ((rev_map.hub_port == 0) || (rev_map.hub_port == hub_port)) {
+                const usage_def_t* our_usage2 = find_usage(their_descriptors[dev_addr_int_rep_id >> 16].output, dev_addr_int_rep_id & 0xFFFF, rev_map.target);
+                rev_map.our_usages.push_back((out_usage_def_t){
+                    .data = out_reports[dev_addr_int_rep_id],
+                    .len = out_report_sizes[dev_addr_int_rep_id],
+                    .size = our_usage2->size,
+                    .bitpos = our_usage2->bitpos,
+                });
+            }
+        }
+    }
+}
+
+static inline uint8_t mapping_source_port(const mapping_config11_t& mapping) {
+    if (((mapping.source_usage & 0xFFFF0000) == EXPR_USAGE_PAGE) ||
+        ((mapping.source_usage & 0xFFFF0000) == REGISTER_USAGE_PAGE) ||
+        ((mapping.source_usage & 0xFFFF0000) == GPIO_USAGE_PAGE)) {
+        return 0;
+    }
+    return mapping.hub_ports & 0x0F;
+}
+
+// hub_port+target, what the sources of a mapping are grouped by
+static inline uint64_t mapping_target_key(const mapping_config11_t& mapping) {
+    return ((uint64_t) ((mapping.hub_ports >> 4) & 0x0F) << 32) | mapping.target_usage;
+}
+
+static uint8_t mapping_layer_mask(const mapping_config11_t& mapping) {
+    uint8_t layer_mask = mapping.layer_mask;
+    if ((mapping.target_usage & 0xFFFF0000) == LAYERS_USAGE_PAGE) {
+        uint16_t layer = mapping.target_usage & 0xFFFF;
+        if (mapping.flags & MAPPING_FLAG_STICKY) {
+            // sticky layer-triggering mappings are forces to NOT be present on the layer they trigger
+            layer_mask &= ~(1 << layer);
+        } else {
+            // non-sticky layer-triggering mappings are forced to BE present on the layer they trigger
+            layer_mask |= (1 << layer) & ((1 << NLAYERS) - 1);
+        }
+    }
+    return layer_mask;
+}
+
+// Calls f(usage, layer_mask) for every usage that the mapping makes count as mapped
+// for unmapped passthrough purposes.
+template <typename F>
+static void for_each_mapped_usage(const mapping_config11_t& mapping, uint8_t layer_mask, F f) {
+    if (((mapping.target_usage & 0xFFFF0000) == LAYERS_USAGE_PAGE) && (mapping.flags & MAPPING_FLAG_STICKY)) {
+        // sticky layer-triggering mappings aren't present on the layer they trigger, but we pretend they are
+        f(mapping.source_usage, (1 << (mapping.target_usage & 0xFFFF)) & ((1 << NLAYERS) - 1));
+    }
+    // if a usage appears in an expression, consider it mapped
+    uint16_t expr = (mapping.source_usage & 0xFFFF) - 1;
+    if (((mapping.source_usage & 0xFFFF0000) == EXPR_USAGE_PAGE) && (expr < NEXPRESSIONS)) {
+        for (auto const& elem : expressions[expr]) {
+            if (elem.op == Op::PUSH_USAGE) {
+                f(elem.val, layer_mask);
+            }
+        }
+    }
+    f(mapping.source_usage, layer_mask);  // usage mapped on any hub_port is considered to be mapped
+}
+
+// state_ptr is the source's input state, as assign_state_slot() returned it.
+static map_source_t mapping_source(const mapping_config11_t& mapping, uint8_t layer_mask, int32_t* state_ptr) {
+    return (map_source_t){
+        .usage = mapping.source_usage,
+        .scaling = mapping.scaling,
+        .sticky = (mapping.flags & MAPPING_FLAG_STICKY) != 0,
+        .tap = (mapping.flags & MAPPING_FLAG_TAP) != 0,
+        .hold = (mapping.flags & MAPPING_FLAG_HOLD) != 0,
+        .orig_source_port = (uint8_t) (mapping.hub_ports & 0x0F),
+        .layer_mask = layer_mask,
+        .input_state = state_ptr,
+        .tap_hold_state = tap_hold_state + (state_ptr - input_state),
+        .sticky_state = sticky_state + (state_ptr - input_state),
+    };
+}
+
+// Layers a usage is mapped on, without adding an entry for every usage that isn't.
+static inline uint8_t mapped_layers(uint32_t usage) {
+    auto search = mapped_on_layers.find(usage);
+    return (search != mapped_on_layers.end()) ? search->second : 0;
+}
+
+static bool add_passthrough_source(uint32_t usage, uint8_t unmapped_layers, std::vector<map_source_t>& sources) {
+    int32_t* state_ptr = assign_state_slot(usage, 0, false);
+    if (state_ptr == NULL) {
+        return false;
+    }
+    sources.push_back((map_source_t){
+        .usage = usage,
+        .layer_mask = unmapped_layers,
+        .input_state = state_ptr,
+    });
+    return true;
+}
+
+static uint32_t macros_gpio_out_mask() {
+    uint32_t mask = 0;
+    my_mutex_enter(MutexId::MACROS);
+    for (int macro = 0; macro < NMACROS; macro++) {
+        for (uint32_t usage : macros[macro]) {
+            if ((usage & 0xFFFF0000) == GPIO_USAGE_PAGE) {
+                uint16_t pin = usage & 0xFFFF;
+                mask |= 1 << pin;
+            }
+        }
+    }
+    my_mutex_exit(MutexId::MACROS);
+    return mask;
+}
+
+static std::vector<reverse_mapping_t>& reverse_mapping_for_target(uint32_t target) {
+    if ((target & 0xFFFF0000) == MACRO_USAGE_PAGE) {
+        return reverse_mapping_macros;
+    }
+    if ((target & 0xFFFF0000) == LAYERS_USAGE_PAGE) {
+        return reverse_mapping_layers;
+    }
+    if ((target & 0xFFFF0000) == PROFILE_USAGE_PAGE) {
+        return reverse_mapping_profiles;
+    }
+    return reverse_mapping;
+}
+
+static void write_default_value(const reverse_mapping_t& rev_map, bool keep_held) {
+    // Mappings with unplugged sources aren't executed, but this still helps with sources
+    // that are connected, but haven't sent anything yet (or never will, like MIDI and GPIO).
+    // A zero default is what the source has anyway. Writing it would also undo another
+    // target's default on a shared source, depending on which target got compiled last.
+    if (rev_map.default_value == 0) {
+        return;
+    }
+    for (auto const& source : rev_map.sources) {
+        if (!source.sticky && !source.tap && !source.hold && (source.scaling == 1000) &&
+            !(keep_held && (*(source.input_state) != 0))) {
+            *(source.input_state) = rev_map.default_value;
+        }
+    }
+}
+
+// Fills in everything about a target other than its sources. If keep_held is set, default
+// values are only written to sources whose input state is zero.
+static void compile_rev_map(reverse_mapping_t& rev_map, bool keep_held) {
+    uint32_t target = rev_map.target;
+    auto id_search = our_usage_ids.find(target);
+    if (id_search != our_usage_ids.end()) {
+        rev_map.our_usage_id = id_search->second;
+    }
+    if (our_descriptor->default_value != nullptr) {
+        rev_map.default_value = our_descriptor->default_value(target);
+        write_default_value(rev_map, keep_held);
+    }
+    if ((target == (DIGIPOT_USAGE_PAGE | 0)) ||
+        (target == (DIGIPOT_USAGE_PAGE | 1)) ||
+        (target == (DIGIPOT_USAGE_PAGE | 2)) ||
+        (target == (DIGIPOT_USAGE_PAGE | 3))) {
+        rev_map.default_value = 128;
+        write_default_value(rev_map, keep_held);
+    }
+    if ((target & 0xFFFF0000) == GPIO_USAGE_PAGE) {
+        rev_map.our_usages.push_back((out_usage_def_t){
+            .data = gpio_out_state,
+            .len = sizeof(gpio_out_state),
+            .size = 1,
+            .bitpos = (uint16_t) (target & 0xFFFF),
+        });
+    } else if ((target & 0xFFFF0000) == DIGIPOT_USAGE_PAGE) {
+        rev_map.our_usages.push_back((out_usage_def_t){
+            .data = (uint8_t*) digipot_state,
+            .len = sizeof(digipot_state),
+            .size = 9,
+            .bitpos = (uint16_t) ((target & 0xFFFF) * 16),
+        });
+    } else if ((target & 0xFFFF0000) == DPAD_USAGE_PAGE) {
+        rev_map.our_usages.push_back((out_usage_def_t){
+            .data = &dpad_state,
+            .len = sizeof(dpad_state),
+            .size = 1,
+            .bitpos = (uint16_t) (((target & 0xFFFF) - 1) & 0x03),
+        });
+    } else if ((target & 0xFFFF0000) == REGISTER_USAGE_PAGE) {
+        rev_map.our_usages.push_back((out_usage_def_t){
+            .data = (uint8_t*) registers,
+            .len = sizeof(registers),
+            .size = 8 * sizeof(registers[0]),
+            .bitpos = (uint16_t) (((target & 0xFFFF) - 1) * 8 * sizeof(registers[0])),
+        });
+    } else {
+        bool handled = false;
+        for (auto const& array_usage : our_array_range_usages) {
+            if ((target >= array_usage.usage) && (target <= array_usage.usage_def.usage_maximum)) {
+                rev_map.our_usages.push_back((out_usage_def_t){
+                    .data = reports[array_usage.usage_def.report_id],
+                    .len = report_sizes[array_usage.usage_def.report_id],
+                    .size = array_usage.usage_def.size,
+                    .bitpos = array_usage.usage_def.bitpos,
+                    .array_count = (uint8_t) array_usage.usage_def.count,
+                    .array_index = array_usage.usage_def.logical_minimum + target - array_usage.usage,
+                });
+                handled = true;
+                break;
+            }
+        }
+        if (!handled && (rev_map.our_usage_id != NO_OUR_USAGE_ID)) {
+            const usage_def_t& our_usage = *our_usage_defs[rev_map.our_usage_id];
+            rev_map.our_usages.push_back((out_usage_def_t){
+                .data = reports[our_usage.report_id],
+                .len = report_sizes[our_usage.report_id],
+                .size = our_usage.size,
+                .bitpos = our_usage.bitpos,
+            });
+            rev_map.is_relative = our_usage.is_relative;
+        }
+    }
+}
+
+static bool same_expressions() {
+    for (uint8_t i = 0; i < NEXPRESSIONS; i++) {
+        if (expressions[i].size() != compiled_expressions[i].size()) {
+            return false;
+        }
+        for (size_t j = 0; j < expressions[i].size(); j++) {
+            if ((expressions[i][j].op != compiled_expressions[i][j].op) ||
+                (expressions[i][j].val != compiled_expressions[i][j].val)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Mappings that only affect the sources of their own target (and the unmapped passthrough of their source).
+// Everything else feeds into things that are derived from all the mappings together.
+static bool can_patch_mapping(const mapping_config11_t& mapping) {
+    uint32_t target_page = mapping.target_usage & 0xFFFF0000;
+    uint32_t source_page = mapping.source_usage & 0xFFFF0000;
+    return (mapping.flags == 0) &&
+           (target_page != LAYERS_USAGE_PAGE) &&
+           (target_page != REGISTER_USAGE_PAGE) &&
+           (target_page != GPIO_USAGE_PAGE) &&
+           (target_page != PROFILE_USAGE_PAGE) &&
+           (source_page != EXPR_USAGE_PAGE) &&
+           (source_page != REGISTER_USAGE_PAGE) &&
+           (source_page != GPIO_USAGE_PAGE);
+}
+
+static void add_slot_source(map_source_t& map_source) {
+    uint16_t slot = state_slot(map_source.input_state);
+    if (slot >= slot_sources.size()) {
+        slot_sources.resize(slot + 1);
+    }
+    slot_sources[slot].push_back(&map_source);
+}
+
+// Calls f with the reverse_mapping of the active profile and of every precompiled one, they
+// all read from the same input state slots and need to be linked to what's connected.
+template <typename F>
+static void for_each_compiled_reverse_mapping(F f) {
+    f(reverse_mapping);
+    for (auto& compiled : compiled_profiles) {
+        if (compiled.valid) {
+            f(compiled.reverse_mapping);
+        }
+    }
+}
+
+static void rebuild_slot_sources() {
+    // indexed by slot, the vectors keep their capacity from one compile to the next
+    for (auto& sources : slot_sources) {
+        sources.clear();
+    }
+    slot_sources.resize(used_state_slots);
+    for_each_compiled_reverse_mapping([](std::vector<reverse_mapping_t>& rev_maps) {
+        for (auto& rev_map : rev_maps) {
+            for (auto& map_source : rev_map.sources) {
+                if (map_source.input_state != NULL) {
+                    add_slot_source(map_source);
+                }
+            }
+        }
+    });
+}
+
+static void unlink_sources(reverse_mapping_t& rev_map) {
+    for (auto& map_source : rev_map.sources) {
+        uint16_t slot = state_slot(map_source.input_state);
+        if (slot < slot_sources.size()) {
+            std::vector<map_source_t*>& sources = slot_sources[slot];
+            sources.erase(std::remove(sources.begin(), sources.end(), &map_source), sources.end());
+        }
+    }
+}
+
+#define MAX_PATCHED_MAPPINGS 32
+#define MAX_UNREFERENCED_SLOTS 64
+
+// Whether any mapping reads the input state slot. Expressions aren't looked at, a slot that only
+// an expression reads counts as unreferenced, which just makes the next full compile come sooner.
+static bool slot_has_sources(const int32_t* state_ptr) {
+    for (auto const* rev_maps : { &reverse_mapping, &reverse_mapping_macros, &reverse_mapping_layers, &reverse_mapping_profiles }) {
+        for (auto const& rev_map : *rev_maps) {
+            for (auto const& map_source : rev_map.sources) {
+                if (map_source.input_state == state_ptr) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// Recompiles only the targets whose mappings changed since the last time the mappings were compiled.
+// What changed is whatever lies between the common prefix and suffix of the old and new mappings, so
+// editing, adding or removing a mapping touches just its targets. Input state slots stay where they
+// are, so sources that are still mapped keep their state, including tap-hold and sticky state.
+// Slots that are no longer used aren't freed until everything is compiled from scratch, which
+// happens once there are MAX_UNREFERENCED_SLOTS of them. Returns false if the change can't be patched in.
+static bool patch_mappings() {
+    if (all_mappings_dirty ||
+        (unreferenced_slots.size() >= MAX_UNREFERENCED_SLOTS) ||
+        (unmapped_passthrough_layer_mask != compiled_passthrough_layer_mask) ||
+        (macros_gpio_out_mask() != compiled_macros_gpio_out_mask) ||
+        !same_expressions()) {
+        return false;
+    }
+
+    size_t old_size = compiled_mappings.size();
+    size_t new_size = config_mappings.size();
+    size_t prefix = 0;
+    while ((prefix < old_size) && (prefix < new_size) &&
+           !memcmp(&compiled_mappings[prefix], &config_mappings[prefix], sizeof(mapping_config11_t))) {
+        prefix++;
+    }
+    size_t suffix = 0;
+    while ((prefix + suffix < old_size) && (prefix + suffix < new_size) &&
+           !memcmp(&compiled_mappings[old_size - 1 - suffix], &config_mappings[new_size - 1 - suffix], sizeof(mapping_config11_t))) {
+        suffix++;
+    }
+    if ((prefix == old_size) && (prefix == new_size)) {
+        // nothing to do, like after switching to a precompiled profile
+        return true;
+    }
+    if ((old_size - prefix - suffix) + (new_size - prefix - suffix) > MAX_PATCHED_MAPPINGS) {
+        return false;
+    }
+
+    std::set<uint64_t> targets;  // hub_port+target
+    std::set<uint32_t> source_usages;
+    for (auto const* mappings : { &compiled_mappings, &config_mappings }) {
+        for (size_t i = prefix; i < mappings->size() - suffix; i++) {
+            const mapping_config11_t& mapping = (*mappings)[i];
+            if (!can_patch_mapping(mapping)) {
+                return false;
+            }
+            targets.insert(mapping_target_key(mapping));
+            source_usages.insert(mapping.source_usage);
+        }
+    }
+
+    // a source that's mapped on different layers now may also need its unmapped passthrough changed
+    std::unordered_map<uint32_t, uint8_t> new_mapped_on_layers;
+    for (auto const& mapping : config_mappings) {
+        for_each_mapped_usage(mapping, mapping_layer_mask(mapping), [&](uint32_t usage, uint8_t layers) {
+            if (source_usages.count(usage)) {
+                new_mapped_on_layers[usage] |= layers;
+            }
+        });
+    }
+    for (uint32_t usage : source_usages) {
+        if ((unmapped_passthrough_layer_mask & ~mapped_on_layers[usage]) !=
+            (unmapped_passthrough_layer_mask & ~new_mapped_on_layers[usage])) {
+            targets.insert(usage);
+        }
+    }
+
+    // Whether a slot is at its default value or actually held is ambiguous, we'd rather compile everything.
+    for (uint64_t hub_port_target : targets) {
+        uint32_t target = hub_port_target & 0xFFFFFFFF;
+        uint8_t hub_port = hub_port_target >> 32;
+        for (auto const& rev_map : reverse_mapping_for_target(target)) {
+            if ((rev_map.target == target) && (rev_map.hub_port == hub_port) && (rev_map.default_value != 0)) {
+                return false;
+            }
+        }
+    }
+
+    for (uint32_t usage : source_usages) {
+        mapped_on_layers[usage] = new_mapped_on_layers[usage];
+    }
+
+    uint32_t prev_used_state_slots = used_state_slots;
+
+    // what the changed targets read before, some of it may not be read by anything anymore
+    std::vector<const int32_t*> prev_slots;
+    for (uint64_t hub_port_target : targets) {
+        uint32_t target = hub_port_target & 0xFFFFFFFF;
+        uint8_t hub_port = hub_port_target >> 32;
+        for (auto const& rev_map : reverse_mapping_for_target(target)) {
+            if ((rev_map.target == target) && (rev_map.hub_port == hub_port)) {
+                for (auto const& map_source : rev_map.sources) {
+                    prev_slots.push_back(map_source.input_state);
+                }
+            }
+        }
+    }
+
+    for (uint64_t hub_port_target : targets) {
+        uint32_t target = hub_port_target & 0xFFFFFFFF;
+        uint8_t hub_port = hub_port_target >> 32;
+
+        // same sources, in the same order, as set_mapping_from_config() would give it
+        std::vector<map_source_t> sources;
+        for (auto const& mapping : config_mappings) {
+            if (mapping_target_key(mapping) == hub_port_target) {
+                int32_t* state_ptr = assign_state_slot(mapping.source_usage, mapping_source_port(mapping), false);
+                if (state_ptr == NULL) {
+                    return false;
+                }
+                sources.push_back(mapping_source(mapping, mapping_layer_mask(mapping), state_ptr));
+            }
+        }
+        uint8_t unmapped_layers = unmapped_passthrough_layer_mask & ~mapped_on_layers[target];
+        if ((hub_port == 0) && unmapped_layers) {
+            uint8_t passthrough_sources = our_usage_ids.count(target);
+            for (auto const& array_usage : our_array_range_usages) {
+                if ((target >= array_usage.usage) && (target <= array_usage.usage_def.usage_maximum)) {
+                    passthrough_sources++;
+                }
+            }
+            const usage_table_t& our_out_usages = their_descriptors[OUR_OUT_INTERFACE].input;
+            for (uint32_t i = 0; i < our_out_usages.nusages; i++) {
+                if (our_out_usages.usages[i].usage == target) {
+                    passthrough_sources++;
+                }
+            }
+            for (uint8_t i = 0; i < passthrough_sources; i++) {
+                if (!add_passthrough_source(target, unmapped_layers, sources)) {
                     return false;
                 }
-                on_stack -= 2;
-                break;
-            default:
-                printf("unknown op in is_expr_valid()\n");
-                return false;
+            }
         }
-    }
-    return true;
-}
 
-void validate_expressions() {
-    for (uint8_t i = 0; i < NEXPRESSIONS; i++) {
-        expression_valid[i] = is_expr_valid(i);
-        if (!expression_valid[i]) {
-            printf("Expression %d invalid.\n", i + 1);
+        std::vector<reverse_mapping_t>& rev_maps = reverse_mapping_for_target(target);
+        bool linked = (&rev_maps == &reverse_mapping);
+        auto search = std::find_if(rev_maps.begin(), rev_maps.end(), [&](const reverse_mapping_t& rev_map) {
+            return (rev_map.target == target) && (rev_map.hub_port == hub_port);
+        });
+        if ((search != rev_maps.end()) && linked) {
+            unlink_sources(*search);
         }
-    }
-}
 
-void invalidate_expr_state_ptr_cache() {
-    for (uint8_t i = 0; i < NEXPRESSIONS; i++) {
-        for (auto& elem : expressions[i]) {
-            elem.state_ptr = NULL;
+        if (sources.empty()) {
+            if (search != rev_maps.end()) {
+                // the moved entry keeps its sources where they are, so pointers to them stay valid
+                if (search != rev_maps.end() - 1) {
+                    *search = std::move(rev_maps.back());
+                }
+                rev_maps.pop_back();
+            }
+            continue;
         }
-    }
-}
 
-bool assign_state_slot(uint32_t usage, uint8_t hub_port, bool raw) {
-    uint64_t key = (raw ? ((uint64_t) 1 << 40) : 0) | ((uint64_t) hub_port << 32) | usage;
-    if (usage_state_ptr.count(key) == 0) {
-        if (used_state_slots >= MAX_INPUT_STATES) {
-            printf("out of input_state slots!");
-            return false;
+        reverse_mapping_t rev_map = {
+            .target = target,
+            .hub_port = hub_port,
+            .sources = std::move(sources),
+        };
+        compile_rev_map(rev_map, true);
+        if (search != rev_maps.end()) {
+            *search = std::move(rev_map);
+        } else {
+            rev_maps.push_back(std::move(rev_map));
+            search = rev_maps.end() - 1;
         }
 
-        usage_state_ptr[key] = input_state + used_state_slots++;
-    }
-    return true;
-}
+        for (auto const& map_source : search->sources) {
+            if (map_source.input_state != NULL) {
+                unreferenced_slots.erase(state_slot(map_source.input_state));
+            }
+        }
 
-inline int32_t* get_state_ptr(uint32_t usage, uint8_t hub_port, bool assign_if_absent = false, bool raw = false) {
-    uint64_t key = (raw ? ((uint64_t) 1 << 40) : 0) | ((uint64_t) hub_port << 32) | usage;
-    auto search = usage_state_ptr.find(key);
-    if (search != usage_state_ptr.end()) {
-        return search->second;
+        if (linked) {
+            for (auto& map_source : search->sources) {
+                add_slot_source(map_source);
+                link_source(map_source);
+            }
+            link_out_usages(*search);
+        }
     }
 
-    if (assign_if_absent) {
-        if (assign_state_slot(usage, hub_port, raw)) {
-            their_descriptor_updated = true;
-            return usage_state_ptr[key];  // it's zero, but maybe someone wants to write to it
+    for (const int32_t* state_ptr : prev_slots) {
+        if ((state_ptr != NULL) && !slot_has_sources(state_ptr)) {
+            unreferenced_slots.insert(state_slot(state_ptr));
         }
     }
 
-    return NULL;
-}
-
-inline tap_hold_state_t* get_tap_hold_state_ptr(uint32_t usage, uint8_t hub_port, bool assign_if_absent = false) {
-    int32_t* state_ptr = get_state_ptr(usage, hub_port, assign_if_absent);
-    if (state_ptr != NULL) {
-        return tap_hold_state + (state_ptr - input_state);
-    }
+    compiled_mappings = config_mappings;
 
-    return NULL;
-}
+    build_eval_order();
 
-inline uint8_t* get_sticky_state_ptr(uint32_t usage, uint8_t hub_port, bool assign_if_absent = false) {
-    int32_t* state_ptr = get_state_ptr(usage, hub_port, assign_if_absent);
-    if (state_ptr != NULL) {
-        return sticky_state + (state_ptr - input_state);
+    if (used_state_slots != prev_used_state_slots) {
+        // connected devices may have the new usages
+        all_interfaces_dirty = true;
+        update_their_descriptor_derivates();
+    } else {
+        build_layer_tables();
     }
 
-    return NULL;
+    return true;
 }
 
-void set_mapping_from_config() {
+// Compiles config_mappings, macros and expressions into reverse_mapping and the rest of what
+// compiled_profile_t has, for the active profile or one that's exchanged in. Sources keep the input
+// state slots they already have, new ones get new slots. If keep_held is set, default values are
+// only written to sources whose input state is zero.
+static void compile_profile(bool keep_held) {
     std::unordered_map<uint64_t, std::vector<map_source_t>> reverse_mapping_map;  // hub_port+target -> sources list
     std::unordered_map<uint64_t, uint8_t> sticky_usage_map;
     std::unordered_map<uint64_t, uint8_t> tap_sticky_usage_map;
     std::unordered_map<uint64_t, uint8_t> hold_sticky_usage_map;
     std::unordered_set<uint64_t> tap_hold_usage_set;
-    std::unordered_map<uint32_t, uint8_t> mapped_on_layers;  // usage -> layer mask
 
     validate_expressions();
     invalidate_expr_state_ptr_cache();
@@ -393,85 +1744,61 @@ void set_mapping_from_config() {
     reverse_mapping.clear();
     reverse_mapping_macros.clear();
     reverse_mapping_layers.clear();
-    used_state_slots = 0;
-    usage_state_ptr.clear();
+    reverse_mapping_profiles.clear();
+    layer_tables.clear();
+    layer_tables_bytes = 0;
+    layer_table = NULL;
+    layer_table_mask = 0;
+    mapped_on_layers.clear();
+    unreferenced_slots.clear();
     register_ptrs.clear();
-    memset(input_state, 0, sizeof(input_state));
-    memset(tap_hold_state, 0, sizeof(tap_hold_state));
-    memset(sticky_state, 0, sizeof(sticky_state));
+    memset(watched_slot_index, 0, used_state_slots * sizeof(watched_slot_index[0]));
+    slot_watches.clear();
     uint32_t gpio_in_mask_ = 0;
     uint32_t gpio_out_mask_ = 0;
 
-    for (auto const& mapping : config_mappings) {
-        uint8_t layer_mask = mapping.layer_mask;
-        uint8_t source_port = mapping.hub_ports & 0x0F;
-        uint8_t orig_source_port = source_port;
-        if (((mapping.source_usage & 0xFFFF0000) == EXPR_USAGE_PAGE) ||
-            ((mapping.source_usage & 0xFFFF0000) == REGISTER_USAGE_PAGE) ||
-            ((mapping.source_usage & 0xFFFF0000) == GPIO_USAGE_PAGE)) {
-            source_port = 0;
-        }
-        uint8_t target_port = (mapping.hub_ports >> 4) & 0x0F;
-        if ((mapping.target_usage & 0xFFFF0000) == LAYERS_USAGE_PAGE) {
-            uint16_t layer = mapping.target_usage & 0xFFFF;
-            if (mapping.flags & MAPPING_FLAG_STICKY) {
-                // sticky layer-triggering mappings are forces to NOT be present on the layer they trigger
-                layer_mask &= ~(1 << layer);
-                // but for unmapped passthrough purposes we pretend they are
-                mapped_on_layers[mapping.source_usage] |= (1 << layer) & ((1 << NLAYERS) - 1);
-            } else {
-                // non-sticky layer-triggering mappings are forced to BE present on the layer they trigger
-                layer_mask |= (1 << layer) & ((1 << NLAYERS) - 1);
-            }
+    // at most one target per mapping and one per passthrough usage, sizing the maps up front
+    // saves rehashing them over and over while they're filled
+    size_t ntargets = config_mappings.size();
+    if (unmapped_passthrough_layer_mask) {
+        ntargets += our_usage_ids.size() + their_descriptors[OUR_OUT_INTERFACE].input.nusages;
+        for (auto const& array_usage : our_array_range_usages) {
+            ntargets += array_usage.usage_def.usage_maximum - array_usage.usage + 1;
         }
+    }
+    reverse_mapping_map.reserve(ntargets);
+    usage_state_ptr.reserve(usage_state_ptr.size() + ntargets);
+    mapped_on_layers.reserve(config_mappings.size());
+
+    for (auto const& mapping : config_mappings) {
+        uint8_t layer_mask = mapping_layer_mask(mapping);
+        uint8_t source_port = mapping_source_port(mapping);
 
         if ((mapping.target_usage & 0xFFFF0000) == GPIO_USAGE_PAGE) {
             uint16_t pin = mapping.target_usage & 0xFFFF;
             gpio_out_mask_ |= 1 << pin;
         }
 
-        if ((mapping.source_usage & 0xFFFF0000) == GPIO_USAGE_PAGE) {
-            uint16_t pin = mapping.source_usage & 0xFFFF;
-            gpio_in_mask_ |= 1 << pin;
-        }
-
-        if (assign_state_slot(mapping.source_usage, source_port, false)) {
-            reverse_mapping_map[((uint64_t) target_port << 32) | mapping.target_usage].push_back((map_source_t){
-                .usage = mapping.source_usage,
-                .scaling = mapping.scaling,
-                .sticky = (mapping.flags & MAPPING_FLAG_STICKY) != 0,
-                .tap = (mapping.flags & MAPPING_FLAG_TAP) != 0,
-                .hold = (mapping.flags & MAPPING_FLAG_HOLD) != 0,
-                .orig_source_port = orig_source_port,
-                .layer_mask = layer_mask,
-                .input_state = get_state_ptr(mapping.source_usage, source_port),
-                .tap_hold_state = get_tap_hold_state_ptr(mapping.source_usage, source_port),
-                .sticky_state = get_sticky_state_ptr(mapping.source_usage, source_port),
-            });
+        int32_t* state_ptr = assign_state_slot(mapping.source_usage, source_port, false);
+        if (state_ptr != NULL) {
+            reverse_mapping_map[mapping_target_key(mapping)].push_back(mapping_source(mapping, layer_mask, state_ptr));
 
             if ((mapping.source_usage & 0xFFFF0000) == REGISTER_USAGE_PAGE) {
                 register_ptrs.push_back((register_ptrs_t){
                     .register_ptr = &registers[(mapping.source_usage & 0xFFFF) - 1],
-                    .state_ptr = get_state_ptr(mapping.source_usage, source_port),
+                    .state_ptr = state_ptr,
                 });
             }
         }
-        // if a usage appears in an expression, consider it mapped
-        if ((mapping.source_usage & 0xFFFF0000) == EXPR_USAGE_PAGE) {
-            uint8_t expr = (mapping.source_usage & 0xFFFF) - 1;
-            for (auto const& elem : expressions[expr]) {
-                if (elem.op == Op::PUSH_USAGE) {
-                    mapped_on_layers[elem.val] |= layer_mask;
+        for_each_mapped_usage(mapping, layer_mask, [&](uint32_t usage, uint8_t layers) {
+            mapped_on_layers[usage] |= layers;
 
-                    // if a GPIO pin usage appears in an expression, it's an "in" pin
-                    if ((elem.val & 0xFFFF0000) == GPIO_USAGE_PAGE) {
-                        uint16_t pin = elem.val & 0xFFFF;
-                        gpio_in_mask_ |= 1 << pin;
-                    }
-                }
+            // if a GPIO pin usage is a source or appears in an expression, it's an "in" pin
+            if ((usage & 0xFFFF0000) == GPIO_USAGE_PAGE) {
+                uint16_t pin = usage & 0xFFFF;
+                gpio_in_mask_ |= 1 << pin;
             }
-        }
-        mapped_on_layers[mapping.source_usage] |= layer_mask;  // usage mapped on any hub_port is considered to be mapped
+        });
         if ((mapping.flags & MAPPING_FLAG_STICKY) != 0) {
             if (mapping.flags & MAPPING_FLAG_TAP) {
                 tap_sticky_usage_map[((uint64_t) source_port << 32) | mapping.source_usage] |= layer_mask;
@@ -490,18 +1817,8 @@ void set_mapping_from_config() {
         }
     }
 
-    my_mutex_enter(MutexId::MACROS);
-    for (int macro = 0; macro < NMACROS; macro++) {
-        for (auto const& usages : macros[macro]) {
-            for (uint32_t usage : usages) {
-                if ((usage & 0xFFFF0000) == GPIO_USAGE_PAGE) {
-                    uint16_t pin = usage & 0xFFFF;
-                    gpio_out_mask_ |= 1 << pin;
-                }
-            }
-        }
-    }
-    my_mutex_exit(MutexId::MACROS);
+    uint32_t macros_gpio_out_mask_ = macros_gpio_out_mask();
+    gpio_out_mask_ |= macros_gpio_out_mask_;
 
     sticky_usages.clear();
     tap_hold_usages.clear();
@@ -513,6 +1830,7 @@ void set_mapping_from_config() {
         uint8_t hub_port = hub_port_usage >> 32;
         int32_t* state_ptr = get_state_ptr(usage, hub_port);
         if (state_ptr != NULL) {
+            slot_watches[watch_slot(state_ptr)].sticky = sticky_usages.size();
             sticky_usages.push_back((sticky_usage_t){
                 .input_state = state_ptr,
                 .sticky_state = get_sticky_state_ptr(usage, hub_port),
@@ -524,7 +1842,9 @@ void set_mapping_from_config() {
     for (auto const& [hub_port_usage, layer_mask] : tap_sticky_usage_map) {
         uint32_t usage = hub_port_usage & 0xFFFFFFFF;
         uint8_t hub_port = hub_port_usage >> 32;
-        if (get_state_ptr(usage, hub_port) != NULL) {
+        int32_t* state_ptr = get_state_ptr(usage, hub_port);
+        if (state_ptr != NULL) {
+            slot_watches[watch_slot(state_ptr)].tap_sticky = tap_sticky_usages.size();
             tap_sticky_usages.push_back((tap_hold_sticky_usage_t){
                 .layer_mask = layer_mask,
                 .tap_hold_state = get_tap_hold_state_ptr(usage, hub_port),
@@ -536,7 +1856,9 @@ void set_mapping_from_config() {
     for (auto const& [hub_port_usage, layer_mask] : hold_sticky_usage_map) {
         uint32_t usage = hub_port_usage & 0xFFFFFFFF;
         uint8_t hub_port = hub_port_usage >> 32;
-        if (get_state_ptr(usage, hub_port) != NULL) {
+        int32_t* state_ptr = get_state_ptr(usage, hub_port);
+        if (state_ptr != NULL) {
+            slot_watches[watch_slot(state_ptr)].hold_sticky = hold_sticky_usages.size();
             hold_sticky_usages.push_back((tap_hold_sticky_usage_t){
                 .layer_mask = layer_mask,
                 .tap_hold_state = get_tap_hold_state_ptr(usage, hub_port),
@@ -550,6 +1872,7 @@ void set_mapping_from_config() {
         uint8_t hub_port = hub_port_usage >> 32;
         int32_t* state_ptr = get_state_ptr(usage, hub_port);
         if (state_ptr != NULL) {
+            slot_watches[watch_slot(state_ptr)].tap_hold = tap_hold_usages.size();
             tap_hold_usages.push_back((tap_hold_usage_t){
                 .input_state = state_ptr,
                 .tap_hold_state = get_tap_hold_state_ptr(usage, hub_port),
@@ -558,149 +1881,355 @@ void set_mapping_from_config() {
     }
 
     if (unmapped_passthrough_layer_mask) {
-        for (auto const& [usage, usage_def] : our_usages_flat) {
-            uint8_t unmapped_layers = unmapped_passthrough_layer_mask & ~mapped_on_layers[usage];
+        for (auto const& [usage, our_usage_id] : our_usage_ids) {
+            uint8_t unmapped_layers = unmapped_passthrough_layer_mask & ~mapped_layers(usage);
             if (unmapped_layers) {
-                if (assign_state_slot(usage, 0, false)) {
-                    reverse_mapping_map[usage].push_back((map_source_t){
-                        .usage = usage,
-                        .layer_mask = unmapped_layers,
-                        .input_state = get_state_ptr(usage, 0),
-                    });
-                }
+                add_passthrough_source(usage, unmapped_layers, reverse_mapping_map[usage]);
             }
         }
 
         for (auto const& array_usage : our_array_range_usages) {
             for (uint32_t usage = array_usage.usage; usage <= array_usage.usage_def.usage_maximum; usage++) {
-                uint8_t unmapped_layers = unmapped_passthrough_layer_mask & ~mapped_on_layers[usage];
+                uint8_t unmapped_layers = unmapped_passthrough_layer_mask & ~mapped_layers(usage);
                 if (unmapped_layers) {
-                    if (assign_state_slot(usage, 0, false)) {
-                        reverse_mapping_map[usage].push_back((map_source_t){
-                            .usage = usage,
-                            .layer_mask = unmapped_layers,
-                            .input_state = get_state_ptr(usage, 0),
-                        });
-                    }
+                    add_passthrough_source(usage, unmapped_layers, reverse_mapping_map[usage]);
                 }
             }
         }
 
-        for (auto const& [report_id, usage_map] : their_usages[OUR_OUT_INTERFACE]) {
-            for (auto const& [usage, usage_def] : usage_map) {
-                uint8_t unmapped_layers = unmapped_passthrough_layer_mask & ~mapped_on_layers[usage];
-                if (unmapped_layers) {
-                    if (assign_state_slot(usage, 0, false)) {
-                        reverse_mapping_map[usage].push_back((map_source_t){
-                            .usage = usage,
-                            .layer_mask = unmapped_layers,
-                            .input_state = get_state_ptr(usage, 0),
-                        });
-                    }
-                }
+        const usage_table_t& our_out_usages = their_descriptors[OUR_OUT_INTERFACE].input;
+        for (uint32_t i = 0; i < our_out_usages.nusages; i++) {
+            uint32_t usage = our_out_usages.usages[i].usage;
+            uint8_t unmapped_layers = unmapped_passthrough_layer_mask & ~mapped_layers(usage);
+            if (unmapped_layers) {
+                add_passthrough_source(usage, unmapped_layers, reverse_mapping_map[usage]);
             }
         }
     }
 
-    for (auto const& [hub_port_target, sources] : reverse_mapping_map) {
-        uint8_t hub_port = (hub_port_target >> 32) & 0xFF;
+    for (auto& [hub_port_target, sources] : reverse_mapping_map) {
         uint32_t target = hub_port_target & 0xFFFFFFFF;
-        reverse_mapping_t rev_map = {
+        std::vector<reverse_mapping_t>& rev_maps = reverse_mapping_for_target(target);
+        rev_maps.push_back((reverse_mapping_t){
             .target = target,
-            .hub_port = hub_port,
-            .sources = sources,
-        };
-        if (our_descriptor->default_value != nullptr) {
-            rev_map.default_value = our_descriptor->default_value(target);
-            // This helps in cases where nothing is plugged in to provide state for a source
-            // and a default of zero is not good, but the proper way to solve this would be
-            // to not execute mappings with unplugged sources.
-            for (auto const& source : sources) {
-                if (!source.sticky && !source.tap && !source.hold && (source.scaling == 1000)) {
-                    *(source.input_state) = rev_map.default_value;
-                }
+            .hub_port = (uint8_t) ((hub_port_target >> 32) & 0xFF),
+            .sources = std::move(sources),
+        });
+        compile_rev_map(rev_maps.back(), keep_held);
+    }
+
+    // the profile switch mappings are only looked at when one of their sources changes
+    for (auto const& rev_map : reverse_mapping_profiles) {
+        for (auto const& map_source : rev_map.sources) {
+            if (map_source.input_state != NULL) {
+                slot_watches[watch_slot(map_source.input_state)].profile = true;
             }
         }
-        if ((target == (DIGIPOT_USAGE_PAGE | 0)) ||
-            (target == (DIGIPOT_USAGE_PAGE | 1)) ||
-            (target == (DIGIPOT_USAGE_PAGE | 2)) ||
-            (target == (DIGIPOT_USAGE_PAGE | 3))) {
-            rev_map.default_value = 128;
-            for (auto const& source : sources) {
-                if (!source.sticky && !source.tap && !source.hold && (source.scaling == 1000)) {
-                    *(source.input_state) = 128;
-                }
-            }
+    }
+
+    build_eval_order();
+
+    compiled_mappings = config_mappings;
+    for (uint8_t i = 0; i < NEXPRESSIONS; i++) {
+        compiled_expressions[i] = expressions[i];
+    }
+    compiled_passthrough_layer_mask = unmapped_passthrough_layer_mask;
+    compiled_macros_gpio_out_mask = macros_gpio_out_mask_;
+    compiled_gpio_in_mask = gpio_in_mask_;
+    compiled_gpio_out_mask = gpio_out_mask_;
+}
+
+static uint32_t rev_maps_bytes(const std::vector<reverse_mapping_t>& rev_maps) {
+    uint32_t bytes = rev_maps.size() * sizeof(reverse_mapping_t);
+    for (auto const& rev_map : rev_maps) {
+        bytes += rev_map.sources.size() * sizeof(map_source_t) + rev_map.our_usages.size() * sizeof(out_usage_def_t);
+    }
+    return bytes;
+}
+
+// What a precompiled profile takes, give or take allocator and hash table overhead.
+static uint32_t compiled_profile_bytes(const compiled_profile_t& compiled) {
+    uint32_t bytes = sizeof(compiled_profile_t) + compiled.layer_tables_bytes;
+    for (auto const* rev_maps : { &compiled.reverse_mapping, &compiled.reverse_mapping_macros, &compiled.reverse_mapping_layers, &compiled.reverse_mapping_profiles }) {
+        bytes += rev_maps_bytes(*rev_maps);
+    }
+    bytes += compiled.compiled_mappings.size() * sizeof(mapping_config11_t);
+    for (auto const& elems : compiled.compiled_expressions) {
+        bytes += elems.size() * sizeof(expr_elem_t);
+    }
+    for (auto const& rev_map_idxs : compiled.register_rev_maps) {
+        bytes += rev_map_idxs.size() * sizeof(uint16_t);
+    }
+    bytes += (compiled.mapped_on_layers.size() + compiled.unreferenced_slots.size()) * 16;
+    bytes += compiled.sticky_usages.size() * sizeof(sticky_usage_t) +
+             (compiled.tap_sticky_usages.size() + compiled.hold_sticky_usages.size()) * sizeof(tap_hold_sticky_usage_t) +
+             compiled.tap_hold_usages.size() * sizeof(tap_hold_usage_t) +
+             compiled.watched_slot_index.size() * sizeof(uint16_t) +
+             compiled.slot_watches.size() * sizeof(slot_watch_t) +
+             compiled.register_ptrs.size() * sizeof(register_ptrs_t) +
+             compiled.eval_order.size();
+    return bytes;
+}
+
+static uint32_t precompiled_profiles_bytes() {
+    uint32_t bytes = 0;
+    for (auto const& compiled : compiled_profiles) {
+        if (compiled.valid) {
+            bytes += compiled.bytes;
         }
-        if ((target & 0xFFFF0000) == GPIO_USAGE_PAGE) {
-            rev_map.our_usages.push_back((out_usage_def_t){
-                .data = gpio_out_state,
-                .len = sizeof(gpio_out_state),
-                .size = 1,
-                .bitpos = (uint16_t) (target & 0xFFFF),
-            });
-        } else if ((target & 0xFFFF0000) == DIGIPOT_USAGE_PAGE) {
-            rev_map.our_usages.push_back((out_usage_def_t){
-                .data = (uint8_t*) digipot_state,
-                .len = sizeof(digipot_state),
-                .size = 9,
-                .bitpos = (uint16_t) ((target & 0xFFFF) * 16),
-            });
-        } else if ((target & 0xFFFF0000) == DPAD_USAGE_PAGE) {
-            rev_map.our_usages.push_back((out_usage_def_t){
-                .data = &dpad_state,
-                .len = sizeof(dpad_state),
-                .size = 1,
-                .bitpos = (uint16_t) ((target & 0xFFFF) - 1) & 0x03,
-            });
-        } else if ((target & 0xFFFF0000) == REGISTER_USAGE_PAGE) {
-            rev_map.our_usages.push_back((out_usage_def_t){
-                .data = (uint8_t*) registers,
-                .len = sizeof(registers),
-                .size = 8 * sizeof(registers[0]),
-                .bitpos = (uint16_t) (((target & 0xFFFF) - 1) * 8 * sizeof(registers[0])),
-            });
-        } else {
-            bool handled = false;
-            for (auto const& array_usage : our_array_range_usages) {
-                if ((target >= array_usage.usage) && (target <= array_usage.usage_def.usage_maximum)) {
-                    rev_map.our_usages.push_back((out_usage_def_t){
-                        .data = reports[array_usage.usage_def.report_id],
-                        .len = report_sizes[array_usage.usage_def.report_id],
-                        .size = array_usage.usage_def.size,
-                        .bitpos = array_usage.usage_def.bitpos,
-                        .array_count = array_usage.usage_def.count,
-                        .array_index = array_usage.usage_def.logical_minimum + target - array_usage.usage,
-                    });
-                    handled = true;
-                    break;
-                }
+    }
+    return bytes;
+}
+
+// Keeps what was just swapped into compiled if it fits in the budget, without its layer tables if
+// that's what it takes. Returns false if it didn't fit.
+static bool keep_compiled(compiled_profile_t& compiled) {
+    uint32_t others = precompiled_profiles_bytes();
+    uint32_t bytes = compiled_profile_bytes(compiled);
+    if (others + bytes > precompiled_profiles_budget) {
+        // they're built again as they're needed
+        bytes -= compiled.layer_tables_bytes;
+        compiled.layer_tables.clear();
+        compiled.layer_tables_bytes = 0;
+    }
+    if (others + bytes > precompiled_profiles_budget) {
+        compiled = compiled_profile_t();
+        return false;
+    }
+    compiled.valid = true;
+    compiled.bytes = bytes;
+    return true;
+}
+
+// Trades what's compiled for the active profile for what's in compiled. Nothing is copied.
+static void swap_compiled(compiled_profile_t& compiled) {
+    reverse_mapping.swap(compiled.reverse_mapping);
+    reverse_mapping_macros.swap(compiled.reverse_mapping_macros);
+    reverse_mapping_layers.swap(compiled.reverse_mapping_layers);
+    reverse_mapping_profiles.swap(compiled.reverse_mapping_profiles);
+    layer_tables.swap(compiled.layer_tables);
+    std::swap(layer_tables_bytes, compiled.layer_tables_bytes);
+    layer_table = NULL;
+    layer_table_mask = 0;
+    compiled_mappings.swap(compiled.compiled_mappings);
+    for (uint8_t i = 0; i < NEXPRESSIONS; i++) {
+        compiled_expressions[i].swap(compiled.compiled_expressions[i]);
+    }
+    std::swap(compiled_passthrough_layer_mask, compiled.compiled_passthrough_layer_mask);
+    std::swap(compiled_macros_gpio_out_mask, compiled.compiled_macros_gpio_out_mask);
+    std::swap(compiled_gpio_in_mask, compiled.compiled_gpio_in_mask);
+    std::swap(compiled_gpio_out_mask, compiled.compiled_gpio_out_mask);
+    mapped_on_layers.swap(compiled.mapped_on_layers);
+    unreferenced_slots.swap(compiled.unreferenced_slots);
+    sticky_usages.swap(compiled.sticky_usages);
+    tap_sticky_usages.swap(compiled.tap_sticky_usages);
+    hold_sticky_usages.swap(compiled.hold_sticky_usages);
+    tap_hold_usages.swap(compiled.tap_hold_usages);
+    // slots that were handed out since it was swapped out aren't watched by it
+    compiled.watched_slot_index.resize(used_state_slots);
+    std::swap_ranges(watched_slot_index, watched_slot_index + used_state_slots, compiled.watched_slot_index.begin());
+    slot_watches.swap(compiled.slot_watches);
+    std::swap(expression_valid, compiled.expression_valid);
+    register_ptrs.swap(compiled.register_ptrs);
+    eval_order.swap(compiled.eval_order);
+    std::swap(eval_writes_registers, compiled.eval_writes_registers);
+    for (uint8_t i = 0; i < NREGISTERS; i++) {
+        register_rev_maps[i].swap(compiled.register_rev_maps[i]);
+    }
+    std::swap(eval_cycle_breaks, compiled.eval_cycle_breaks);
+}
+
+// Undoes write_default_value() on sources that are still at the default value, the profile
+// that takes over may not have one for them.
+static void clear_default_value(const reverse_mapping_t& rev_map) {
+    if (rev_map.default_value == 0) {
+        return;
+    }
+    for (auto const& source : rev_map.sources) {
+        if (!source.sticky && !source.tap && !source.hold && (source.scaling == 1000) &&
+            (*(source.input_state) == rev_map.default_value)) {
+            *(source.input_state) = 0;
+        }
+    }
+}
+
+// Links a profile that was compiled on its own to what's connected, like a full
+// update_their_descriptor_derivates() would.
+static void link_compiled_profile() {
+    for (auto& rev_map : reverse_mapping) {
+        for (auto& map_source : rev_map.sources) {
+            if (map_source.input_state != NULL) {
+                add_slot_source(map_source);
             }
-            if (!handled) {
-                auto search = our_usages_flat.find(target);
-                if (search != our_usages_flat.end()) {
-                    const usage_def_t& our_usage = search->second;
-                    rev_map.our_usages.push_back((out_usage_def_t){
-                        .data = reports[our_usage.report_id],
-                        .len = report_sizes[our_usage.report_id],
-                        .size = our_usage.size,
-                        .bitpos = our_usage.bitpos,
-                    });
-                    rev_map.is_relative = our_usage.is_relative;
-                }
+            link_source(map_source);
+        }
+        link_out_usages(rev_map);
+    }
+    build_layer_tables();
+}
+
+struct tap_hold_carry_t {
+    uint16_t slot;
+    bool timer_armed;
+    uint64_t pressed_at;
+};
+
+// The profile we're leaving keeps what was compiled for it, if it fits in the budget, and a precompiled
+// profile we're switching to takes over the globals. One that isn't precompiled is compiled now, on top
+// of the input state slots that are there. Either way the slots don't move, so held inputs stay held and
+// sticky state stays latched. Tap-hold timers in progress carry over to the new profile's tap-hold usage
+// for the same slot, if it has one.
+static void switch_compiled_profile(uint8_t prev_profile) {
+    // tap and hold edges have had their frame, the indexes are about to mean something else
+    for (int16_t idx : tap_hold_one_frame) {
+        tap_hold_usages[idx].tap_hold_state->tap = false;
+        tap_hold_usages[idx].tap_hold_state->prev_hold = tap_hold_usages[idx].tap_hold_state->hold;
+    }
+    tap_hold_one_frame.clear();
+
+    std::vector<tap_hold_carry_t> carried;
+    carried.reserve(tap_hold_usages.size());
+    for (auto& tap_hold : tap_hold_usages) {
+        carried.push_back((tap_hold_carry_t){
+            .slot = state_slot(tap_hold.input_state),
+            .timer_armed = (tap_hold.timer_bucket >= 0),
+            .pressed_at = tap_hold.pressed_at,
+        });
+        tap_hold.timer_bucket = -1;
+    }
+    timer_wheel_clear();
+
+    for (auto const* rev_maps : { &reverse_mapping, &reverse_mapping_macros, &reverse_mapping_layers, &reverse_mapping_profiles }) {
+        for (auto const& rev_map : *rev_maps) {
+            clear_default_value(rev_map);
+        }
+    }
+
+    compiled_profile_t& prev = compiled_profiles[prev_profile];
+    compiled_profile_t& next = compiled_profiles[active_profile];
+    bool precompiled = next.valid;
+    bool layer_tables_stale = (next.layer_tables_generation != layer_tables_generation);
+    swap_compiled(prev);
+    prev.layer_tables_generation = layer_tables_generation;
+    if (precompiled) {
+        swap_compiled(next);
+        next = compiled_profile_t();
+        if (layer_tables_stale) {
+            // they're built again as they're needed
+            layer_tables.clear();
+            layer_tables_bytes = 0;
+        }
+    }
+    if (!keep_compiled(prev)) {
+        // its sources are gone
+        rebuild_slot_sources();
+    }
+
+    if (precompiled) {
+        for (auto const* rev_maps : { &reverse_mapping, &reverse_mapping_macros, &reverse_mapping_layers, &reverse_mapping_profiles }) {
+            for (auto const& rev_map : *rev_maps) {
+                write_default_value(rev_map, true);
             }
         }
-        if ((target & 0xFFFF0000) == MACRO_USAGE_PAGE) {
-            reverse_mapping_macros.push_back(rev_map);
-        } else if ((target & 0xFFFF0000) == LAYERS_USAGE_PAGE) {
-            reverse_mapping_layers.push_back(rev_map);
+    } else {
+        uint32_t prev_used_state_slots = used_state_slots;
+        compile_profile(true);
+        profiles_gpio_in_mask |= compiled_gpio_in_mask;
+        if (used_state_slots != prev_used_state_slots) {
+            // connected devices may have the new usages
+            all_interfaces_dirty = true;
+            update_their_descriptor_derivates();
         } else {
-            reverse_mapping.push_back(rev_map);
+            link_compiled_profile();
+        }
+    }
+
+    for (auto const& carry : carried) {
+        uint16_t watch = watched_slot_index[carry.slot];
+        int16_t tap_hold = watch ? slot_watches[watch - 1].tap_hold : -1;
+        if (tap_hold >= 0) {
+            tap_hold_usages[tap_hold].pressed_at = carry.pressed_at;
+            if (carry.timer_armed) {
+                timer_arm(tap_hold, carry.pressed_at + tap_hold_threshold);
+            }
+        }
+    }
+
+    // the new profile may watch slots that changed since the last frame
+    memset(changed_slots, 0, sizeof(changed_slots));
+    for (uint16_t slot = 0; slot < used_state_slots; slot++) {
+        if (input_state[slot] != input_state[slot + PREV_STATE_OFFSET]) {
+            mark_changed(input_state + slot);
+        }
+    }
+
+    set_gpio_inout_masks(profiles_gpio_in_mask, compiled_gpio_out_mask);
+}
+
+void set_mapping_from_config() {
+    std::vector<std::pair<uint64_t, int32_t>> held_inputs;  // usage_state_ptr key -> value
+    std::vector<source_state_t> source_states;
+
+    uint8_t prev_profile = active_profile;
+    bool switching_profiles = switch_to_requested_profile();
+    if (switching_profiles && !all_mappings_dirty) {
+        switch_compiled_profile(prev_profile);
+    }
+
+    // also catches a precompiled profile whose config changed since it was compiled
+    if (patch_mappings()) {
+        return;
+    }
+
+    save_held_inputs(held_inputs);
+    if (switching_profiles) {
+        save_source_states(source_states);
+    }
+
+    for (auto& compiled : compiled_profiles) {
+        compiled = compiled_profile_t();
+    }
+    usage_state_ptr.clear();
+    // slots past used_state_slots were never handed out and are still zero
+    memset(input_state, 0, used_state_slots * sizeof(input_state[0]));
+    memset(input_state + PREV_STATE_OFFSET, 0, used_state_slots * sizeof(input_state[0]));
+    memset(tap_hold_state, 0, used_state_slots * sizeof(tap_hold_state[0]));
+    memset(sticky_state, 0, used_state_slots * sizeof(sticky_state[0]));
+    memset(watched_slot_index, 0, used_state_slots * sizeof(watched_slot_index[0]));
+    used_state_slots = 0;
+    shared_input_bits.held.clear();
+    shared_input_bits.holders.clear();
+    memset(changed_slots, 0, sizeof(changed_slots));
+    tap_hold_one_frame.clear();
+    timer_wheel_clear();
+
+    // The other profiles are compiled first and kept while they fit in the budget. The ones that
+    // don't fit still get their input state slots, so that compiling them later doesn't need new ones.
+    profiles_gpio_in_mask = 0;
+    for (uint8_t profile = 0; profile < NPROFILES; profile++) {
+        if ((profile == active_profile) || inactive_profile_empty(profile)) {
+            continue;
         }
+        exchange_profile_config(profile);
+        compile_profile(false);
+        exchange_profile_config(profile);
+        profiles_gpio_in_mask |= compiled_gpio_in_mask;
+        swap_compiled(compiled_profiles[profile]);
+        keep_compiled(compiled_profiles[profile]);
     }
+    // their default values are the active profile's business
+    memset(input_state, 0, used_state_slots * sizeof(input_state[0]));
+
+    compile_profile(false);
+    profiles_gpio_in_mask |= compiled_gpio_in_mask;
 
-    set_gpio_inout_masks(gpio_in_mask_, gpio_out_mask_);
+    restore_held_inputs(held_inputs);
+    restore_source_states(source_states);
+
+    set_gpio_inout_masks(profiles_gpio_in_mask, compiled_gpio_out_mask);
+    all_interfaces_dirty = true;
     update_their_descriptor_derivates();
+    all_mappings_dirty = false;
 }
 
 bool differ_on_absolute(const uint8_t* report1, const uint8_t* report2, uint8_t report_id) {
@@ -716,7 +2245,12 @@ bool differ_on_absolute(const uint8_t* report1, const uint8_t* report2, uint8_t
 }
 
 void aggregate_relative(uint8_t* prev_report, const uint8_t* report, uint8_t report_id) {
-    for (auto const& [usage, usage_def] : our_usages[report_id]) {
+    const report_usages_t* report_usages = find_report(our_usages, report_id);
+    if (report_usages == NULL) {
+        return;
+    }
+    for (uint32_t i = report_usages->first; i < report_usages->first + report_usages->count; i++) {
+        const usage_def_t& usage_def = our_usages.usages[i].usage_def;
         if (usage_def.is_relative) {
             int32_t val1 = get_bits(report, report_sizes[report_id], usage_def.bitpos, usage_def.size);
             if (usage_def.logical_minimum < 0) {
@@ -1087,47 +2621,191 @@ int32_t eval_expr(uint8_t expr, uint64_t now, bool auto_repeat) {
     return 0;
 }
 
-void process_mapping(bool auto_repeat) {
-    if (suspended) {
+static void press_macro_usage(uint32_t usage) {
+    if ((usage & 0xFFFF0000) == GPIO_USAGE_PAGE) {
+        put_bits(gpio_out_state, sizeof(gpio_out_state), (uint16_t) (usage & 0xFFFF), 1, 1);
+    } else if ((usage & 0xFFFF0000) == DPAD_USAGE_PAGE) {
+        put_bits(&dpad_state, sizeof(dpad_state), (uint16_t) (usage & 0xFFFF) - 1, 1, 1);
+    } else {
+        bool handled = false;
+        for (auto const& array_usage : our_array_range_usages) {
+            if ((usage >= array_usage.usage) && (usage <= array_usage.usage_def.usage_maximum)) {
+                const uint8_t report_id = array_usage.usage_def.report_id;
+                for (unsigned int i = 0; i < array_usage.usage_def.count; i++) {
+                    int32_t existing_val = get_bits(reports[report_id], report_sizes[report_id], array_usage.usage_def.bitpos + i * array_usage.usage_def.size, array_usage.usage_def.size);
+                    // theoretically zero could be a valid index, but let's ignore that for now
+                    if (existing_val == 0) {
+                        put_bits(reports[report_id], report_sizes[report_id], array_usage.usage_def.bitpos + i * array_usage.usage_def.size, array_usage.usage_def.size, array_usage.usage_def.logical_minimum + usage - array_usage.usage);
+                        break;
+                    }
+                }
+                // we don't do RollOver
+                handled = true;
+                break;
+            }
+        }
+        if (!handled) {
+            const usage_def_t* our_usage_ptr = find_our_usage(usage);
+            if (our_usage_ptr != NULL) {
+                const usage_def_t& our_usage = *our_usage_ptr;
+                put_bits((uint8_t*) reports[our_usage.report_id], report_sizes[our_usage.report_id], our_usage.bitpos, our_usage.size, 1);
+            }
+        }
+    }
+}
+
+static inline bool is_modifier_usage(uint32_t usage) {
+    return (usage >= LEFT_CTRL_USAGE) && (usage <= RIGHT_GUI_USAGE);
+}
+
+static inline bool is_array_key_usage(uint32_t usage) {
+    for (auto const& array_usage : our_array_range_usages) {
+        if ((usage >= array_usage.usage) && (usage <= array_usage.usage_def.usage_maximum)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint8_t macro_entry_modifiers(const std::vector<uint32_t>& items) {
+    uint8_t modifiers = 0;
+    for (uint32_t usage : items) {
+        if (is_modifier_usage(usage)) {
+            modifiers |= 1 << (usage - LEFT_CTRL_USAGE);
+        }
+    }
+    return modifiers;
+}
+
+static void hold_modifiers_only(uint8_t modifiers) {
+    macro_held.clear();
+    for (uint8_t i = 0; i < 8; i++) {
+        if (modifiers & (1 << i)) {
+            macro_held.push_back(LEFT_CTRL_USAGE + i);
+        }
+    }
+    macro_held_modifiers = modifiers;
+}
+
+// In high-rate mode macro steps are scheduled in microseconds and every
+// report carries as many consecutive steps as can be pressed together without
+// changing what the host sees: same modifiers, no repeated keys, at most
+// MACRO_KEYS_PER_REPORT keys and an order the host will preserve (array slots
+// are read in order, bitmap keys in ascending usage order). Steps that need
+// a key released or the modifiers changed first get an extra report.
+static void play_macros_high_rate(uint64_t now) {
+    if ((now < macro_next_step_at) || (or_items != 0)) {
+        // keep holding the current report until its time is up and it has been sent
         return;
     }
 
-    uint64_t now = get_time();
-    frame_counter++;
+    if (macro_queue.empty()) {
+        macro_held.clear();
+        macro_held_modifiers = 0;
+        return;
+    }
 
-    for (auto& tap_hold : tap_hold_usages) {
-        if ((*tap_hold.input_state != 0) && (*(tap_hold.input_state + PREV_STATE_OFFSET) == 0)) {
-            tap_hold.pressed_at = now;
+    if (macro_held.empty() && (macro_next_step_at + macro_step_duration_us < now)) {
+        // starting from idle, don't try to catch up
+        macro_next_step_at = now;
+    }
+
+    const std::vector<uint32_t>& first = macro_queue.front().items;
+    uint8_t modifiers = macro_entry_modifiers(first);
+    bool first_has_keys = false;
+    bool first_conflicts = false;
+    for (uint32_t usage : first) {
+        if (!is_modifier_usage(usage)) {
+            first_has_keys = true;
+            if (std::find(macro_held.begin(), macro_held.end(), usage) != macro_held.end()) {
+                first_conflicts = true;
+            }
         }
-        tap_hold.tap_hold_state->tap =
-            (*tap_hold.input_state == 0) && (*(tap_hold.input_state + PREV_STATE_OFFSET) != 0) &&
-            (now - tap_hold.pressed_at < tap_hold_threshold);
-        tap_hold.tap_hold_state->prev_hold = tap_hold.tap_hold_state->hold;
-        tap_hold.tap_hold_state->hold =
-            (*tap_hold.input_state != 0) &&
-            (now - tap_hold.pressed_at >= tap_hold_threshold);
     }
 
-    for (auto const& sticky : sticky_usages) {
-        if ((layer_state_mask & sticky.layer_mask) &&
-            ((*(sticky.input_state + PREV_STATE_OFFSET) == 0) && (*sticky.input_state != 0))) {
-            *sticky.sticky_state ^= (layer_state_mask & sticky.layer_mask);
-        }
+    if (first_has_keys && (modifiers != macro_held_modifiers)) {
+        // change modifiers (and release everything else) before pressing keys
+        hold_modifiers_only(modifiers);
+        return;
+    }
+
+    if (first_conflicts) {
+        // key is already pressed, release it first
+        hold_modifiers_only(macro_held_modifiers);
+        return;
     }
 
-    for (auto& tap_sticky : tap_sticky_usages) {
-        if ((layer_state_mask & tap_sticky.layer_mask) && tap_sticky.tap_hold_state->tap) {
-            *tap_sticky.sticky_state ^= (layer_state_mask & tap_sticky.layer_mask);
+    macro_held.clear();
+    macro_held_modifiers = modifiers;
+    uint8_t nkeys = 0;
+    uint32_t last_bitmap_key = 0;
+    bool batch_has_array_keys = false;
+    bool batch_has_other = false;
+
+    while (!macro_queue.empty() && (macro_next_step_at <= now)) {
+        const std::vector<uint32_t>& items = macro_queue.front().items;
+        bool first_in_batch = macro_held.empty();
+
+        if (!first_in_batch) {
+            if (batch_has_other || (macro_entry_modifiers(items) != modifiers)) {
+                break;
+            }
+            uint8_t entry_nkeys = 0;
+            bool fits = true;
+            uint32_t entry_last_bitmap_key = last_bitmap_key;
+            bool entry_has_array_keys = batch_has_array_keys;
+            for (uint32_t usage : items) {
+                if (is_modifier_usage(usage)) {
+                    continue;
+                }
+                if (((usage & 0xFFFF0000) != KEYBOARD_USAGE_PAGE) ||
+                    (std::find(macro_held.begin(), macro_held.end(), usage) != macro_held.end())) {
+                    fits = false;
+                    break;
+                }
+                if (is_array_key_usage(usage)) {
+                    entry_has_array_keys = true;
+                } else {
+                    if (usage <= entry_last_bitmap_key) {
+                        fits = false;
+                        break;
+                    }
+                    entry_last_bitmap_key = usage;
+                }
+                entry_nkeys++;
+            }
+            // mixing array and bitmap keys in one report doesn't preserve order
+            if (!fits ||
+                (entry_has_array_keys && (entry_last_bitmap_key != 0)) ||
+                (nkeys + entry_nkeys > MACRO_KEYS_PER_REPORT)) {
+                break;
+            }
         }
-    }
 
-    for (auto& hold_sticky : hold_sticky_usages) {
-        if ((layer_state_mask & hold_sticky.layer_mask) &&
-            hold_sticky.tap_hold_state->hold && !hold_sticky.tap_hold_state->prev_hold) {
-            *hold_sticky.sticky_state ^= (layer_state_mask & hold_sticky.layer_mask);
+        for (uint32_t usage : items) {
+            if (is_modifier_usage(usage)) {
+                if (first_in_batch) {
+                    macro_held.push_back(usage);
+                }
+                continue;
+            }
+            macro_held.push_back(usage);
+            if ((usage & 0xFFFF0000) != KEYBOARD_USAGE_PAGE) {
+                batch_has_other = true;
+            } else if (is_array_key_usage(usage)) {
+                batch_has_array_keys = true;
+            } else {
+                last_bitmap_key = usage;
+            }
+            nkeys++;
         }
+
+        macro_queue.pop();
+        macro_next_step_at += macro_step_duration_us;
     }
+}
 
+static void update_layer_state() {
     uint8_t new_layer_state_mask = 0;
     for (auto const& rev_map : reverse_mapping_layers) {
         uint16_t i = rev_map.target & 0xFFFF;
@@ -1165,39 +2843,210 @@ void process_mapping(bool auto_repeat) {
     }
 
     layer_state_mask = new_layer_state_mask;
+    if (layer_table_mask != layer_state_mask) {
+        layer_table = get_layer_table(layer_state_mask);
+        layer_table_mask = layer_state_mask;
+    }
+}
 
-    // evaluate all expressions
-    // XXX should we do this before or after tap-hold/sticky/layer logic?
-    port_register = 0;
-    for (uint8_t i = 0; i < NEXPRESSIONS; i++) {
-        int32_t result = eval_expr(i, frame_counter, auto_repeat);
-        int32_t* state_ptr = get_state_ptr(EXPR_USAGE_PAGE | (i + 1), 0);
-        if (state_ptr != NULL) {
-            *state_ptr = result;
+static void process_reverse_mapping(uint16_t rev_map_idx, bool auto_repeat, uint64_t now) {
+    auto& rev_map = reverse_mapping[rev_map_idx];
+    uint32_t target = rev_map.target;
+    bool register_target = (target & 0xFFFF0000) == REGISTER_USAGE_PAGE;
+    if (rev_map.is_relative) {
+        for_each_active_source(rev_map_idx, [&](map_source_t& map_source) {
+            int32_t value = 0;
+            if (auto_repeat || map_source.is_relative) {
+                if (map_source.sticky) {
+                    value = !!(*map_source.sticky_state & map_source.layer_mask) * map_source.scaling;
+                } else {
+                    value = map_source.hold ? map_source.tap_hold_state->hold : *map_source.input_state;
+                    if (map_source.is_binary) {
+                        value = !!value;
+                    }
+                    value *= map_source.scaling;
+                    if (((map_source.usage & 0xFFFF0000) == EXPR_USAGE_PAGE) ||
+                        ((map_source.usage & 0xFFFF0000) == REGISTER_USAGE_PAGE)) {
+                        value /= 1000;
+                    }
+                }
+            }
+            if (value != 0) {
+                if (target == V_SCROLL_USAGE || target == H_SCROLL_USAGE) {
+                    accumulated[rev_map.our_usage_id] += handle_scroll(map_source, target, value * RESOLUTION_MULTIPLIER, now);
+                } else {
+                    accumulated[rev_map.our_usage_id] += value;
+                }
+            }
+        });
+    } else {  // our_usage is absolute
+        int32_t value = rev_map.default_value;
+        for_each_active_source(rev_map_idx, [&](const map_source_t& map_source) {
+            if (map_source.sticky) {
+                if (*map_source.sticky_state & map_source.layer_mask) {
+                    value += 1 * map_source.scaling / 1000 - rev_map.default_value;
+                }
+            } else {
+                if ((map_source.tap && map_source.tap_hold_state->tap) ||
+                    (map_source.hold && map_source.tap_hold_state->hold)) {
+                    value += 1 * map_source.scaling / 1000 - rev_map.default_value;
+                }
+                if (!map_source.tap && !map_source.hold) {
+                    if (map_source.is_relative && !register_target) {
+                        if (*map_source.input_state * map_source.scaling > 0) {
+                            value += 1;
+                        }
+                    } else {
+                        if ((*map_source.input_state != 0) || (rev_map.default_value != 0)) {
+                            int32_t candidate = *map_source.input_state;
+                            if (map_source.is_binary) {
+                                candidate = !!candidate;
+                            }
+                            if ((candidate != 0) || !map_source.is_binary) {
+                                candidate = (int64_t) candidate * map_source.scaling / 1000;
+                                if (((map_source.usage & 0xFFFF0000) == EXPR_USAGE_PAGE) ||
+                                    ((map_source.usage & 0xFFFF0000) == REGISTER_USAGE_PAGE)) {
+                                    candidate /= 1000;
+                                }
+                                if (candidate != rev_map.default_value) {
+                                    value += candidate - rev_map.default_value;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        });
+
+        if ((rev_map.our_usage_id != NO_OUR_USAGE_ID) && injected[rev_map.our_usage_id]) {
+            int32_t injected_value = injected_state[rev_map.our_usage_id];
+            if (our_usage_defs[rev_map.our_usage_id]->size == 1) {
+                if (injected_value) {
+                    value = 1;
+                }
+            } else {
+                value += injected_value;
+            }
+        }
+
+        // we don't currently have any absolute usages that can be negative
+        if ((value < 0) && !register_target) {
+            value = 0;
+        }
+        if (register_target) {
+            value *= 1000;
+        }
+        if ((value != rev_map.default_value) || register_target) {
+            for (auto const& out_usage_def : rev_map.our_usages) {
+                if (out_usage_def.array_count == 0) {
+                    uint32_t effective_value = value;
+                    if ((out_usage_def.size < 32) && (effective_value > ((1 << out_usage_def.size) - 1))) {
+                        effective_value = (1 << out_usage_def.size) - 1;
+                    }
+                    put_bits(out_usage_def.data, out_usage_def.len, out_usage_def.bitpos, out_usage_def.size, effective_value);
+                } else {  // array range
+                    for (int i = 0; i < out_usage_def.array_count; i++) {
+                        int32_t existing_val = get_bits(out_usage_def.data, out_usage_def.len, out_usage_def.bitpos + i * out_usage_def.size, out_usage_def.size);
+                        // theoretically zero could be a valid index, but let's ignore that for now
+                        if (existing_val == 0) {
+                            put_bits(out_usage_def.data, out_usage_def.len, out_usage_def.bitpos + i * out_usage_def.size, out_usage_def.size, out_usage_def.array_index);
+                            break;
+                        }
+                    }
+                    // we don't do RollOver
+                }
+            }
+        }
+    }
+}
+
+void process_mapping(bool auto_repeat) {
+    if (suspended) {
+        return;
+    }
+
+    uint64_t now = get_time();
+    frame_counter++;
+
+    // tap and hold edges only last one frame
+    for (int16_t idx : tap_hold_one_frame) {
+        tap_hold_usages[idx].tap_hold_state->tap = false;
+        tap_hold_usages[idx].tap_hold_state->prev_hold = tap_hold_usages[idx].tap_hold_state->hold;
+    }
+    tap_hold_one_frame.clear();
+
+    for (uint16_t word = 0; word < (used_state_slots + 31) / 32; word++) {
+        while (changed_slots[word]) {
+            uint8_t bit = __builtin_ctz(changed_slots[word]);
+            changed_slots[word] &= ~(1 << bit);
+            watched_slot_changed(word * 32 + bit, now);
         }
     }
 
-    for (auto const& reg_ptr : register_ptrs) {
-        *reg_ptr.state_ptr = *reg_ptr.register_ptr;
+    run_timers(now);
+
+    if (layer_table_mask != layer_state_mask) {
+        layer_table = get_layer_table(layer_state_mask);
+        layer_table_mask = layer_state_mask;
+    }
+
+    // layers, expressions and mappings that target registers, in dependency order
+    port_register = 0;
+    for (uint8_t unit : eval_order) {
+        if (unit == EVAL_LAYERS) {
+            update_layer_state();
+        } else if (unit < EVAL_REGISTER(0)) {
+            uint8_t expr = unit - EVAL_EXPRESSION(0);
+            int32_t result = eval_expr(expr, frame_counter, auto_repeat);
+            int32_t* state_ptr = get_state_ptr(EXPR_USAGE_PAGE | (expr + 1), 0);
+            if (state_ptr != NULL) {
+                set_evaluated_state(state_ptr, result, now);
+            }
+        } else {
+            for (uint16_t rev_map_idx : register_rev_maps[unit - EVAL_REGISTER(0)]) {
+                process_reverse_mapping(rev_map_idx, auto_repeat, now);
+            }
+        }
+        if (eval_writes_registers & ((uint64_t) 1 << unit)) {
+            for (auto const& reg_ptr : register_ptrs) {
+                set_evaluated_state(reg_ptr.state_ptr, *reg_ptr.register_ptr, now);
+            }
+        }
     }
 
     // queue triggered macros
-    for (auto const& rev_map : reverse_mapping_macros) {
-        uint16_t macro = (rev_map.target & 0xFFFF) - 1;
+    for (uint16_t rev_map_idx = 0; rev_map_idx < reverse_mapping_macros.size(); rev_map_idx++) {
+        uint16_t macro = (reverse_mapping_macros[rev_map_idx].target & 0xFFFF) - 1;
         if (macro >= NMACROS) {
             continue;
         }
-        for (auto const& map_source : rev_map.sources) {
-            if ((layer_state_mask & map_source.layer_mask) &&
-                ((!map_source.tap && !map_source.hold && (*(map_source.input_state + PREV_STATE_OFFSET) == 0) && (*map_source.input_state != 0)) ||
-                    (map_source.hold && map_source.tap_hold_state->hold && !map_source.tap_hold_state->prev_hold) ||
-                    (map_source.tap && map_source.tap_hold_state->tap))) {
+        for_each_active_macro_source(rev_map_idx, [&](const map_source_t& map_source) {
+            if ((!map_source.tap && !map_source.hold && (*(map_source.input_state + PREV_STATE_OFFSET) == 0) && (*map_source.input_state != 0)) ||
+                (map_source.hold && map_source.tap_hold_state->hold && !map_source.tap_hold_state->prev_hold) ||
+                (map_source.tap && map_source.tap_hold_state->tap)) {
                 my_mutex_enter(MutexId::MACROS);
-                for (auto const& usages : macros[macro]) {
-                    macro_queue.push((macro_entry_t){ duration_left : macro_entry_duration, items : usages });
+                for (auto entry = macros[macro].begin(); entry != macros[macro].end(); entry++) {
+                    auto entry_end = std::find(entry, macros[macro].end(), 0);
+                    macro_queue.push((macro_entry_t){ duration_left : macro_entry_duration, items : std::vector<uint32_t>(entry, entry_end) });
+                    entry = entry_end;
                 }
                 my_mutex_exit(MutexId::MACROS);
             }
+        });
+    }
+
+    // switch profiles, the switch itself happens when the mappings are rebuilt in the main loop
+    if (profile_sources_changed) {
+        profile_sources_changed = false;
+        for (auto const& rev_map : reverse_mapping_profiles) {
+            for (auto const& map_source : rev_map.sources) {
+                if ((map_source.layer_mask & layer_state_mask) &&
+                    ((!map_source.tap && !map_source.hold && (*(map_source.input_state + PREV_STATE_OFFSET) == 0) && (*map_source.input_state != 0)) ||
+                        (map_source.hold && map_source.tap_hold_state->hold && !map_source.tap_hold_state->prev_hold) ||
+                        (map_source.tap && map_source.tap_hold_state->tap))) {
+                    set_active_profile(rev_map.target & 0xFFFF);
+                }
+            }
         }
     }
 
@@ -1210,168 +3059,37 @@ void process_mapping(bool auto_repeat) {
     digipot_state[5] = 0;
     dpad_state = 0;
 
-    for (auto& rev_map : reverse_mapping) {
-        uint32_t target = rev_map.target;
-        bool register_target = (target & 0xFFFF0000) == REGISTER_USAGE_PAGE;
-        if (rev_map.is_relative) {
-            for (auto& map_source : rev_map.sources) {
-                if ((map_source.orig_source_port != 0) &&
-                    !(active_ports_mask & (1 << map_source.orig_source_port))) {
-                    continue;
-                }
-                int32_t value = 0;
-                if (auto_repeat || map_source.is_relative) {
-                    if (map_source.sticky) {
-                        value = !!(*map_source.sticky_state & map_source.layer_mask) * map_source.scaling;
-                    } else {
-                        if (layer_state_mask & map_source.layer_mask) {
-                            value = map_source.hold ? map_source.tap_hold_state->hold : *map_source.input_state;
-                            if (map_source.is_binary) {
-                                value = !!value;
-                            }
-                            value *= map_source.scaling;
-                            if (((map_source.usage & 0xFFFF0000) == EXPR_USAGE_PAGE) ||
-                                ((map_source.usage & 0xFFFF0000) == REGISTER_USAGE_PAGE)) {
-                                value /= 1000;
-                            }
-                        }
-                    }
-                }
-                if (value != 0) {
-                    if (target == V_SCROLL_USAGE || target == H_SCROLL_USAGE) {
-                        accumulated[target] += handle_scroll(map_source, target, value * RESOLUTION_MULTIPLIER, now);
-                    } else {
-                        accumulated[target] += value;
-                    }
-                }
-            }
-        } else {  // our_usage is absolute
-            int32_t value = rev_map.default_value;
-            for (auto const& map_source : rev_map.sources) {
-                if ((map_source.orig_source_port != 0) &&
-                    !(active_ports_mask & (1 << map_source.orig_source_port))) {
-                    continue;
-                }
-                if (map_source.sticky) {
-                    if (*map_source.sticky_state & map_source.layer_mask) {
-                        value += 1 * map_source.scaling / 1000 - rev_map.default_value;
-                    }
-                } else {
-                    if ((layer_state_mask & map_source.layer_mask)) {
-                        if ((map_source.tap && map_source.tap_hold_state->tap) ||
-                            (map_source.hold && map_source.tap_hold_state->hold)) {
-                            value += 1 * map_source.scaling / 1000 - rev_map.default_value;
-                        }
-                        if (!map_source.tap && !map_source.hold) {
-                            if (map_source.is_relative && !register_target) {
-                                if (*map_source.input_state * map_source.scaling > 0) {
-                                    value += 1;
-                                }
-                            } else {
-                                if ((*map_source.input_state != 0) || (rev_map.default_value != 0)) {
-                                    int32_t candidate = *map_source.input_state;
-                                    if (map_source.is_binary) {
-                                        candidate = !!candidate;
-                                    }
-                                    if ((candidate != 0) || !map_source.is_binary) {
-                                        candidate = (int64_t) candidate * map_source.scaling / 1000;
-                                        if (((map_source.usage & 0xFFFF0000) == EXPR_USAGE_PAGE) ||
-                                            ((map_source.usage & 0xFFFF0000) == REGISTER_USAGE_PAGE)) {
-                                            candidate /= 1000;
-                                        }
-                                        if (candidate != rev_map.default_value) {
-                                            value += candidate - rev_map.default_value;
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-
-            if (injected_state.count(target)) {
-                int32_t injected = injected_state[target];
-                if (our_usages_flat[target].size == 1) {
-                    if (injected) {
-                        value = 1 * our_usages_flat[target].scaling / 1000;
-                    }
-                } else {
-                    value += injected;
-                }
-            }
-
-            // we don't currently have any absolute usages that can be negative
-            if ((value < 0) && !register_target) {
-                value = 0;
-            }
-            if (register_target) {
-                value *= 1000;
-            }
-            if ((value != rev_map.default_value) || register_target) {
-                for (auto const& out_usage_def : rev_map.our_usages) {
-                    if (out_usage_def.array_count == 0) {
-                        uint32_t effective_value = value;
-                        if ((out_usage_def.size < 32) && (effective_value > ((1 << out_usage_def.size) - 1))) {
-                            effective_value = (1 << out_usage_def.size) - 1;
-                        }
-                        put_bits(out_usage_def.data, out_usage_def.len, out_usage_def.bitpos, out_usage_def.size, effective_value);
-                    } else {  // array range
-                        for (int i = 0; i < out_usage_def.array_count; i++) {
-                            int32_t existing_val = get_bits(out_usage_def.data, out_usage_def.len, out_usage_def.bitpos + i * out_usage_def.size, out_usage_def.size);
-                            // theoretically zero could be a valid index, but let's ignore that for now
-                            if (existing_val == 0) {
-                                put_bits(out_usage_def.data, out_usage_def.len, out_usage_def.bitpos + i * out_usage_def.size, out_usage_def.size, out_usage_def.array_index);
-                                break;
-                            }
-                        }
-                        // we don't do RollOver
-                    }
-                }
+    if (layer_table != NULL) {
+        for (uint16_t rev_map_idx : layer_table->rev_maps) {
+            process_reverse_mapping(rev_map_idx, auto_repeat, now);
+        }
+    } else {
+        for (uint16_t rev_map_idx = 0; rev_map_idx < reverse_mapping.size(); rev_map_idx++) {
+            // register targets are handled in eval_order
+            if ((reverse_mapping[rev_map_idx].target & 0xFFFF0000) != REGISTER_USAGE_PAGE) {
+                process_reverse_mapping(rev_map_idx, auto_repeat, now);
             }
         }
     }
 
     // execute queued macros
-    if (!macro_queue.empty()) {
-        for (uint32_t usage : macro_queue.front().items) {
-            if ((usage & 0xFFFF0000) == GPIO_USAGE_PAGE) {
-                put_bits(gpio_out_state, sizeof(gpio_out_state), (uint16_t) (usage & 0xFFFF), 1, 1);
-            } else if ((usage & 0xFFFF0000) == DPAD_USAGE_PAGE) {
-                put_bits(&dpad_state, sizeof(dpad_state), (uint16_t) (usage & 0xFFFF) - 1, 1, 1);
+    if (macro_step_duration_us == 0) {
+        if (!macro_queue.empty()) {
+            for (uint32_t usage : macro_queue.front().items) {
+                press_macro_usage(usage);
+            }
+            if (macro_queue.front().duration_left > 0) {
+                macro_queue.front().duration_left--;
             } else {
-                bool handled = false;
-                for (auto const& array_usage : our_array_range_usages) {
-                    if ((usage >= array_usage.usage) && (usage <= array_usage.usage_def.usage_maximum)) {
-                        const uint8_t report_id = array_usage.usage_def.report_id;
-                        for (unsigned int i = 0; i < array_usage.usage_def.count; i++) {
-                            int32_t existing_val = get_bits(reports[report_id], report_sizes[report_id], array_usage.usage_def.bitpos + i * array_usage.usage_def.size, array_usage.usage_def.size);
-                            // theoretically zero could be a valid index, but let's ignore that for now
-                            if (existing_val == 0) {
-                                put_bits(reports[report_id], report_sizes[report_id], array_usage.usage_def.bitpos + i * array_usage.usage_def.size, array_usage.usage_def.size, array_usage.usage_def.logical_minimum + usage - array_usage.usage);
-                                break;
-                            }
-                        }
-                        // we don't do RollOver
-                        handled = true;
-                        break;
-                    }
-                }
-                if (!handled) {
-                    auto search = our_usages_flat.find(usage);
-                    if (search != our_usages_flat.end()) {
-                        const usage_def_t& our_usage = search->second;
-                        put_bits((uint8_t*) reports[our_usage.report_id], report_sizes[our_usage.report_id], our_usage.bitpos, our_usage.size, 1);
-                    }
+                if (or_items == 0) {
+                    macro_queue.pop();
                 }
             }
         }
-        if (macro_queue.front().duration_left > 0) {
-            macro_queue.front().duration_left--;
-        } else {
-            if (or_items == 0) {
-                macro_queue.pop();
-            }
+    } else {
+        play_macros_high_rate(now);
+        for (uint32_t usage : macro_held) {
+            press_macro_usage(usage);
         }
     }
 
@@ -1381,14 +3099,18 @@ void process_mapping(bool auto_repeat) {
     }
 
     for (auto state : relative_usages) {
-        *state = 0;
+        if (*state != 0) {
+            *state = 0;
+            mark_changed(state);
+        }
     }
 
-    for (auto& [usage, accumulated_val] : accumulated) {
+    for (uint16_t our_usage_id : our_relative_usage_ids) {
+        int32_t& accumulated_val = accumulated[our_usage_id];
         if (accumulated_val == 0) {
             continue;
         }
-        usage_def_t& our_usage = our_usages_flat[usage];
+        const usage_def_t& our_usage = *our_usage_defs[our_usage_id];
         // XXX I don't think this is necessary now that we only do process_mapping once per frame (existing_val is always zero)
         int32_t existing_val = get_bits((uint8_t*) reports[our_usage.report_id], report_sizes[our_usage.report_id], our_usage.bitpos, our_usage.size);
         if (our_usage.logical_minimum < 0) {
@@ -1492,12 +3214,19 @@ void monitor_usage(uint32_t usage, int32_t value, uint8_t hub_port) {
 }
 
 void inject_input(uint32_t usage, int32_t value) {
-    if (our_usages_flat.count(usage)) {
-        usage_def_t& our_usage = our_usages_flat[usage];
-        if (our_usage.is_relative) {
-            accumulated[usage] += value;
+    auto search = our_usage_ids.find(usage);
+    if (search != our_usage_ids.end()) {
+        uint16_t our_usage_id = search->second;
+        if (our_usage_defs[our_usage_id]->is_relative) {
+            accumulated[our_usage_id] += value;
         } else {
-            injected_state[usage] = value;
+            bool new_target = !injected[our_usage_id];
+            injected[our_usage_id] = true;
+            injected_state[our_usage_id] = value;
+            if (new_target) {
+                layer_tables_generation++;
+                build_layer_tables();
+            }
         }
     }
 }
@@ -1525,9 +3254,11 @@ inline void read_input(const uint8_t* report, int len, uint32_t source_usage, co
     if (their_usage.is_relative) {
         if (their_usage.input_state_0 != NULL) {
             *(their_usage.input_state_0) += value;
+            mark_changed(their_usage.input_state_0);
         }
         if (their_usage.input_state_n != NULL) {
             *(their_usage.input_state_n) = value;  // XXX does it need to be += ?
+            mark_changed(their_usage.input_state_n);
         }
     } else {
         int32_t scaled_value;
@@ -1538,17 +3269,20 @@ inline void read_input(const uint8_t* report, int len, uint32_t source_usage, co
         }
         if (their_usage.input_state_0 != NULL) {
             if ((their_usage.size == 1) || their_usage.is_array) {
+                uint32_t slot = their_usage.input_state_0 - input_state;
                 if (value) {
-                    *(their_usage.input_state_0) |= 1 << interface_idx;
+                    set_interface_bit(*(their_usage.input_state_0), interface_idx, shared_input_bits, slot);
                 } else {
-                    *(their_usage.input_state_0) &= ~(1 << interface_idx);
+                    clear_interface_bit(*(their_usage.input_state_0), interface_idx, shared_input_bits, slot);
                 }
             } else {
                 *(their_usage.input_state_0) = scaled_value;
             }
+            mark_changed(their_usage.input_state_0);
         }
         if (their_usage.input_state_n != NULL) {
             *(their_usage.input_state_n) = scaled_value;
+            mark_changed(their_usage.input_state_n);
         }
     }
 }
@@ -1563,12 +3297,15 @@ inline void read_input_range(const uint8_t* report, int len, uint32_t source_usa
             uint32_t actual_usage = source_usage + bits - their_usage.logical_minimum;
             int32_t* state_ptr_0 = get_state_ptr(actual_usage, 0);
             if (state_ptr_0 != NULL) {
-                *state_ptr_0 |= 1 << interface_idx;
+                set_interface_bit(*state_ptr_0, interface_idx, shared_input_bits, state_ptr_0 - input_state);
+                mark_changed(state_ptr_0);
             }
             if (hub_port != HUB_PORT_NONE) {
                 int32_t* state_ptr_n = get_state_ptr(actual_usage, hub_port);
                 if (state_ptr_n != NULL) {
-                    *state_ptr_n = 1 << interface_idx;  // set the bit because in do_handle_received_report we clear it not knowing if it's "0" or "n"
+                    // set the bit because in do_handle_received_report we clear it not knowing if it's "0" or "n"
+                    set_interface_bit(*state_ptr_n, interface_idx, shared_input_bits, state_ptr_n - input_state);
+                    mark_changed(state_ptr_n);
                 }
             }
         }
@@ -1601,13 +3338,14 @@ inline void monitor_read_input(const uint8_t* report, int len, uint32_t source_u
         }
     } else {
         if ((their_usage.size == 1) || their_usage.is_array) {
-            if (value != (1 & (monitor_input_state[source_usage] >> interface_idx))) {
+            int32_t& state = monitor_input_state[source_usage];
+            if (value != get_interface_bit(state, interface_idx, shared_monitor_bits, source_usage)) {
                 monitor_usage(source_usage, value, hub_port);
             }
             if (value) {
-                monitor_input_state[source_usage] |= 1 << interface_idx;
+                set_interface_bit(state, interface_idx, shared_monitor_bits, source_usage);
             } else {
-                monitor_input_state[source_usage] &= ~(1 << interface_idx);
+                clear_interface_bit(state, interface_idx, shared_monitor_bits, source_usage);
             }
         } else {
             if (value != monitor_input_state[source_usage]) {
@@ -1667,8 +3405,10 @@ void do_handle_received_report(const uint8_t* report, int len, uint16_t interfac
 
     my_mutex_enter(MutexId::THEIR_USAGES);
 
+    auto their = their_descriptors.find(interface);
+
     uint8_t report_id = 0;
-    if (has_report_id_theirs[interface]) {
+    if ((their != their_descriptors.end()) && their->second.has_report_id) {
         if (external_report_id != 0) {
             report_id = external_report_id;
         } else {
@@ -1683,7 +3423,8 @@ void do_handle_received_report(const uint8_t* report, int len, uint16_t interfac
 
     if (!is_rollover(report, len, interface, report_id)) {
         for (int32_t* state_ptr : array_range_usages[interface][report_id]) {
-            *state_ptr &= ~(1 << interface_idx);
+            clear_interface_bit(*state_ptr, interface_idx, shared_input_bits, state_ptr - input_state);
+            mark_changed(state_ptr);
         }
 
         for (auto const& their : their_used_usages[interface][report_id]) {
@@ -1695,8 +3436,14 @@ void do_handle_received_report(const uint8_t* report, int len, uint16_t interfac
         }
     }
 
-    if (monitor_enabled) {
-        for (auto const& [their_usage, their_usage_def] : their_usages[interface][report_id]) {
+    const report_usages_t* report_usages = NULL;
+    if (monitor_enabled && (their != their_descriptors.end())) {
+        report_usages = find_report(their->second.input, report_id);
+    }
+    if (report_usages != NULL) {
+        for (uint32_t i = report_usages->first; i < report_usages->first + report_usages->count; i++) {
+            uint32_t their_usage = their->second.input.usages[i].usage;
+            const usage_def_t& their_usage_def = their->second.input.usages[i].usage_def;
             if (their_usage_def.usage_maximum == 0) {
                 monitor_read_input(report, len, their_usage, their_usage_def, interface_idx, hub_port);
             } else {
@@ -1758,17 +3505,31 @@ void set_input_state(uint32_t usage, int32_t state_raw, int32_t state_scaled, ui
     int32_t* state_ptr = get_state_ptr(usage, hub_port, false, true);
     if (state_ptr != NULL) {
         *state_ptr = state_raw;
+        mark_changed(state_ptr);
     }
     state_ptr = get_state_ptr(usage, hub_port, false, false);
     if (state_ptr != NULL) {
         *state_ptr = state_scaled;
+        mark_changed(state_ptr);
     }
 }
 
-void rlencode(const std::set<uint64_t>& usage_ranges, std::vector<usage_rle_t>& output) {
+static inline uint64_t range_key(uint64_t range) {
+    return range;
+}
+
+template <typename T>
+static inline uint64_t range_key(const std::pair<const uint64_t, T>& item) {
+    return item.first;
+}
+
+// usage_ranges must be ordered (std::set of ranges or std::map keyed by them)
+template <typename C>
+void rlencode(const C& usage_ranges, std::vector<usage_rle_t>& output) {
     uint32_t start_usage = 0;
     uint32_t count = 0;
-    for (auto const& range : usage_ranges) {
+    for (auto const& item : usage_ranges) {
+        uint64_t range = range_key(item);
         uint32_t usage_minimum = range >> 32;
         uint32_t usage_maximum = range & 0xFFFFFFFF;
 
@@ -1805,167 +3566,317 @@ bool should_scale_input(const usage_def_t& their_usage) {
     return true;
 }
 
-void update_their_descriptor_derivates() {
-    std::unordered_set<int32_t*> relative_usage_set;
-    std::unordered_set<int32_t*> binary_usage_set;
-    std::set<uint64_t> their_usage_ranges_set;
-
-    relative_usages.clear();
-    their_used_usages.clear();
-    array_range_usages.clear();
-    rollover_usages.clear();
-
-    for (auto& [interface, report_id_usage_map] : their_usages) {
-        uint8_t hub_port = hub_ports[interface >> 8];
-        for (auto& [report_id, usage_map] : report_id_usage_map) {
-            for (auto [usage, usage_def] : usage_map) {
-                usage_def.should_be_scaled = should_scale_input(usage_def);
-                if (usage_def.usage_maximum == 0) {
-                    int32_t* state_ptr_0 = get_state_ptr(usage, 0);
-                    int32_t* state_ptr_n = get_state_ptr(usage, hub_port);
-                    int32_t* state_ptr_raw_0 = get_state_ptr(usage, 0, false, true);
-                    int32_t* state_ptr_raw_n = get_state_ptr(usage, hub_port, false, true);
-                    their_usage_ranges_set.insert(((uint64_t) usage << 32) | usage);
-                    if (usage_def.is_relative) {
-                        if (state_ptr_0 != NULL) {
-                            relative_usage_set.insert(state_ptr_0);
-                        }
-                        if (state_ptr_n != NULL) {
-                            relative_usage_set.insert(state_ptr_n);
-                        }
-                        if (state_ptr_raw_0 != NULL) {
-                            relative_usage_set.insert(state_ptr_raw_0);
-                        }
-                        if (state_ptr_raw_n != NULL) {
-                            relative_usage_set.insert(state_ptr_raw_n);
-                        }
-                    }
-                    if ((usage_def.size == 1) || usage_def.is_array) {
-                        if (state_ptr_0 != NULL) {
-                            binary_usage_set.insert(state_ptr_0);
-                        }
-                        if (state_ptr_n != NULL) {
-                            binary_usage_set.insert(state_ptr_n);
-                        }
-                        if (state_ptr_raw_0 != NULL) {
-                            binary_usage_set.insert(state_ptr_raw_0);
-                        }
-                        if (state_ptr_raw_n != NULL) {
-                            binary_usage_set.insert(state_ptr_raw_n);
-                        }
-                    }
-                    if ((state_ptr_0 != NULL) || (state_ptr_n != NULL)) {
-                        usage_def.input_state_0 = state_ptr_0;
-                        usage_def.input_state_n = state_ptr_n;
-                        their_used_usages[interface][report_id].push_back((usage_usage_def_t){
-                            .usage = usage,
-                            .usage_def = usage_def,
-                        });
-                    }
-                    if ((state_ptr_raw_0 != NULL) || (state_ptr_raw_n != NULL)) {
-                        usage_def.input_state_0 = state_ptr_raw_0;
-                        usage_def.input_state_n = state_ptr_raw_n;
-                        usage_def.should_be_scaled = false;
-                        their_used_usages[interface][report_id].push_back((usage_usage_def_t){
-                            .usage = usage,
-                            .usage_def = usage_def,
-                        });
-                    }
-                    if (usage == ROLLOVER_USAGE) {
-                        rollover_usages[interface][report_id].push_back(usage_def);
+static void add_slot(std::vector<uint16_t>& slots, const int32_t* state_ptr) {
+    if (state_ptr != NULL) {
+        slots.push_back(state_slot(state_ptr));
+    }
+}
+
+// Fills their_used_usages, array_range_usages and rollover_usages for one interface
+// and records which slots and usages it provides in derivates.
+static void derive_interface(uint16_t interface, const parsed_descriptor_t& their, interface_derivates_t& derivates) {
+    uint8_t hub_port = hub_ports[interface >> 8];
+    for (uint16_t r = 0; r < their.input.nreports; r++) {
+        uint8_t report_id = their.input.reports[r].report_id;
+        uint32_t first = their.input.reports[r].first;
+        for (uint32_t i = first; i < first + their.input.reports[r].count; i++) {
+            uint32_t usage = their.input.usages[i].usage;
+            usage_def_t usage_def = their.input.usages[i].usage_def;
+            usage_def.should_be_scaled = should_scale_input(usage_def);
+            if (usage_def.usage_maximum == 0) {
+                int32_t* state_ptr_0 = get_state_ptr(usage, 0);
+                int32_t* state_ptr_n = get_state_ptr(usage, hub_port);
+                int32_t* state_ptr_raw_0 = get_state_ptr(usage, 0, false, true);
+                int32_t* state_ptr_raw_n = get_state_ptr(usage, hub_port, false, true);
+                derivates.usage_ranges.push_back(((uint64_t) usage << 32) | usage);
+                if (usage_def.is_relative) {
+                    add_slot(derivates.relative_slots, state_ptr_0);
+                    add_slot(derivates.relative_slots, state_ptr_n);
+                    add_slot(derivates.relative_slots, state_ptr_raw_0);
+                    add_slot(derivates.relative_slots, state_ptr_raw_n);
+                }
+                if ((usage_def.size == 1) || usage_def.is_array) {
+                    add_slot(derivates.binary_slots, state_ptr_0);
+                    add_slot(derivates.binary_slots, state_ptr_n);
+                    add_slot(derivates.binary_slots, state_ptr_raw_0);
+                    add_slot(derivates.binary_slots, state_ptr_raw_n);
+                }
+                add_slot(derivates.live_slots, state_ptr_0);
+                add_slot(derivates.live_slots, state_ptr_n);
+                add_slot(derivates.live_slots, state_ptr_raw_0);
+                add_slot(derivates.live_slots, state_ptr_raw_n);
+                if ((state_ptr_0 != NULL) || (state_ptr_n != NULL)) {
+                    usage_def.input_state_0 = state_ptr_0;
+                    usage_def.input_state_n = state_ptr_n;
+                    their_used_usages[interface][report_id].push_back((usage_usage_def_t){
+                        .usage = usage,
+                        .usage_def = usage_def,
+                    });
+                }
+                if ((state_ptr_raw_0 != NULL) || (state_ptr_raw_n != NULL)) {
+                    usage_def.input_state_0 = state_ptr_raw_0;
+                    usage_def.input_state_n = state_ptr_raw_n;
+                    usage_def.should_be_scaled = false;
+                    their_used_usages[interface][report_id].push_back((usage_usage_def_t){
+                        .usage = usage,
+                        .usage_def = usage_def,
+                    });
+                }
+                if (usage == ROLLOVER_USAGE) {
+                    rollover_usages[interface][report_id].push_back(usage_def);
+                }
+            } else {  // usage_maximum != 0, array range usage
+                derivates.usage_ranges.push_back(((uint64_t) usage << 32) | usage_def.usage_maximum);
+                bool any_used = false;
+                for (uint32_t actual_usage = usage; actual_usage <= usage_def.usage_maximum; actual_usage++) {
+                    int32_t* state_ptr_0 = get_state_ptr(actual_usage, 0);
+                    int32_t* state_ptr_n = get_state_ptr(actual_usage, hub_port);
+                    if (state_ptr_0 != NULL) {
+                        any_used = true;
+                        array_range_usages[interface][report_id].push_back(state_ptr_0);
+                        add_slot(derivates.binary_slots, state_ptr_0);
+                        add_slot(derivates.live_slots, state_ptr_0);
                     }
-                } else {  // usage_maximum != 0, array range usage
-                    their_usage_ranges_set.insert(((uint64_t) usage << 32) | usage_def.usage_maximum);
-                    bool any_used = false;
-                    for (uint32_t actual_usage = usage; actual_usage <= usage_def.usage_maximum; actual_usage++) {
-                        int32_t* state_ptr_0 = get_state_ptr(actual_usage, 0);
-                        int32_t* state_ptr_n = get_state_ptr(actual_usage, hub_port);
-                        if (state_ptr_0 != NULL) {
-                            any_used = true;
-                            array_range_usages[interface][report_id].push_back(state_ptr_0);
-                            binary_usage_set.insert(state_ptr_0);
-                        }
-                        if (state_ptr_n != NULL) {
-                            any_used = true;
-                            array_range_usages[interface][report_id].push_back(state_ptr_n);
-                            binary_usage_set.insert(state_ptr_n);
-                        }
-                        if (actual_usage == ROLLOVER_USAGE) {
-                            rollover_usages[interface][report_id].push_back((usage_def_t){
-                                .size = usage_def.size,
-                                .bitpos = usage_def.bitpos,
-                                .is_array = true,
-                                .index = usage_def.logical_minimum + actual_usage - usage,
-                                .count = usage_def.count,
-                            });
-                        }
+                    if (state_ptr_n != NULL) {
+                        any_used = true;
+                        array_range_usages[interface][report_id].push_back(state_ptr_n);
+                        add_slot(derivates.binary_slots, state_ptr_n);
+                        add_slot(derivates.live_slots, state_ptr_n);
                     }
-                    if (any_used) {
-                        their_used_usages[interface][report_id].push_back((usage_usage_def_t){
-                            .usage = usage,
-                            .usage_def = usage_def,
+                    if (actual_usage == ROLLOVER_USAGE) {
+                        rollover_usages[interface][report_id].push_back((usage_def_t){
+                            .size = usage_def.size,
+                            .bitpos = usage_def.bitpos,
+                            .is_array = true,
+                            .index = usage_def.logical_minimum + actual_usage - usage,
+                            .count = usage_def.count,
                         });
                     }
                 }
+                if (any_used) {
+                    their_used_usages[interface][report_id].push_back((usage_usage_def_t){
+                        .usage = usage,
+                        .usage_def = usage_def,
+                    });
+                }
             }
         }
     }
 
-    for (int32_t* ptr : relative_usage_set) {
-        relative_usages.push_back(ptr);
+    for (uint16_t r = 0; r < their.output.nreports; r++) {
+        uint32_t first = their.output.reports[r].first;
+        for (uint32_t i = first; i < first + their.output.reports[r].count; i++) {
+            derivates.out_usages.push_back(their.output.usages[i].usage);
+        }
+    }
+
+    // Some keyboards have the same usage as both non-array and array inputs.
+    // By reading the non-array ones first we get the right result regardless of which they actually use.
+    for (auto& [report_id, usages_vector] : their_used_usages[interface]) {
+        std::stable_sort(usages_vector.begin(), usages_vector.end(),
+            [](const usage_usage_def_t& a, const usage_usage_def_t& b) {
+                return (a.usage_def.is_array < b.usage_def.is_array);
+            });
     }
 
-    their_usages_rle.clear();
-    rlencode(their_usage_ranges_set, their_usages_rle);
+    // each interface counts once
+    for (auto* slots : { &derivates.relative_slots, &derivates.binary_slots, &derivates.live_slots }) {
+        std::sort(slots->begin(), slots->end());
+        slots->erase(std::unique(slots->begin(), slots->end()), slots->end());
+    }
+    std::sort(derivates.usage_ranges.begin(), derivates.usage_ranges.end());
+    derivates.usage_ranges.erase(std::unique(derivates.usage_ranges.begin(), derivates.usage_ranges.end()), derivates.usage_ranges.end());
+}
 
-    for (auto& rev_map : reverse_mapping) {
-        for (auto& map_source : rev_map.sources) {
-            map_source.is_relative = relative_usage_set.count(map_source.input_state) > 0;
-            map_source.is_binary = ((binary_usage_set.count(map_source.input_state) > 0) &&
-                                       (map_source.usage != H_SCROLL_USAGE) &&
-                                       !((map_source.usage >= 0x00010030) && (map_source.usage <= 0x00010039))) ||
-                                   ((map_source.usage & 0xFFFF0000) == GPIO_USAGE_PAGE);
-        }
-        auto search = their_out_usages_flat.find(rev_map.target);
-        if (search != their_out_usages_flat.end()) {
-            rev_map.our_usages.clear();
-            for (auto dev_addr_int_rep_id : search->second) {
-                uint8_t hub_port = hub_ports[dev_addr_int_rep_id >> 24];
-                if ((rev_map.hub_port == 0) || (rev_map.hub_port == hub_port)) {
-                    auto const& our_usage2 = their_out_usages[dev_addr_int_rep_id >> 16][dev_addr_int_rep_id & 0xFFFF][rev_map.target];
-                    rev_map.our_usages.push_back((out_usage_def_t){
-                        .data = out_reports[dev_addr_int_rep_id],
-                        .len = out_report_sizes[dev_addr_int_rep_id],
-                        .size = our_usage2.size,
-                        .bitpos = our_usage2.bitpos,
-                    });
+// Adjusts reference counts, returns true if anything went from zero to non-zero or back.
+template <typename K>
+static bool add_refs(std::unordered_map<K, uint16_t>& refs, const std::vector<K>& keys, std::vector<K>* flipped) {
+    bool changed = false;
+    for (K key : keys) {
+        if (refs[key]++ == 0) {
+            changed = true;
+            if (flipped != NULL) {
+                flipped->push_back(key);
+            }
+        }
+    }
+    return changed;
+}
+
+template <typename K>
+static bool remove_refs(std::unordered_map<K, uint16_t>& refs, const std::vector<K>& keys, std::vector<K>* flipped) {
+    bool changed = false;
+    for (K key : keys) {
+        auto search = refs.find(key);
+        if ((search != refs.end()) && (--search->second == 0)) {
+            refs.erase(search);
+            changed = true;
+            if (flipped != NULL) {
+                flipped->push_back(key);
+            }
+        }
+    }
+    return changed;
+}
+
+// Only the interfaces that were added or removed since the last call are looked at, unless mappings
+// were compiled from scratch or new input state slots were assigned, in which case everything is
+// derived from scratch. (Mappings that are patched in link themselves, see patch_mappings().)
+void update_their_descriptor_derivates() {
+    std::vector<uint16_t> changes;
+    my_mutex_enter(MutexId::THEIR_USAGES);
+    changes.swap(their_descriptor_changes);
+    my_mutex_exit(MutexId::THEIR_USAGES);
+
+    bool full = all_interfaces_dirty;
+    all_interfaces_dirty = false;
+
+    if (full) {
+        their_used_usages.clear();
+        array_range_usages.clear();
+        rollover_usages.clear();
+        interface_derivates.clear();
+        relative_slot_refs.clear();
+        binary_slot_refs.clear();
+        live_slot_refs.clear();
+        their_usage_ranges.clear();
+        memset(live_slots, 0, sizeof(live_slots));
+
+        changes.clear();
+        for (auto const& [interface, their] : their_descriptors) {
+            changes.push_back(interface);
+        }
+
+        rebuild_slot_sources();
+    }
+
+    std::vector<uint16_t> flipped_slots;  // relative or binary
+    std::vector<uint16_t> flipped_live_slots;
+    std::unordered_set<uint32_t> changed_out_usages;
+    bool relative_changed = full;
+    bool ranges_changed = full;
+
+    for (uint16_t interface : changes) {
+        auto search = interface_derivates.find(interface);
+        if (search != interface_derivates.end()) {
+            interface_derivates_t& derivates = search->second;
+            relative_changed |= remove_refs(relative_slot_refs, derivates.relative_slots, &flipped_slots);
+            remove_refs(binary_slot_refs, derivates.binary_slots, &flipped_slots);
+            remove_refs(live_slot_refs, derivates.live_slots, &flipped_live_slots);
+            for (uint64_t range : derivates.usage_ranges) {
+                auto range_search = their_usage_ranges.find(range);
+                if ((range_search != their_usage_ranges.end()) && (--range_search->second == 0)) {
+                    their_usage_ranges.erase(range_search);
+                    ranges_changed = true;
+                }
+            }
+            changed_out_usages.insert(derivates.out_usages.begin(), derivates.out_usages.end());
+            their_used_usages.erase(interface);
+            array_range_usages.erase(interface);
+            rollover_usages.erase(interface);
+            interface_derivates.erase(search);
+        }
+
+        auto their_search = their_descriptors.find(interface);
+        if (their_search != their_descriptors.end()) {
+            interface_derivates_t& derivates = interface_derivates[interface];
+            derive_interface(interface, their_search->second, derivates);
+            relative_changed |= add_refs(relative_slot_refs, derivates.relative_slots, &flipped_slots);
+            add_refs(binary_slot_refs, derivates.binary_slots, &flipped_slots);
+            add_refs(live_slot_refs, derivates.live_slots, &flipped_live_slots);
+            for (uint64_t range : derivates.usage_ranges) {
+                if (their_usage_ranges[range]++ == 0) {
+                    ranges_changed = true;
                 }
             }
+            changed_out_usages.insert(derivates.out_usages.begin(), derivates.out_usages.end());
         }
     }
 
-    // Some keyboards have the same usage as both non-array and array inputs.
-    // By reading the non-array ones first we get the right result regardless of which they actually use.
-    for (auto& [interface, report_id_usages_map] : their_used_usages) {
-        for (auto& [report_id, usages_vector] : report_id_usages_map) {
-            std::sort(usages_vector.begin(), usages_vector.end(),
-                [](const usage_usage_def_t& a, const usage_usage_def_t& b) {
-                    return (a.usage_def.is_array < b.usage_def.is_array);
-                });
+    if (relative_changed) {
+        relative_usages.clear();
+        for (auto const& [slot, refs] : relative_slot_refs) {
+            relative_usages.push_back(input_state + slot);
+        }
+    }
+
+    if (ranges_changed) {
+        their_usages_rle.clear();
+        rlencode(their_usage_ranges, their_usages_rle);
+        their_usages_generation++;
+    }
+
+    for (uint16_t slot : flipped_live_slots) {
+        if (live_slot_refs.count(slot)) {
+            live_slots[slot >> 5] |= 1 << (slot & 31);
+        } else {
+            live_slots[slot >> 5] &= ~(1 << (slot & 31));
+        }
+    }
+
+    if (full) {
+        for_each_compiled_reverse_mapping([](std::vector<reverse_mapping_t>& rev_maps) {
+            for (auto& rev_map : rev_maps) {
+                for (auto& map_source : rev_map.sources) {
+                    link_source(map_source);
+                }
+                link_out_usages(rev_map);
+            }
+        });
+    } else {
+        for (uint16_t slot : flipped_slots) {
+            if (slot < slot_sources.size()) {
+                for (map_source_t* map_source : slot_sources[slot]) {
+                    link_source(*map_source);
+                }
+            }
+        }
+        if (!changed_out_usages.empty()) {
+            for_each_compiled_reverse_mapping([&](std::vector<reverse_mapping_t>& rev_maps) {
+                for (auto& rev_map : rev_maps) {
+                    if (changed_out_usages.count(rev_map.target)) {
+                        // the target may be gone from all devices, don't keep pointers to freed buffers
+                        rev_map.our_usages.clear();
+                        link_out_usages(rev_map);
+                    }
+                }
+            });
         }
     }
+
+    if (full || !flipped_live_slots.empty() || (layer_tables_ports_mask != active_ports_mask)) {
+        // precompiled profiles rebuild theirs when they're switched to
+        layer_tables_generation++;
+        build_layer_tables();
+    }
+}
+
+static void add_our_usage(uint32_t usage, const usage_def_t* usage_def) {
+    auto search = our_usage_ids.find(usage);
+    if (search != our_usage_ids.end()) {
+        // same usage in more than one report, the last one wins
+        our_usage_defs[search->second] = usage_def;
+        return;
+    }
+    our_usage_ids[usage] = our_usage_defs.size();
+    our_usage_defs.push_back(usage_def);
 }
 
 void parse_our_descriptor() {
-    std::unordered_map<uint8_t, std::unordered_map<uint32_t, usage_def_t>> our_feature_usages;
+    descriptor_usages_t parsed;
+    parsed_descriptor_t our_parsed;
 
-    our_usages.clear();
+    our_usages = {};
+    arena_release(our_usages_arena);
     our_usages_rle.clear();
-    their_usages.erase(OUR_OUT_INTERFACE);
-    has_report_id_theirs.erase(OUR_OUT_INTERFACE);
-    our_usages_flat.clear();
+    their_descriptors.erase(OUR_OUT_INTERFACE);
+    our_usage_ids.clear();
+    our_usage_defs.clear();
+    our_relative_usage_ids.clear();
     our_array_range_usages.clear();
     have_dpad = false;
+    // the compiled mappings point into the reports we're about to free
+    all_mappings_dirty = true;
 
     for (unsigned int i = 0; i < report_ids.size(); i++) {
         uint8_t report_id = report_ids[i];
@@ -1982,15 +3893,22 @@ void parse_our_descriptor() {
     memset(report_masks_relative, 0, sizeof(report_masks_relative));
     memset(report_masks_absolute, 0, sizeof(report_masks_absolute));
 
-    auto report_sizes_map = parse_descriptor(
-        our_usages,
-        their_usages[OUR_OUT_INTERFACE],
-        our_feature_usages,
-        has_report_id_theirs[OUR_OUT_INTERFACE],
+    parse_descriptor(
+        parsed,
         boot_protocol_keyboard ? boot_kb_report_descriptor : our_descriptor->descriptor,
         boot_protocol_keyboard ? boot_kb_report_descriptor_length : our_descriptor->descriptor_length);
+    pack_descriptor(our_parsed, our_usages_arena, parsed);
+
+    // what the host sends us is processed like input from a device on an extra interface
+    our_usages = our_parsed.input;
+    their_descriptors[OUR_OUT_INTERFACE] = (parsed_descriptor_t){
+        .input = our_parsed.output,
+        .has_report_id = our_parsed.has_report_id,
+    };
 
-    for (auto const& [report_id, size] : report_sizes_map[ReportType::INPUT]) {
+    for (uint16_t i = 0; i < our_usages.nreports; i++) {
+        uint8_t report_id = our_usages.reports[i].report_id;
+        uint16_t size = our_usages.reports[i].size;
         report_sizes[report_id] = size;
         reports[report_id] = new uint8_t[size];
         memset(reports[report_id], 0, size);
@@ -2004,18 +3922,23 @@ void parse_our_descriptor() {
         report_ids.push_back(report_id);
     }
 
+    our_usage_defs.reserve(our_usages.nusages + 4);  // dpad adds 4
     std::set<uint64_t> our_usage_ranges_set;
-    for (auto const& [report_id, usage_map] : our_usages) {
-        for (auto const& [usage, usage_def] : usage_map) {
+    for (uint16_t r = 0; r < our_usages.nreports; r++) {
+        uint8_t report_id = our_usages.reports[r].report_id;
+        uint32_t first = our_usages.reports[r].first;
+        for (uint32_t i = first; i < first + our_usages.reports[r].count; i++) {
+            uint32_t usage = our_usages.usages[i].usage;
+            const usage_def_t& usage_def = our_usages.usages[i].usage_def;
             if (usage_def.usage_maximum == 0) {
-                our_usages_flat[usage] = usage_def;
+                add_our_usage(usage, &usage_def);
                 if (usage == DPAD_USAGE) {
                     our_dpad_usage = usage_def;
                     have_dpad = true;
-                    our_usages_flat[DPAD_USAGE_LEFT] = (usage_def_t){};
-                    our_usages_flat[DPAD_USAGE_RIGHT] = (usage_def_t){};
-                    our_usages_flat[DPAD_USAGE_UP] = (usage_def_t){};
-                    our_usages_flat[DPAD_USAGE_DOWN] = (usage_def_t){};
+                    add_our_usage(DPAD_USAGE_LEFT, &dpad_direction_usage_def);
+                    add_our_usage(DPAD_USAGE_RIGHT, &dpad_direction_usage_def);
+                    add_our_usage(DPAD_USAGE_UP, &dpad_direction_usage_def);
+                    add_our_usage(DPAD_USAGE_DOWN, &dpad_direction_usage_def);
                 }
                 our_usage_ranges_set.insert(((uint64_t) usage << 32) | (usage_def.usage_maximum ? usage_def.usage_maximum : usage));
 
@@ -2035,11 +3958,20 @@ void parse_our_descriptor() {
         }
     }
 
+    for (uint16_t our_usage_id = 0; our_usage_id < our_usage_defs.size(); our_usage_id++) {
+        if (our_usage_defs[our_usage_id]->is_relative) {
+            our_relative_usage_ids.push_back(our_usage_id);
+        }
+    }
+    accumulated.assign(our_usage_defs.size(), 0);
+    injected_state.assign(our_usage_defs.size(), 0);
+    injected.assign(our_usage_defs.size(), false);
+
     rlencode(our_usage_ranges_set, our_usages_rle);
 }
 
 void print_stats() {
-    printf("%lu %lu %lu\n", reports_received, reports_sent, processing_time);
+    printf("%lu %lu %lu %u %lu %lu\n", reports_received, reports_sent, processing_time, armed_timers, descriptor_cache_hits, descriptor_cache_misses);
     reports_received = 0;
     reports_sent = 0;
     processing_time = 0;
@@ -2047,7 +3979,9 @@ void print_stats() {
 
 void reset_state() {
     memset(registers, 0, sizeof(registers));
-    accumulated.clear();
+    macro_held.clear();
+    macro_held_modifiers = 0;
+    std::fill(accumulated.begin(), accumulated.end(), 0);
     layer_state_mask = 1;
     frame_counter = 0;
 }
@@ -2055,6 +3989,8 @@ void reset_state() {
 void set_monitor_enabled(bool enabled) {
     if (monitor_enabled != enabled) {
         monitor_input_state.clear();
+        shared_monitor_bits.held.clear();
+        shared_monitor_bits.holders.clear();
         monitor_enabled = enabled;
     }
 }
@@ -2063,6 +3999,7 @@ void device_connected_callback(uint16_t interface, uint16_t vid, uint16_t pid, u
     hub_ports[interface >> 8] = (hub_port != 0) ? hub_port : HUB_PORT_NONE;
     if (hub_port != 0) {
         active_ports_mask |= 1 << hub_port;
+        their_descriptor_updated = true;  // so that active sources are updated
     }
     if (our_descriptor->device_connected != nullptr) {
         our_descriptor->device_connected(interface, vid, pid);
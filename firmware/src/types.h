@@ -33,6 +33,16 @@ enum class ConfigCommand : int8_t {
     ADD_QUIRK = 24,
     GET_QUIRK = 25,
     INJECT_INPUT = 26,
+    GET_EXTRA_CONFIG = 27,
+    BEGIN_BLOB = 28,
+    BLOB_CHUNK = 29,
+    COMMIT_BLOB = 30,
+    READ_BLOB = 31,
+    GET_BLOB_CHUNK = 32,
+    GET_THEIR_USAGES_PACKED = 33,
+    GET_PERSIST_STATUS = 34,
+    SET_ACTIVE_PROFILE = 35,
+    GET_ACTIVE_PROFILE = 36,
 };
 
 struct usage_def_t {
@@ -57,6 +67,28 @@ struct usage_usage_def_t {
     usage_def_t usage_def;
 };
 
+struct report_usages_t {
+    uint8_t report_id;
+    uint16_t size;   // in bytes
+    uint32_t first;  // index of the report's first usage in usage_table_t.usages
+    uint32_t count;
+};
+
+// Usages of one report type of one interface, packed into an arena and sorted by report ID and usage.
+struct usage_table_t {
+    const usage_usage_def_t* usages = NULL;
+    const report_usages_t* reports = NULL;  // sorted by report ID
+    uint32_t nusages = 0;
+    uint16_t nreports = 0;
+};
+
+struct parsed_descriptor_t {
+    usage_table_t input;
+    usage_table_t output;
+    usage_table_t feature;
+    bool has_report_id = false;
+};
+
 enum class Op : int8_t {
     PUSH = 0,
     PUSH_USAGE = 1,
@@ -157,8 +189,11 @@ struct out_usage_def_t {
     uint32_t array_index;
 };
 
+#define NO_OUR_USAGE_ID 0xFFFF
+
 struct reverse_mapping_t {
     uint32_t target;
+    uint16_t our_usage_id = NO_OUR_USAGE_ID;  // if the target is one of our (non-array) usages
     uint8_t default_value = 0;  // should be int32_t theoretically, but currently all defaults fit uint8_t
     uint8_t hub_port = 0;
     bool is_relative = false;
@@ -166,10 +201,24 @@ struct reverse_mapping_t {
     std::vector<map_source_t> sources;
 };
 
+// Sources that are in effect for a given layer state (and connected devices). Sources of
+// reverse_mapping[i] are sources[sources_start[i]] to sources[sources_start[i + 1] - 1].
+struct layer_table_t {
+    std::vector<uint16_t> rev_maps;  // reverse_mapping entries that need to be processed
+    std::vector<map_source_t*> sources;
+    std::vector<uint16_t> sources_start;
+    std::vector<map_source_t*> macro_sources;
+    std::vector<uint16_t> macro_sources_start;
+};
+
 struct tap_hold_usage_t {
     int32_t* input_state;
     tap_hold_state_t* tap_hold_state;
     uint64_t pressed_at;
+    uint64_t deadline;         // only valid when timer is armed
+    int16_t timer_bucket = -1;  // -1 if not armed
+    int16_t timer_prev;
+    int16_t timer_next;
 };
 
 struct sticky_usage_t {
@@ -184,6 +233,15 @@ struct tap_hold_sticky_usage_t {
     uint8_t* sticky_state;
 };
 
+// what to do when an input state slot changes, indexes into the vectors above
+struct slot_watch_t {
+    int16_t tap_hold = -1;
+    int16_t sticky = -1;
+    int16_t tap_sticky = -1;
+    int16_t hold_sticky = -1;
+    bool profile = false;  // source of a profile switch mapping
+};
+
 struct usage_rle_t {
     uint32_t usage;
     uint32_t count;
@@ -313,7 +371,27 @@ typedef persist_config_v12_t persist_config_v13_t;
 
 typedef persist_config_v13_t persist_config_v18_t;
 
-typedef persist_config_v18_t persist_config_t;
+struct __attribute__((packed)) persist_config_v19_t {
+    uint8_t version;
+    uint8_t flags;
+    uint8_t unmapped_passthrough_layer_mask;
+    uint32_t partial_scroll_timeout;
+    uint16_t mapping_count;
+    uint8_t interval_override;
+    uint32_t tap_hold_threshold;
+    uint8_t gpio_debounce_time_ms;
+    uint8_t our_descriptor_number;
+    uint8_t macro_entry_duration;
+    uint16_t quirk_count;
+    uint32_t macro_step_duration_us;
+};
+
+typedef persist_config_v19_t persist_config_v20_t;
+
+// same header, but what follows it is variable-length (see config.cc)
+typedef persist_config_v20_t persist_config_v21_t;
+
+typedef persist_config_v21_t persist_config_t;
 
 struct __attribute__((packed)) get_config_t {
     uint8_t version;
@@ -340,6 +418,12 @@ struct __attribute__((packed)) set_config_t {
     uint8_t gpio_debounce_time_ms;
     uint8_t our_descriptor_number;
     uint8_t macro_entry_duration;
+    uint32_t macro_step_duration_us;
+};
+
+// GET_CONFIG response is full, so newer settings are read back with GET_EXTRA_CONFIG
+struct __attribute__((packed)) get_extra_config_t {
+    uint32_t macro_step_duration_us;
 };
 
 struct __attribute__((packed)) get_indexed_t {
@@ -358,6 +442,17 @@ struct __attribute__((packed)) crc32_t {
     uint32_t crc32;
 };
 
+struct __attribute__((packed)) config_log_record_t {
+    uint32_t crc32;  // of everything that follows, including the data
+    uint16_t magic;
+    uint8_t type;
+    uint8_t reserved;
+    uint32_t seq;
+    uint16_t offset;   // delta: the data replaces bytes [offset, offset + removed) of the previous config
+    uint16_t removed;  // snapshot: always 0
+    uint16_t size;     // of the data that follows the header
+};
+
 struct __attribute__((packed)) get_macro_t {
     uint32_t requested_macro;
     uint32_t requested_macro_item;
@@ -378,6 +473,23 @@ struct __attribute__((packed)) usages_list_t {
     usage_rle_t usages[NUSAGES_IN_PACKET];
 };
 
+// Pages after the first one say which generation they continue. If their usages changed
+// since then, the reply has stale set and no items, and the caller has to start over.
+struct __attribute__((packed)) get_their_usages_packed_t {
+    uint32_t requested_index;
+    uint32_t generation;
+};
+
+// Each RLE item is two LEB128 varints: the distance from the end of the previous item
+// in the packet (from zero for the first one) and the count.
+struct __attribute__((packed)) packed_usages_t {
+    uint32_t generation;
+    uint16_t total;
+    uint8_t nitems;
+    bool stale;
+    uint8_t data[20];
+};
+
 enum class MutexId : int8_t {
     THEIR_USAGES,
     MACROS,
@@ -410,16 +522,65 @@ enum class PersistConfigReturnCode : int8_t {
     UNKNOWN = 0,
     SUCCESS = 1,
     CONFIG_TOO_BIG = 2,
+    BUSY = 3,  // only from READ_BLOB, a persist is in progress
 };
 
 struct __attribute__((packed)) persist_config_response_t {
     PersistConfigReturnCode return_code;
 };
 
+struct __attribute__((packed)) persist_status_t {
+    uint8_t in_progress;
+    uint32_t longest_stall_us;  // longest the main loop was held up by a single persistence step since boot
+};
+
+// A config blob is the persisted config without the padding and the trailing CRC.
+// It's uploaded with BEGIN_BLOB, any number of BLOB_CHUNKs and COMMIT_BLOB,
+// and downloaded with READ_BLOB and a GET_BLOB_CHUNK and GET_FEATURE for every 28 bytes.
+// GET_BLOB_CHUNK's requested_index is the offset, so a read can be retried.
+struct __attribute__((packed)) blob_header_t {
+    uint32_t size;
+    uint32_t crc32;
+};
+
+#define BLOB_BYTES_IN_PACKET 21
+
+struct __attribute__((packed)) blob_chunk_t {
+    uint32_t offset;
+    uint8_t len;
+    uint8_t data[BLOB_BYTES_IN_PACKET];
+};
+
+struct __attribute__((packed)) read_blob_response_t {
+    PersistConfigReturnCode return_code;
+    blob_header_t header;
+};
+
+enum class CommitBlobReturnCode : int8_t {
+    UNKNOWN = 0,
+    SUCCESS = 1,
+    CRC_MISMATCH = 2,
+    INVALID_CONFIG = 3,
+    BUSY = 4,  // a persist is in progress
+};
+
+struct __attribute__((packed)) commit_blob_response_t {
+    CommitBlobReturnCode return_code;
+};
+
 struct __attribute__((packed)) monitor_t {
     uint8_t enabled;
 };
 
+struct __attribute__((packed)) active_profile_t {
+    uint8_t profile;
+};
+
+struct __attribute__((packed)) active_profile_response_t {
+    uint8_t profile;
+    uint8_t nprofiles;
+};
+
 struct __attribute__((packed)) monitor_report_item_t {
     uint32_t usage;
     int32_t value;
@@ -0,0 +1,166 @@
+#include <stdlib.h>
+
+#include <chrono>
+#include <new>
+#include <vector>
+
+#include "config.h"
+#include "globals.h"
+#include "our_descriptor.h"
+#include "remapper.h"
+#include "test_util.h"
+
+// What a cold boot does before the first remapped report goes out, for a persisted config
+// with a given number of mappings: load_config(), parse_our_descriptor(),
+// set_mapping_from_config(), then a keyboard getting plugged in and its first report going
+// through. These are host numbers, they only say how the steps compare to each other.
+// Allocations are counted too: on the device every one of them goes through a malloc()
+// behind a lock, they're a better guide to what a step costs there than host time.
+//
+//   bench_boot [iterations]
+
+static uint64_t allocations = 0;
+
+void* operator new(size_t size) {
+    allocations++;
+    void* p = malloc(size ? size : 1);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void make_config(int nmappings) {
+    srand(nmappings);
+    config_mappings.clear();
+    for (int i = 0; i < nmappings; i++) {
+        uint32_t source = (i % 5 == 0) ? 0x00090001 + rand() % 8 : 0x00070004 + rand() % 0x60;
+        uint32_t target = (i % 7 == 0) ? 0x00010030 + rand() % 2 : 0x00070004 + rand() % 0x60;
+        config_mappings.push_back({ .target_usage = target, .source_usage = source, .scaling = 1000, .layer_mask = (uint8_t) (1 << (i % 4)), .flags = 0 });
+    }
+    for (int i = 0; i < NMACROS; i++) {
+        macros[i] = { 0x00070004 + (uint32_t) i, 0, 0x00070005, 0 };
+    }
+    for (int i = 0; i < NEXPRESSIONS; i++) {
+        expressions[i] = {
+            { .op = Op::PUSH_USAGE, .val = 0x00070004 + (uint32_t) i },
+            { .op = Op::INPUT_STATE },
+        };
+    }
+}
+
+static void bench_boot(int nmappings, long iterations) {
+    make_config(nmappings);
+    CHECK(persist_config() == PersistConfigReturnCode::SUCCESS);
+    std::vector<uint8_t> persisted(last_persisted, last_persisted + PERSISTED_CONFIG_SIZE);
+
+    double load = 0;
+    double parse = 0;
+    double compile = 0;
+    uint64_t compile_allocations = 0;
+    double plug = 0;
+    double first_report = 0;
+    for (long i = 0; i < iterations; i++) {
+        // load_config() expects what it has at boot, nothing loaded yet
+        config_mappings.clear();
+        quirks.clear();
+        auto start = std::chrono::steady_clock::now();
+        load_config(persisted.data());
+        load += seconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        our_descriptor = &our_descriptors[our_descriptor_number];
+        parse_our_descriptor();
+        parse += seconds_since(start);
+
+        uint64_t allocations_before = allocations;
+        start = std::chrono::steady_clock::now();
+        set_mapping_from_config();
+        compile += seconds_since(start);
+        compile_allocations += allocations - allocations_before;
+        CHECK_EQ(config_mappings.size(), nmappings);
+
+        start = std::chrono::steady_clock::now();
+        plug_keyboard();
+        plug += seconds_since(start);
+
+        sent_reports.clear();
+        start = std::chrono::steady_clock::now();
+        press_keys({ 0x04 });
+        run_frame();
+        first_report += seconds_since(start);
+        CHECK(!sent_reports.empty());
+
+        press_keys({});
+        run_frame();
+        unplug_device(1);
+    }
+    printf("%d mappings: load_config() %.1f us, parse_our_descriptor() %.1f us, set_mapping_from_config() %.1f us (%lu allocations), keyboard plugged in %.1f us, first report %.1f us\n",
+        nmappings,
+        load * 1e6 / iterations,
+        parse * 1e6 / iterations,
+        compile * 1e6 / iterations,
+        (unsigned long) (compile_allocations / iterations),
+        plug * 1e6 / iterations,
+        first_report * 1e6 / iterations);
+}
+
+extern uint32_t precompiled_profiles_budget;
+
+// Switching back and forth between two profiles like the configs above, with the other profile
+// precompiled and with it compiled on every switch, which is what happens when it doesn't fit
+// in the budget.
+static void bench_profile_switch(int nmappings, long iterations) {
+    make_config(nmappings + 1);
+    exchange_profile_config(1);
+    make_config(nmappings);
+    uint32_t default_budget = precompiled_profiles_budget;
+    for (bool precompiled : { true, false }) {
+        precompiled_profiles_budget = precompiled ? UINT32_MAX : 0;
+        set_mapping_from_config();
+        plug_keyboard();
+
+        uint64_t allocations_before = allocations;
+        auto start = std::chrono::steady_clock::now();
+        for (long i = 0; i < iterations; i++) {
+            set_active_profile(1);
+            set_mapping_from_config();
+            set_active_profile(0);
+            set_mapping_from_config();
+        }
+        printf("%d mappings: profile switch %.1f us (%lu allocations) %s\n",
+            nmappings,
+            seconds_since(start) * 1e6 / (2 * iterations),
+            (unsigned long) ((allocations - allocations_before) / (2 * iterations)),
+            precompiled ? "precompiled" : "compiled on the switch");
+        unplug_device(1);
+    }
+    precompiled_profiles_budget = default_budget;
+    profiles[1] = profile_t();
+}
+
+int main(int argc, char** argv) {
+    long iterations = (argc > 1) ? atol(argv[1]) : 200;
+
+    init_remapper();
+    for (int nmappings : { 10, 100, 500 }) {
+        bench_boot(nmappings, iterations);
+    }
+    for (int nmappings : { 10, 100, 500 }) {
+        bench_profile_switch(nmappings, iterations);
+    }
+
+    return 0;
+}
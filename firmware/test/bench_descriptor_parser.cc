@@ -0,0 +1,82 @@
+#include <stdlib.h>
+
+#include <chrono>
+#include <vector>
+
+#include "descriptor_parser.h"
+#include "globals.h"
+#include "our_descriptor.h"
+#include "remapper.h"
+#include "test_util.h"
+
+// The built-in quirk descriptors are local to quirks.cc, so this is built with
+// quirks.cc included here instead of linked in.
+#include "quirks.cc"
+
+// How fast descriptors get parsed and how long a received report takes to go through
+// handle_received_report(), for a short report and for long ones.
+//
+//   bench_descriptor_parser [iterations]
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void bench_parsing(long iterations) {
+    std::vector<std::vector<uint8_t>> corpus;
+    for (const builtin_quirk_t& quirk : builtin_quirks) {
+        corpus.push_back(std::vector<uint8_t>(quirk.descriptor, quirk.descriptor + quirk.len));
+    }
+    for (int i = 0; i < NOUR_DESCRIPTORS; i++) {
+        corpus.push_back(std::vector<uint8_t>(our_descriptors[i].descriptor, our_descriptors[i].descriptor + our_descriptors[i].descriptor_length));
+    }
+
+    descriptor_usages_t parsed;
+    long n = 0;
+    size_t bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations / 100; i++) {
+        for (auto const& descriptor : corpus) {
+            parse_descriptor(parsed, descriptor.data(), descriptor.size());
+            n++;
+            bytes += descriptor.size();
+        }
+    }
+    double elapsed = seconds_since(start);
+    printf("parse_descriptor(): %.0f descriptors/s, %.1f MB/s\n", n / elapsed, bytes / elapsed / 1e6);
+}
+
+static void bench_reports(long iterations) {
+    config_mappings = {
+        { .target_usage = 0x00070004, .source_usage = 0x00090001, .scaling = 1000, .layer_mask = 1 },
+        { .target_usage = 0x00010030, .source_usage = 0x00010030, .scaling = 1000, .layer_mask = 1 },
+    };
+    init_remapper();
+
+    for (int total_len : { 8, 64, 512, 1100 }) {
+        std::vector<uint8_t> descriptor = long_report_descriptor(total_len);
+        plug_device(0x0100, descriptor.data(), descriptor.size());
+
+        std::vector<uint8_t> report(total_len, 0);
+        report[0] = 2;
+        report[total_len - 1] = 1;
+        auto start = std::chrono::steady_clock::now();
+        for (long i = 0; i < iterations; i++) {
+            report[total_len - 3] = i & 0x7F;
+            do_handle_received_report(report.data(), total_len, 0x0100);
+        }
+        double elapsed = seconds_since(start);
+        printf("handle_received_report(), %d-byte report: %.1f ns\n", total_len, elapsed * 1e9 / iterations);
+
+        unplug_device(1);
+    }
+}
+
+int main(int argc, char** argv) {
+    long iterations = (argc > 1) ? atol(argv[1]) : 1000000;
+
+    bench_parsing(iterations);
+    bench_reports(iterations);
+
+    return 0;
+}
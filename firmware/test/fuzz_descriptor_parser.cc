@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "descriptor_parser.h"
+#include "globals.h"
+#include "our_descriptor.h"
+#include "remapper.h"
+
+// Fuzz target for the descriptor parser and what's derived from the parsed descriptor.
+// The input is a report descriptor. It gets parsed for one of a few interfaces, then
+// reports made from the input's bytes are fed through, some of them longer than the
+// descriptor says. Devices are unplugged from time to time.
+//
+// Built with libFuzzer when REMAPPER_LIBFUZZER is on, otherwise fuzz_driver.cc
+// runs it on mutated built-in descriptors.
+
+static bool discard_report(uint8_t interface, const uint8_t* report_with_id, uint8_t len) {
+    return true;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    static bool initialized = false;
+    if (!initialized) {
+        our_descriptor = &our_descriptors[0];
+        parse_our_descriptor();
+        // a few mappings, so that there's something to derive from their usages
+        config_mappings = {
+            { .target_usage = 0x00010030, .source_usage = 0x00010031, .scaling = 1000, .layer_mask = 1 },
+            { .target_usage = 0x00070004, .source_usage = 0x00090001, .scaling = 1000, .layer_mask = 1 },
+            { .target_usage = 0x00090002, .source_usage = 0x00070005, .scaling = 1000, .layer_mask = 1 },
+            { .target_usage = 0x00080001, .source_usage = 0x00070039, .scaling = 1000, .layer_mask = 1 },
+            { .target_usage = 0x00010038, .source_usage = 0x000C0238, .scaling = 1000, .layer_mask = 1 },
+        };
+        set_mapping_from_config();
+        initialized = true;
+    }
+
+    uint8_t dev_addr = 1 + (size % 4);
+    uint16_t interface = (dev_addr << 8) | (size % 3);
+
+    // exact size, so that reads past the end get noticed
+    uint8_t* descriptor = (uint8_t*) malloc(size > 0 ? size : 1);
+    memcpy(descriptor, data, size);
+    parse_descriptor(0x1234, 0x5678, descriptor, size, interface, interface & 0xFF);
+    free(descriptor);
+    update_their_descriptor_derivates();
+
+    static const int REPORT_LENGTHS[] = { 1, 8, 64, 65, 1100 };
+    for (int len : REPORT_LENGTHS) {
+        std::vector<uint8_t> report(len);
+        for (int i = 0; i < len; i++) {
+            report[i] = (size > 0) ? data[(i * 7) % size] ^ i : i;
+        }
+        do_handle_received_report(report.data(), len, interface);
+    }
+    process_mapping(true);
+    while (send_report(discard_report)) {
+    }
+
+    if ((size % 16) == 0) {
+        device_disconnected_callback(dev_addr);
+        update_their_descriptor_derivates();
+    }
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include <stdlib.h>
+
+#include <random>
+#include <vector>
+
+#include "our_descriptor.h"
+
+// The built-in quirk descriptors are local to quirks.cc, so this is built with
+// quirks.cc included here instead of linked in.
+#include "quirks.cc"
+
+// Runs a fuzz target without libFuzzer: the built-in descriptors are mutated with bit
+// flips, byte edits, inserts, deletes, truncation and splicing, and fed to the target.
+//
+//   fuzz_descriptor_parser [iterations] [seed]
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+int main(int argc, char** argv) {
+    long iterations = (argc > 1) ? atol(argv[1]) : 100000;
+    std::mt19937 rng((argc > 2) ? atoi(argv[2]) : 1);
+
+    std::vector<std::vector<uint8_t>> corpus;
+    for (const builtin_quirk_t& quirk : builtin_quirks) {
+        corpus.push_back(std::vector<uint8_t>(quirk.descriptor, quirk.descriptor + quirk.len));
+    }
+    for (int i = 0; i < NOUR_DESCRIPTORS; i++) {
+        corpus.push_back(std::vector<uint8_t>(our_descriptors[i].descriptor, our_descriptors[i].descriptor + our_descriptors[i].descriptor_length));
+    }
+    corpus.push_back(std::vector<uint8_t>(config_report_descriptor, config_report_descriptor + config_report_descriptor_length));
+    corpus.push_back(std::vector<uint8_t>(boot_kb_report_descriptor, boot_kb_report_descriptor + boot_kb_report_descriptor_length));
+
+    for (auto const& input : corpus) {
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+
+    static const uint8_t INTERESTING[] = { 0x00, 0x01, 0x7F, 0x80, 0xFF };
+    for (long i = 0; i < iterations; i++) {
+        std::vector<uint8_t> input = corpus[rng() % corpus.size()];
+        int nmutations = 1 + rng() % 8;
+        for (int j = 0; j < nmutations; j++) {
+            size_t pos = input.empty() ? 0 : rng() % input.size();
+            switch (rng() % 7) {
+                case 0:
+                    if (!input.empty()) {
+                        input[pos] ^= 1 << (rng() % 8);
+                    }
+                    break;
+                case 1:
+                    if (!input.empty()) {
+                        input[pos] = rng();
+                    }
+                    break;
+                case 2:
+                    input.insert(input.begin() + pos, (uint8_t) rng());
+                    break;
+                case 3:
+                    if (!input.empty()) {
+                        input.erase(input.begin() + pos);
+                    }
+                    break;
+                case 4:
+                    input.resize(pos);
+                    break;
+                case 5: {
+                    // splice in a piece of another input
+                    auto const& other = corpus[rng() % corpus.size()];
+                    if (!other.empty()) {
+                        size_t from = rng() % other.size();
+                        size_t len = rng() % (other.size() - from + 1);
+                        input.insert(input.begin() + pos, other.begin() + from, other.begin() + from + len);
+                    }
+                    break;
+                }
+                case 6:
+                    if (!input.empty()) {
+                        input[pos] = INTERESTING[rng() % sizeof(INTERESTING)];
+                    }
+                    break;
+            }
+        }
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+        if ((rng() % 64) == 0) {
+            corpus.push_back(input);
+        }
+    }
+
+    printf("%ld inputs\n", iterations);
+    return 0;
+}
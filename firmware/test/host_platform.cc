@@ -0,0 +1,88 @@
+#include <cstring>
+
+#include "config_log.h"
+#include "platform.h"
+#include "remapper.h"
+#include "test_util.h"
+
+// Stands in for the platform functions (platform.h and the parts of remapper.h that
+// remapper_single.cc etc. implement) when the firmware sources are built for the host.
+
+uint64_t fake_time = 0;
+uint8_t last_persisted[PERSISTED_CONFIG_SIZE];
+uint32_t persist_count = 0;
+bool persist_to_config_log = false;
+uint8_t host_config_log[CONFIG_LOG_SIZE];
+uint32_t config_log_ops = 0;
+uint32_t host_gpio_in_mask = 0;
+uint32_t host_gpio_out_mask = 0;
+
+void do_persist_config(uint8_t* buffer) {
+    memcpy(last_persisted, buffer, PERSISTED_CONFIG_SIZE);
+    persist_count++;
+    if (persist_to_config_log) {
+        config_log_persist(buffer);
+    }
+}
+
+void config_log_erase_sector(uint32_t offset) {
+    memset(host_config_log + offset, 0xFF, CONFIG_LOG_SECTOR_SIZE);
+    config_log_ops++;
+}
+
+void config_log_program_page(uint32_t offset, const uint8_t* data) {
+    for (int i = 0; i < CONFIG_LOG_PAGE_SIZE; i++) {
+        host_config_log[offset + i] &= data[i];
+    }
+    config_log_ops++;
+}
+
+void reset_to_bootloader() {
+}
+
+void pair_new_device() {
+}
+
+void clear_bonds() {
+}
+
+void flash_b_side() {
+}
+
+void my_mutexes_init() {
+}
+
+void my_mutex_enter(MutexId id) {
+}
+
+void my_mutex_exit(MutexId id) {
+}
+
+uint64_t get_time() {
+    return fake_time;
+}
+
+uint64_t get_unique_id() {
+    return 0;
+}
+
+uint32_t get_gpio_valid_pins_mask() {
+    return 0;
+}
+
+void set_gpio_inout_masks(uint32_t in_mask, uint32_t out_mask) {
+    host_gpio_in_mask = in_mask;
+    host_gpio_out_mask = out_mask;
+}
+
+void interval_override_updated() {
+}
+
+void queue_out_report(uint16_t interface, uint8_t report_id, const uint8_t* buffer, uint8_t len) {
+}
+
+void queue_set_feature_report(uint16_t interface, uint8_t report_id, const uint8_t* buffer, uint8_t len) {
+}
+
+void queue_get_feature_report(uint16_t interface, uint8_t report_id, uint8_t len) {
+}
@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "config.h"
+#include "crc.h"
+#include "globals.h"
+#include "test_util.h"
+
+// The whole config goes up and down as one CRC-checked blob. Downloads take the offset
+// from each GET_BLOB_CHUNK, so a GET_FEATURE that gets repeated returns the same chunk.
+// The blob shares its buffer with persist_config(), so blob commands are refused while
+// a persist is in progress. The profiles that aren't active go in the blob too.
+
+static std::vector<uint8_t> read_chunk(uint32_t offset) {
+    get_indexed_t request = { .requested_index = offset };
+    config_command(ConfigCommand::GET_BLOB_CHUNK, &request, sizeof(request));
+    uint8_t response[28];
+    config_response(response);
+    return std::vector<uint8_t>(response, response + sizeof(response));
+}
+
+static PersistConfigReturnCode read_blob(std::vector<uint8_t>& blob) {
+    config_command(ConfigCommand::READ_BLOB);
+    uint8_t response[28];
+    config_response(response);
+    read_blob_response_t* returned = (read_blob_response_t*) response;
+    blob.clear();
+    while (blob.size() < returned->header.size) {
+        std::vector<uint8_t> chunk = read_chunk(blob.size());
+        blob.insert(blob.end(), chunk.begin(), chunk.end());
+    }
+    blob.resize(returned->header.size);
+    if (returned->return_code == PersistConfigReturnCode::SUCCESS) {
+        CHECK_EQ(crc32(blob.data(), blob.size()), returned->header.crc32);
+    }
+    return returned->return_code;
+}
+
+static CommitBlobReturnCode commit() {
+    config_command(ConfigCommand::COMMIT_BLOB);
+    uint8_t response[28];
+    config_response(response);
+    return ((commit_blob_response_t*) response)->return_code;
+}
+
+static void send_chunk(const std::vector<uint8_t>& blob, uint32_t offset, uint8_t len) {
+    blob_chunk_t chunk = { .offset = offset, .len = len };
+    memcpy(chunk.data, blob.data() + offset, len);
+    config_command(ConfigCommand::BLOB_CHUNK, &chunk, sizeof(chunk));
+}
+
+// Chunks go in backwards, order doesn't matter.
+static CommitBlobReturnCode send_blob(const std::vector<uint8_t>& blob, uint32_t crc) {
+    blob_header_t header = { .size = (uint32_t) blob.size(), .crc32 = crc };
+    config_command(ConfigCommand::BEGIN_BLOB, &header, sizeof(header));
+    uint32_t last = blob.size() / BLOB_BYTES_IN_PACKET * BLOB_BYTES_IN_PACKET;
+    for (int64_t offset = last; offset >= 0; offset -= BLOB_BYTES_IN_PACKET) {
+        send_chunk(blob, offset, std::min<uint32_t>(BLOB_BYTES_IN_PACKET, blob.size() - offset));
+    }
+    return commit();
+}
+
+static CommitBlobReturnCode send_blob(const std::vector<uint8_t>& blob) {
+    return send_blob(blob, crc32(blob.data(), blob.size()));
+}
+
+static void set_test_config() {
+    config_mappings.clear();
+    for (uint32_t i = 0; i < 50; i++) {
+        config_mappings.push_back({ .target_usage = 0x00070004 + i, .source_usage = 0x00090001 + i, .scaling = (int32_t) (1000 + i), .layer_mask = (uint8_t) (1 + i % 3), .flags = 0 });
+    }
+    macros[0] = { 0x00070004, 0x00070005, 0, 0x00070006, 0, 0 };
+    expressions[0] = {
+        { .op = Op::PUSH, .val = 123000 },
+        { .op = Op::PUSH_USAGE, .val = 0x00070004 },
+        { .op = Op::INPUT_STATE },
+    };
+    profiles[1] = profile_t();
+    profiles[1].mappings.push_back({ .target_usage = 0x000C00E9, .source_usage = 0x00070004, .scaling = 1000, .layer_mask = 1, .flags = 0, .hub_ports = 0x21 });
+    profiles[1].macros[3] = { 0x000C00E2, 0 };
+    profiles[3] = profile_t();
+    profiles[3].expressions[7] = { { .op = Op::PUSH, .val = (uint32_t) -5 } };
+    config_updated = true;
+    run_frame();
+}
+
+static void clear_profiles() {
+    for (auto& profile : profiles) {
+        profile = profile_t();
+    }
+}
+
+// The base blob with its profile section replaced.
+static std::vector<uint8_t> with_profile_section(const std::vector<uint8_t>& base, std::vector<uint8_t> section) {
+    std::vector<uint8_t> blob(base.begin(), base.end() - 2);  // active profile 0, no others
+    blob.insert(blob.end(), section.begin(), section.end());
+    return blob;
+}
+
+static void profile_sections() {
+    std::vector<uint8_t> original;
+    CHECK(read_blob(original) == PersistConfigReturnCode::SUCCESS);
+    clear_profiles();
+    std::vector<uint8_t> base;
+    CHECK(read_blob(base) == PersistConfigReturnCode::SUCCESS);
+    CHECK(base.size() < original.size());
+    CHECK(base[base.size() - 2] == 0);
+    CHECK(base[base.size() - 1] == 0);
+
+    // the other profiles come back, nothing else does
+    CHECK(send_blob(original) == CommitBlobReturnCode::SUCCESS);
+    CHECK_EQ(profiles[1].mappings.size(), 1);
+    CHECK_EQ(profiles[1].mappings[0].hub_ports, 0x21);
+    CHECK_EQ(profiles[1].macros[3].size(), 2);
+    CHECK_EQ(profiles[3].expressions[7].size(), 1);
+    CHECK_EQ((int32_t) profiles[3].expressions[7][0].val, -5);
+    CHECK(profiles[2].mappings.empty());
+
+    // and a blob without them clears them
+    CHECK(send_blob(base) == CommitBlobReturnCode::SUCCESS);
+    CHECK(profiles[1].mappings.empty());
+    CHECK(profiles[3].expressions[7].empty());
+
+    // a blob makes the profile it says active, what's in its main part is that profile
+    CHECK(send_blob(with_profile_section(base, { 2, 1, 0, 0, 0, 0 })) == CommitBlobReturnCode::SUCCESS);
+    run_frame();
+    CHECK_EQ(active_profile, 2);
+    CHECK_EQ(config_mappings.size(), 50);
+    CHECK(profiles[0].mappings.empty());
+
+    // an active profile that doesn't exist, the active one stored again, a profile
+    // stored twice and more profiles than there are
+    CHECK(send_blob(with_profile_section(base, { NPROFILES, 0 })) == CommitBlobReturnCode::INVALID_CONFIG);
+    CHECK(send_blob(with_profile_section(base, { 0, 1, 0, 0, 0, 0 })) == CommitBlobReturnCode::INVALID_CONFIG);
+    CHECK(send_blob(with_profile_section(base, { 0, 2, 1, 0, 0, 0, 1, 0, 0, 0 })) == CommitBlobReturnCode::INVALID_CONFIG);
+    CHECK(send_blob(with_profile_section(base, { 0, NPROFILES, 1, 0, 0, 0, 2, 0, 0, 0, 3, 0, 0, 0 })) == CommitBlobReturnCode::INVALID_CONFIG);
+    CHECK(send_blob(with_profile_section(base, { 0, 1, NPROFILES, 0, 0, 0 })) == CommitBlobReturnCode::INVALID_CONFIG);
+    // too many macros in a profile, or nothing after the quirks
+    CHECK(send_blob(with_profile_section(base, { 0, 1, 1, 0, NMACROS + 1 })) == CommitBlobReturnCode::INVALID_CONFIG);
+    CHECK(send_blob(with_profile_section(base, {})) == CommitBlobReturnCode::INVALID_CONFIG);
+    CHECK_EQ(active_profile, 2);
+
+    CHECK(send_blob(original) == CommitBlobReturnCode::SUCCESS);
+    run_frame();
+    CHECK_EQ(active_profile, 0);
+}
+
+int main() {
+    init_remapper();
+    set_test_config();
+
+    std::vector<uint8_t> original;
+    CHECK(read_blob(original) == PersistConfigReturnCode::SUCCESS);
+    CHECK(original.size() > 28 * 10);
+
+    // a repeated read gets the same chunk, not the next one
+    std::vector<uint8_t> chunk = read_chunk(28);
+    uint8_t again[28];
+    config_response(again);
+    CHECK(!memcmp(chunk.data(), again, sizeof(again)));
+    CHECK(!memcmp(chunk.data(), original.data() + 28, sizeof(again)));
+    // past the end it's zeros
+    std::vector<uint8_t> past_end = read_chunk(original.size() + 100);
+    CHECK(std::all_of(past_end.begin(), past_end.end(), [](uint8_t b) { return b == 0; }));
+
+    // round trip
+    config_mappings.clear();
+    macros[0].clear();
+    expressions[0].clear();
+    clear_profiles();
+    config_updated = true;
+    run_frame();
+    CHECK(send_blob(original) == CommitBlobReturnCode::SUCCESS);
+    run_frame();
+    CHECK_EQ(config_mappings.size(), 50);
+    CHECK_EQ(config_mappings[49].scaling, 1049);
+    CHECK_EQ(macros[0].size(), 6);
+    CHECK_EQ(expressions[0].size(), 3);
+    CHECK_EQ(profiles[1].mappings.size(), 1);
+    std::vector<uint8_t> round_trip;
+    CHECK(read_blob(round_trip) == PersistConfigReturnCode::SUCCESS);
+    CHECK(round_trip == original);
+
+    // a wrong CRC, a blob that doesn't parse and a chunk out of range leave the config alone
+    std::vector<uint8_t> corrupted = original;
+    corrupted[40] ^= 1;
+    CHECK(send_blob(corrupted, crc32(original.data(), original.size())) == CommitBlobReturnCode::CRC_MISMATCH);
+    std::vector<uint8_t> truncated(original.begin(), original.end() - 3);
+    CHECK(send_blob(truncated) == CommitBlobReturnCode::INVALID_CONFIG);
+    blob_header_t header = { .size = (uint32_t) original.size(), .crc32 = crc32(original.data(), original.size()) };
+    config_command(ConfigCommand::BEGIN_BLOB, &header, sizeof(header));
+    for (uint32_t offset = 0; offset < original.size(); offset += BLOB_BYTES_IN_PACKET) {
+        send_chunk(original, offset, std::min<uint32_t>(BLOB_BYTES_IN_PACKET, original.size() - offset));
+    }
+    send_chunk(original, original.size() - 1, 2);
+    CHECK(commit() == CommitBlobReturnCode::CRC_MISMATCH);
+    // chunks without BEGIN_BLOB don't count
+    for (uint32_t offset = 0; offset < original.size(); offset += BLOB_BYTES_IN_PACKET) {
+        send_chunk(original, offset, std::min<uint32_t>(BLOB_BYTES_IN_PACKET, original.size() - offset));
+    }
+    CHECK(commit() == CommitBlobReturnCode::CRC_MISMATCH);
+    run_frame();
+    CHECK_EQ(config_mappings.size(), 50);
+    CHECK(read_blob(round_trip) == PersistConfigReturnCode::SUCCESS);
+    CHECK(round_trip == original);
+
+    profile_sections();
+
+    // nothing touches the buffer while a persist is using it
+    need_to_persist_config = true;
+    std::vector<uint8_t> blob;
+    CHECK(read_blob(blob) == PersistConfigReturnCode::BUSY);
+    CHECK(blob.empty());
+    CHECK(send_blob(original) == CommitBlobReturnCode::BUSY);
+    need_to_persist_config = false;
+
+    // a persist in the middle of an upload ends it
+    config_command(ConfigCommand::BEGIN_BLOB, &header, sizeof(header));
+    for (uint32_t offset = 0; offset < original.size(); offset += BLOB_BYTES_IN_PACKET) {
+        send_chunk(original, offset, std::min<uint32_t>(BLOB_BYTES_IN_PACKET, original.size() - offset));
+    }
+    uint32_t persisted_before = persist_count;
+    CHECK(persist_config() == PersistConfigReturnCode::SUCCESS);
+    CHECK_EQ(persist_count, persisted_before + 1);
+    CHECK(commit() == CommitBlobReturnCode::CRC_MISMATCH);
+
+    // and what was persisted is the config with the profiles after it
+    CHECK(!memcmp(last_persisted, original.data(), original.size()));
+    uint32_t persisted_crc;
+    memcpy(&persisted_crc, last_persisted + PERSISTED_CONFIG_SIZE - 4, 4);
+    CHECK_EQ(crc32(last_persisted, PERSISTED_CONFIG_SIZE - 4), persisted_crc);
+
+    // Mutated blobs with a matching CRC either load or get rejected as invalid. Run under
+    // ASan, this also checks that nothing is read past the end of the blob.
+    srand(1);
+    int nvalid = 0;
+    for (int i = 0; i < 20000; i++) {
+        std::vector<uint8_t> mutated = original;
+        int nchanges = 1 + rand() % 4;
+        for (int j = 0; j < nchanges; j++) {
+            size_t pos = rand() % mutated.size();
+            switch (rand() % 3) {
+                case 0:
+                    mutated[pos] = rand();
+                    break;
+                case 1:
+                    mutated.erase(mutated.begin() + pos);
+                    break;
+                case 2:
+                    mutated.insert(mutated.begin() + pos, rand());
+                    break;
+            }
+        }
+        mutated[0] = original[0];  // keep the version, otherwise it's always rejected
+        CommitBlobReturnCode result = send_blob(mutated);
+        CHECK((result == CommitBlobReturnCode::SUCCESS) || (result == CommitBlobReturnCode::INVALID_CONFIG));
+        nvalid += (result == CommitBlobReturnCode::SUCCESS);
+        if ((i % 100) == 0) {
+            run_frame();
+        }
+    }
+    printf("%d of 20000 mutated blobs loaded\n", nvalid);
+    config_updated = true;
+    run_frame();
+
+    return 0;
+}
@@ -0,0 +1,200 @@
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "config_log.h"
+#include "crc.h"
+#include "test_util.h"
+
+// The config log on a simulated flash. Programming can only clear bits and erasing sets a
+// whole sector to 0xFF. Power gets cut at random points, in the middle of an erase or a
+// page program, leaving that sector or page partly done. After every cut the log is
+// loaded again, the way it is at boot. What comes back has to be either the config that
+// was being written or the one before it, never nothing and never a mix.
+//
+// Built with config_log.cc and crc.cc only, the rest of the firmware isn't involved.
+
+static uint8_t flash[CONFIG_LOG_SIZE];
+static long ops = 0;
+static long cut_at = -1;
+static long erases = 0;
+static long programs = 0;
+static jmp_buf power_cut;
+
+void config_log_erase_sector(uint32_t offset) {
+    CHECK_EQ(offset % CONFIG_LOG_SECTOR_SIZE, 0);
+    CHECK(offset < CONFIG_LOG_SIZE);
+    if (ops++ == cut_at) {
+        for (int i = 0; i < CONFIG_LOG_SECTOR_SIZE; i++) {
+            if (rand() % 2) {
+                flash[offset + i] = 0xFF;
+            }
+        }
+        longjmp(power_cut, 1);
+    }
+    erases++;
+    memset(flash + offset, 0xFF, CONFIG_LOG_SECTOR_SIZE);
+}
+
+void config_log_program_page(uint32_t offset, const uint8_t* data) {
+    CHECK_EQ(offset % CONFIG_LOG_PAGE_SIZE, 0);
+    CHECK(offset < CONFIG_LOG_SIZE);
+    // the log never relies on programming setting bits
+    for (int i = 0; i < CONFIG_LOG_PAGE_SIZE; i++) {
+        CHECK_EQ(flash[offset + i] & data[i], data[i]);
+    }
+    if (ops++ == cut_at) {
+        // some of the bits that should have been cleared are
+        for (int i = 0; i < CONFIG_LOG_PAGE_SIZE; i++) {
+            flash[offset + i] &= data[i] | (uint8_t) rand();
+        }
+        longjmp(power_cut, 1);
+    }
+    programs++;
+    for (int i = 0; i < CONFIG_LOG_PAGE_SIZE; i++) {
+        flash[offset + i] &= data[i];
+    }
+}
+
+// A persisted config: the body, zeros up to the CRC, the CRC.
+static void make_config(uint8_t* buffer, const std::vector<uint8_t>& body) {
+    memset(buffer, 0, PERSISTED_CONFIG_SIZE);
+    memcpy(buffer, body.data(), body.size());
+    uint32_t crc = crc32(buffer, PERSISTED_CONFIG_SIZE - 4);
+    memcpy(buffer + PERSISTED_CONFIG_SIZE - 4, &crc, 4);
+}
+
+static void mutate(std::vector<uint8_t>& body) {
+    int kind = rand() % 10;
+    if (kind < 6) {
+        body[rand() % body.size()] = rand() | 1;
+    } else if (kind < 8) {
+        size_t pos = rand() % (body.size() + 1);
+        int n = 1 + rand() % 4;
+        if (body.size() + n < PERSISTED_CONFIG_SIZE - 4) {
+            body.insert(body.begin() + pos, n, (uint8_t) (rand() | 1));
+        }
+    } else if ((kind < 9) && (body.size() > 4)) {
+        size_t pos = rand() % (body.size() - 2);
+        body.erase(body.begin() + pos, body.begin() + pos + 2);
+    } else {
+        body.resize(1 + rand() % (PERSISTED_CONFIG_SIZE - 4));
+        for (auto& b : body) {
+            b = rand() | 1;
+        }
+    }
+    // trailing zeros aren't kept, make the end easy to tell
+    body.back() |= 1;
+}
+
+static void write_all(const uint8_t* buffer) {
+    config_log_persist(buffer);
+    while (config_log_busy()) {
+        config_log_step();
+    }
+}
+
+static void power_cut_run(int seed) {
+    srand(seed);
+    memset(flash, 0xFF, sizeof(flash));
+    static uint8_t loaded[PERSISTED_CONFIG_SIZE];
+    CHECK(!config_log_load(flash, loaded));
+
+    static uint8_t buffer[PERSISTED_CONFIG_SIZE];
+    static uint8_t expected_new[PERSISTED_CONFIG_SIZE];
+    static uint8_t expected_old[PERSISTED_CONFIG_SIZE];
+    std::vector<uint8_t> committed;
+    std::vector<uint8_t> body(300 + rand() % 1500);
+    for (auto& b : body) {
+        b = rand() | 1;
+    }
+    bool have_config = false;
+    int ncuts = 0;
+    int nkept_old = 0;
+
+    for (int round = 0; round < 2000; round++) {
+        std::vector<uint8_t> next = body;
+        if (rand() % 20) {
+            mutate(next);
+        }
+        make_config(buffer, next);
+        // a write is at most a slot's worth of erases plus a record's worth of programs
+        cut_at = (rand() % 3 == 0) ? ops + rand() % 20 : -1;
+        if (setjmp(power_cut) == 0) {
+            write_all(buffer);
+        } else {
+            ncuts++;
+        }
+        cut_at = -1;
+
+        // reboot
+        make_config(expected_new, next);
+        make_config(expected_old, committed);
+        if (!config_log_load(flash, loaded)) {
+            CHECK(!have_config);
+            continue;
+        }
+        if (!memcmp(loaded, expected_new, PERSISTED_CONFIG_SIZE)) {
+            committed = next;
+            body = next;
+            have_config = true;
+        } else {
+            CHECK(have_config);
+            CHECK(!memcmp(loaded, expected_old, PERSISTED_CONFIG_SIZE));
+            nkept_old++;
+        }
+    }
+    printf("seed %d: %d power cuts, previous config kept after %d of them\n", seed, ncuts, nkept_old);
+}
+
+// Small changes to a config of a given size, how many sector erases does a persist take.
+static double erases_per_persist(int len) {
+    srand(len);
+    memset(flash, 0xFF, sizeof(flash));
+    static uint8_t loaded[PERSISTED_CONFIG_SIZE];
+    config_log_load(flash, loaded);
+    erases = 0;
+    programs = 0;
+
+    std::vector<uint8_t> body(len);
+    for (auto& b : body) {
+        b = rand() | 1;
+    }
+    static uint8_t buffer[PERSISTED_CONFIG_SIZE];
+    const int npersists = 1000;
+    for (int i = 0; i < npersists; i++) {
+        body[rand() % len] = rand() | 1;
+        make_config(buffer, body);
+        write_all(buffer);
+    }
+    CHECK(config_log_load(flash, loaded));
+    CHECK(!memcmp(loaded, buffer, PERSISTED_CONFIG_SIZE));
+    printf("%d-byte config: %.3f sector erases and %.2f page programs per persist\n", len, (double) erases / npersists, (double) programs / npersists);
+    return (double) erases / npersists;
+}
+
+int main() {
+    for (int seed = 1; seed <= 8; seed++) {
+        power_cut_run(seed);
+    }
+
+    // writing the same config again doesn't touch the flash
+    static uint8_t buffer[PERSISTED_CONFIG_SIZE];
+    static uint8_t loaded[PERSISTED_CONFIG_SIZE];
+    CHECK(config_log_load(flash, loaded));
+    long ops_before = ops;
+    write_all(loaded);
+    CHECK_EQ(ops, ops_before);
+
+    // rewriting the whole config every time used to be a sector erase per persist
+    CHECK(erases_per_persist(1835) < 0.2);
+    CHECK(erases_per_persist(4000) < 0.2);
+
+    // an empty log, the caller falls back to the old config sector
+    memset(flash, 0xFF, sizeof(flash));
+    CHECK(!config_log_load(flash, buffer));
+
+    return 0;
+}
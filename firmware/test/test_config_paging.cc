@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "globals.h"
+#include "test_util.h"
+
+// GET_MACRO and GET_EXPRESSION return a page starting at any position, without walking
+// the macro or expression from its start. Pages have to match what was appended, whether
+// they're read in order, at random positions, or with appends in between.
+
+struct expr_item_t {
+    uint8_t op;
+    uint32_t val;
+};
+
+static std::vector<uint32_t> ref_macros[NMACROS];
+static std::vector<expr_item_t> ref_expressions[NEXPRESSIONS];
+
+static bool has_val(uint8_t op) {
+    return (op == (uint8_t) Op::PUSH) || (op == (uint8_t) Op::PUSH_USAGE);
+}
+
+static void append_to_macro(uint8_t macro, int nitems) {
+    append_to_macro_t cmd = { .macro = macro, .nitems = (uint8_t) nitems };
+    for (int i = 0; i < nitems; i++) {
+        // zeros separate entries
+        cmd.usages[i] = (rand() % 4 == 0) ? 0 : 0x00070000 | (1 + rand() % 0xFF);
+        if (macro < NMACROS) {
+            ref_macros[macro].push_back(cmd.usages[i]);
+        }
+    }
+    config_command(ConfigCommand::APPEND_TO_MACRO, &cmd, sizeof(cmd));
+}
+
+static void append_to_expression(uint8_t expr) {
+    append_to_expr_t cmd = { .expr = expr, .nelems = 0 };
+    uint8_t* ptr = cmd.elem_data;
+    while (true) {
+        uint8_t op = rand() % 3 ? (uint8_t) Op::ADD : (uint8_t) ((rand() % 2) ? Op::PUSH : Op::PUSH_USAGE);
+        uint32_t val = has_val(op) ? rand() : 0;
+        if (ptr + 1 + (has_val(op) ? 4 : 0) > cmd.elem_data + sizeof(cmd.elem_data)) {
+            break;
+        }
+        *ptr++ = op;
+        if (has_val(op)) {
+            memcpy(ptr, &val, 4);
+            ptr += 4;
+        }
+        cmd.nelems++;
+        if (expr < NEXPRESSIONS) {
+            ref_expressions[expr].push_back({ op, val });
+        }
+        if (rand() % 4 == 0) {
+            break;
+        }
+    }
+    config_command(ConfigCommand::APPEND_TO_EXPRESSION, &cmd, sizeof(cmd));
+}
+
+static std::vector<uint32_t> get_macro_page(uint32_t macro, uint32_t item) {
+    get_macro_t cmd = { .requested_macro = macro, .requested_macro_item = item };
+    config_command(ConfigCommand::GET_MACRO, &cmd, sizeof(cmd));
+    uint8_t response[28];
+    config_response(response);
+    get_macro_response_t* returned = (get_macro_response_t*) response;
+    CHECK(returned->nitems <= MACRO_ITEMS_IN_PACKET);
+    std::vector<uint32_t> page;
+    for (int i = 0; i < returned->nitems; i++) {
+        page.push_back(returned->usages[i]);
+    }
+    return page;
+}
+
+static std::vector<expr_item_t> get_expression_page(uint32_t expr, uint32_t elem) {
+    get_expr_t cmd = { .requested_expr = expr, .requested_expr_elem = elem };
+    config_command(ConfigCommand::GET_EXPRESSION, &cmd, sizeof(cmd));
+    uint8_t response[28];
+    config_response(response);
+    get_expr_response_t* returned = (get_expr_response_t*) response;
+    std::vector<expr_item_t> elems;
+    const uint8_t* ptr = returned->elem_data;
+    for (int i = 0; i < returned->nelems; i++) {
+        expr_item_t elem = { .op = *ptr++, .val = 0 };
+        if (has_val(elem.op)) {
+            memcpy(&elem.val, ptr, 4);
+            ptr += 4;
+        }
+        CHECK(ptr <= returned->elem_data + sizeof(returned->elem_data));
+        elems.push_back(elem);
+    }
+    return elems;
+}
+
+static void check_macro_page(uint32_t macro, uint32_t item) {
+    std::vector<uint32_t> page = get_macro_page(macro, item);
+    const std::vector<uint32_t>& ref = ref_macros[macro];
+    uint32_t expected = (item < ref.size()) ? std::min<uint32_t>(MACRO_ITEMS_IN_PACKET, ref.size() - item) : 0;
+    CHECK_EQ(page.size(), expected);
+    for (uint32_t i = 0; i < page.size(); i++) {
+        CHECK_EQ(page[i], ref[item + i]);
+    }
+}
+
+// Returns the number of elements on the page.
+static uint32_t check_expression_page(uint32_t expr, uint32_t elem) {
+    std::vector<expr_item_t> page = get_expression_page(expr, elem);
+    const std::vector<expr_item_t>& ref = ref_expressions[expr];
+    if (elem < ref.size()) {
+        CHECK(page.size() > 0);
+    }
+    for (uint32_t i = 0; i < page.size(); i++) {
+        CHECK(elem + i < ref.size());
+        CHECK_EQ(page[i].op, ref[elem + i].op);
+        CHECK_EQ(page[i].val, ref[elem + i].val);
+    }
+    return page.size();
+}
+
+static void check_all_sequentially() {
+    for (uint32_t macro = 0; macro < NMACROS; macro++) {
+        std::vector<uint32_t> dumped;
+        while (true) {
+            std::vector<uint32_t> page = get_macro_page(macro, dumped.size());
+            dumped.insert(dumped.end(), page.begin(), page.end());
+            if (page.size() < MACRO_ITEMS_IN_PACKET) {
+                break;
+            }
+        }
+        CHECK(dumped == ref_macros[macro]);
+    }
+    for (uint32_t expr = 0; expr < NEXPRESSIONS; expr++) {
+        uint32_t elem = 0;
+        uint32_t n;
+        while ((n = check_expression_page(expr, elem)) > 0) {
+            elem += n;
+        }
+        CHECK_EQ(elem, ref_expressions[expr].size());
+    }
+}
+
+int main() {
+    init_remapper();
+    srand(3);
+
+    for (int i = 0; i < 2000; i++) {
+        append_to_macro(rand() % NMACROS, 1 + rand() % MACRO_ITEMS_IN_PACKET);
+        append_to_expression(rand() % NEXPRESSIONS);
+    }
+    check_all_sequentially();
+
+    // random positions, with appends in between
+    for (int i = 0; i < 100000; i++) {
+        switch (rand() % 8) {
+            case 0:
+                append_to_macro(rand() % NMACROS, 1 + rand() % MACRO_ITEMS_IN_PACKET);
+                break;
+            case 1:
+                append_to_expression(rand() % NEXPRESSIONS);
+                break;
+            default: {
+                uint32_t macro = rand() % NMACROS;
+                check_macro_page(macro, rand() % (ref_macros[macro].size() + 10));
+                uint32_t expr = rand() % NEXPRESSIONS;
+                check_expression_page(expr, rand() % (ref_expressions[expr].size() + 10));
+                break;
+            }
+        }
+    }
+    check_all_sequentially();
+
+    // out of range numbers are ignored
+    append_to_macro(NMACROS, 3);
+    append_to_expression(NEXPRESSIONS);
+    CHECK(get_macro_page(NMACROS, 0).empty());
+    CHECK(get_expression_page(NEXPRESSIONS, 0).empty());
+    check_all_sequentially();
+
+    config_command(ConfigCommand::CLEAR_MACROS);
+    config_command(ConfigCommand::CLEAR_EXPRESSIONS);
+    for (auto& macro : ref_macros) {
+        macro.clear();
+    }
+    for (auto& expr : ref_expressions) {
+        expr.clear();
+    }
+    check_all_sequentially();
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include "descriptor_parser.h"
+#include "globals.h"
+#include "quirks.h"
+#include "test_util.h"
+
+// Interfaces with the same descriptor, VID/PID and matching user quirks share one set of
+// packed tables. Tables no longer used by any interface are kept for a while, in case
+// the device comes back.
+
+static const uint32_t KEY_B = 0x00070005;
+
+static const uint16_t INTERFACES[] = { 0x0100, 0x0200, 0x0300, 0x0400 };
+
+static void check_shift_maps_to_b(uint16_t interface, bool expected) {
+    press_keys({ 0xE1 }, interface);
+    run_frames(2);
+    CHECK_EQ(sent_value(KEY_B), expected);
+    press_keys({}, interface);
+    run_frames(2);
+    CHECK_EQ(sent_value(KEY_B), 0);
+}
+
+int main() {
+    config_mappings = {
+        { .target_usage = KEY_B, .source_usage = 0x000700E1, .scaling = 1000, .layer_mask = 1 },
+    };
+    init_remapper();
+
+    // four identical keyboards on a hub
+    for (uint16_t interface : INTERFACES) {
+        plug_keyboard(interface);
+    }
+    CHECK_EQ(descriptor_cache_misses, 1);
+    CHECK_EQ(descriptor_cache_hits, 3);
+    for (uint16_t interface : INTERFACES) {
+        CHECK(their_descriptors[interface].input.usages == their_descriptors[INTERFACES[0]].input.usages);
+        check_shift_maps_to_b(interface, true);
+    }
+
+    // a user quirk for interface number 1 only: that interface gets its own tables
+    quirks.push_back((quirk_t){ .vendor_id = 0x1234, .product_id = 0x5678, .interface = 1, .report_id = 0, .usage = 0x000700E1, .bitpos = 0, .size_flags = 0 });
+    invalidate_user_quirks_index();
+    plug_keyboard(0x0501);
+    CHECK_EQ(descriptor_cache_misses, 2);
+    CHECK(their_descriptors[0x0501].input.usages != their_descriptors[INTERFACES[0]].input.usages);
+    CHECK(find_usage(their_descriptors[0x0501].input, 0, 0x000700E1) == NULL);
+    CHECK(find_usage(their_descriptors[INTERFACES[0]].input, 0, 0x000700E1) != NULL);
+    check_shift_maps_to_b(0x0501, false);
+    check_shift_maps_to_b(INTERFACES[1], true);
+
+    // the tables outlive the interfaces, a device that comes back doesn't get parsed again
+    for (uint16_t interface : INTERFACES) {
+        unplug_device(interface >> 8);
+    }
+    unplug_device(5);
+    for (uint16_t interface : INTERFACES) {
+        CHECK_EQ(their_descriptors.count(interface), 0);
+    }
+    plug_keyboard(0x0100);
+    CHECK_EQ(descriptor_cache_misses, 2);
+    CHECK_EQ(descriptor_cache_hits, 4);
+    check_shift_maps_to_b(0x0100, true);
+    unplug_device(1);
+
+    // only a few unused entries are kept, least recently used go first
+    for (uint16_t vid = 1; vid <= 8; vid++) {
+        plug_device(0x0200, boot_keyboard_descriptor, boot_keyboard_descriptor_length, vid, 1);
+        unplug_device(2);
+    }
+    CHECK_EQ(descriptor_cache_misses, 10);
+    plug_device(0x0200, boot_keyboard_descriptor, boot_keyboard_descriptor_length, 8, 1);
+    unplug_device(2);
+    CHECK_EQ(descriptor_cache_hits, 5);
+    plug_device(0x0200, boot_keyboard_descriptor, boot_keyboard_descriptor_length, 1, 1);
+    unplug_device(2);
+    CHECK_EQ(descriptor_cache_misses, 11);
+
+    return 0;
+}
@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+#include "descriptor_parser.h"
+#include "globals.h"
+#include "our_descriptor.h"
+#include "remapper.h"
+#include "test_util.h"
+
+// The built-in quirk descriptors are local to quirks.cc, so this test is built with
+// quirks.cc included here instead of linked in.
+#include "quirks.cc"
+
+// Parses our descriptors and the built-in quirk descriptors (and mutated versions of them)
+// and checks that the packed tables have exactly what the parser found, with lookups
+// finding every usage. Also keeps an eye on how many allocations a packed descriptor takes.
+
+static uint32_t allocations = 0;
+static size_t allocated_bytes = 0;
+
+// ASan has its own operator new, the counts stay at 0 there
+#ifndef __SANITIZE_ADDRESS__
+
+void* operator new(size_t size) {
+    allocations++;
+    allocated_bytes += size;
+    void* ret = malloc(size);
+    if (ret == NULL) {
+        throw std::bad_alloc();
+    }
+    return ret;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+#endif
+
+static bool same_usage_def(const usage_def_t& a, const usage_def_t& b) {
+    return (a.report_id == b.report_id) &&
+           (a.size == b.size) &&
+           (a.bitpos == b.bitpos) &&
+           (a.is_relative == b.is_relative) &&
+           (a.is_array == b.is_array) &&
+           (a.logical_minimum == b.logical_minimum) &&
+           (a.logical_maximum == b.logical_maximum) &&
+           (a.index == b.index) &&
+           (a.count == b.count) &&
+           (a.usage_maximum == b.usage_maximum) &&
+           (a.index_mask == b.index_mask);
+}
+
+static uint32_t report_bits(const descriptor_usages_t& parsed, ReportType type, uint8_t report_id) {
+    for (const report_bits_t& bits : parsed.report_bits) {
+        if ((bits.report_type == type) && (bits.report_id == report_id)) {
+            return bits.bits;
+        }
+    }
+    return 0;
+}
+
+static void check_table(const usage_table_t& table, usage_list_t& list, const descriptor_usages_t& parsed, ReportType type) {
+    CHECK_EQ(table.nusages, list.size());
+
+    uint32_t next = 0;
+    for (uint16_t r = 0; r < table.nreports; r++) {
+        const report_usages_t& report = table.reports[r];
+        if (r > 0) {
+            CHECK(table.reports[r - 1].report_id < report.report_id);
+        }
+        CHECK_EQ(report.first, next);
+        next += report.count;
+        CHECK(find_report(table, report.report_id) == &report);
+        CHECK_EQ(report.size, report_bits(parsed, type, report.report_id) / 8);
+
+        for (uint32_t i = report.first; i < report.first + report.count; i++) {
+            const usage_usage_def_t& packed = table.usages[i];
+            if (i > report.first) {
+                CHECK(table.usages[i - 1].usage < packed.usage);
+            }
+            CHECK_EQ(packed.usage_def.report_id, report.report_id);
+            CHECK(find_usage(table, report.report_id, packed.usage) == &packed.usage_def);
+        }
+    }
+    CHECK_EQ(next, table.nusages);
+
+    for (const report_usage_t& usage : list) {
+        const usage_def_t* packed = find_usage(table, usage.report_id, usage.usage);
+        CHECK(packed != NULL);
+        CHECK(same_usage_def(*packed, usage.usage_def));
+        CHECK(find_usage(list, usage.report_id, usage.usage) != NULL);
+    }
+}
+
+// Returns the number of allocations the packed tables took.
+static uint32_t check_descriptor(const uint8_t* descriptor, int len, uint16_t vendor_id, uint16_t product_id) {
+    static descriptor_usages_t parsed;
+    parse_descriptor(parsed, descriptor, len);
+    apply_quirks(vendor_id, product_id, parsed.usages[(uint8_t) ReportType::INPUT], descriptor, len, 0);
+
+    parsed_descriptor_t packed;
+    arena_t arena;
+    uint32_t allocations_before = allocations;
+    pack_descriptor(packed, arena, parsed);
+    uint32_t pack_allocations = allocations - allocations_before;
+
+    CHECK_EQ(packed.has_report_id, parsed.has_report_id);
+    check_table(packed.input, parsed.usages[(uint8_t) ReportType::INPUT], parsed, ReportType::INPUT);
+    check_table(packed.output, parsed.usages[(uint8_t) ReportType::OUTPUT], parsed, ReportType::OUTPUT);
+    check_table(packed.feature, parsed.usages[(uint8_t) ReportType::FEATURE], parsed, ReportType::FEATURE);
+
+    arena_release(arena);
+    return pack_allocations;
+}
+
+// The full path, as used when a device is connected. Returns the number of allocations.
+static uint32_t plug_and_unplug(const uint8_t* descriptor, int len, uint16_t vendor_id, uint16_t product_id) {
+    uint32_t allocations_before = allocations;
+    parse_descriptor(vendor_id, product_id, descriptor, len, 0x0100, 0);
+    uint32_t ret = allocations - allocations_before;
+    clear_descriptor_data(1);
+    return ret;
+}
+
+int main() {
+    normalize_gamepad_inputs = true;
+    our_descriptor = &our_descriptors[0];
+    parse_our_descriptor();
+
+    std::vector<std::vector<uint8_t>> descriptors;
+
+    for (int i = 0; i < NOUR_DESCRIPTORS; i++) {
+        uint32_t n = check_descriptor(our_descriptors[i].descriptor, our_descriptors[i].descriptor_length, 0, 0);
+        printf("our descriptor %d: %u bytes, packed in %u allocations\n", i, our_descriptors[i].descriptor_length, n);
+        CHECK(n <= 10);
+        descriptors.push_back(std::vector<uint8_t>(our_descriptors[i].descriptor, our_descriptors[i].descriptor + our_descriptors[i].descriptor_length));
+    }
+
+    for (const builtin_quirk_t& quirk : builtin_quirks) {
+        uint32_t n = check_descriptor(quirk.descriptor, quirk.len, quirk.vendor_id, quirk.product_id);
+        CHECK(n <= 10);
+        // the number of allocations doesn't grow with the size of the descriptor
+        size_t bytes_before = allocated_bytes;
+        uint32_t plug_allocations = plug_and_unplug(quirk.descriptor, quirk.len, quirk.vendor_id, quirk.product_id);
+        printf("%04x:%04x: %u bytes, packed in %u allocations, %u allocations (%zu bytes) to plug in\n",
+            quirk.vendor_id, quirk.product_id, quirk.len, n, plug_allocations, allocated_bytes - bytes_before);
+        CHECK(plug_allocations <= 40);
+        descriptors.push_back(std::vector<uint8_t>(quirk.descriptor, quirk.descriptor + quirk.len));
+    }
+
+    // Mutated descriptors have to give consistent tables too, whatever the parser makes of them.
+    srand(1);
+    for (int i = 0; i < 2000; i++) {
+        std::vector<uint8_t> descriptor = descriptors[rand() % descriptors.size()];
+        int nchanges = 1 + rand() % 4;
+        for (int j = 0; j < nchanges; j++) {
+            size_t pos = rand() % descriptor.size();
+            switch (rand() % 3) {
+                case 0:
+                    descriptor[pos] = rand();
+                    break;
+                case 1:
+                    descriptor.erase(descriptor.begin() + pos);
+                    break;
+                case 2:
+                    descriptor.insert(descriptor.begin() + pos, rand());
+                    break;
+            }
+        }
+        check_descriptor(descriptor.data(), descriptor.size(), 0, 0);
+    }
+
+    return 0;
+}
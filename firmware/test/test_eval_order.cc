@@ -0,0 +1,95 @@
+#include "globals.h"
+#include "remapper.h"
+#include "test_util.h"
+
+// Layers, expressions and mappings that target registers are evaluated in dependency order,
+// so a chain of them settles in the frame its input changes in. Cycles are broken and
+// the part of the cycle that runs first sees the previous frame's values.
+
+extern int32_t registers[];
+extern uint8_t eval_cycle_breaks;
+
+static const uint32_t KEY_A = 0x00070004;
+static const uint32_t KEY_B = 0x00070005;
+static const uint32_t KEY_C = 0x00070006;
+static const uint32_t KEY_D = 0x00070007;
+static const uint32_t KEY_E = 0x00070008;
+
+int main() {
+    init_remapper();
+    plug_keyboard();
+
+    // key -> register -> expression -> layer
+    expressions[0] = {
+        { .op = Op::PUSH, .val = 1000 },
+        { .op = Op::RECALL },
+    };
+    config_mappings = {
+        { .target_usage = 0xFFF50001, .source_usage = KEY_A, .scaling = 1000, .layer_mask = 3 },
+        { .target_usage = 0xFFF10001, .source_usage = 0xFFF30001, .scaling = 1000, .layer_mask = 3 },
+        { .target_usage = KEY_C, .source_usage = KEY_B, .scaling = 1000, .layer_mask = 2 },
+        { .target_usage = KEY_D, .source_usage = KEY_B, .scaling = 1000, .layer_mask = 1 },
+    };
+    set_mapping_from_config();
+    CHECK_EQ(eval_cycle_breaks, 0);
+
+    press_keys({ 0x05 });
+    run_frames(3);
+    CHECK_EQ(sent_value(KEY_D), 1);
+    CHECK_EQ(sent_value(KEY_C), 0);
+    press_keys({ 0x04, 0x05 });
+    run_frame();
+    CHECK_EQ(sent_value(KEY_D), 0);
+    CHECK_EQ(sent_value(KEY_C), 1);
+    press_keys({ 0x05 });
+    run_frame();
+    CHECK_EQ(sent_value(KEY_D), 1);
+    CHECK_EQ(sent_value(KEY_C), 0);
+    press_keys({});
+    run_frames(3);
+
+    // key -> layer -> expression -> register -> output, the other way around in the old fixed order
+    expressions[1] = {
+        { .op = Op::LAYER_STATE },
+        { .op = Op::PUSH, .val = 4 },
+        { .op = Op::BITWISE_AND },
+        { .op = Op::PUSH, .val = 0 },
+        { .op = Op::GT },
+    };
+    config_mappings = {
+        { .target_usage = 0xFFF10002, .source_usage = KEY_A, .scaling = 1000, .layer_mask = 5 },
+        { .target_usage = 0xFFF50002, .source_usage = 0xFFF30002, .scaling = 1000, .layer_mask = 5 },
+        { .target_usage = KEY_E, .source_usage = 0xFFF50002, .scaling = 1000, .layer_mask = 5 },
+    };
+    set_mapping_from_config();
+    CHECK_EQ(eval_cycle_breaks, 0);
+
+    run_frames(3);
+    CHECK_EQ(sent_value(KEY_E), 0);
+    press_keys({ 0x04 });
+    run_frame();
+    CHECK_EQ(sent_value(KEY_E), 1);
+    press_keys({});
+    run_frame();
+    CHECK_EQ(sent_value(KEY_E), 0);
+
+    // register 3 = expression 3 = register 3 + 1, one step per frame
+    expressions[2] = {
+        { .op = Op::PUSH, .val = 3000 },
+        { .op = Op::RECALL },
+        { .op = Op::PUSH, .val = 1000 },
+        { .op = Op::ADD },
+    };
+    config_mappings = {
+        { .target_usage = 0xFFF50003, .source_usage = 0xFFF30003, .scaling = 1000, .layer_mask = 1 },
+    };
+    set_mapping_from_config();
+    CHECK(eval_cycle_breaks > 0);
+
+    run_frame();
+    int32_t start = registers[2];
+    run_frames(10);
+    CHECK_EQ(registers[2] - start, 10 * 1000);
+
+    return 0;
+}
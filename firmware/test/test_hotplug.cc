@@ -0,0 +1,238 @@
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+
+#include "descriptor_parser.h"
+#include "globals.h"
+#include "remapper.h"
+#include "test_util.h"
+
+// The built-in quirk descriptors are local to quirks.cc, so this test is built with
+// quirks.cc included here instead of linked in.
+#include "quirks.cc"
+
+// When a device is connected or disconnected, only the interfaces that changed get
+// re-derived. After every such step, everything derived has to be the same as what
+// deriving all interfaces from scratch gives.
+
+extern int32_t input_state[];
+extern std::unordered_map<uint16_t, std::unordered_map<uint8_t, std::vector<usage_usage_def_t>>> their_used_usages;
+extern std::unordered_map<uint16_t, std::unordered_map<uint8_t, std::vector<int32_t*>>> array_range_usages;
+extern std::unordered_map<uint16_t, std::unordered_map<uint8_t, std::vector<usage_def_t>>> rollover_usages;
+extern std::vector<int32_t*> relative_usages;
+extern uint32_t live_slots[1024 / 32];
+extern std::vector<reverse_mapping_t> reverse_mapping;
+extern std::unordered_map<uint8_t, layer_table_t> layer_tables;
+extern bool all_interfaces_dirty;
+
+struct device_t {
+    const uint8_t* descriptor;
+    int len;
+    uint16_t product_id;
+    uint8_t hub_port;
+};
+
+static void append(std::string& s, const char* format, ...) {
+    char buf[128];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    s += buf;
+}
+
+static long slot(const int32_t* ptr) {
+    return (ptr != NULL) ? ptr - input_state : -1;
+}
+
+// Everything update_their_descriptor_derivates() derives, in a stable order.
+static std::string derived_state() {
+    std::string s;
+
+    std::map<uint16_t, std::map<uint8_t, bool>> interfaces;
+    for (auto const& [interface, reports] : their_used_usages) {
+        for (auto const& [report_id, usages] : reports) {
+            interfaces[interface][report_id] = true;
+        }
+    }
+    for (auto const& [interface, reports] : array_range_usages) {
+        for (auto const& [report_id, slots] : reports) {
+            interfaces[interface][report_id] = true;
+        }
+    }
+    for (auto const& [interface, reports] : rollover_usages) {
+        for (auto const& [report_id, usages] : reports) {
+            interfaces[interface][report_id] = true;
+        }
+    }
+    for (auto const& [interface, reports] : interfaces) {
+        for (auto const& [report_id, unused] : reports) {
+            append(s, "interface %04x report %d\n", interface, report_id);
+            auto used = their_used_usages.find(interface);
+            if ((used != their_used_usages.end()) && used->second.count(report_id)) {
+                for (auto const& usage : used->second.at(report_id)) {
+                    append(s, " used %08x %ld %ld %d %d %d\n", usage.usage, slot(usage.usage_def.input_state_0), slot(usage.usage_def.input_state_n),
+                        usage.usage_def.should_be_scaled, usage.usage_def.bitpos, usage.usage_def.is_array);
+                }
+            }
+            auto ranges = array_range_usages.find(interface);
+            if ((ranges != array_range_usages.end()) && ranges->second.count(report_id)) {
+                for (int32_t* ptr : ranges->second.at(report_id)) {
+                    append(s, " array %ld\n", slot(ptr));
+                }
+            }
+            auto rollover = rollover_usages.find(interface);
+            if ((rollover != rollover_usages.end()) && rollover->second.count(report_id)) {
+                for (auto const& usage_def : rollover->second.at(report_id)) {
+                    append(s, " rollover %d %d\n", usage_def.bitpos, usage_def.index);
+                }
+            }
+        }
+    }
+
+    std::vector<long> relative;
+    for (int32_t* ptr : relative_usages) {
+        relative.push_back(slot(ptr));
+    }
+    std::sort(relative.begin(), relative.end());
+    s += "relative";
+    for (long r : relative) {
+        append(s, " %ld", r);
+    }
+    s += "\nlive";
+    for (uint32_t bits : live_slots) {
+        append(s, " %08x", bits);
+    }
+    s += "\nrle";
+    for (auto const& rle : their_usages_rle) {
+        append(s, " %08x/%d", rle.usage, rle.count);
+    }
+    s += "\n";
+
+    for (auto const& rev_map : reverse_mapping) {
+        append(s, "target %08x", rev_map.target);
+        for (auto const& source : rev_map.sources) {
+            append(s, " %08x:%d%d", source.usage, source.is_relative, source.is_binary);
+        }
+        for (auto const& our_usage : rev_map.our_usages) {
+            long key = -1;
+            for (auto const& [k, data] : out_reports) {
+                if (data == our_usage.data) {
+                    key = k;
+                }
+            }
+            append(s, " out %lx/%d/%d/%d", key, our_usage.len, our_usage.size, our_usage.bitpos);
+        }
+        s += "\n";
+    }
+
+    std::vector<std::string> tables;
+    for (auto const& [mask, table] : layer_tables) {
+        std::string t;
+        append(t, "layers %d", mask);
+        for (const map_source_t* source : table.sources) {
+            append(t, " %08x", source->usage);
+        }
+        for (uint16_t i : table.rev_maps) {
+            append(t, " r%d", i);
+        }
+        tables.push_back(t + "\n");
+    }
+    std::sort(tables.begin(), tables.end());
+    for (auto const& t : tables) {
+        s += t;
+    }
+
+    return s;
+}
+
+static double update_us = 0;
+static int nupdates = 0;
+
+static void update_and_compare() {
+    auto start = std::chrono::steady_clock::now();
+    update_their_descriptor_derivates();
+    update_us += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    nupdates++;
+    their_descriptor_updated = false;
+
+    std::string incremental = derived_state();
+    all_interfaces_dirty = true;
+    update_their_descriptor_derivates();
+    std::string from_scratch = derived_state();
+    if (incremental != from_scratch) {
+        printf("incremental:\n%s\nfrom scratch:\n%s\n", incremental.c_str(), from_scratch.c_str());
+    }
+    CHECK(incremental == from_scratch);
+}
+
+static void run(int ndevices) {
+    static const uint32_t TARGETS[] = { 0xFFF10001, 0x00070010, 0x00070011, 0x000700E1, 0x00010030, 0x00010031, 0x00010038, 0x00090001, 0x00080001, 0x00080002, 0x00080003 };
+    static const uint32_t SOURCES[] = { 0x00090001, 0x00090002, 0x00090003, 0x00090006, 0x00010030, 0x00010031, 0x00010038, 0x000C0238, 0x00070004, 0x00070005, 0x000700E0, 0x00070039, 0x00010035, 0x00010033 };
+    const int nbuiltin = sizeof(builtin_quirks) / sizeof(builtin_quirks[0]);
+
+    config_mappings.clear();
+    for (int i = 0; i < 60; i++) {
+        config_mappings.push_back({
+            .target_usage = TARGETS[rand() % (sizeof(TARGETS) / sizeof(TARGETS[0]))],
+            .source_usage = SOURCES[rand() % (sizeof(SOURCES) / sizeof(SOURCES[0]))],
+            .scaling = 1000,
+            .layer_mask = (uint8_t) (1 + rand() % 3),
+            .flags = 0,
+            .hub_ports = (uint8_t) ((rand() % 4 == 0) ? 1 + rand() % 3 : 0),
+        });
+    }
+    set_mapping_from_config();
+
+    std::vector<device_t> devices;
+    for (int i = 0; i < ndevices; i++) {
+        int which = i % (nbuiltin + 1);
+        uint8_t hub_port = rand() % 4;
+        if (which == 0) {
+            devices.push_back({ boot_keyboard_descriptor, boot_keyboard_descriptor_length, 0, hub_port });
+        } else {
+            devices.push_back({ builtin_quirks[which - 1].descriptor, builtin_quirks[which - 1].len, (uint16_t) which, hub_port });
+        }
+    }
+    auto connect = [&](int i) {
+        uint16_t interface = (i + 1) << 8;
+        device_connected_callback(interface, 0x1234, devices[i].product_id, devices[i].hub_port);
+        parse_descriptor(0x1234, devices[i].product_id, devices[i].descriptor, devices[i].len, interface, 0);
+    };
+
+    for (int i = 0; i < ndevices; i++) {
+        connect(i);
+    }
+    update_and_compare();
+
+    update_us = 0;
+    nupdates = 0;
+    for (int i = 0; i < 100; i++) {
+        int device = rand() % ndevices;
+        device_disconnected_callback(device + 1);
+        update_and_compare();
+        connect(device);
+        update_and_compare();
+    }
+    printf("%d devices: %.1f us per update\n", ndevices, update_us / nupdates);
+
+    for (int i = 0; i < ndevices; i++) {
+        device_disconnected_callback(i + 1);
+    }
+    update_and_compare();
+}
+
+int main() {
+    init_remapper();
+
+    srand(7);
+    for (int ndevices : { 1, 3, 8, 16, 32 }) {
+        run(ndevices);
+    }
+
+    return 0;
+}
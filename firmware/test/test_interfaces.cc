@@ -0,0 +1,115 @@
+#include "globals.h"
+#include "remapper.h"
+#include "test_util.h"
+
+// More than 32 interfaces at once. The first 31 interface indexes have their own bit in
+// binary input states, the rest share bit 31 and which of them hold an input is tracked
+// on the side. A key held on several interfaces stays held until the last of them
+// releases it, whichever bits they use.
+
+static const uint8_t KEY_A = 0x04;
+static const uint32_t KEY_B = 0x00070005;
+static const uint8_t KEY_C = 0x06;
+
+static const int NDEVICES = 40;
+
+static uint16_t keyboard_interface(int i) {
+    return (uint16_t) (i + 1) << 8;
+}
+
+// the interface that has the given index
+static uint16_t with_index(uint8_t idx) {
+    for (auto const& [interface, index] : interface_index) {
+        if (index == idx) {
+            return interface;
+        }
+    }
+    CHECK(false);
+    return 0;
+}
+
+static void press_a(uint8_t idx, bool pressed) {
+    if (pressed) {
+        press_keys({ KEY_A }, with_index(idx));
+    } else {
+        press_keys({}, with_index(idx));
+    }
+    run_frame();
+}
+
+// Presses A on the given indexes in order, then releases it in the same order.
+// B has to stay on until the last release.
+static void check_held_until_last_release(std::initializer_list<uint8_t> indexes) {
+    for (uint8_t idx : indexes) {
+        press_a(idx, true);
+        CHECK_EQ(sent_value(KEY_B), 1);
+    }
+    int left = indexes.size();
+    for (uint8_t idx : indexes) {
+        press_a(idx, false);
+        left--;
+        CHECK_EQ(sent_value(KEY_B), (left > 0) ? 1 : 0);
+    }
+}
+
+int main() {
+    config_mappings = {
+        { .target_usage = KEY_B, .source_usage = 0x00070000 | KEY_A, .scaling = 1000, .layer_mask = 1 },
+    };
+    init_remapper();
+    for (int i = 0; i < NDEVICES; i++) {
+        plug_keyboard(keyboard_interface(i));
+    }
+
+    // every interface has its own index
+    uint32_t seen[INTERFACE_INDEX_WORDS] = { 0 };
+    for (int i = 0; i < NDEVICES; i++) {
+        uint8_t idx = interface_index[keyboard_interface(i)];
+        CHECK(idx < NDEVICES);
+        CHECK(!(seen[idx / 32] & (1 << (idx % 32))));
+        seen[idx / 32] |= 1 << (idx % 32);
+    }
+
+    // indexes above 31
+    check_held_until_last_release({ 33, 36 });
+    check_held_until_last_release({ 36, 33, 39 });
+    // index 31, whose bit is the shared one, together with indexes above it
+    check_held_until_last_release({ 31, 35 });
+    check_held_until_last_release({ 35, 31 });
+    // an index with its own bit and one that uses the shared bit
+    check_held_until_last_release({ 5, 33 });
+    check_held_until_last_release({ 33, 5, 31, 30 });
+
+    // releasing on an interface that never pressed it doesn't release it
+    press_a(34, true);
+    press_a(37, false);
+    press_a(31, false);
+    CHECK_EQ(sent_value(KEY_B), 1);
+    press_a(34, false);
+    CHECK_EQ(sent_value(KEY_B), 0);
+
+    // unmapped keys pass through from any interface
+    press_keys({ KEY_C }, with_index(38));
+    run_frame();
+    CHECK_EQ(sent_value(0x00070000 | KEY_C), 1);
+    press_keys({}, with_index(38));
+    run_frame();
+    CHECK_EQ(sent_value(0x00070000 | KEY_C), 0);
+
+    // an unplugged interface gives its index back, the others keep theirs
+    uint16_t interface_31 = with_index(31);
+    uint16_t interface_36 = with_index(36);
+    unplug_device(interface_31 >> 8);
+    CHECK(!interface_index.count(interface_31));
+    CHECK_EQ(interface_index[interface_36], 36);
+    plug_keyboard(interface_31);
+    CHECK_EQ(interface_index[interface_31], 31);
+    check_held_until_last_release({ 31, 36 });
+
+    for (int i = 0; i < NDEVICES; i++) {
+        unplug_device(i + 1);
+    }
+    CHECK(interface_index.empty());
+
+    return 0;
+}
@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <unordered_map>
+
+#include "globals.h"
+#include "remapper.h"
+#include "test_util.h"
+
+// Layer states get a precompiled table as long as the tables fit in layer_tables_budget,
+// the others have their sources filtered on the fly. Both have to give the same results,
+// also when the layer state changes while tap-hold and sticky keys are held.
+
+extern std::unordered_map<uint8_t, layer_table_t> layer_tables;
+extern uint32_t layer_tables_budget;
+
+static const uint8_t STICKY = 1 << 0;
+static const uint8_t TAP = 1 << 1;
+static const uint8_t HOLD = 1 << 2;
+
+static const uint32_t THRESHOLD_US = 50000;
+
+static const uint8_t KEY_A = 0x04;
+static const uint8_t LAYER_KEYS[] = { 0x1E, 0x1F, 0x20 };  // 1, 2, 3 activate layers 1, 2, 3
+static const uint32_t A_TARGETS[] = { 0x00070005, 0x00070006, 0x00070007, 0x00070008 };  // B, C, D, E on layers 0-3
+
+static void set_config(int nfiller) {
+    config_mappings.clear();
+    for (int layer = 1; layer <= 3; layer++) {
+        config_mappings.push_back({ .target_usage = 0xFFF10000u | layer, .source_usage = 0x00070000u | LAYER_KEYS[layer - 1], .scaling = 1000, .layer_mask = 0x0F });
+    }
+    for (int layer = 0; layer < 4; layer++) {
+        config_mappings.push_back({ .target_usage = A_TARGETS[layer], .source_usage = 0x00070000u | KEY_A, .scaling = 1000, .layer_mask = (uint8_t) (1 << layer) });
+    }
+    // keys M-Z (0x10-0x1D) each map to themselves and to mouse buttons, on various layers
+    for (int i = 0; i < nfiller; i++) {
+        uint32_t source = 0x00070010 + i % 14;
+        uint32_t target = (i % 3 == 0) ? source : 0x00090001 + i % 5;
+        config_mappings.push_back({ .target_usage = target, .source_usage = source, .scaling = 1000, .layer_mask = (uint8_t) (1 + i % 15) });
+    }
+    set_mapping_from_config();
+}
+
+static void check_layer_states(int nfiller) {
+    for (int held = 0; held < 8; held++) {
+        uint8_t layers = held << 1;
+        if (layers == 0) {
+            layers = 1;
+        }
+
+        std::vector<uint8_t> keys;
+        for (int i = 0; i < 3; i++) {
+            if (held & (1 << i)) {
+                keys.push_back(LAYER_KEYS[i]);
+            }
+        }
+        uint8_t report[8] = { 0 };
+        for (size_t i = 0; i < keys.size(); i++) {
+            report[2 + i] = keys[i];
+        }
+        do_handle_received_report(report, sizeof(report), KEYBOARD_INTERFACE);
+        run_frames(2);
+        report[2 + keys.size()] = KEY_A;
+        report[3 + keys.size()] = 0x10;  // M
+        report[4 + keys.size()] = 0x11;  // N
+        do_handle_received_report(report, sizeof(report), KEYBOARD_INTERFACE);
+        run_frames(2);
+
+        for (int layer = 0; layer < 4; layer++) {
+            CHECK_EQ(sent_value(A_TARGETS[layer]), !!(layers & (1 << layer)));
+        }
+        // filler mappings on active layers
+        for (uint32_t source : { 0x00070010, 0x00070011 }) {
+            for (int i = 0; i < nfiller; i++) {
+                if ((0x00070010u + i % 14 == source) && ((1 + i % 15) & layers)) {
+                    uint32_t target = (i % 3 == 0) ? source : 0x00090001 + i % 5;
+                    CHECK_EQ(sent_value(target), 1);
+                }
+            }
+        }
+
+        press_keys({});
+        run_frames(2);
+        for (int layer = 0; layer < 4; layer++) {
+            CHECK_EQ(sent_value(A_TARGETS[layer]), 0);
+        }
+    }
+}
+
+// Ctrl activates layer 1 and Shift layer 2. E is a tap-hold key whose targets depend on
+// the layer, Z latches F24 on layer 0 and is just Y on layer 1.
+static const uint8_t KEY_E = 0x08;
+static const uint8_t KEY_Z = 0x1D;
+static const uint8_t KEY_LEFT_CTRL = 0xE0;
+static const uint8_t KEY_LEFT_SHIFT = 0xE1;
+static const uint32_t E_TAP[] = { 0x00070004, 0x00070006 };   // A, C
+static const uint32_t E_HOLD[] = { 0x00070005, 0x00070007 };  // B, D
+static const uint32_t KEY_Y = 0x0007001C;
+static const uint32_t KEY_F24 = 0x00070073;
+
+static void set_tap_hold_config() {
+    tap_hold_threshold = THRESHOLD_US;
+    config_mappings = {
+        { .target_usage = 0xFFF10001, .source_usage = 0x00070000u | KEY_LEFT_CTRL, .scaling = 1000, .layer_mask = 0x07 },
+        { .target_usage = 0xFFF10002, .source_usage = 0x00070000u | KEY_LEFT_SHIFT, .scaling = 1000, .layer_mask = 0x07 },
+        { .target_usage = E_TAP[0], .source_usage = 0x00070000u | KEY_E, .scaling = 1000, .layer_mask = 1, .flags = TAP },
+        { .target_usage = E_HOLD[0], .source_usage = 0x00070000u | KEY_E, .scaling = 1000, .layer_mask = 1, .flags = HOLD },
+        { .target_usage = E_TAP[1], .source_usage = 0x00070000u | KEY_E, .scaling = 1000, .layer_mask = 2, .flags = TAP },
+        { .target_usage = E_HOLD[1], .source_usage = 0x00070000u | KEY_E, .scaling = 1000, .layer_mask = 2, .flags = HOLD },
+        { .target_usage = KEY_F24, .source_usage = 0x00070000u | KEY_Z, .scaling = 1000, .layer_mask = 1, .flags = STICKY },
+        { .target_usage = KEY_Y, .source_usage = 0x00070000u | KEY_Z, .scaling = 1000, .layer_mask = 2 },
+        { .target_usage = 0x00090001, .source_usage = 0x00070010, .scaling = 1000, .layer_mask = 0x06 },
+    };
+}
+
+// Everything we sent, flattened.
+static std::vector<uint32_t> sent_so_far() {
+    std::vector<uint32_t> result;
+    for (auto const& report : sent_reports) {
+        result.push_back(report.time);
+        result.push_back(report.data.size());
+        result.insert(result.end(), report.data.begin(), report.data.end());
+    }
+    return result;
+}
+
+static void start(uint32_t budget) {
+    layer_tables_budget = budget;
+    set_tap_hold_config();
+    init_remapper();
+    plug_keyboard();
+    run_frames(2);
+    CHECK((budget == 0) ? layer_tables.empty() : (layer_tables.size() == 4));
+}
+
+static bool any_tap() {
+    return sent_value(E_TAP[0]) || sent_value(E_TAP[1]);
+}
+
+// The layer changes while E and Z are held, then they're released.
+static std::vector<uint32_t> mid_hold(uint32_t budget) {
+    start(budget);
+
+    // a hold on layer 0 doesn't turn into a tap or stay stuck when it's released on layer 1
+    press_keys({ KEY_E });
+    run_frames(THRESHOLD_US / 1000 + 10);
+    CHECK_EQ(sent_value(E_HOLD[0]), 1);
+    press_keys({ KEY_E, KEY_LEFT_CTRL });
+    run_frames(10);
+    press_keys({ KEY_LEFT_CTRL });
+    for (int i = 0; i < 10; i++) {
+        run_frame();
+        CHECK(!any_tap());
+    }
+    CHECK_EQ(sent_value(E_HOLD[0]), 0);
+    CHECK_EQ(sent_value(E_HOLD[1]), 0);
+
+    // pressed on layer 1 and released on layer 0 before the threshold: still a tap
+    press_keys({ KEY_E, KEY_LEFT_CTRL });
+    run_frames(10);
+    press_keys({ KEY_E });
+    run_frames(10);
+    press_keys({});
+    bool tapped = false;
+    for (int i = 0; i < 10; i++) {
+        run_frame();
+        tapped |= any_tap();
+        CHECK_EQ(sent_value(E_HOLD[0]), 0);
+        CHECK_EQ(sent_value(E_HOLD[1]), 0);
+    }
+    CHECK(tapped);
+    CHECK(!any_tap());
+
+    // Z latches F24 on layer 0. Holding it through layer 1 and releasing it there doesn't
+    // unlatch it, pressing it on layer 1 gives Y and doesn't either.
+    press_keys({ KEY_Z });
+    run_frames(5);
+    CHECK_EQ(sent_value(KEY_F24), 1);
+    press_keys({ KEY_Z, KEY_LEFT_CTRL });
+    run_frames(5);
+    press_keys({ KEY_LEFT_CTRL });
+    run_frames(5);
+    CHECK_EQ(sent_value(KEY_F24), 1);
+    press_keys({ KEY_Z, KEY_LEFT_CTRL });
+    run_frames(5);
+    CHECK_EQ(sent_value(KEY_Y), 1);
+    press_keys({});
+    run_frames(5);
+    CHECK_EQ(sent_value(KEY_Y), 0);
+    CHECK_EQ(sent_value(KEY_F24), 1);
+    // and a press on layer 0 does
+    press_keys({ KEY_Z });
+    run_frames(5);
+    press_keys({});
+    run_frames(5);
+    CHECK_EQ(sent_value(KEY_F24), 0);
+
+    // E held past the threshold while the layer goes 0 -> 2 -> 1 -> 0 and Z latched on the way
+    press_keys({ KEY_E });
+    run_frames(20);
+    press_keys({ KEY_E, KEY_LEFT_SHIFT });
+    run_frames(20);
+    press_keys({ KEY_E, KEY_LEFT_CTRL, KEY_Z });
+    run_frames(20);
+    press_keys({ KEY_E, KEY_Z });
+    run_frames(20);
+    press_keys({});
+    for (int i = 0; i < 10; i++) {
+        run_frame();
+        CHECK(!any_tap());
+    }
+    CHECK_EQ(sent_value(E_HOLD[0]), 0);
+    CHECK_EQ(sent_value(E_HOLD[1]), 0);
+
+    return sent_so_far();
+}
+
+// Random presses and releases of the layer keys, E, Z and M, with random gaps around the
+// tap-hold threshold.
+static std::vector<uint32_t> random_presses(uint32_t budget, int seed) {
+    start(budget);
+    srand(seed);
+    static const uint8_t keys[] = { KEY_LEFT_CTRL, KEY_LEFT_SHIFT, KEY_E, KEY_Z, 0x10 };
+    uint8_t report[8] = { 0 };
+    for (int i = 0; i < 300; i++) {
+        int k = rand() % 5;
+        if (k < 2) {
+            report[0] ^= 1 << (keys[k] - 0xE0);
+        } else {
+            report[k] = report[k] ? 0 : keys[k];
+        }
+        do_handle_received_report(report, sizeof(report), KEYBOARD_INTERFACE);
+        run_frames(1 + rand() % 80);
+    }
+    memset(report, 0, sizeof(report));
+    do_handle_received_report(report, sizeof(report), KEYBOARD_INTERFACE);
+    run_frames(100);
+    return sent_so_far();
+}
+
+static void check_same_with_and_without_tables() {
+    uint32_t budget = layer_tables_budget;
+    std::vector<uint32_t> with_tables = in_child([&]() { return mid_hold(budget); });
+    std::vector<uint32_t> without_tables = in_child([]() { return mid_hold(0); });
+    CHECK(!with_tables.empty());
+    CHECK(with_tables == without_tables);
+
+    for (int seed = 0; seed < 20; seed++) {
+        with_tables = in_child([&]() { return random_presses(budget, seed); });
+        without_tables = in_child([&]() { return random_presses(0, seed); });
+        CHECK(with_tables == without_tables);
+    }
+}
+
+int main() {
+    check_same_with_and_without_tables();
+
+    init_remapper();
+    plug_keyboard();
+
+    // everything fits
+    set_config(20);
+    check_layer_states(20);
+    CHECK_EQ(layer_tables.size(), 8);
+
+    // only some layer states get a table
+    set_config(1200);
+    run_frame();
+    CHECK(layer_tables.size() >= 1);
+    CHECK(layer_tables.size() < 8);
+    check_layer_states(1200);
+    CHECK(layer_tables.size() < 8);
+
+    return 0;
+}
@@ -0,0 +1,80 @@
+#include <vector>
+
+#include "descriptor_parser.h"
+#include "globals.h"
+#include "remapper.h"
+#include "test_util.h"
+
+// Input reports can be longer than 64 bytes, with fields up to just under 8KB into the
+// report. Output and feature reports are still limited to 64 bytes.
+
+static const uint32_t KEY_A = 0x00070004;
+static const uint32_t MOUSE_X = 0x00010030;
+static const uint32_t BUTTON_1 = 0x00090001;
+
+static void check_report_length(int total_len, bool expect_fields) {
+    static uint8_t x = 0;
+    x++;  // different every time, so that we don't see the previous one's report
+    std::vector<uint8_t> descriptor = long_report_descriptor(total_len);
+    plug_device(0x0100, descriptor.data(), descriptor.size());
+
+    const parsed_descriptor_t& their = their_descriptors[0x0100];
+    CHECK_EQ(find_usage(their.input, 2, MOUSE_X) != NULL, expect_fields);
+    CHECK_EQ(find_usage(their.input, 2, BUTTON_1) != NULL, expect_fields);
+
+    std::vector<uint8_t> report(total_len, 0);
+    report[0] = 2;
+    report[total_len - 3] = x;
+    report[total_len - 1] = 1;  // button 1
+    do_handle_received_report(report.data(), report.size(), 0x0100);
+    run_frame();
+    CHECK_EQ(sent_value(KEY_A), expect_fields);
+    if (expect_fields) {
+        // (relative, so a mouse report only gets sent when it moves)
+        CHECK_EQ(sent_value(MOUSE_X), x);
+    }
+
+    report[total_len - 3] = 0;
+    report[total_len - 1] = 0;
+    do_handle_received_report(report.data(), report.size(), 0x0100);
+    run_frames(2);
+    CHECK_EQ(sent_value(KEY_A), 0);
+
+    unplug_device(1);
+}
+
+int main() {
+    config_mappings = {
+        { .target_usage = KEY_A, .source_usage = BUTTON_1, .scaling = 1000, .layer_mask = 1 },
+        { .target_usage = MOUSE_X, .source_usage = MOUSE_X, .scaling = 1000, .layer_mask = 1 },
+    };
+    init_remapper();
+
+    for (int total_len : { 8, 64, 65, 128, 256, 512, 1100, 8000 }) {
+        check_report_length(total_len, true);
+    }
+    // X would start past what a 16-bit bit position can address
+    check_report_length(8200, false);
+
+    // output reports go through 64-byte buffers, fields past that are dropped
+    static const uint8_t long_output_descriptor[] = {
+        0x05, 0x08,        // Usage Page (LEDs)
+        0x09, 0x01,        // Usage (Num Lock)
+        0xA1, 0x01,        // Collection (Application)
+        0x75, 0x08,        //   Report Size (8)
+        0x95, 0x50,        //   Report Count (80)
+        0x91, 0x01,        //   Output (Const)
+        0x09, 0x02,        //   Usage (Caps Lock)
+        0x75, 0x01,        //   Report Size (1)
+        0x95, 0x01,        //   Report Count (1)
+        0x91, 0x02,        //   Output (Data, Var, Abs)
+        0x75, 0x07,        //   Report Size (7)
+        0x91, 0x01,        //   Output (Const)
+        0xC0,              // End Collection
+    };
+    plug_device(0x0100, long_output_descriptor, sizeof(long_output_descriptor));
+    CHECK(find_usage(their_descriptors[0x0100].output, 0, 0x00080002) == NULL);
+    unplug_device(1);
+
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <utility>
+
+#include "globals.h"
+#include "test_util.h"
+
+// Macro playback, frame-based and high-rate (macro_step_duration_us != 0). Whatever
+// the steps are packed into, the host has to see the same key presses in the same
+// order, and high-rate playback has to get there in fewer reports.
+
+typedef std::vector<std::pair<uint8_t, uint8_t>> typed_t;  // modifiers, key
+
+static const uint8_t LSHIFT = 0xE1;
+
+// What a host would type given the reports sent since a given index: keys that go down
+// in a report, in ascending usage order (the boot keyboard bitmap order), with the
+// modifiers held in that report.
+static typed_t typed_since(size_t first) {
+    typed_t typed;
+    std::vector<uint8_t> prev;
+    for (size_t i = first; i < sent_reports.size(); i++) {
+        if (sent_reports[i].data[0] != 2) {  // REPORT_ID_KEYBOARD
+            continue;
+        }
+        std::vector<uint8_t> keys = report_keys(sent_reports[i]);
+        uint8_t modifiers = 0;
+        for (uint8_t key : keys) {
+            if (key >= 0xE0) {
+                modifiers |= 1 << (key - 0xE0);
+            }
+        }
+        for (uint8_t key : keys) {
+            if ((key < 0xE0) && (std::find(prev.begin(), prev.end(), key) == prev.end())) {
+                typed.push_back({ modifiers, key });
+            }
+        }
+        prev = keys;
+    }
+    return typed;
+}
+
+static void set_macro(int macro, const std::vector<std::vector<uint32_t>>& entries) {
+    macros[macro].clear();
+    for (auto const& entry : entries) {
+        macros[macro].insert(macros[macro].end(), entry.begin(), entry.end());
+        macros[macro].push_back(0);
+    }
+    macros[macro].push_back(0);
+}
+
+// Frame-based playback sends one report per entry, so a key that's in two consecutive
+// entries is only pressed once. High-rate playback releases it in between.
+static typed_t expected_typed(const std::vector<std::vector<uint32_t>>& entries, bool frame_based = false) {
+    typed_t typed;
+    const std::vector<uint32_t>* prev = nullptr;
+    for (auto const& entry : entries) {
+        uint8_t modifiers = 0;
+        for (uint32_t usage : entry) {
+            if ((usage & 0xFF) >= 0xE0) {
+                modifiers |= 1 << ((usage & 0xFF) - 0xE0);
+            }
+        }
+        for (uint32_t usage : entry) {
+            if (((usage & 0xFFFF0000) == 0x00070000) && ((usage & 0xFF) < 0xE0) &&
+                !(frame_based && (prev != nullptr) && (std::find(prev->begin(), prev->end(), usage) != prev->end()))) {
+                typed.push_back({ modifiers, usage & 0xFF });
+            }
+        }
+        prev = &entry;
+    }
+    return typed;
+}
+
+// Triggers macro 1 with key A and returns how many frames it took until the keyboard
+// report went back to idle.
+static int play(const std::vector<std::vector<uint32_t>>& entries, size_t& first_report) {
+    set_macro(0, entries);
+    run_frames(5);
+    first_report = sent_reports.size();
+    press_keys({ 0x04 });
+    run_frame();
+    press_keys({});
+    int frames = 1;
+    uint64_t last_change = fake_time;
+    while (fake_time - last_change < 100000) {
+        size_t before = sent_reports.size();
+        run_frame();
+        frames++;
+        if (sent_reports.size() != before) {
+            last_change = fake_time;
+        }
+        CHECK(frames < 10000);
+    }
+    return frames - 100;
+}
+
+static std::vector<std::vector<uint32_t>> text(const char* s) {
+    std::vector<std::vector<uint32_t>> entries;
+    for (const char* c = s; *c; c++) {
+        if ((*c >= 'a') && (*c <= 'z')) {
+            entries.push_back({ 0x00070004u + (*c - 'a') });
+        } else if ((*c >= 'A') && (*c <= 'Z')) {
+            entries.push_back({ 0x00070000u | LSHIFT, 0x00070004u + (*c - 'A') });
+        } else if (*c == ' ') {
+            entries.push_back({ 0x0007002Cu });
+        }
+    }
+    return entries;
+}
+
+int main() {
+    config_mappings = {
+        { .target_usage = 0xFFF20001, .source_usage = 0x00070004, .scaling = 1000, .layer_mask = 1 },
+    };
+    init_remapper();
+    plug_keyboard();
+
+    const std::vector<std::vector<std::vector<uint32_t>>> cases = {
+        text("abcdefghijklmnopqrstuvwxyz"),
+        text("hello world"),
+        text("Hello World"),
+        text("aaaa bbbb AAAA"),
+        text("zyxwvutsrqponm"),
+        // several keys and a non-keyboard usage in one entry
+        { { 0x00070004, 0x00070005 }, { 0x00070006 }, { 0x00090001 }, { 0x00070007 } },
+    };
+
+    for (auto const& entries : cases) {
+        size_t first;
+
+        macro_step_duration_us = 0;
+        play(entries, first);
+        CHECK(typed_since(first) == expected_typed(entries, true));
+
+        for (uint32_t step_us : { 1000u, 250u, 100u, 1u }) {
+            macro_step_duration_us = step_us;
+            play(entries, first);
+            CHECK(typed_since(first) == expected_typed(entries));
+        }
+    }
+
+    // ascending lowercase letters can share reports, 250us steps with 1ms frames means
+    // four steps per report
+    size_t first;
+    macro_step_duration_us = 0;
+    int frame_based_frames = play(text("abcdefghijklmnopqrstuvwxyz"), first);
+    size_t frame_based_reports = sent_reports.size() - first;
+    macro_step_duration_us = 250;
+    int high_rate_frames = play(text("abcdefghijklmnopqrstuvwxyz"), first);
+    size_t high_rate_reports = sent_reports.size() - first;
+    printf("26 letters: frame-based %d frames %zu reports, high-rate %d frames %zu reports\n",
+        frame_based_frames, frame_based_reports, high_rate_frames, high_rate_reports);
+    CHECK(high_rate_frames * 3 <= frame_based_frames);
+    CHECK(high_rate_reports * 3 <= frame_based_reports);
+
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include <set>
+#include <vector>
+
+#include "globals.h"
+#include "our_descriptor.h"
+#include "remapper.h"
+#include "test_util.h"
+
+// Each of our non-array usages gets a dense ID when our descriptor is parsed. Accumulated
+// relative movement and injected input are kept in vectors indexed by that ID, and
+// reverse mappings know the ID of their target.
+
+extern usage_table_t our_usages;
+extern std::unordered_map<uint32_t, uint16_t> our_usage_ids;
+extern std::vector<const usage_def_t*> our_usage_defs;
+extern std::vector<uint16_t> our_relative_usage_ids;
+extern std::vector<int32_t> accumulated;
+extern std::vector<int32_t> injected_state;
+extern std::vector<bool> injected;
+extern std::vector<reverse_mapping_t> reverse_mapping;
+
+static const uint32_t KEY_A = 0x00070004;
+static const uint32_t KEY_B = 0x00070005;
+static const uint32_t MOUSE_X = 0x00010030;
+static const uint32_t MOUSE_Y = 0x00010031;
+static const uint32_t BUTTON_1 = 0x00090001;
+
+static void check_ids(uint8_t descriptor_number) {
+    config_mappings = {
+        { .target_usage = KEY_A, .source_usage = BUTTON_1, .scaling = 1000, .layer_mask = 1 },
+        { .target_usage = MOUSE_X, .source_usage = MOUSE_X, .scaling = 1000, .layer_mask = 1 },
+        { .target_usage = 0xFFF10001, .source_usage = KEY_B, .scaling = 1000, .layer_mask = 1 },
+    };
+    init_remapper(descriptor_number);
+
+    uint32_t nids = our_usage_defs.size();
+    CHECK_EQ(our_usage_ids.size(), nids);
+    CHECK_EQ(accumulated.size(), nids);
+    CHECK_EQ(injected_state.size(), nids);
+    CHECK_EQ(injected.size(), nids);
+
+    // every non-array usage has one, the definition is the last one in our descriptor
+    std::set<uint32_t> usages;
+    for (uint32_t i = 0; i < our_usages.nusages; i++) {
+        const usage_usage_def_t& our_usage = our_usages.usages[i];
+        if (our_usage.usage_def.usage_maximum != 0) {
+            continue;
+        }
+        usages.insert(our_usage.usage);
+        CHECK(our_usage_ids.count(our_usage.usage));
+        const usage_def_t* def = our_usage_defs[our_usage_ids[our_usage.usage]];
+        CHECK(def >= &our_usage.usage_def);
+        CHECK(def < &our_usages.usages[our_usages.nusages].usage_def);
+    }
+
+    // the IDs are 0..n-1, each used once; only the d-pad directions aren't in the table
+    std::vector<bool> seen(nids, false);
+    for (auto const& [usage, id] : our_usage_ids) {
+        CHECK(id < nids);
+        CHECK(!seen[id]);
+        seen[id] = true;
+        if (usages.count(usage) == 0) {
+            CHECK_EQ(usage & 0xFFFF0000, DPAD_USAGE_PAGE);
+            CHECK(usages.count(DPAD_USAGE));
+        }
+    }
+    CHECK_EQ(nids, usages.size() + (usages.count(DPAD_USAGE) ? 4 : 0));
+
+    std::vector<uint16_t> relative;
+    for (uint16_t id = 0; id < nids; id++) {
+        if (our_usage_defs[id]->is_relative) {
+            relative.push_back(id);
+        }
+    }
+    CHECK(relative == our_relative_usage_ids);
+
+    for (auto const& rev_map : reverse_mapping) {
+        auto search = our_usage_ids.find(rev_map.target);
+        if (search != our_usage_ids.end()) {
+            CHECK_EQ(rev_map.our_usage_id, search->second);
+        } else {
+            CHECK_EQ(rev_map.our_usage_id, NO_OUR_USAGE_ID);
+        }
+    }
+}
+
+static int32_t sent_total(uint32_t usage, size_t since) {
+    int32_t total = 0;
+    for (size_t i = since; i < sent_reports.size(); i++) {
+        total += report_value(sent_reports[i], usage);
+    }
+    return total;
+}
+
+static void inject(uint32_t usage, int32_t value) {
+    inject_input_cmd_t cmd = { .usage = usage, .value = value };
+    config_command(ConfigCommand::INJECT_INPUT, &cmd, sizeof(cmd));
+}
+
+int main() {
+    for (uint8_t i = 0; i < NOUR_DESCRIPTORS; i++) {
+        check_ids(i);
+    }
+
+    // fractions of relative movement carry over to the next frame
+    config_mappings = {
+        { .target_usage = MOUSE_X, .source_usage = MOUSE_X, .scaling = 300, .layer_mask = 1 },
+    };
+    init_remapper();
+    std::vector<uint8_t> descriptor = long_report_descriptor(8);
+    plug_device(0x0100, descriptor.data(), descriptor.size());
+    size_t start = sent_reports.size();
+    std::vector<uint8_t> report(8, 0);
+    report[0] = 2;
+    report[5] = 1;
+    for (int i = 0; i < 10; i++) {
+        do_handle_received_report(report.data(), report.size(), 0x0100);
+        run_frame();
+    }
+    CHECK_EQ(sent_total(MOUSE_X, start), 3);
+    report[5] = 0;
+    do_handle_received_report(report.data(), report.size(), 0x0100);
+    run_frames(3);
+    CHECK_EQ(sent_total(MOUSE_X, start), 3);
+    unplug_device(1);
+
+    // injected input
+    start = sent_reports.size();
+    inject(MOUSE_Y, 5000);  // relative values are in thousandths, like everything accumulated
+    run_frames(3);
+    CHECK_EQ(sent_total(MOUSE_Y, start), 5);
+
+    inject(KEY_B, 1);
+    run_frame();
+    CHECK_EQ(sent_value(KEY_B), 1);
+    inject(KEY_B, 0);
+    run_frame();
+    CHECK_EQ(sent_value(KEY_B), 0);
+
+    // not one of ours, ignored
+    inject(0x00FF0001, 1);
+    run_frame();
+
+    return 0;
+}
@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <unordered_set>
+#include <vector>
+
+#include "crc.h"
+#include "globals.h"
+#include "our_descriptor.h"
+#include "remapper.h"
+#include "test_util.h"
+
+// Small changes to the mappings are patched in instead of compiling everything again.
+// Patching has to give the same reports as a full compile would, keep the state of
+// sources that are still mapped and compile everything once enough input state slots
+// aren't read by anything anymore.
+
+extern bool all_mappings_dirty;
+extern std::unordered_set<uint16_t> unreferenced_slots;
+extern uint32_t used_state_slots;
+
+static const uint8_t STICKY = 1 << 0;
+static const uint8_t TAP = 1 << 1;
+static const uint8_t HOLD = 1 << 2;
+
+static const uint32_t KEY_Z = 0x0007001D;
+static const uint32_t KEY_F24 = 0x00070073;
+
+// Only sources go on a hub port. A target on a hub port is meant for devices on that port,
+// in our report it writes the same field as the target without one, and which of them wins
+// depends on the order they were compiled in, patched or not.
+static mapping_config11_t random_mapping() {
+    static const uint32_t targets[] = { 0x00070004, 0x00070005, 0x00070006, 0x00070010, 0x000700E1, 0x00090001, 0x00090002, 0x00010030, 0x00010038, 0xFFF20001, 0xFFF10001, 0x000C00E9, 0x00070007, 0x00070008 };
+    mapping_config11_t mapping = {
+        .target_usage = targets[rand() % (sizeof(targets) / sizeof(targets[0]))],
+        .source_usage = (rand() % 6 == 0) ? 0x000700E0u + rand() % 4 : 0x00070004u + rand() % 12,
+        .scaling = (rand() % 5 == 0) ? -1000 : 1000,
+        .layer_mask = (uint8_t) (1 + rand() % 3),
+        .flags = (uint8_t) ((rand() % 10 == 0) ? ((rand() % 2) ? TAP : HOLD) : 0),
+        .hub_ports = (uint8_t) ((rand() % 8 == 0) ? 0x01 : 0),
+    };
+    if ((mapping.target_usage & 0xFFFF0000) == 0xFFF10000) {
+        mapping.flags = 0;
+    }
+    return mapping;
+}
+
+static uint32_t hash_reports(uint32_t hash) {
+    for (auto const& report : sent_reports) {
+        hash = crc32_update(crc32((uint8_t*) &hash, sizeof(hash)), report.data.data(), report.data.size());
+    }
+    sent_reports.clear();
+    return hash;
+}
+
+// Keys 0-11 are A-L, 12-15 are the left modifiers.
+static void send_keys(const bool* down) {
+    uint8_t report[8] = { 0 };
+    int n = 2;
+    for (int i = 0; (i < 16) && (n < 8); i++) {
+        if (down[i]) {
+            if (i >= 12) {
+                report[0] |= 1 << (i - 12);
+            } else {
+                report[n++] = 4 + i;
+            }
+        }
+    }
+    do_handle_received_report(report, sizeof(report), KEYBOARD_INTERFACE);
+}
+
+// Random edits with keys being pressed in between, returns a hash of what was sent after each
+// edit. With full set, every edit is compiled from scratch.
+static std::vector<uint32_t> random_edits(int seed, uint8_t descriptor_number, bool full) {
+    srand(seed);
+    tap_hold_threshold = 5000;
+    unmapped_passthrough_layer_mask = 1 + rand() % 3;
+    config_mappings.clear();
+    int n = 20 + rand() % 40;
+    for (int i = 0; i < n; i++) {
+        config_mappings.push_back(random_mapping());
+    }
+    init_remapper(descriptor_number);
+    plug_keyboard();
+
+    std::vector<uint32_t> hashes;
+    uint32_t hash = 0;
+    bool down[16] = { false };
+    for (int edit = 0; edit < 300; edit++) {
+        for (int i = 0; i < 60; i++) {
+            if (rand() % 4 == 0) {
+                down[rand() % 16] = rand() % 2;
+                send_keys(down);
+            }
+            run_frame();
+        }
+        // everything released, so that tap-hold state doesn't depend on how the mappings were compiled
+        memset(down, 0, sizeof(down));
+        send_keys(down);
+        run_frames(20);
+        hash = hash_reports(hash);
+
+        switch (rand() % 4) {
+            case 0:
+                if (config_mappings.size() > 1) {
+                    config_mappings.erase(config_mappings.begin() + rand() % config_mappings.size());
+                }
+                break;
+            case 1:
+                config_mappings.insert(config_mappings.begin() + rand() % (config_mappings.size() + 1), random_mapping());
+                break;
+            case 2:
+                config_mappings[rand() % config_mappings.size()] = random_mapping();
+                break;
+            case 3: {
+                mapping_config11_t& mapping = config_mappings[rand() % config_mappings.size()];
+                if (rand() % 2) {
+                    mapping.layer_mask = 1 + rand() % 3;
+                } else {
+                    mapping.scaling = -mapping.scaling;
+                }
+                break;
+            }
+        }
+        if (rand() % 20 == 0) {
+            std::swap(config_mappings.front(), config_mappings.back());
+        }
+        if (full) {
+            all_mappings_dirty = true;
+        }
+        config_updated = true;
+        run_frame();
+        hashes.push_back(hash_reports(hash));
+    }
+    return hashes;
+}
+
+static uint32_t random_key() {
+    return 0x00070004 + rand() % 0x18;
+}
+
+static void set_sticky_f24() {
+    press_keys({ (uint8_t) (KEY_Z & 0xFF) });
+    run_frame();
+    press_keys({});
+    run_frame();
+    CHECK_EQ(sent_value(KEY_F24), 1);
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// 500 mappings and single mapping edits. Z is a sticky key for F24, it stays on as long as
+// nothing gets compiled from scratch.
+static void large_config() {
+    srand(500);
+    unmapped_passthrough_layer_mask = 1;
+    config_mappings.clear();
+    config_mappings.push_back({ .target_usage = KEY_F24, .source_usage = KEY_Z, .scaling = 1000, .layer_mask = 1, .flags = STICKY });
+    while (config_mappings.size() < 500) {
+        config_mappings.push_back({ .target_usage = random_key(), .source_usage = random_key(), .scaling = 1000, .layer_mask = 1 });
+    }
+    init_remapper();
+    plug_keyboard();
+    set_sticky_f24();
+
+    const int nedits = 1000;
+    double patched = 0;
+    for (int i = 0; i < nedits; i++) {
+        config_mappings[1 + rand() % 499] = { .target_usage = random_key(), .source_usage = random_key(), .scaling = 1000, .layer_mask = 1 };
+        auto start = std::chrono::steady_clock::now();
+        set_mapping_from_config();
+        patched += seconds_since(start);
+        run_frame();
+        CHECK_EQ(sent_value(KEY_F24), 1);
+    }
+    CHECK(unreferenced_slots.empty());
+
+    double full = 0;
+    for (int i = 0; i < nedits; i++) {
+        config_mappings[1 + rand() % 499] = { .target_usage = random_key(), .source_usage = random_key(), .scaling = 1000, .layer_mask = 1 };
+        all_mappings_dirty = true;
+        auto start = std::chrono::steady_clock::now();
+        set_mapping_from_config();
+        full += seconds_since(start);
+    }
+    run_frame();
+    CHECK_EQ(sent_value(KEY_F24), 0);
+
+    printf("500 mappings, one mapping changed: %.1f us patched, %.1f us compiled from scratch\n", patched * 1e6 / nedits, full * 1e6 / nedits);
+
+    unplug_device(1);
+}
+
+// Every edit maps a different source, so the slot of the previous one isn't read by anything.
+static void unreferenced_slot_limit() {
+    unmapped_passthrough_layer_mask = 0;
+    config_mappings = {
+        { .target_usage = KEY_F24, .source_usage = KEY_Z, .scaling = 1000, .layer_mask = 1, .flags = STICKY },
+        { .target_usage = 0x00070004, .source_usage = 0x000C0001, .scaling = 1000, .layer_mask = 1 },
+    };
+    init_remapper();
+    plug_keyboard();
+    set_sticky_f24();
+
+    uint32_t slots_after_full_compile = used_state_slots;
+    int full_compiles = 0;
+    for (int i = 1; i <= 200; i++) {
+        size_t unreferenced_before = unreferenced_slots.size();
+        config_mappings[1].source_usage = 0x000C0001 + i;
+        config_updated = true;
+        run_frames(2);
+        CHECK(unreferenced_slots.size() <= 64);
+        if (sent_value(KEY_F24) == 0) {
+            // compiled from scratch, the unused slots are gone
+            CHECK_EQ(unreferenced_before, 64);
+            CHECK(unreferenced_slots.empty());
+            CHECK_EQ(used_state_slots, slots_after_full_compile);
+            full_compiles++;
+            set_sticky_f24();
+        } else {
+            CHECK_EQ(unreferenced_slots.size(), unreferenced_before + 1);
+            CHECK(used_state_slots <= slots_after_full_compile + 64);
+        }
+    }
+    CHECK_EQ(full_compiles, 200 / 65);
+
+    unplug_device(1);
+}
+
+int main() {
+    for (int seed = 1; seed <= 4; seed++) {
+        for (uint8_t descriptor_number = 0; descriptor_number < NOUR_DESCRIPTORS; descriptor_number++) {
+            std::vector<uint32_t> patched = in_child([&]() { return random_edits(seed, descriptor_number, false); });
+            std::vector<uint32_t> full = in_child([&]() { return random_edits(seed, descriptor_number, true); });
+            CHECK_EQ(patched.size(), 300);
+            CHECK(patched == full);
+        }
+    }
+
+    large_config();
+    unreferenced_slot_limit();
+
+    return 0;
+}
@@ -0,0 +1,348 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "config.h"
+#include "crc.h"
+#include "globals.h"
+#include "interval_override.h"
+#include "test_util.h"
+
+// The persisted config is written with varints and a usage page dictionary. Whatever
+// goes in has to come out the same when it's loaded back, including the values at the
+// edges of the encoding. Configs persisted by v19 and v20, which had fixed-width fields,
+// still load. Corrupted configs with a valid CRC don't crash the loader.
+
+struct config_snapshot_t {
+    uint8_t unmapped_passthrough_layer_mask;
+    uint32_t partial_scroll_timeout;
+    uint32_t tap_hold_threshold;
+    uint64_t gpio_debounce_time;
+    uint8_t interval_override;
+    uint8_t our_descriptor_number;
+    bool ignore_auth_dev_inputs;
+    uint8_t gpio_output_mode;
+    bool normalize_gamepad_inputs;
+    uint8_t macro_entry_duration;
+    uint32_t macro_step_duration_us;
+    std::vector<mapping_config11_t> mappings;
+    std::vector<uint32_t> macros[NMACROS];
+    std::vector<expr_elem_t> expressions[NEXPRESSIONS];
+    std::vector<quirk_t> quirks;
+};
+
+static config_snapshot_t take_snapshot() {
+    config_snapshot_t s;
+    s.unmapped_passthrough_layer_mask = unmapped_passthrough_layer_mask;
+    s.partial_scroll_timeout = partial_scroll_timeout;
+    s.tap_hold_threshold = tap_hold_threshold;
+    s.gpio_debounce_time = gpio_debounce_time;
+    s.interval_override = interval_override;
+    s.our_descriptor_number = our_descriptor_number;
+    s.ignore_auth_dev_inputs = ignore_auth_dev_inputs;
+    s.gpio_output_mode = gpio_output_mode;
+    s.normalize_gamepad_inputs = normalize_gamepad_inputs;
+    s.macro_entry_duration = macro_entry_duration;
+    s.macro_step_duration_us = macro_step_duration_us;
+    s.mappings = config_mappings;
+    for (int i = 0; i < NMACROS; i++) {
+        s.macros[i] = macros[i];
+    }
+    for (int i = 0; i < NEXPRESSIONS; i++) {
+        s.expressions[i] = expressions[i];
+    }
+    s.quirks = quirks;
+    return s;
+}
+
+static void check_same(const config_snapshot_t& a, const config_snapshot_t& b) {
+    CHECK_EQ(a.unmapped_passthrough_layer_mask, b.unmapped_passthrough_layer_mask);
+    CHECK_EQ(a.partial_scroll_timeout, b.partial_scroll_timeout);
+    CHECK_EQ(a.tap_hold_threshold, b.tap_hold_threshold);
+    CHECK_EQ(a.gpio_debounce_time, b.gpio_debounce_time);
+    CHECK_EQ(a.interval_override, b.interval_override);
+    CHECK_EQ(a.our_descriptor_number, b.our_descriptor_number);
+    CHECK_EQ(a.ignore_auth_dev_inputs, b.ignore_auth_dev_inputs);
+    CHECK_EQ(a.gpio_output_mode, b.gpio_output_mode);
+    CHECK_EQ(a.normalize_gamepad_inputs, b.normalize_gamepad_inputs);
+    CHECK_EQ(a.macro_entry_duration, b.macro_entry_duration);
+    CHECK_EQ(a.macro_step_duration_us, b.macro_step_duration_us);
+    CHECK_EQ(a.mappings.size(), b.mappings.size());
+    for (size_t i = 0; i < a.mappings.size(); i++) {
+        CHECK(!memcmp(&a.mappings[i], &b.mappings[i], sizeof(mapping_config11_t)));
+    }
+    for (int i = 0; i < NMACROS; i++) {
+        CHECK(a.macros[i] == b.macros[i]);
+    }
+    for (int i = 0; i < NEXPRESSIONS; i++) {
+        CHECK_EQ(a.expressions[i].size(), b.expressions[i].size());
+        for (size_t j = 0; j < a.expressions[i].size(); j++) {
+            CHECK_EQ((uint8_t) a.expressions[i][j].op, (uint8_t) b.expressions[i][j].op);
+            CHECK_EQ(a.expressions[i][j].val, b.expressions[i][j].val);
+        }
+    }
+    CHECK_EQ(a.quirks.size(), b.quirks.size());
+    for (size_t i = 0; i < a.quirks.size(); i++) {
+        CHECK(!memcmp(&a.quirks[i], &b.quirks[i], sizeof(quirk_t)));
+    }
+}
+
+static void clear_config() {
+    config_mappings.clear();
+    for (auto& macro : macros) {
+        macro.clear();
+    }
+    for (auto& expr : expressions) {
+        expr.clear();
+    }
+    quirks.clear();
+    for (auto& profile : profiles) {
+        profile = profile_t();
+    }
+    active_profile = 0;
+}
+
+// Values near the varint byte boundaries, plus some random ones.
+static uint32_t edgy(uint32_t random_max) {
+    static const uint32_t EDGES[] = { 0, 1, 0x3F, 0x40, 0x7F, 0x80, 0x3FFF, 0x4000, 0xFFFF, 0x10000, 0x1FFFFF, 0x200000, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFF };
+    if (rand() % 2) {
+        return EDGES[rand() % (sizeof(EDGES) / sizeof(EDGES[0]))] % ((uint64_t) random_max + 1);
+    }
+    return ((uint32_t) rand() * 7919u) % ((uint64_t) random_max + 1);
+}
+
+static uint32_t random_usage() {
+    static const uint16_t PAGES[] = { 0x0001, 0x0007, 0x0009, 0x000C, 0xFFF1, 0xFFF3, 0xFFF5, 0x0002, 0xFF00, 0xFFFF };
+    return ((uint32_t) PAGES[rand() % (sizeof(PAGES) / sizeof(PAGES[0]))] << 16) | edgy(0xFFFF);
+}
+
+static int32_t random_push_value() {
+    switch (rand() % 4) {
+        case 0:
+            return (int32_t) edgy(0xFFFFFFFF);
+        case 1:
+            return 1000 * (rand() % 2001 - 1000);
+        case 2:
+            return (rand() % 2) ? 2147483000 : -2147483000;
+        default:
+            return rand() % 2001 - 1000;
+    }
+}
+
+static void random_config(int nmappings) {
+    clear_config();
+    unmapped_passthrough_layer_mask = rand();
+    partial_scroll_timeout = edgy(0xFFFFFFFF);
+    tap_hold_threshold = edgy(0xFFFFFFFF);
+    gpio_debounce_time = (rand() % 256) * 1000;
+    interval_override = rand() % 3;
+    our_descriptor_number = rand() % NOUR_DESCRIPTORS;
+    ignore_auth_dev_inputs = rand() % 2;
+    gpio_output_mode = rand() % 2;
+    normalize_gamepad_inputs = rand() % 2;
+    macro_entry_duration = rand();
+    macro_step_duration_us = edgy(0xFFFFFFFF);
+
+    for (int i = 0; i < nmappings; i++) {
+        config_mappings.push_back({
+            .target_usage = random_usage(),
+            .source_usage = random_usage(),
+            .scaling = (rand() % 2) ? 1000 : (int32_t) edgy(0xFFFFFFFF),
+            .layer_mask = (uint8_t) rand(),
+            .flags = (uint8_t) (rand() % 8),
+            .hub_ports = (uint8_t) ((rand() % 3 == 0) ? rand() : 0),
+        });
+    }
+    // trailing empty macros and expressions aren't stored
+    int nmacros = rand() % (NMACROS + 1);
+    for (int i = 0; i < nmacros; i++) {
+        int nentries = rand() % 4;
+        for (int j = 0; j < nentries; j++) {
+            int nitems = rand() % 4;
+            for (int k = 0; k < nitems; k++) {
+                uint32_t usage = random_usage();
+                macros[i].push_back(usage ? usage : 1);
+            }
+            macros[i].push_back(0);
+        }
+    }
+    int nexpressions = rand() % (NEXPRESSIONS + 1);
+    for (int i = 0; i < nexpressions; i++) {
+        int nelems = rand() % 12;
+        for (int j = 0; j < nelems; j++) {
+            switch (rand() % 3) {
+                case 0:
+                    expressions[i].push_back({ .op = Op::PUSH, .val = (uint32_t) random_push_value() });
+                    break;
+                case 1:
+                    expressions[i].push_back({ .op = Op::PUSH_USAGE, .val = random_usage() });
+                    break;
+                default:
+                    expressions[i].push_back({ .op = (Op) (2 + rand() % 40) });
+                    break;
+            }
+        }
+    }
+    int nquirks = rand() % 5;
+    for (int i = 0; i < nquirks; i++) {
+        quirks.push_back({
+            .vendor_id = (uint16_t) rand(),
+            .product_id = (uint16_t) rand(),
+            .interface = (uint8_t) rand(),
+            .report_id = (uint8_t) rand(),
+            .usage = random_usage(),
+            .bitpos = (uint16_t) edgy(0xFFFF),
+            .size_flags = (uint8_t) rand(),
+        });
+    }
+}
+
+static void set_crc(uint8_t* buffer) {
+    uint32_t crc = crc32(buffer, PERSISTED_CONFIG_SIZE - 4);
+    memcpy(buffer + PERSISTED_CONFIG_SIZE - 4, &crc, 4);
+}
+
+// What v19 and v20 wrote: the same header, then everything fixed-width.
+static void write_v19(uint8_t* buffer, uint8_t version, const config_snapshot_t& s) {
+    memset(buffer, 0, PERSISTED_CONFIG_SIZE);
+    persist_config_v19_t* config = (persist_config_v19_t*) buffer;
+    config->version = version;
+    config->flags = (s.ignore_auth_dev_inputs << 4) | (s.gpio_output_mode << 5) | (s.normalize_gamepad_inputs << 6);
+    config->unmapped_passthrough_layer_mask = s.unmapped_passthrough_layer_mask;
+    config->partial_scroll_timeout = s.partial_scroll_timeout;
+    config->mapping_count = s.mappings.size();
+    config->interval_override = s.interval_override;
+    config->tap_hold_threshold = s.tap_hold_threshold;
+    config->gpio_debounce_time_ms = s.gpio_debounce_time / 1000;
+    config->our_descriptor_number = s.our_descriptor_number;
+    config->macro_entry_duration = s.macro_entry_duration;
+    config->quirk_count = s.quirks.size();
+    config->macro_step_duration_us = s.macro_step_duration_us;
+    uint8_t* ptr = buffer + sizeof(persist_config_v19_t);
+    for (auto const& mapping : s.mappings) {
+        memcpy(ptr, &mapping, sizeof(mapping));
+        ptr += sizeof(mapping);
+    }
+    for (int i = 0; i < NMACROS; i++) {
+        uint8_t* macro_len = ptr++;
+        *macro_len = 0;
+        uint8_t* entry_len = nullptr;
+        bool entry_started = false;
+        for (uint32_t usage : s.macros[i]) {
+            if (!entry_started) {
+                entry_len = ptr++;
+                *entry_len = 0;
+                (*macro_len)++;
+                entry_started = true;
+            }
+            if (usage == 0) {
+                entry_started = false;
+                continue;
+            }
+            memcpy(ptr, &usage, 4);
+            ptr += 4;
+            (*entry_len)++;
+        }
+    }
+    for (int i = 0; i < NEXPRESSIONS; i++) {
+        uint16_t len = s.expressions[i].size();
+        memcpy(ptr, &len, 2);
+        ptr += 2;
+        for (auto const& elem : s.expressions[i]) {
+            *ptr++ = (uint8_t) elem.op;
+            if ((elem.op == Op::PUSH) || (elem.op == Op::PUSH_USAGE)) {
+                memcpy(ptr, &elem.val, 4);
+                ptr += 4;
+            }
+        }
+    }
+    for (auto const& quirk : s.quirks) {
+        memcpy(ptr, &quirk, sizeof(quirk));
+        ptr += sizeof(quirk);
+    }
+    CHECK(ptr <= buffer + PERSISTED_CONFIG_SIZE - 4);
+    set_crc(buffer);
+}
+
+int main() {
+    static uint8_t buffer[PERSISTED_CONFIG_SIZE];
+    srand(5);
+
+    int persisted_bytes = 0;
+    int v19_bytes = 0;
+    for (int i = 0; i < 2000; i++) {
+        random_config(rand() % 60);
+        config_snapshot_t before = take_snapshot();
+        CHECK(persist_config() == PersistConfigReturnCode::SUCCESS);
+        memcpy(buffer, last_persisted, PERSISTED_CONFIG_SIZE);
+
+        clear_config();
+        load_config(buffer);
+        check_same(before, take_snapshot());
+
+        // persisting what was loaded gives the same bytes
+        CHECK(persist_config() == PersistConfigReturnCode::SUCCESS);
+        CHECK(!memcmp(buffer, last_persisted, PERSISTED_CONFIG_SIZE));
+
+        // the same config as v19 and v20 wrote it
+        for (uint8_t version : { 19, 20 }) {
+            write_v19(buffer, version, before);
+            clear_config();
+            load_config(buffer);
+            check_same(before, take_snapshot());
+        }
+        int len = PERSISTED_CONFIG_SIZE - 4;
+        while ((len > 0) && (buffer[len - 1] == 0)) {
+            len--;
+        }
+        v19_bytes += len;
+        len = PERSISTED_CONFIG_SIZE - 4;
+        while ((len > 0) && (last_persisted[len - 1] == 0)) {
+            len--;
+        }
+        persisted_bytes += len;
+    }
+    printf("random configs: %d bytes persisted, %d bytes as v19\n", persisted_bytes, v19_bytes);
+
+    // a config that doesn't fit isn't persisted
+    random_config(1000);
+    CHECK(persist_config() == PersistConfigReturnCode::CONFIG_TOO_BIG);
+
+    // a bad CRC or a version from the future isn't loaded
+    random_config(10);
+    config_snapshot_t good = take_snapshot();
+    CHECK(persist_config() == PersistConfigReturnCode::SUCCESS);
+    memcpy(buffer, last_persisted, PERSISTED_CONFIG_SIZE);
+    buffer[sizeof(persist_config_t)] ^= 1;
+    clear_config();
+    load_config(buffer);
+    CHECK(config_mappings.empty());
+    buffer[sizeof(persist_config_t)] ^= 1;
+    buffer[0]++;
+    set_crc(buffer);
+    load_config(buffer);
+    CHECK(config_mappings.empty());
+    buffer[0]--;
+    set_crc(buffer);
+    load_config(buffer);
+    check_same(good, take_snapshot());
+
+    // Mutated configs with a valid CRC. Whatever they load as, the loader must not read
+    // past the end of the buffer or crash; run under ASan to see the former.
+    for (int i = 0; i < 20000; i++) {
+        random_config(rand() % 30);
+        CHECK(persist_config() == PersistConfigReturnCode::SUCCESS);
+        memcpy(buffer, last_persisted, PERSISTED_CONFIG_SIZE);
+        int nchanges = 1 + rand() % 4;
+        for (int j = 0; j < nchanges; j++) {
+            int pos = 1 + rand() % 300;
+            buffer[pos] = (rand() % 4) ? rand() : 0xFF;
+        }
+        set_crc(buffer);
+        clear_config();
+        load_config(buffer);
+    }
+
+    return 0;
+}
@@ -0,0 +1,176 @@
+#include <string.h>
+
+#include <vector>
+
+#include "config.h"
+#include "config_log.h"
+#include "crc.h"
+#include "globals.h"
+#include "test_util.h"
+
+// PERSIST_CONFIG goes through persist_config_maybe() into the config log, one flash
+// operation per main loop iteration. Until the write is done the host sees no return code,
+// GET_PERSIST_STATUS says it's in progress and the blob commands, which would overwrite the
+// buffer the log is reading from, are refused. Config changes made in the meantime are
+// accepted and go into the next persist, not the one being written.
+
+// What a host polling after PERSIST_CONFIG sees, the last command sent has to be that.
+static PersistConfigReturnCode persist_return_code() {
+    uint8_t response[28];
+    config_response(response);
+    return ((persist_config_response_t*) response)->return_code;
+}
+
+static bool persist_in_progress_reported() {
+    config_command(ConfigCommand::GET_PERSIST_STATUS);
+    uint8_t response[28];
+    config_response(response);
+    return ((persist_status_t*) response)->in_progress;
+}
+
+static PersistConfigReturnCode read_blob_return_code() {
+    config_command(ConfigCommand::READ_BLOB);
+    uint8_t response[28];
+    config_response(response);
+    return ((read_blob_response_t*) response)->return_code;
+}
+
+static CommitBlobReturnCode send_blob(const std::vector<uint8_t>& blob) {
+    blob_header_t header = { .size = (uint32_t) blob.size(), .crc32 = crc32(blob.data(), blob.size()) };
+    config_command(ConfigCommand::BEGIN_BLOB, &header, sizeof(header));
+    for (uint32_t offset = 0; offset < blob.size(); offset += BLOB_BYTES_IN_PACKET) {
+        blob_chunk_t chunk = { .offset = offset, .len = (uint8_t) std::min<uint32_t>(BLOB_BYTES_IN_PACKET, blob.size() - offset) };
+        memcpy(chunk.data, blob.data() + offset, chunk.len);
+        config_command(ConfigCommand::BLOB_CHUNK, &chunk, sizeof(chunk));
+    }
+    config_command(ConfigCommand::COMMIT_BLOB);
+    uint8_t response[28];
+    config_response(response);
+    return ((commit_blob_response_t*) response)->return_code;
+}
+
+// The config as it is now, the way a blob carries it.
+static std::vector<uint8_t> current_blob() {
+    config_command(ConfigCommand::READ_BLOB);
+    uint8_t response[28];
+    config_response(response);
+    CHECK(((read_blob_response_t*) response)->return_code == PersistConfigReturnCode::SUCCESS);
+    std::vector<uint8_t> blob;
+    uint32_t size = ((read_blob_response_t*) response)->header.size;
+    while (blob.size() < size) {
+        get_indexed_t cmd = { .requested_index = (uint32_t) blob.size() };
+        config_command(ConfigCommand::GET_BLOB_CHUNK, &cmd, sizeof(cmd));
+        config_response(response);
+        blob.insert(blob.end(), response, response + std::min<uint32_t>(sizeof(response), size - blob.size()));
+    }
+    return blob;
+}
+
+static void add_mapping(uint32_t i) {
+    mapping_config11_t mapping = { .target_usage = 0x00070004 + i % 20, .source_usage = 0x00090001 + i, .scaling = 1000, .layer_mask = 1 };
+    config_command(ConfigCommand::ADD_MAPPING, &mapping, sizeof(mapping));
+}
+
+// What the log gives back at boot.
+static std::vector<uint8_t> loaded_from_log() {
+    std::vector<uint8_t> loaded(PERSISTED_CONFIG_SIZE);
+    CHECK(config_log_load(host_config_log, loaded.data()));
+    return loaded;
+}
+
+// One main loop iteration, it never does more than one flash operation.
+static void main_loop_step() {
+    uint32_t ops_before = config_log_ops;
+    persist_config_maybe();
+    CHECK(config_log_ops - ops_before <= 1);
+}
+
+int main() {
+    memset(host_config_log, 0xFF, CONFIG_LOG_SIZE);
+    uint8_t buffer[PERSISTED_CONFIG_SIZE];
+    CHECK(!config_log_load(host_config_log, buffer));
+    persist_to_config_log = true;
+
+    init_remapper();
+    for (uint32_t i = 0; i < 200; i++) {
+        add_mapping(i);
+    }
+    std::vector<uint8_t> blob = current_blob();
+
+    // the first persist writes a snapshot, several pages
+    config_command(ConfigCommand::PERSIST_CONFIG);
+    CHECK(persist_return_code() == PersistConfigReturnCode::UNKNOWN);
+    main_loop_step();
+    CHECK(persist_return_code() == PersistConfigReturnCode::UNKNOWN);
+    CHECK(config_log_busy());
+    std::vector<uint8_t> first(last_persisted, last_persisted + PERSISTED_CONFIG_SIZE);
+
+    int steps = 1;
+    bool changed_during_write = false;
+    while (config_log_busy()) {
+        CHECK(persist_config_return_code == PersistConfigReturnCode::UNKNOWN);
+        CHECK(persist_in_progress_reported());
+        CHECK(read_blob_return_code() == PersistConfigReturnCode::BUSY);
+        CHECK(send_blob(blob) == CommitBlobReturnCode::BUSY);
+        if (!changed_during_write) {
+            // accepted, but not part of what's being written
+            add_mapping(1000);
+            changed_during_write = true;
+        }
+        main_loop_step();
+        steps++;
+    }
+    printf("first persist: %d main loop iterations\n", steps);
+    CHECK(steps > 2);
+    CHECK(persist_config_return_code == PersistConfigReturnCode::SUCCESS);
+    CHECK(!persist_in_progress_reported());
+    CHECK(loaded_from_log() == first);
+    CHECK_EQ(config_mappings.size(), 201);
+
+    // with the write done, blobs go through again
+    CHECK(read_blob_return_code() == PersistConfigReturnCode::SUCCESS);
+    CHECK(send_blob(blob) == CommitBlobReturnCode::SUCCESS);
+    CHECK_EQ(config_mappings.size(), 200);
+
+    // a second PERSIST_CONFIG during a write waits for it, the return code only comes after both
+    add_mapping(2000);
+    config_command(ConfigCommand::PERSIST_CONFIG);
+    main_loop_step();
+    CHECK(config_log_busy());
+    std::vector<uint8_t> second(last_persisted, last_persisted + PERSISTED_CONFIG_SIZE);
+    add_mapping(3000);
+    config_command(ConfigCommand::PERSIST_CONFIG);
+    CHECK(need_to_persist_config);
+    while (config_log_busy()) {
+        main_loop_step();
+        CHECK(persist_return_code() == PersistConfigReturnCode::UNKNOWN);
+    }
+    CHECK(loaded_from_log() == second);
+    CHECK(persist_return_code() == PersistConfigReturnCode::UNKNOWN);
+    main_loop_step();
+    std::vector<uint8_t> third(last_persisted, last_persisted + PERSISTED_CONFIG_SIZE);
+    CHECK(third != second);
+    while (config_log_busy() || need_to_persist_config) {
+        CHECK(persist_return_code() == PersistConfigReturnCode::UNKNOWN);
+        main_loop_step();
+    }
+    CHECK(persist_return_code() == PersistConfigReturnCode::SUCCESS);
+    CHECK(!persist_in_progress_reported());
+    CHECK(send_blob(blob) == CommitBlobReturnCode::SUCCESS);
+    CHECK(loaded_from_log() == third);
+
+    // nothing to do, nothing happens
+    uint32_t ops_before = config_log_ops;
+    for (int i = 0; i < 10; i++) {
+        main_loop_step();
+    }
+    CHECK_EQ(config_log_ops, ops_before);
+
+    // what's in the log loads back as the config
+    config_mappings.clear();
+    load_config(loaded_from_log().data());
+    CHECK_EQ(config_mappings.size(), 202);
+    CHECK(config_mappings.back().source_usage == 0x00090001 + 3000);
+
+    return 0;
+}
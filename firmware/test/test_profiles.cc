@@ -0,0 +1,392 @@
+#include <string.h>
+
+#include <vector>
+
+#include "config.h"
+#include "crc.h"
+#include "globals.h"
+#include "remapper.h"
+#include "test_util.h"
+
+// Switching profiles. Switches keep sticky and tap-hold state, held keys don't look like they
+// were just pressed, profile switch mappings only fire on their layers and configs persisted
+// before v22 load without the other profiles. Profiles that fit in the budget are precompiled
+// and a switch to one doesn't compile anything, but it behaves like a switch that does. GPIO
+// pins can switch profiles and stay inputs in the profiles that use them as outputs.
+
+extern uint32_t precompiled_profiles_budget;
+extern std::vector<reverse_mapping_t> reverse_mapping;
+extern uint32_t used_state_slots;
+
+static const uint8_t STICKY = 1 << 0;
+static const uint8_t TAP = 1 << 1;
+static const uint8_t HOLD = 1 << 2;
+
+static const uint32_t KEY_A = 0x00070004;
+static const uint32_t KEY_B = 0x00070005;
+static const uint32_t KEY_E = 0x00070008;
+static const uint32_t KEY_F2 = 0x0007003B;
+static const uint32_t KEY_F4 = 0x0007003D;
+static const uint32_t KEY_Z = 0x0007001D;
+static const uint32_t KEY_F24 = 0x00070073;
+static const uint32_t KEY_LEFT_CTRL = 0x000700E0;
+static const uint32_t GPIO_5 = GPIO_USAGE_PAGE | 5;
+static const uint32_t GPIO_6 = GPIO_USAGE_PAGE | 6;
+
+static const uint32_t THRESHOLD_US = 50000;
+
+// Z latches F24, tapping E gives A and holding it gives B, Ctrl activates layer 1 and F2
+// on layer 1 switches to the given profile.
+static std::vector<mapping_config11_t> profile_mappings(uint8_t switch_to) {
+    return {
+        { .target_usage = KEY_F24, .source_usage = KEY_Z, .scaling = 1000, .layer_mask = 1, .flags = STICKY },
+        { .target_usage = KEY_A, .source_usage = KEY_E, .scaling = 1000, .layer_mask = 1, .flags = TAP },
+        { .target_usage = KEY_B, .source_usage = KEY_E, .scaling = 1000, .layer_mask = 1, .flags = HOLD },
+        { .target_usage = 0xFFF10001, .source_usage = KEY_LEFT_CTRL, .scaling = 1000, .layer_mask = 0x03 },
+        { .target_usage = 0xFFFA0000u | switch_to, .source_usage = KEY_F2, .scaling = 1000, .layer_mask = 2 },
+    };
+}
+
+// Profile 0 and 1 switch to each other. Their expressions differ, so a switch between them
+// can't be patched in. Holding F4 in profile 0 switches to profile 2.
+static void set_config() {
+    unmapped_passthrough_layer_mask = 1;
+    tap_hold_threshold = THRESHOLD_US;
+    config_mappings = profile_mappings(1);
+    config_mappings.push_back({ .target_usage = 0xFFFA0002, .source_usage = KEY_F4, .scaling = 1000, .layer_mask = 1, .flags = HOLD });
+    for (auto& expr : expressions) {
+        expr.clear();
+    }
+    profiles[1] = profile_t();
+    profiles[1].mappings = profile_mappings(0);
+    profiles[1].expressions[0] = {
+        { .op = Op::PUSH_USAGE, .val = KEY_E },
+        { .op = Op::INPUT_STATE_BINARY },
+    };
+    profiles[2] = profile_t();
+    profiles[2].mappings = profile_mappings(0);
+}
+
+static void switch_profile(uint8_t profile) {
+    active_profile_t cmd = { .profile = profile };
+    config_command(ConfigCommand::SET_ACTIVE_PROFILE, &cmd, sizeof(cmd));
+    run_frame();
+    CHECK_EQ(active_profile, profile);
+}
+
+static void press(std::initializer_list<uint32_t> keys) {
+    uint8_t report[8] = { 0 };
+    int n = 2;
+    for (uint32_t key : keys) {
+        uint8_t code = key & 0xFF;
+        if (code >= 0xE0) {
+            report[0] |= 1 << (code - 0xE0);
+        } else {
+            report[n++] = code;
+        }
+    }
+    do_handle_received_report(report, sizeof(report), KEYBOARD_INTERFACE);
+}
+
+static void sticky_kept() {
+    press({ KEY_Z });
+    run_frame();
+    press({});
+    run_frames(2);
+    CHECK_EQ(sent_value(KEY_F24), 1);
+
+    switch_profile(1);
+    run_frames(2);
+    CHECK_EQ(sent_value(KEY_F24), 1);
+    switch_profile(0);
+    run_frames(2);
+    CHECK_EQ(sent_value(KEY_F24), 1);
+
+    // and it still toggles off
+    press({ KEY_Z });
+    run_frame();
+    press({});
+    run_frames(2);
+    CHECK_EQ(sent_value(KEY_F24), 0);
+
+    // a press that comes in after the last frame, right before the switch, counts in the new profile
+    active_profile_t cmd = { .profile = 1 };
+    config_command(ConfigCommand::SET_ACTIVE_PROFILE, &cmd, sizeof(cmd));
+    press({ KEY_Z });
+    set_mapping_from_config();
+    config_updated = false;
+    CHECK_EQ(active_profile, 1);
+    run_frame();
+    press({});
+    run_frames(2);
+    CHECK_EQ(sent_value(KEY_F24), 1);
+    switch_profile(0);
+    press({ KEY_Z });
+    run_frame();
+    press({});
+    run_frames(2);
+    CHECK_EQ(sent_value(KEY_F24), 0);
+}
+
+// E is pressed in one profile and released in the other.
+static void tap_hold_kept() {
+    // a press time that didn't carry over would be long enough ago to make it a hold
+    run_frames(THRESHOLD_US / 1000);
+
+    // a tap
+    press({ KEY_E });
+    run_frames(10);
+    switch_profile(1);
+    run_frames(10);
+    bool tapped = false;
+    press({});
+    for (int i = 0; i < 5; i++) {
+        run_frame();
+        tapped |= (sent_value(KEY_A) != 0);
+        CHECK_EQ(sent_value(KEY_B), 0);
+    }
+    CHECK(tapped);
+
+    // a hold that happens after the switch
+    press({ KEY_E });
+    run_frames(10);
+    switch_profile(0);
+    run_frames(THRESHOLD_US / 1000);
+    CHECK_EQ(sent_value(KEY_B), 1);
+    press({});
+    for (int i = 0; i < 5; i++) {
+        run_frame();
+        CHECK_EQ(sent_value(KEY_A), 0);
+        CHECK_EQ(sent_value(KEY_B), 0);
+    }
+
+    // a hold that happened before the switch stays held
+    press({ KEY_E });
+    run_frames(THRESHOLD_US / 1000 + 10);
+    CHECK_EQ(sent_value(KEY_B), 1);
+    switch_profile(1);
+    run_frames(10);
+    CHECK_EQ(sent_value(KEY_B), 1);
+    press({});
+    for (int i = 0; i < 5; i++) {
+        run_frame();
+        CHECK_EQ(sent_value(KEY_A), 0);
+    }
+    CHECK_EQ(sent_value(KEY_B), 0);
+    switch_profile(0);
+}
+
+static void switch_mappings() {
+    // not on layer 0
+    press({ KEY_F2 });
+    run_frames(5);
+    press({});
+    run_frames(5);
+    CHECK_EQ(active_profile, 0);
+
+    // on layer 1, F2 switches to profile 1 and profile 1's F2 mapping doesn't switch back
+    // while it's still held
+    press({ KEY_LEFT_CTRL });
+    run_frames(2);
+    press({ KEY_LEFT_CTRL, KEY_F2 });
+    run_frames(20);
+    CHECK_EQ(active_profile, 1);
+    press({ KEY_LEFT_CTRL });
+    run_frames(5);
+    CHECK_EQ(active_profile, 1);
+
+    // pressing it again does
+    press({ KEY_LEFT_CTRL, KEY_F2 });
+    run_frames(5);
+    CHECK_EQ(active_profile, 0);
+    press({});
+    run_frames(5);
+    CHECK_EQ(active_profile, 0);
+
+    // a hold mapping switches when the threshold passes
+    press({ KEY_F4 });
+    run_frames(THRESHOLD_US / 1000 - 10);
+    CHECK_EQ(active_profile, 0);
+    run_frames(20);
+    CHECK_EQ(active_profile, 2);
+    press({});
+    run_frames(5);
+    switch_profile(0);
+}
+
+// The tables a profile is compiled into are swapped in as they are, nothing is compiled again.
+static void precompiled() {
+    const map_source_t* sources0 = reverse_mapping[0].sources.data();
+    uint32_t slots = used_state_slots;
+    switch_profile(1);
+    const map_source_t* sources1 = reverse_mapping[0].sources.data();
+    CHECK(sources1 != sources0);
+    switch_profile(2);
+    switch_profile(0);
+    CHECK(reverse_mapping[0].sources.data() == sources0);
+    switch_profile(1);
+    CHECK(reverse_mapping[0].sources.data() == sources1);
+    switch_profile(0);
+    CHECK_EQ(used_state_slots, slots);
+}
+
+// A keyboard that comes back while a profile isn't active works when it's switched to. (Profiles
+// that were dropped from the budget mustn't be linked to it anymore.)
+static void replugged() {
+    unplug_device(1);
+    run_frames(2);
+    switch_profile(1);
+    run_frames(2);
+    switch_profile(0);
+    plug_keyboard();
+    run_frames(2);
+    switch_profile(1);
+    press({ KEY_F4 });
+    run_frame();
+    CHECK_EQ(sent_value(KEY_F4), 1);
+    press({});
+    run_frame();
+    CHECK_EQ(sent_value(KEY_F4), 0);
+    switch_profile(0);
+}
+
+// Everything that was sent, when.
+static std::vector<uint32_t> sent_so_far() {
+    std::vector<uint32_t> sent;
+    for (auto const& report : sent_reports) {
+        sent.push_back(report.time);
+        sent.insert(sent.end(), report.data.begin(), report.data.end());
+    }
+    return sent;
+}
+
+static std::vector<uint32_t> switches(uint32_t budget) {
+    precompiled_profiles_budget = budget;
+    set_config();
+    init_remapper();
+    plug_keyboard();
+    run_frames(2);
+
+    sticky_kept();
+    tap_hold_kept();
+    switch_mappings();
+    replugged();
+    return sent_so_far();
+}
+
+// Pin 5 switches from profile 0 to 3, where it's an output, pin 6 switches back. The switch
+// pins are inputs in every profile, so pin 5 doesn't get driven in profile 3 and is there to
+// switch the next time. A keyboard plugged in meanwhile works in profile 3 when it comes back.
+static void gpio_switches() {
+    config_mappings = {
+        { .target_usage = 0xFFFA0003, .source_usage = GPIO_5, .scaling = 1000, .layer_mask = 1 },
+    };
+    profiles[3] = profile_t();
+    profiles[3].mappings = {
+        { .target_usage = 0xFFFA0000, .source_usage = GPIO_6, .scaling = 1000, .layer_mask = 1 },
+        { .target_usage = GPIO_5, .source_usage = KEY_A, .scaling = 1000, .layer_mask = 1 },
+    };
+    init_remapper();
+    CHECK_EQ(host_gpio_in_mask, (1 << 5) | (1 << 6));
+    CHECK_EQ(host_gpio_out_mask, 0);
+
+    for (int i = 0; i < 2; i++) {
+        // the way read_gpio() reports them, active low already taken care of
+        set_input_state(GPIO_5, 1, 1);
+        run_frame();
+        CHECK_EQ(active_profile, 3);
+        CHECK(host_gpio_in_mask & (1 << 5));
+        CHECK_EQ(host_gpio_out_mask, 1 << 5);
+        set_input_state(GPIO_5, 0, 0);
+        run_frames(2);
+        CHECK_EQ(active_profile, 3);
+
+        set_input_state(GPIO_6, 1, 1);
+        run_frame();
+        CHECK_EQ(active_profile, 0);
+        CHECK_EQ(host_gpio_out_mask, 0);
+        set_input_state(GPIO_6, 0, 0);
+        run_frames(2);
+    }
+
+    // there was no keyboard when profile 3 was last active
+    plug_keyboard();
+    run_frames(2);
+    set_input_state(GPIO_5, 1, 1);
+    run_frame();
+    CHECK_EQ(active_profile, 3);
+    press({ KEY_F4 });
+    run_frame();
+    CHECK_EQ(sent_value(KEY_F4), 1);
+}
+
+static void set_crc(uint8_t* buffer) {
+    uint32_t crc = crc32(buffer, PERSISTED_CONFIG_SIZE - 4);
+    memcpy(buffer + PERSISTED_CONFIG_SIZE - 4, &crc, 4);
+}
+
+static void clear_config() {
+    config_mappings.clear();
+    for (auto& expr : expressions) {
+        expr.clear();
+    }
+    for (auto& profile : profiles) {
+        profile = profile_t();
+    }
+    active_profile = 0;
+}
+
+static void persisted_versions() {
+    switch_profile(1);
+    CHECK(persist_config() == PersistConfigReturnCode::SUCCESS);
+    static uint8_t buffer[PERSISTED_CONFIG_SIZE];
+    memcpy(buffer, last_persisted, PERSISTED_CONFIG_SIZE);
+    CHECK_EQ(buffer[0], 22);
+
+    clear_config();
+    load_config(buffer);
+    CHECK_EQ(active_profile, 1);
+    CHECK_EQ(config_mappings.size(), 5);
+    CHECK_EQ(profiles[0].mappings.size(), 6);
+    CHECK_EQ(profiles[2].mappings.size(), 5);
+    CHECK_EQ(profiles[1].mappings.size(), 0);
+
+    // v21 had the same layout without the profiles at the end, whatever is there isn't read
+    buffer[0] = 21;
+    set_crc(buffer);
+    clear_config();
+    load_config(buffer);
+    CHECK_EQ(active_profile, 0);
+    CHECK_EQ(config_mappings.size(), 5);
+    for (auto const& profile : profiles) {
+        CHECK(profile.mappings.empty());
+    }
+}
+
+int main() {
+    // all of them precompiled, as many as the default budget allows, none
+    uint32_t budget = precompiled_profiles_budget;
+    std::vector<uint32_t> precompiled_sent = in_child([]() { return switches(UINT32_MAX); });
+    CHECK(!precompiled_sent.empty());
+    CHECK(precompiled_sent == in_child([&]() { return switches(budget); }));
+    CHECK(precompiled_sent == in_child([]() { return switches(0); }));
+
+    in_child([]() {
+        gpio_switches();
+        return std::vector<uint32_t>();
+    });
+
+    precompiled_profiles_budget = UINT32_MAX;
+    set_config();
+    init_remapper();
+    plug_keyboard();
+    run_frames(2);
+
+    precompiled();
+    sticky_kept();
+    tap_hold_kept();
+    switch_mappings();
+    persisted_versions();
+
+    return 0;
+}
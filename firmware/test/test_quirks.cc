@@ -0,0 +1,186 @@
+#include <stdlib.h>
+
+#include <chrono>
+
+#include "descriptor_parser.h"
+#include "globals.h"
+#include "test_util.h"
+
+// The built-in quirk table is local to quirks.cc, so this test is built with quirks.cc
+// included here instead of linked in.
+#include "quirks.cc"
+
+// Built-in quirks apply to their exact VID/PID and descriptor only. User quirks are looked
+// up through an index, but have to apply exactly as if we went through the whole list
+// in config order, with the ones for all devices mixed in where they are.
+
+static bool same_usages(const usage_list_t& a, const usage_list_t& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        const usage_def_t& x = a[i].usage_def;
+        const usage_def_t& y = b[i].usage_def;
+        if ((a[i].report_id != b[i].report_id) ||
+            (a[i].usage != b[i].usage) ||
+            (x.size != y.size) ||
+            (x.bitpos != y.bitpos) ||
+            (x.is_relative != y.is_relative) ||
+            (x.is_array != y.is_array) ||
+            (x.logical_minimum != y.logical_minimum) ||
+            (x.logical_maximum != y.logical_maximum)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static usage_list_t parse_input_usages(const uint8_t* descriptor, int len) {
+    static descriptor_usages_t parsed;
+    parse_descriptor(parsed, descriptor, len);
+    return parsed.usages[(uint8_t) ReportType::INPUT];
+}
+
+// What applying user quirks means: go through all of them in order.
+static void apply_user_quirks_slowly(uint16_t vendor_id, uint16_t product_id, uint8_t itf_num, usage_list_t& usages) {
+    for (const quirk_t& quirk : quirks) {
+        bool global = (quirk.vendor_id == 0) && (quirk.product_id == 0);
+        bool matches = (quirk.vendor_id == vendor_id) && (quirk.product_id == product_id) && (quirk.interface == itf_num);
+        if (!global && !matches) {
+            continue;
+        }
+        uint8_t quirk_size = quirk.size_flags & QUIRK_SIZE_MASK;
+        if (quirk_size != 0) {
+            get_usage(usages, quirk.report_id, quirk.usage) = (usage_def_t){
+                .report_id = quirk.report_id,
+                .size = quirk_size,
+                .bitpos = quirk.bitpos,
+                .is_relative = (quirk.size_flags & QUIRK_FLAG_RELATIVE_MASK) != 0,
+                .logical_minimum = ((quirk.size_flags & QUIRK_FLAG_SIGNED_MASK) != 0) ? -1 : 0,
+            };
+        } else {
+            erase_usage(usages, quirk.report_id, quirk.usage);
+        }
+    }
+}
+
+static void check_builtin_quirks() {
+    for (const builtin_quirk_t& quirk : builtin_quirks) {
+        usage_list_t plain = parse_input_usages(quirk.descriptor, quirk.len);
+
+        usage_list_t expected = plain;
+        quirk.apply(expected);
+        CHECK(!same_usages(expected, plain));
+        usage_list_t usages = plain;
+        apply_quirks(quirk.vendor_id, quirk.product_id, usages, quirk.descriptor, quirk.len, 0);
+        CHECK(same_usages(usages, expected));
+
+        // another product with the same descriptor
+        usages = plain;
+        apply_quirks(quirk.vendor_id, quirk.product_id ^ 0x8000, usages, quirk.descriptor, quirk.len, 0);
+        CHECK(same_usages(usages, plain));
+
+        // same product, descriptor differs in one byte
+        std::vector<uint8_t> changed(quirk.descriptor, quirk.descriptor + quirk.len);
+        changed[quirk.len / 2] ^= 0x01;
+        usage_list_t changed_plain = parse_input_usages(changed.data(), changed.size());
+        usages = changed_plain;
+        apply_quirks(quirk.vendor_id, quirk.product_id, usages, changed.data(), changed.size(), 0);
+        CHECK(same_usages(usages, changed_plain));
+
+        // same product, descriptor one byte shorter
+        usage_list_t shorter_plain = parse_input_usages(quirk.descriptor, quirk.len - 1);
+        usages = shorter_plain;
+        apply_quirks(quirk.vendor_id, quirk.product_id, usages, quirk.descriptor, quirk.len - 1, 0);
+        CHECK(same_usages(usages, shorter_plain));
+    }
+}
+
+static const uint16_t DEVICES[][2] = {
+    { 0x1234, 0x0001 },
+    { 0x1234, 0x0002 },
+    { 0x5678, 0x0001 },
+};
+
+static quirk_t random_quirk() {
+    quirk_t quirk = { 0 };
+    if (rand() % 3 != 0) {
+        const uint16_t* device = DEVICES[rand() % 3];
+        quirk.vendor_id = device[0];
+        quirk.product_id = device[1];
+        quirk.interface = rand() % 2;
+    }
+    quirk.report_id = 0;
+    // the same few usages, so that quirks override each other
+    quirk.usage = 0x00070000 | (0xE0 + rand() % 4);
+    quirk.bitpos = rand() % 64;
+    quirk.size_flags = (rand() % 4 == 0) ? 0 : ((rand() % 8) | (rand() % 4) << 6);
+    return quirk;
+}
+
+static void check_user_quirks() {
+    usage_list_t plain = parse_input_usages(boot_keyboard_descriptor, boot_keyboard_descriptor_length);
+
+    srand(1);
+    for (int round = 0; round < 500; round++) {
+        quirks.clear();
+        int n = rand() % 12;
+        for (int i = 0; i < n; i++) {
+            quirks.push_back(random_quirk());
+        }
+        invalidate_user_quirks_index();
+
+        for (const uint16_t* device : DEVICES) {
+            for (uint8_t itf_num = 0; itf_num < 3; itf_num++) {
+                usage_list_t usages = plain;
+                apply_quirks(device[0], device[1], usages, boot_keyboard_descriptor, boot_keyboard_descriptor_length, itf_num);
+                usage_list_t expected = plain;
+                apply_user_quirks_slowly(device[0], device[1], itf_num, expected);
+                CHECK(same_usages(usages, expected));
+            }
+        }
+    }
+
+    // a quirk added later goes after the ones already indexed
+    quirks = {
+        { .vendor_id = 0x1234, .product_id = 0x0001, .interface = 0, .report_id = 0, .usage = 0x000700E0, .bitpos = 3, .size_flags = 1 },
+    };
+    invalidate_user_quirks_index();
+    usage_list_t usages = plain;
+    apply_quirks(0x1234, 0x0001, usages, boot_keyboard_descriptor, boot_keyboard_descriptor_length, 0);
+    CHECK_EQ(find_usage(usages, 0, 0x000700E0)->bitpos, 3);
+    quirks.push_back({ .vendor_id = 0, .product_id = 0, .interface = 0, .report_id = 0, .usage = 0x000700E0, .bitpos = 5, .size_flags = 1 });
+    invalidate_user_quirks_index();
+    usages = plain;
+    apply_quirks(0x1234, 0x0001, usages, boot_keyboard_descriptor, boot_keyboard_descriptor_length, 0);
+    CHECK_EQ(find_usage(usages, 0, 0x000700E0)->bitpos, 5);
+}
+
+// Quirks for other devices shouldn't make a device's lookup slower.
+static void time_unrelated_quirks() {
+    usage_list_t plain = parse_input_usages(boot_keyboard_descriptor, boot_keyboard_descriptor_length);
+    quirks.clear();
+    for (int i = 0; i < 100; i++) {
+        quirks.push_back({ .vendor_id = 0x4321, .product_id = (uint16_t) i, .interface = 0, .report_id = 0, .usage = 0x000700E0, .bitpos = 0, .size_flags = 1 });
+    }
+    invalidate_user_quirks_index();
+
+    const int N = 100000;
+    usage_list_t usages = plain;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < N; i++) {
+        apply_quirks(0x1234, 0x0001, usages, boot_keyboard_descriptor, boot_keyboard_descriptor_length, 0);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    CHECK(same_usages(usages, plain));
+    printf("apply_quirks() with 100 quirks for other devices: %.3f us\n",
+        std::chrono::duration<double, std::micro>(elapsed).count() / N);
+}
+
+int main() {
+    check_builtin_quirks();
+    check_user_quirks();
+    time_unrelated_quirks();
+
+    return 0;
+}
@@ -0,0 +1,187 @@
+#include <stdlib.h>
+
+#include <new>
+
+#include "descriptor_parser.h"
+#include "globals.h"
+#include "our_descriptor.h"
+#include "remapper.h"
+#include "test_util.h"
+
+// The built-in quirk descriptors are local to quirks.cc, so this test is built with
+// quirks.cc included here instead of linked in.
+#include "quirks.cc"
+
+// Devices with one to three interfaces get plugged in and out at random, thousands of
+// times. Everything a device brings goes away with it: nothing is left behind in the
+// per-interface tables, and the heap doesn't grow from one round to the next.
+
+extern std::unordered_map<uint16_t, std::unordered_map<uint8_t, std::vector<usage_usage_def_t>>> their_used_usages;
+extern std::unordered_map<uint8_t, uint8_t> hub_ports;
+
+static const int NSLOTS = 16;
+
+static long live_bytes = 0;
+static long peak_bytes = 0;
+static long allocations = 0;
+
+// ASan has its own operator new, the counts stay at 0 there
+#ifndef __SANITIZE_ADDRESS__
+
+// the size goes in front of the block, so that delete knows how much is freed
+void* operator new(size_t size) {
+    size_t* ptr = (size_t*) malloc(size + 16);
+    if (ptr == NULL) {
+        throw std::bad_alloc();
+    }
+    *ptr = size;
+    live_bytes += size;
+    if (live_bytes > peak_bytes) {
+        peak_bytes = live_bytes;
+    }
+    allocations++;
+    return (uint8_t*) ptr + 16;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    if (ptr == NULL) {
+        return;
+    }
+    size_t* block = (size_t*) ((uint8_t*) ptr - 16);
+    live_bytes -= *block;
+    free(block);
+}
+
+void operator delete[](void* ptr) noexcept {
+    operator delete(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+
+#endif
+
+static std::vector<std::vector<uint8_t>> descriptors;
+static bool connected[NSLOTS];
+
+static void connect(int slot, bool mutate) {
+    uint8_t dev_addr = slot + 1;
+    int ninterfaces = 1 + rand() % 3;
+    device_connected_callback(dev_addr << 8, 0x1234, slot, 0);
+    for (int itf = 0; itf < ninterfaces; itf++) {
+        std::vector<uint8_t> descriptor = descriptors[rand() % descriptors.size()];
+        int nchanges = mutate ? rand() % 4 : 0;
+        for (int i = 0; i < nchanges; i++) {
+            size_t pos = rand() % descriptor.size();
+            switch (rand() % 3) {
+                case 0:
+                    descriptor[pos] = rand();
+                    break;
+                case 1:
+                    descriptor.erase(descriptor.begin() + pos);
+                    break;
+                case 2:
+                    descriptor.insert(descriptor.begin() + pos, rand());
+                    break;
+            }
+        }
+        parse_descriptor(0x1234, slot * 4 + itf, descriptor.data(), descriptor.size(), (dev_addr << 8) | itf, itf);
+    }
+    connected[slot] = true;
+}
+
+static void disconnect(int slot) {
+    device_disconnected_callback(slot + 1);
+    connected[slot] = false;
+}
+
+// Returns the number of plugs.
+static int soak(int nsteps, bool mutate) {
+    int nplugs = 0;
+    for (int i = 0; i < nsteps; i++) {
+        int slot = rand() % NSLOTS;
+        if (connected[slot]) {
+            disconnect(slot);
+        } else {
+            connect(slot, mutate);
+            nplugs++;
+        }
+        update_their_descriptor_derivates();
+    }
+    for (int slot = 0; slot < NSLOTS; slot++) {
+        if (connected[slot]) {
+            disconnect(slot);
+        }
+    }
+    update_their_descriptor_derivates();
+    return nplugs;
+}
+
+static void check_nothing_left() {
+    CHECK(their_out_usages_flat.empty());
+    for (auto const& [key, buffer] : out_reports) {
+        CHECK_EQ(key >> 16, OUR_OUT_INTERFACE);
+    }
+    for (auto const& [key, size] : out_report_sizes) {
+        CHECK_EQ(key >> 16, OUR_OUT_INTERFACE);
+    }
+    for (auto const& [interface, reports] : their_used_usages) {
+        CHECK_EQ(interface, OUR_OUT_INTERFACE);
+    }
+    for (auto const& [interface, index] : interface_index) {
+        CHECK_EQ(interface, OUR_OUT_INTERFACE);
+    }
+    for (auto const& [dev_addr, hub_port] : hub_ports) {
+        CHECK_EQ(dev_addr, OUR_OUT_INTERFACE >> 8);
+    }
+}
+
+int main() {
+    srand(1);
+    for (int i = 0; i < 40; i++) {
+        config_mappings.push_back({ .target_usage = 0x00070004u + rand() % 20, .source_usage = 0x00070004u + rand() % 20, .scaling = 1000, .layer_mask = 1 });
+    }
+    config_mappings.push_back({ .target_usage = 0x00080001, .source_usage = 0x00070039, .scaling = 1000, .layer_mask = 1 });  // Caps Lock LED
+    init_remapper();
+
+    descriptors.push_back(std::vector<uint8_t>(boot_keyboard_descriptor, boot_keyboard_descriptor + boot_keyboard_descriptor_length));
+    for (const builtin_quirk_t& quirk : builtin_quirks) {
+        descriptors.push_back(std::vector<uint8_t>(quirk.descriptor, quirk.descriptor + quirk.len));
+    }
+    for (int i = 0; i < NOUR_DESCRIPTORS; i++) {
+        descriptors.push_back(std::vector<uint8_t>(our_descriptors[i].descriptor, our_descriptors[i].descriptor + our_descriptors[i].descriptor_length));
+    }
+
+    // The first round assigns input state slots to all the usages and fills the
+    // descriptor cache, both of which stay. After that, what's left on the heap when
+    // everything is unplugged only depends on which entries the cache happens to keep.
+    soak(2000, false);
+    check_nothing_left();
+    long start_bytes = live_bytes;
+    long start_allocations = allocations;
+    peak_bytes = live_bytes;
+    int nplugs = 0;
+    for (int round = 0; round < 20; round++) {
+        nplugs += soak(1000, false);
+        check_nothing_left();
+        CHECK(labs(live_bytes - start_bytes) < 32 * 1024);
+    }
+    double per_plug = (double) (allocations - start_allocations) / nplugs;
+    printf("%d plugs: %.1f allocations per plug and unplug, peak +%ld bytes\n", nplugs, per_plug, peak_bytes - start_bytes);
+    CHECK(per_plug < 200);
+
+    // Mutated descriptors bring new usages, so here only check that nothing is left behind.
+    soak(5000, true);
+    check_nothing_left();
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include "globals.h"
+#include "remapper.h"
+#include "test_util.h"
+
+// Tap, hold and sticky mappings, with their source being a key, an expression and a
+// register. Expression results and register values are computed inside process_mapping()
+// rather than received from a device, but they have to behave the same.
+
+static const uint32_t KEY_A = 0x00070004;
+static const uint32_t KEY_B = 0x00070005;
+static const uint32_t KEY_C = 0x00070006;
+static const uint32_t KEY_D = 0x00070007;
+static const uint32_t KEY_E = 0x00070008;
+static const uint32_t KEY_F = 0x00070009;
+
+static const uint8_t TAP = 1 << 1;
+static const uint8_t HOLD = 1 << 2;
+static const uint8_t STICKY = 1 << 0;
+
+static const uint32_t THRESHOLD_US = 50000;
+
+// Presses E (which drives the source) for a given time and returns which of the
+// targets went down: bit 0 for the tap target, bit 1 for the hold target.
+static uint8_t press_for(uint32_t duration_us, uint32_t tap_target, uint32_t hold_target) {
+    uint8_t seen = 0;
+    press_keys({ (uint8_t) (KEY_E & 0xFF) });
+    for (uint32_t t = 0; t < duration_us; t += 1000) {
+        run_frame();
+        seen |= (sent_value(tap_target) ? 1 : 0) | (sent_value(hold_target) ? 2 : 0);
+    }
+    CHECK((duration_us < THRESHOLD_US) || sent_value(hold_target));
+    press_keys({});
+    for (int i = 0; i < 10; i++) {
+        run_frame();
+        seen |= (sent_value(tap_target) ? 1 : 0) | (sent_value(hold_target) ? 2 : 0);
+    }
+    CHECK(!sent_value(tap_target));
+    CHECK(!sent_value(hold_target));
+    return seen;
+}
+
+static void check_source(uint32_t source) {
+    config_mappings = {
+        { .target_usage = KEY_A, .source_usage = source, .scaling = 1000, .layer_mask = 1, .flags = TAP },
+        { .target_usage = KEY_B, .source_usage = source, .scaling = 1000, .layer_mask = 1, .flags = HOLD },
+        { .target_usage = KEY_C, .source_usage = source, .scaling = 1000, .layer_mask = 1, .flags = STICKY },
+        { .target_usage = 0xFFF50001, .source_usage = KEY_E, .scaling = 1000, .layer_mask = 1 },
+        // a held key that isn't the source doesn't interfere
+        { .target_usage = KEY_D, .source_usage = KEY_F, .scaling = 1000, .layer_mask = 1 },
+    };
+    set_mapping_from_config();
+    run_frames(10);
+    CHECK(!sent_value(KEY_C));
+
+    // tap
+    CHECK_EQ(press_for(10000, KEY_A, KEY_B), 1);
+    CHECK(sent_value(KEY_C));  // sticky toggled on
+
+    // hold
+    CHECK_EQ(press_for(THRESHOLD_US + 20000, KEY_A, KEY_B), 2);
+    CHECK(!sent_value(KEY_C));  // sticky toggled off
+
+    // tap again, to check the state got reset
+    CHECK_EQ(press_for(5000, KEY_A, KEY_B), 1);
+    CHECK(sent_value(KEY_C));
+    CHECK_EQ(press_for(5000, KEY_A, KEY_B), 1);
+    CHECK(!sent_value(KEY_C));
+}
+
+int main() {
+    tap_hold_threshold = THRESHOLD_US;
+    expressions[0] = {
+        { .op = Op::PUSH_USAGE, .val = KEY_E },
+        { .op = Op::INPUT_STATE_BINARY },
+    };
+    init_remapper();
+    plug_keyboard();
+
+    check_source(KEY_E);
+    check_source(0xFFF30001);  // expression 1
+    check_source(0xFFF50001);  // register 1
+
+    return 0;
+}
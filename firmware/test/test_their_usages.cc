@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "globals.h"
+#include "remapper.h"
+#include "test_util.h"
+
+// GET_THEIR_USAGES_PACKED returns the same RLE items as GET_THEIR_USAGES, as many as fit
+// in a packet. The generation counter changes when devices that change their usages are
+// plugged in or unplugged, and a page that continues an older generation is refused.
+
+struct rle_t {
+    uint32_t usage;
+    uint32_t count;
+
+    bool operator==(const rle_t& other) const {
+        return (usage == other.usage) && (count == other.count);
+    }
+};
+
+// One-bit inputs with random vendor usages, on a few usage pages, so that the RLE items
+// have gaps of all sizes between them.
+static std::vector<uint8_t> random_descriptor(int nusages) {
+    std::vector<uint8_t> desc = {
+        0x06, 0x00, 0xFF,  // Usage Page (Vendor 0xFF00)
+        0x09, 0x01,        // Usage (1)
+        0xA1, 0x01,        // Collection (Application)
+        0x85, 0x01,        //   Report ID (1)
+        0x15, 0x00,        //   Logical Minimum (0)
+        0x25, 0x01,        //   Logical Maximum (1)
+        0x75, 0x01,        //   Report Size (1)
+        0x95, 0x01,        //   Report Count (1)
+    };
+    uint16_t usage = 1;
+    for (int i = 0; i < nusages; i++) {
+        if (rand() % 20 == 0) {
+            desc.insert(desc.end(), { 0x06, (uint8_t) (rand() % 4), 0xFF });  // Usage Page (Vendor)
+        }
+        switch (rand() % 3) {
+            case 0:
+                usage += 1;
+                break;
+            case 1:
+                usage += 2 + rand() % 100;
+                break;
+            default:
+                usage = 1 + rand() % 0xFFFE;
+                break;
+        }
+        desc.insert(desc.end(), { 0x0A, (uint8_t) (usage & 0xFF), (uint8_t) (usage >> 8) });  // Usage
+        desc.insert(desc.end(), { 0x81, 0x02 });                                               // Input (Data, Var, Abs)
+    }
+    desc.insert(desc.end(), {
+                                0x75, 0x08,  // Report Size (8)
+                                0x81, 0x01,  // Input (Const)
+                                0xC0,        // End Collection
+                            });
+    return desc;
+}
+
+static uint32_t their_usage_count() {
+    config_command(ConfigCommand::GET_CONFIG);
+    uint8_t response[28];
+    config_response(response);
+    return ((get_config_t*) response)->their_usage_count;
+}
+
+static std::vector<rle_t> get_plain() {
+    std::vector<rle_t> items;
+    uint32_t count = their_usage_count();
+    for (uint32_t i = 0; i < count; i += NUSAGES_IN_PACKET) {
+        get_indexed_t cmd = { .requested_index = i };
+        config_command(ConfigCommand::GET_THEIR_USAGES, &cmd, sizeof(cmd));
+        uint8_t response[28];
+        config_response(response);
+        usages_list_t* returned = (usages_list_t*) response;
+        for (uint32_t j = 0; (j < NUSAGES_IN_PACKET) && (i + j < count); j++) {
+            items.push_back({ returned->usages[j].usage, returned->usages[j].count });
+        }
+    }
+    return items;
+}
+
+static packed_usages_t get_packed_page(uint32_t index, uint32_t generation) {
+    get_their_usages_packed_t cmd = { .requested_index = index, .generation = generation };
+    config_command(ConfigCommand::GET_THEIR_USAGES_PACKED, &cmd, sizeof(cmd));
+    packed_usages_t page;
+    config_response((uint8_t*) &page);
+    return page;
+}
+
+static uint32_t read_varint(const uint8_t* data, int& pos) {
+    uint32_t value = 0;
+    for (int shift = 0;; shift += 7) {
+        CHECK(pos < (int) sizeof(packed_usages_t::data));
+        uint8_t byte = data[pos++];
+        value |= (uint32_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+}
+
+// Reads everything the way the config tools do. Returns the number of packets it took.
+static int get_packed(std::vector<rle_t>& items, uint32_t& generation) {
+    items.clear();
+    int npackets = 0;
+    while (true) {
+        packed_usages_t page = get_packed_page(items.size(), generation);
+        npackets++;
+        CHECK(!page.stale);
+        if (!items.empty()) {
+            CHECK_EQ(page.generation, generation);
+        }
+        generation = page.generation;
+        CHECK(items.size() + page.nitems <= page.total);
+        uint32_t prev_end = 0;
+        int pos = 0;
+        for (int i = 0; i < page.nitems; i++) {
+            uint32_t usage = prev_end + read_varint(page.data, pos);
+            uint32_t count = read_varint(page.data, pos);
+            items.push_back({ usage, count });
+            prev_end = usage + count;
+        }
+        if ((page.nitems == 0) || (items.size() == page.total)) {
+            CHECK_EQ(items.size(), page.total);
+            return npackets;
+        }
+    }
+}
+
+static uint32_t current_generation() {
+    return get_packed_page(0, 0).generation;
+}
+
+static void check_same() {
+    std::vector<rle_t> plain = get_plain();
+    std::vector<rle_t> packed;
+    uint32_t generation = 0;
+    get_packed(packed, generation);
+    CHECK(packed == plain);
+}
+
+int main() {
+    srand(43);
+    init_remapper();
+
+    // nothing plugged in
+    check_same();
+    uint32_t initial_count = their_usage_count();
+
+    uint32_t generation = current_generation();
+    plug_keyboard();
+    CHECK(current_generation() != generation);
+    check_same();
+
+    std::vector<std::vector<uint8_t>> descriptors;
+    for (int i = 0; i < 6; i++) {
+        descriptors.push_back(random_descriptor(50 + rand() % 200));
+    }
+    for (int i = 0; i < 5; i++) {
+        generation = current_generation();
+        plug_device((i + 2) << 8, descriptors[i].data(), descriptors[i].size());
+        CHECK(current_generation() != generation);
+        check_same();
+    }
+
+    // denser than GET_THEIR_USAGES
+    std::vector<rle_t> packed;
+    generation = 0;
+    int npackets = get_packed(packed, generation);
+    int nplain = (their_usage_count() + NUSAGES_IN_PACKET - 1) / NUSAGES_IN_PACKET;
+    printf("%zu RLE items: %d packets packed, %d packets plain\n", packed.size(), npackets, nplain);
+    CHECK(npackets * 2 < nplain);
+
+    // reports and frames don't change the generation
+    generation = current_generation();
+    press_keys({ 0x04 });
+    run_frames(5);
+    press_keys({});
+    run_frames(5);
+    CHECK_EQ(current_generation(), generation);
+
+    // a page that continues an older generation is refused, the first page never is
+    packed_usages_t first = get_packed_page(0, 0);
+    CHECK(first.nitems > 0);
+    plug_device(20 << 8, descriptors[5].data(), descriptors[5].size());
+    unplug_device(3);
+    uint32_t new_generation = current_generation();
+    CHECK(new_generation != first.generation);
+    packed_usages_t page = get_packed_page(first.nitems, first.generation);
+    CHECK(page.stale);
+    CHECK_EQ(page.nitems, 0);
+    CHECK_EQ(page.generation, new_generation);
+    page = get_packed_page(first.nitems, new_generation);
+    CHECK(!page.stale);
+    CHECK(page.nitems > 0);
+    check_same();
+
+    // unplugging everything
+    for (uint8_t dev_addr : { 1, 2, 4, 5, 6, 20 }) {
+        generation = current_generation();
+        unplug_device(dev_addr);
+        CHECK(current_generation() != generation);
+        check_same();
+    }
+    CHECK_EQ(their_usage_count(), initial_count);
+
+    return 0;
+}
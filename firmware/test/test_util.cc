@@ -0,0 +1,235 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <unordered_map>
+
+#include "config.h"
+#include "crc.h"
+#include "descriptor_parser.h"
+#include "globals.h"
+#include "our_descriptor.h"
+#include "remapper.h"
+#include "test_util.h"
+
+const uint8_t boot_keyboard_descriptor[] = {
+    0x05, 0x01,  // Usage Page (Generic Desktop Ctrls)
+    0x09, 0x06,  // Usage (Keyboard)
+    0xA1, 0x01,  // Collection (Application)
+    0x05, 0x07,  //   Usage Page (Kbrd/Keypad)
+    0x19, 0xE0,  //   Usage Minimum (0xE0)
+    0x29, 0xE7,  //   Usage Maximum (0xE7)
+    0x15, 0x00,  //   Logical Minimum (0)
+    0x25, 0x01,  //   Logical Maximum (1)
+    0x75, 0x01,  //   Report Size (1)
+    0x95, 0x08,  //   Report Count (8)
+    0x81, 0x02,  //   Input (Data,Var,Abs)
+    0x95, 0x01,  //   Report Count (1)
+    0x75, 0x08,  //   Report Size (8)
+    0x81, 0x01,  //   Input (Const,Array,Abs)
+    0x95, 0x06,  //   Report Count (6)
+    0x75, 0x08,  //   Report Size (8)
+    0x15, 0x00,  //   Logical Minimum (0)
+    0x25, 0x65,  //   Logical Maximum (101)
+    0x05, 0x07,  //   Usage Page (Kbrd/Keypad)
+    0x19, 0x00,  //   Usage Minimum (0x00)
+    0x29, 0x65,  //   Usage Maximum (0x65)
+    0x81, 0x00,  //   Input (Data,Array,Abs)
+    0xC0,        // End Collection
+};
+const int boot_keyboard_descriptor_length = sizeof(boot_keyboard_descriptor);
+
+std::vector<uint8_t> long_report_descriptor(int total_len) {
+    int padding = total_len - 1 - 3;
+    return {
+        0x05, 0x01,                                                   // Usage Page (Generic Desktop)
+        0x09, 0x02,                                                   // Usage (Mouse)
+        0xA1, 0x01,                                                   // Collection (Application)
+        0x85, 0x02,                                                   //   Report ID (2)
+        0x75, 0x08,                                                   //   Report Size (8)
+        0x96, (uint8_t) (padding & 0xFF), (uint8_t) (padding >> 8),  //   Report Count (padding)
+        0x81, 0x01,                                                   //   Input (Const)
+        0x09, 0x30,                                                   //   Usage (X)
+        0x75, 0x10,                                                   //   Report Size (16)
+        0x95, 0x01,                                                   //   Report Count (1)
+        0x16, 0x01, 0x80,                                             //   Logical Minimum (-32767)
+        0x26, 0xFF, 0x7F,                                             //   Logical Maximum (32767)
+        0x81, 0x06,                                                   //   Input (Data, Var, Rel)
+        0x05, 0x09,                                                   //   Usage Page (Button)
+        0x19, 0x01,                                                   //   Usage Minimum (1)
+        0x29, 0x01,                                                   //   Usage Maximum (1)
+        0x15, 0x00,                                                   //   Logical Minimum (0)
+        0x25, 0x01,                                                   //   Logical Maximum (1)
+        0x75, 0x01,                                                   //   Report Size (1)
+        0x95, 0x01,                                                   //   Report Count (1)
+        0x81, 0x02,                                                   //   Input (Data, Var, Abs)
+        0x75, 0x07,                                                   //   Report Size (7)
+        0x81, 0x01,                                                   //   Input (Const)
+        0xC0,                                                         // End Collection
+    };
+}
+
+std::vector<sent_report_t> sent_reports;
+
+static descriptor_usages_t our_parsed;
+static std::unordered_map<uint8_t, std::vector<uint8_t>> last_sent;  // report ID -> report
+
+void init_remapper(uint8_t descriptor_number) {
+    our_descriptor_number = descriptor_number;
+    our_descriptor = &our_descriptors[descriptor_number];
+    parse_our_descriptor();
+    set_mapping_from_config();
+    our_parsed = {};
+    parse_descriptor(our_parsed, our_descriptor->descriptor, our_descriptor->descriptor_length);
+}
+
+void plug_device(uint16_t interface, const uint8_t* descriptor, int len, uint16_t vid, uint16_t pid) {
+    device_connected_callback(interface, vid, pid, 0);
+    parse_descriptor(vid, pid, descriptor, len, interface, interface & 0xFF);
+    update_their_descriptor_derivates();
+    their_descriptor_updated = false;
+}
+
+void plug_keyboard(uint16_t interface) {
+    plug_device(interface, boot_keyboard_descriptor, boot_keyboard_descriptor_length);
+}
+
+void unplug_device(uint8_t dev_addr) {
+    device_disconnected_callback(dev_addr);
+    update_their_descriptor_derivates();
+    their_descriptor_updated = false;
+}
+
+void press_keys(std::initializer_list<uint8_t> keys, uint16_t interface) {
+    uint8_t report[8] = { 0 };
+    int n = 2;
+    for (uint8_t key : keys) {
+        if ((key >= 0xE0) && (key <= 0xE7)) {
+            report[0] |= 1 << (key - 0xE0);
+        } else if (n < 8) {
+            report[n++] = key;
+        }
+    }
+    do_handle_received_report(report, sizeof(report), interface);
+}
+
+static bool capture_report(uint8_t interface, const uint8_t* report_with_id, uint8_t len) {
+    sent_reports.push_back({ fake_time, std::vector<uint8_t>(report_with_id, report_with_id + len) });
+    last_sent[report_with_id[0]] = sent_reports.back().data;
+    return true;
+}
+
+void run_frame(uint32_t duration_us) {
+    fake_time += duration_us;
+    if (their_descriptor_updated) {
+        update_their_descriptor_derivates();
+        their_descriptor_updated = false;
+    }
+    process_mapping(true);
+    if (config_updated) {
+        set_mapping_from_config();
+        config_updated = false;
+    }
+    while (send_report(capture_report)) {
+    }
+}
+
+void run_frames(int n, uint32_t duration_us) {
+    for (int i = 0; i < n; i++) {
+        run_frame(duration_us);
+    }
+}
+
+static int32_t read_field(const std::vector<uint8_t>& report, const usage_def_t& usage_def) {
+    // report[0] is the report ID
+    uint32_t value = 0;
+    for (int i = 0; i < usage_def.size; i++) {
+        uint32_t bit = usage_def.bitpos + i;
+        if ((bit / 8 + 1 < report.size()) && (report[bit / 8 + 1] & (1 << (bit % 8)))) {
+            value |= 1u << i;
+        }
+    }
+    if ((usage_def.logical_minimum < 0) && (usage_def.size < 32) && (value & (1u << (usage_def.size - 1)))) {
+        value |= ~0u << usage_def.size;
+    }
+    return (int32_t) value;
+}
+
+int32_t report_value(const sent_report_t& report, uint32_t usage) {
+    for (auto const& report_usage : our_parsed.usages[(uint8_t) ReportType::INPUT]) {
+        if ((report_usage.usage == usage) && (report_usage.report_id == report.data[0])) {
+            return read_field(report.data, report_usage.usage_def);
+        }
+    }
+    return 0;
+}
+
+int32_t sent_value(uint32_t usage) {
+    for (auto const& report_usage : our_parsed.usages[(uint8_t) ReportType::INPUT]) {
+        if (report_usage.usage == usage) {
+            auto it = last_sent.find(report_usage.report_id);
+            if (it == last_sent.end()) {
+                return 0;
+            }
+            return read_field(it->second, report_usage.usage_def);
+        }
+    }
+    return 0;
+}
+
+std::vector<uint8_t> report_keys(const sent_report_t& report) {
+    std::vector<uint8_t> keys;
+    for (auto const& report_usage : our_parsed.usages[(uint8_t) ReportType::INPUT]) {
+        if (((report_usage.usage & 0xFFFF0000) == 0x00070000) &&
+            (report_usage.report_id == report.data[0]) &&
+            read_field(report.data, report_usage.usage_def)) {
+            keys.push_back(report_usage.usage & 0xFF);
+        }
+    }
+    return keys;
+}
+
+void config_command(ConfigCommand command, const void* data, size_t len) {
+    set_feature_t buffer;
+    memset(&buffer, 0, sizeof(buffer));
+    buffer.version = TEST_CONFIG_VERSION;
+    buffer.command = command;
+    if (len > 0) {
+        memcpy(buffer.data, data, len);
+    }
+    buffer.crc32 = crc32((uint8_t*) &buffer, CONFIG_SIZE - 4);
+    handle_set_report1(REPORT_ID_CONFIG, (uint8_t*) &buffer, CONFIG_SIZE);
+}
+
+void config_response(uint8_t* buffer) {
+    get_feature_t response;
+    handle_get_report1(REPORT_ID_CONFIG, (uint8_t*) &response, CONFIG_SIZE);
+    memcpy(buffer, response.data, sizeof(response.data));
+}
+
+std::vector<uint32_t> in_child(std::function<std::vector<uint32_t>()> f) {
+    int fds[2];
+    CHECK(pipe(fds) == 0);
+    fflush(stdout);
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        close(fds[0]);
+        std::vector<uint32_t> result = f();
+        CHECK(write(fds[1], result.data(), result.size() * sizeof(uint32_t)) == (ssize_t) (result.size() * sizeof(uint32_t)));
+        close(fds[1]);
+        fflush(stdout);
+        _exit(0);
+    }
+    close(fds[1]);
+    std::vector<uint32_t> result;
+    uint32_t value;
+    while (read(fds[0], &value, sizeof(value)) == sizeof(value)) {
+        result.push_back(value);
+    }
+    close(fds[0]);
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+    return result;
+}
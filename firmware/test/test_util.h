@@ -0,0 +1,101 @@
+#ifndef _TEST_UTIL_H_
+#define _TEST_UTIL_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <functional>
+#include <initializer_list>
+#include <vector>
+
+#include "types.h"
+
+// Helpers shared by the host tests. The firmware sources are built for the host with
+// host_platform.cc standing in for the platform. A test drives the remapper the way
+// main.cc does: reports come in through do_handle_received_report(), run_frame() does
+// what a main loop pass with a tick does and captures what would be sent to the host.
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                                                       \
+    do {                                                                                                     \
+        long long _a = (a);                                                                                  \
+        long long _b = (b);                                                                                  \
+        if (_a != _b) {                                                                                      \
+            printf("%s:%d: CHECK_EQ failed: %s == %s (%lld vs %lld)\n", __FILE__, __LINE__, #a, #b, _a, _b); \
+            exit(1);                                                                                         \
+        }                                                                                                    \
+    } while (0)
+
+extern uint64_t fake_time;
+extern uint8_t last_persisted[PERSISTED_CONFIG_SIZE];
+extern uint32_t persist_count;
+
+// With persist_to_config_log set, persisted configs also go to a config log in host_config_log,
+// one flash operation per persist_config_maybe() call, the way they do on the device.
+extern bool persist_to_config_log;
+extern uint8_t host_config_log[];
+extern uint32_t config_log_ops;  // sector erases and page programs so far
+
+// What the remapper last passed to set_gpio_inout_masks().
+extern uint32_t host_gpio_in_mask;
+extern uint32_t host_gpio_out_mask;
+
+// What the config tools put in the version byte of every command.
+#define TEST_CONFIG_VERSION 22
+
+// A boot protocol keyboard: 8 modifier bits, a reserved byte and 6 array slots.
+#define KEYBOARD_INTERFACE 0x0100
+extern const uint8_t boot_keyboard_descriptor[];
+extern const int boot_keyboard_descriptor_length;
+
+// A mouse with input report ID 2, total_len bytes long including the ID: padding, then
+// X (16-bit, relative) and button 1 in the last three bytes.
+std::vector<uint8_t> long_report_descriptor(int total_len);
+
+struct sent_report_t {
+    uint64_t time;
+    std::vector<uint8_t> data;  // report ID first
+};
+
+extern std::vector<sent_report_t> sent_reports;
+
+// Sets up our descriptor and compiles the (possibly empty) config_mappings.
+void init_remapper(uint8_t descriptor_number = 0);
+
+void plug_device(uint16_t interface, const uint8_t* descriptor, int len, uint16_t vid = 0x1234, uint16_t pid = 0x5678);
+void plug_keyboard(uint16_t interface = KEYBOARD_INTERFACE);
+void unplug_device(uint8_t dev_addr);
+
+// Sends a boot keyboard report with the given keys (usage IDs on the keyboard page) held.
+// Modifiers (0xE0-0xE7) go to the modifier byte.
+void press_keys(std::initializer_list<uint8_t> keys, uint16_t interface = KEYBOARD_INTERFACE);
+
+// Advances the fake clock and does what a main loop pass with a tick does.
+void run_frame(uint32_t duration_us = 1000);
+void run_frames(int n, uint32_t duration_us = 1000);
+
+// Value of one of our usages in the last report sent with its report ID, 0 if there wasn't one.
+int32_t sent_value(uint32_t usage);
+// Same, but in a given sent report (0 if the usage isn't in that report).
+int32_t report_value(const sent_report_t& report, uint32_t usage);
+// Keyboard page usages held in a given sent report, in ascending order.
+std::vector<uint8_t> report_keys(const sent_report_t& report);
+
+// Sends a command to the config interface, the way the config tools do.
+void config_command(ConfigCommand command, const void* data = nullptr, size_t len = 0);
+// Reads the response to the last command (28 bytes, without the CRC).
+void config_response(uint8_t* buffer);
+
+// Runs f in a child process and returns what it returned. The remapper's state is global,
+// this way every run starts from scratch.
+std::vector<uint32_t> in_child(std::function<std::vector<uint32_t>()> f);
+
+#endif